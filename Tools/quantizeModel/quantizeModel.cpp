@@ -0,0 +1,234 @@
+#include "stdafx.h"
+#include <stdio.h>
+#include "../../Whisper/CPU/BlockQ4.h"
+using CpuCompute::BlockQ4;
+using CpuCompute::q4BlockSize;
+
+namespace
+{
+	constexpr uint32_t ggmlMagic = 0x67676d6c;
+	constexpr HRESULT E_EOF = HRESULT_FROM_WIN32( ERROR_HANDLE_EOF );
+
+	// Same as in WhisperModel.cpp: 11 integers of sModelParams structure, then size of the MEL filters
+	constexpr size_t cbParamsAndMelHeader = 13 * 4;
+
+	struct sTensorHeader
+	{
+		int n_dims, length, ftype;
+	};
+
+	class File
+	{
+		FILE* f = nullptr;
+	public:
+		~File()
+		{
+			if( nullptr != f )
+				fclose( f );
+		}
+		HRESULT open( const wchar_t* path, bool write )
+		{
+			const errno_t e = _wfopen_s( &f, path, write ? L"wb" : L"rb" );
+			if( 0 == e )
+				return S_OK;
+			fwprintf( stderr, L"Unable to open the file %s\n", path );
+			return E_FAIL;
+		}
+		HRESULT read( void* rdi, size_t cb )
+		{
+			if( 0 == cb )
+				return S_OK;
+			if( 1 == fread( rdi, cb, 1, f ) )
+				return S_OK;
+			return feof( f ) ? E_EOF : E_FAIL;
+		}
+		HRESULT write( const void* rsi, size_t cb )
+		{
+			if( 0 == cb )
+				return S_OK;
+			if( 1 == fwrite( rsi, cb, 1, f ) )
+				return S_OK;
+			return E_FAIL;
+		}
+		template<class E>
+		HRESULT read( std::vector<E>& vec, size_t count )
+		{
+			vec.resize( count );
+			return read( vec.data(), count * sizeof( E ) );
+		}
+		template<class E>
+		HRESULT write( const std::vector<E>& vec )
+		{
+			return write( vec.data(), vec.size() * sizeof( E ) );
+		}
+	};
+
+	HRESULT copyBytes( File& input, File& output, std::vector<uint8_t>& buffer, size_t cb )
+	{
+		CHECK( input.read( buffer, cb ) );
+		return output.write( buffer );
+	}
+
+	// Decoder's weight matrices consumed by mulMat in the hybrid model.
+	// The token embedding stays FP16, the model needs the complete rows of that matrix, and it's also used for the final projection into logits.
+	// Cross-attention keys and values are computed by the encoder on GPU, they also stay in FP16.
+	bool shouldQuantize( const CStringA& name )
+	{
+		static const std::array<const char*, 8> suffixes =
+		{
+			".attn.query.weight",
+			".attn.key.weight",
+			".attn.value.weight",
+			".attn.out.weight",
+			".cross_attn.query.weight",
+			".cross_attn.out.weight",
+			".mlp.0.weight",
+			".mlp.2.weight",
+		};
+		if( 0 != name.Find( "decoder.blocks." ) )
+			return false;
+		for( const char* s : suffixes )
+		{
+			const int len = (int)strlen( s );
+			if( name.GetLength() <= len )
+				continue;
+			if( 0 != strcmp( cstr( name ) + name.GetLength() - len, s ) )
+				continue;
+			return true;
+		}
+		return false;
+	}
+
+	// Quantize FP16 matrix into rows of BlockQ4 structures
+	void quantizeMatrix( std::vector<BlockQ4>& rdi, const uint16_t* rsi, size_t width, size_t height )
+	{
+		const size_t blocksPerRow = width / q4BlockSize;
+		rdi.resize( blocksPerRow * height );
+		BlockQ4* pBlock = rdi.data();
+		alignas( 32 ) std::array<float, q4BlockSize> temp;
+		for( size_t i = 0; i < height; i++ )
+		{
+			for( size_t j = 0; j < blocksPerRow; j++, rsi += q4BlockSize, pBlock++ )
+			{
+				for( size_t k = 0; k < q4BlockSize; k += 8 )
+					_mm256_store_ps( &temp[ k ], _mm256_cvtph_ps( _mm_loadu_si128( ( const __m128i* )( rsi + k ) ) ) );
+				CpuCompute::quantizeBlockQ4( *pBlock, temp.data() );
+			}
+		}
+	}
+
+	HRESULT quantizeModel( const wchar_t* inputPath, const wchar_t* outputPath )
+	{
+		File input, output;
+		CHECK( input.open( inputPath, false ) );
+		CHECK( output.open( outputPath, true ) );
+
+		std::vector<uint8_t> buffer;
+		uint32_t magic;
+		CHECK( input.read( &magic, 4 ) );
+		if( magic != ggmlMagic )
+		{
+			fprintf( stderr, "Invalid model file, bad magic\n" );
+			return E_INVALIDARG;
+		}
+		CHECK( output.write( &magic, 4 ) );
+
+		// Parameters and MEL filters
+		std::array<uint32_t, 13> pmh;
+		static_assert( sizeof( pmh ) == cbParamsAndMelHeader );
+		CHECK( input.read( pmh.data(), cbParamsAndMelHeader ) );
+		CHECK( output.write( pmh.data(), cbParamsAndMelHeader ) );
+		const size_t cbFilters = (size_t)pmh[ 11 ] * pmh[ 12 ] * 4;
+		CHECK( copyBytes( input, output, buffer, cbFilters ) );
+
+		// Vocabulary
+		int countWords;
+		CHECK( input.read( &countWords, 4 ) );
+		CHECK( output.write( &countWords, 4 ) );
+		for( int i = 0; i < countWords; i++ )
+		{
+			int len;
+			CHECK( input.read( &len, 4 ) );
+			if( len < 0 )
+				return E_INVALIDARG;
+			CHECK( output.write( &len, 4 ) );
+			CHECK( copyBytes( input, output, buffer, (size_t)len ) );
+		}
+
+		// Tensors
+		CStringA name;
+		std::vector<BlockQ4> blocks;
+		size_t countQuantized = 0;
+		int64_t cbSource = 0, cbResult = 0;
+		while( true )
+		{
+			sTensorHeader header;
+			HRESULT hr = input.read( &header, sizeof( header ) );
+			if( hr == E_EOF )
+				break;
+			CHECK( hr );
+			if( header.n_dims < 1 || header.n_dims > 3 || header.length <= 0 )
+				return E_INVALIDARG;
+
+			std::array<int, 4> ne = { 1, 1, 1, 1 };
+			CHECK( input.read( ne.data(), (size_t)header.n_dims * 4 ) );
+			char* nameBuffer = name.GetBufferSetLength( header.length );
+			hr = input.read( nameBuffer, header.length );
+			name.ReleaseBuffer();
+			CHECK( hr );
+
+			const size_t totalElts = (size_t)(uint32_t)ne[ 0 ] * (uint32_t)ne[ 1 ] * (uint32_t)ne[ 2 ];
+			size_t cbPayload;
+			if( header.ftype == 0 )
+				cbPayload = totalElts * 4;
+			else if( header.ftype == 1 )
+				cbPayload = totalElts * 2;
+			else
+			{
+				fprintf( stderr, "Tensor %s has unsupported data type %i, the model is already quantized?\n", cstr( name ), header.ftype );
+				return E_INVALIDARG;
+			}
+			CHECK( input.read( buffer, cbPayload ) );
+			cbSource += cbPayload;
+
+			const bool quantize = header.ftype == 1 && header.n_dims == 2 && 0 == ne[ 0 ] % q4BlockSize && shouldQuantize( name );
+			if( quantize )
+				header.ftype = CpuCompute::ftypeQ4;
+			CHECK( output.write( &header, sizeof( header ) ) );
+			CHECK( output.write( ne.data(), (size_t)header.n_dims * 4 ) );
+			CHECK( output.write( cstr( name ), header.length ) );
+
+			if( quantize )
+			{
+				quantizeMatrix( blocks, (const uint16_t*)buffer.data(), (uint32_t)ne[ 0 ], (uint32_t)ne[ 1 ] );
+				CHECK( output.write( blocks ) );
+				cbResult += blocks.size() * sizeof( BlockQ4 );
+				countQuantized++;
+			}
+			else
+			{
+				CHECK( output.write( buffer ) );
+				cbResult += cbPayload;
+			}
+		}
+
+		constexpr double mulMb = 1.0 / ( 1 << 20 );
+		printf( "Quantized %zu tensors; tensors payload %g MB -> %g MB\n", countQuantized, mulMb * cbSource, mulMb * cbResult );
+		return S_OK;
+	}
+}
+
+int wmain( int argc, wchar_t* argv[] )
+{
+	if( argc != 3 )
+	{
+		fprintf( stderr, "Usage: quantizeModel.exe <input.bin> <output.bin>\n" );
+		return 1;
+	}
+
+	HRESULT hr = quantizeModel( argv[ 1 ], argv[ 2 ] );
+	if( SUCCEEDED( hr ) )
+		return 0;
+	printError( hr );
+	return hr;
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+#include <assert.h>
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <atlstr.h>
+
+#include <vector>
+#include <array>
+#include <immintrin.h>
+
+#define CHECK( hr ) { const HRESULT __hr = ( hr ); if( FAILED( __hr ) ) return __hr; }
+
+void printError( HRESULT hr );
+
+inline const char* cstr( const CStringA& s ) { return s; }
\ No newline at end of file
@@ -9,7 +9,7 @@ namespace Whisper
 	{
 		// Always select the most probable token
 		Greedy,
-		// TODO: not implemented yet!
+		// Keep beam_width most probable hypotheses, decoding all of them in a single batch
 		BeamSearch,
 	};
 
@@ -31,6 +31,9 @@ namespace Whisper
 		// Experimental
 		TokenTimestamps = 0x100,
 		SpeedupAudio = 0x200,
+
+		// Pin the CPU worker threads of the hybrid decoder to logical processors
+		PinCpuThreads = 0x400,
 	};
 
 	inline eFullParamsFlags operator | ( eFullParamsFlags a, eFullParamsFlags b )
@@ -85,6 +88,21 @@ namespace Whisper
 		pfnEncoderBegin encoder_begin_callback;
 		void* encoder_begin_callback_user_data;
 
+		// How long the idle CPU worker threads of the hybrid decoder spin waiting for the next job, before parking in the OS kernel.
+		// Measured in microseconds, 0 disables spinning.
+		uint32_t cpuSpinMicroseconds;
+
+		// Temperature fallback, same as the reference Whisper. When the decoding of a window fails, or the text has the compression ratio above
+		// compression_ratio_thold, or the average log-probability of the tokens below logprob_thold, the window is decoded again by sampling best_of candidates.
+		// The temperature starts at temperature_inc and grows by the same amount after every rejected attempt, up to 1.0; 0 disables the fallback.
+		float temperature_inc;
+		// Count of candidates sampled at every temperature, they are decoded in a single batch
+		int best_of;
+		// 0 disables the check
+		float compression_ratio_thold;
+		// Log-probabilities are never positive, 0 or any positive value disables the check
+		float logprob_thold;
+
 		// Couple utility methods, they workaround the lack of bit fields in C++
 		inline bool flag( eFullParamsFlags f ) const
 		{
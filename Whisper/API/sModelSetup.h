@@ -24,6 +24,24 @@ namespace Whisper
 		NoReshapedMatMul = 4,
 		UseReshapedMatMul = 8,
 		Cloneable = 0x10,
+		// Hybrid model only: quantize the weight matrices of the decoder into INT8 with per-row scales, requires AVX2 CPU.
+		// This halves the memory bandwidth consumed by the decoder, at the cost of slightly lower accuracy.
+		HybridInt8 = 0x20,
+		// Hybrid model only: on first use of every matrix shape, benchmark the available mulMat kernels and thread counts, and use the fastest one.
+		// The results are cached in %LOCALAPPDATA%\Whisper directory, one file per CPU model.
+		HybridAutotune = 0x40,
+		// Hybrid model only: allocate the corresponding buffers of the CPU decoder in large memory pages, to reduce TLB misses.
+		// On Windows that requires SeLockMemoryPrivilege, on Linux pre-allocated huge pages; when unavailable, the buffers use normal pages.
+		HybridLargePagesWeights = 0x80,
+		HybridLargePagesKvCache = 0x100,
+		HybridLargePagesCompute = 0x200,
+		// Hybrid model only: keep the keys and values of both attention caches of the decoder in INT8 with a scale per head of every row, requires AVX2 CPU.
+		// The kernels dequantize in registers; this halves the memory streamed by the cross-attention, and the RAM used by every context.
+		HybridInt8KvCache = 0x400,
+		// Hybrid model only: the contexts of this model submit their single-token decoder steps into a shared queue,
+		// a scheduler thread merges the pending steps of different contexts into a single pass over the weights of the decoder.
+		// Improves the throughput of servers which transcribe multiple streams at once, at the cost of latency for a single stream.
+		HybridSharedDecoder = 0x800,
 	};
 
 	struct sModelSetup
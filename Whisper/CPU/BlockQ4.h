@@ -0,0 +1,58 @@
+#pragma once
+// 4-bit block quantization of the decoder weights.
+// The memory layout is compatible with block_q4_0 structure in GGML.
+// Tools / quantizeModel converter writes these blocks into the model file, the hybrid model consumes them.
+// This header is also included by that tool, keep it self-contained.
+#include <stdint.h>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+
+namespace CpuCompute
+{
+	// Count of elements in the block
+	constexpr uint32_t q4BlockSize = 32;
+
+	// Value of the ftype field in tensor headers of the model file, for tensors made of these blocks
+	constexpr int ftypeQ4 = 2;
+
+	// A block of 32 weights in 18 bytes.
+	// The dequantized values are ( q - 8 ) * scale, where q is an unsigned 4-bit number.
+	// The low 4 bits of values[ i ] contain element i, the high 4 bits contain element i + 16.
+	struct BlockQ4
+	{
+		// FP16 scaling factor
+		uint16_t scale;
+		std::array<uint8_t, 16> values;
+	};
+	static_assert( sizeof( BlockQ4 ) == 18 );
+
+	// Quantize 32 FP32 numbers into the block, same math as quantize_row_q4_0_reference() in GGML
+	inline void quantizeBlockQ4( BlockQ4& rdi, const float* rsi )
+	{
+		// Find the element with the largest magnitude, keeping the sign
+		float absMax = 0, max = 0;
+		for( uint32_t i = 0; i < q4BlockSize; i++ )
+		{
+			const float v = rsi[ i ];
+			if( std::abs( v ) > absMax )
+			{
+				absMax = std::abs( v );
+				max = v;
+			}
+		}
+
+		// That element becomes -8, the rest of them are in [ -8 .. +7 ] interval
+		const float scale = max / -8.0f;
+		const float mul = ( scale != 0 ) ? 1.0f / scale : 0.0f;
+		rdi.scale = (uint16_t)_mm_cvtsi128_si32( _mm_cvtps_ph( _mm_set_ss( scale ), 0 ) );
+
+		for( uint32_t i = 0; i < 16; i++ )
+		{
+			const int x0 = std::min( 15, (int)( rsi[ i ] * mul + 8.5f ) );
+			const int x1 = std::min( 15, (int)( rsi[ i + 16 ] * mul + 8.5f ) );
+			rdi.values[ i ] = (uint8_t)( x0 | ( x1 << 4 ) );
+		}
+	}
+}
\ No newline at end of file
@@ -46,7 +46,8 @@ void* BufferAllocator::allocate( size_t cb, size_t align ) noexcept
 
 namespace
 {
-	// 2 MB of memory, we hope the OS kernel will then be smart enough to give us large pages.
+	// The arena commits memory in 2 MB pieces to reduce count of VirtualAlloc calls.
+	// Large pages can't be committed incrementally, buffers which need them are allocated with LargeBuffer.allocate instead.
 	constexpr size_t virtualAllocGranularityExp2 = 21;
 
 	constexpr size_t virtualAllocGranularityMask = ( ( (size_t)1 ) << virtualAllocGranularityExp2 ) - 1;
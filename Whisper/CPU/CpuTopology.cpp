@@ -0,0 +1,338 @@
+#include "stdafx.h"
+#include "CpuTopology.h"
+#include <thread>
+#include <map>
+#ifndef _WIN32
+#include <pthread.h>
+#include <fstream>
+#include <string>
+#include <filesystem>
+#endif
+using namespace CpuCompute;
+
+CpuTopology::CpuTopology()
+{
+	const HRESULT hr = query();
+	if( FAILED( hr ) || list.empty() )
+	{
+		logWarningHr( hr, u8"Unable to query CPU topology, assuming a single NUMA node without SMT" );
+		queryFallback();
+	}
+	finalize();
+	logDebug( u8"CPU topology: %zu logical processors, %i physical cores, %i NUMA nodes", list.size(), (int)countCores, (int)countNodes );
+}
+
+const CpuTopology& CpuTopology::instance()
+{
+	static const CpuTopology topology;
+	return topology;
+}
+
+void CpuTopology::queryFallback()
+{
+	list.clear();
+	const uint32_t count = std::max( std::thread::hardware_concurrency(), 1u );
+	list.resize( count );
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		sLogicalProcessor& lp = list[ i ];
+		lp.index = i;
+		lp.core = i;
+		lp.node = 0;
+		lp.efficiencyClass = 0;
+		lp.siblingIndex = 0;
+	}
+	countCores = count;
+}
+
+void CpuTopology::finalize()
+{
+	std::sort( list.begin(), list.end(), []( const sLogicalProcessor& a, const sLogicalProcessor& b ) { return a.index < b.index; } );
+
+	// The OS kernel may report sparse node numbers, remap them into [ 0 .. countNodes - 1 ] interval
+	std::map<uint32_t, uint32_t> nodes;
+	for( const auto& lp : list )
+		nodes.emplace( lp.node, 0 );
+	uint32_t idx = 0;
+	for( auto& p : nodes )
+		p.second = idx++;
+	for( auto& lp : list )
+		lp.node = nodes[ lp.node ];
+	countNodes = std::max( idx, 1u );
+}
+
+#ifdef _WIN32
+HRESULT CpuTopology::query()
+{
+	DWORD cb = 0;
+	GetLogicalProcessorInformationEx( RelationAll, nullptr, &cb );
+	if( 0 == cb )
+		return getLastHr();
+
+	// The structures have uint64_t fields, that's why uint64_t type for the storage
+	std::unique_ptr<uint64_t[]> buffer = std::make_unique<uint64_t[]>( ( cb + 7 ) / 8 );
+	if( !GetLogicalProcessorInformationEx( RelationAll, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buffer.get(), &cb ) )
+		return getLastHr();
+
+	// Processor index => NUMA node number
+	std::map<uint32_t, uint32_t> nodes;
+
+	const uint8_t* rsi = (const uint8_t*)buffer.get();
+	const uint8_t* const rsiEnd = rsi + cb;
+	while( rsi < rsiEnd )
+	{
+		const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX& info = *(const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)rsi;
+		if( 0 == info.Size )
+			return E_UNEXPECTED;
+		rsi += info.Size;
+
+		if( info.Relationship == RelationProcessorCore )
+		{
+			const PROCESSOR_RELATIONSHIP& pr = info.Processor;
+			uint8_t sibling = 0;
+			for( WORD g = 0; g < pr.GroupCount; g++ )
+			{
+				uint64_t mask = pr.GroupMask[ g ].Mask;
+				while( 0 != mask )
+				{
+					unsigned long bit;
+					_BitScanForward64( &bit, mask );
+					mask &= mask - 1;
+
+					sLogicalProcessor& lp = list.emplace_back();
+					lp.index = (uint32_t)pr.GroupMask[ g ].Group * 64 + bit;
+					lp.core = countCores;
+					lp.node = 0;
+					lp.efficiencyClass = pr.EfficiencyClass;
+					lp.siblingIndex = sibling++;
+				}
+			}
+			countCores++;
+		}
+		else if( info.Relationship == RelationNumaNode )
+		{
+			const NUMA_NODE_RELATIONSHIP& nr = info.NumaNode;
+			uint64_t mask = nr.GroupMask.Mask;
+			while( 0 != mask )
+			{
+				unsigned long bit;
+				_BitScanForward64( &bit, mask );
+				mask &= mask - 1;
+				nodes[ (uint32_t)nr.GroupMask.Group * 64 + bit ] = (uint32_t)nr.NodeNumber;
+			}
+		}
+	}
+
+	for( auto& lp : list )
+	{
+		auto p = nodes.find( lp.index );
+		if( p != nodes.end() )
+			lp.node = p->second;
+	}
+	return S_OK;
+}
+
+HRESULT CpuCompute::pinCurrentThread( uint32_t processor ) noexcept
+{
+	GROUP_AFFINITY ga;
+	memset( &ga, 0, sizeof( ga ) );
+	ga.Group = (WORD)( processor / 64 );
+	ga.Mask = (KAFFINITY)1 << ( processor % 64 );
+	if( SetThreadGroupAffinity( GetCurrentThread(), &ga, nullptr ) )
+		return S_OK;
+	return getLastHr();
+}
+
+ThreadAffinityRaii::ThreadAffinityRaii( uint32_t processor ) noexcept
+{
+	GROUP_AFFINITY ga;
+	memset( &ga, 0, sizeof( ga ) );
+	ga.Group = (WORD)( processor / 64 );
+	ga.Mask = (KAFFINITY)1 << ( processor % 64 );
+	restore = SetThreadGroupAffinity( GetCurrentThread(), &ga, &prev );
+}
+
+ThreadAffinityRaii::~ThreadAffinityRaii()
+{
+	if( restore )
+		SetThreadGroupAffinity( GetCurrentThread(), &prev, nullptr );
+}
+#else
+namespace
+{
+	bool readLine( const std::string& path, std::string& line )
+	{
+		std::ifstream f{ path };
+		if( !f )
+			return false;
+		std::getline( f, line );
+		return true;
+	}
+
+	bool readNumber( const std::string& path, uint32_t& rdi )
+	{
+		std::string line;
+		if( !readLine( path, line ) || line.empty() )
+			return false;
+		rdi = (uint32_t)std::stoul( line );
+		return true;
+	}
+
+	// Parse CPU list in the format of the kernel, like "0-3,8,10-11"
+	void parseList( const std::string& str, std::vector<uint32_t>& rdi )
+	{
+		size_t pos = 0;
+		while( pos < str.size() )
+		{
+			size_t end = str.find( ',', pos );
+			if( end == std::string::npos )
+				end = str.size();
+			const std::string range = str.substr( pos, end - pos );
+			pos = end + 1;
+			if( range.empty() )
+				continue;
+
+			const size_t dash = range.find( '-' );
+			const uint32_t first = (uint32_t)std::stoul( range.substr( 0, dash ) );
+			const uint32_t last = ( dash == std::string::npos ) ? first : (uint32_t)std::stoul( range.substr( dash + 1 ) );
+			for( uint32_t i = first; i <= last; i++ )
+				rdi.push_back( i );
+		}
+	}
+}
+
+HRESULT CpuTopology::query()
+{
+	const std::string root = "/sys/devices/system/cpu/";
+	std::string line;
+	if( !readLine( root + "online", line ) )
+		return E_NOTIMPL;
+
+	try
+	{
+		std::vector<uint32_t> online;
+		parseList( line, online );
+
+		// On hybrid Intel CPUs, the kernel lists the efficiency cores in that file
+		std::vector<uint32_t> atoms;
+		if( readLine( "/sys/devices/cpu_atom/cpus", line ) )
+			parseList( line, atoms );
+
+		// ( package, core ) => index of the physical core, and count of logical processors found so far
+		std::map<std::pair<uint32_t, uint32_t>, std::pair<uint32_t, uint8_t>> cores;
+
+		for( uint32_t i : online )
+		{
+			const std::string dir = root + "cpu" + std::to_string( i ) + "/";
+			uint32_t package = 0, coreId = i;
+			readNumber( dir + "topology/physical_package_id", package );
+			readNumber( dir + "topology/core_id", coreId );
+
+			auto& core = cores.try_emplace( std::make_pair( package, coreId ), countCores, (uint8_t)0 ).first->second;
+			if( core.first == countCores )
+				countCores++;
+
+			sLogicalProcessor& lp = list.emplace_back();
+			lp.index = i;
+			lp.core = core.first;
+			lp.node = 0;
+			lp.efficiencyClass = atoms.empty() ? 0 : ( std::find( atoms.begin(), atoms.end(), i ) == atoms.end() ? 1 : 0 );
+			lp.siblingIndex = core.second++;
+
+			// The NUMA node is a "nodeN" symbolic link in the directory of the processor
+			for( const auto& e : std::filesystem::directory_iterator( dir ) )
+			{
+				const std::string name = e.path().filename().string();
+				if( name.size() > 4 && 0 == name.compare( 0, 4, "node" ) && isdigit( (uint8_t)name[ 4 ] ) )
+				{
+					lp.node = (uint32_t)std::stoul( name.substr( 4 ) );
+					break;
+				}
+			}
+		}
+		return S_OK;
+	}
+	catch( const std::exception& )
+	{
+		list.clear();
+		countCores = 0;
+		return E_FAIL;
+	}
+}
+
+HRESULT CpuCompute::pinCurrentThread( uint32_t processor ) noexcept
+{
+	cpu_set_t set;
+	CPU_ZERO( &set );
+	CPU_SET( processor, &set );
+	const int err = pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+	return ( 0 == err ) ? S_OK : E_FAIL;
+}
+
+ThreadAffinityRaii::ThreadAffinityRaii( uint32_t processor ) noexcept
+{
+	restore = ( 0 == pthread_getaffinity_np( pthread_self(), sizeof( prev ), &prev ) );
+	if( restore )
+		restore = SUCCEEDED( pinCurrentThread( processor ) );
+}
+
+ThreadAffinityRaii::~ThreadAffinityRaii()
+{
+	if( restore )
+		pthread_setaffinity_np( pthread_self(), sizeof( prev ), &prev );
+}
+#endif
+
+uint32_t CpuTopology::coresOnNode( uint32_t node ) const
+{
+	// The list is sorted by processor index, SMT siblings are not necessarily adjacent
+	uint32_t res = 0;
+	for( const auto& lp : list )
+		if( lp.node == node && 0 == lp.siblingIndex )
+			res++;
+	return res;
+}
+
+uint32_t CpuTopology::coresPerNode() const
+{
+	uint32_t res = 0;
+	for( uint32_t i = 0; i < countNodes; i++ )
+		res = std::max( res, coresOnNode( i ) );
+	return res;
+}
+
+uint32_t CpuTopology::nextNode() const
+{
+	return nextNodeCounter.fetch_add( 1, std::memory_order_relaxed ) % countNodes;
+}
+
+void CpuTopology::placeThreads( std::vector<uint32_t>& rdi, size_t threads, uint32_t node ) const
+{
+	rdi.clear();
+	if( list.empty() || 0 == threads )
+		return;
+	node %= countNodes;
+
+	std::vector<const sLogicalProcessor*> order;
+	order.reserve( list.size() );
+	for( const auto& lp : list )
+		order.push_back( &lp );
+
+	// Processors of the requested node first, then the first logical processor of every core before the SMT siblings, then fast cores before slow ones.
+	// A separate efficiency core is faster than the SMT sibling of a busy performance core.
+	std::stable_sort( order.begin(), order.end(), [ node ]( const sLogicalProcessor* a, const sLogicalProcessor* b )
+		{
+			const bool localA = a->node == node;
+			const bool localB = b->node == node;
+			if( localA != localB )
+				return localA;
+			if( a->siblingIndex != b->siblingIndex )
+				return a->siblingIndex < b->siblingIndex;
+			return a->efficiencyClass > b->efficiencyClass;
+		} );
+
+	// When the computer has less processors than the threads, wrap around
+	rdi.resize( threads );
+	for( size_t i = 0; i < threads; i++ )
+		rdi[ i ] = order[ i % order.size() ]->index;
+}
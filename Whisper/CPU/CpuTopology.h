@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#ifndef _WIN32
+#include <sched.h>
+#endif
+
+namespace CpuCompute
+{
+	// A logical processor of the computer
+	struct sLogicalProcessor
+	{
+		// Index of the processor. On Windows that's 64 * processor group + bit in the affinity mask of the group.
+		uint32_t index;
+		// Zero-based index of the physical core, unique across the complete system
+		uint32_t core;
+		// Zero-based index of the NUMA node
+		uint32_t node;
+		// Larger values mean faster cores of a hybrid CPU; when all cores are identical, that field is 0
+		uint8_t efficiencyClass;
+		// 0 for the first logical processor of the physical core, 1 for the SMT sibling of that processor
+		uint8_t siblingIndex;
+	};
+
+	// Topology of the CPUs: physical cores, SMT siblings, and NUMA nodes.
+	// On Windows it's queried with GetLogicalProcessorInformationEx, on Linux parsed from /sys/devices/system/cpu
+	// When both fail, the fallback assumes a single NUMA node with std::thread::hardware_concurrency() cores without SMT.
+	class CpuTopology
+	{
+		std::vector<sLogicalProcessor> list;
+		uint32_t countCores = 0;
+		uint32_t countNodes = 1;
+		mutable std::atomic<uint32_t> nextNodeCounter = 0;
+
+		CpuTopology();
+		HRESULT query();
+		void queryFallback();
+		void finalize();
+
+	public:
+		// The topology is queried once, on the first call
+		static const CpuTopology& instance();
+
+		const std::vector<sLogicalProcessor>& processors() const
+		{
+			return list;
+		}
+		uint32_t coresCount() const
+		{
+			return countCores;
+		}
+		uint32_t nodesCount() const
+		{
+			return countNodes;
+		}
+		// Count of physical cores of the NUMA node
+		uint32_t coresOnNode( uint32_t node ) const;
+		// Count of physical cores of the largest NUMA node
+		uint32_t coresPerNode() const;
+
+		// Pick NUMA nodes for the new contexts in round-robin order, so multiple contexts spread across the nodes
+		uint32_t nextNode() const;
+
+		// Order logical processors for the threads of a pool which runs on the specified NUMA node.
+		// The first logical processor of every physical core before the SMT siblings, fast cores before slow ones.
+		// When the node has less processors than the threads, the remaining threads go to the processors of other nodes.
+		void placeThreads( std::vector<uint32_t>& rdi, size_t threads, uint32_t node ) const;
+	};
+
+	// Restrict the calling thread to the logical processor, the argument is sLogicalProcessor.index
+	HRESULT pinCurrentThread( uint32_t processor ) noexcept;
+
+	// Pin the calling thread to a logical processor, and restore the original affinity in the destructor
+	class ThreadAffinityRaii
+	{
+#ifdef _WIN32
+		GROUP_AFFINITY prev;
+#else
+		cpu_set_t prev;
+#endif
+		bool restore = false;
+
+	public:
+		ThreadAffinityRaii( uint32_t processor ) noexcept;
+		ThreadAffinityRaii( const ThreadAffinityRaii& ) = delete;
+		~ThreadAffinityRaii();
+	};
+}
@@ -2,6 +2,7 @@
 #include <vector>
 #include "Tensor.h"
 #include "LargeBuffer.h"
+#include "MappedFile.h"
 #if TENSOR_GGML_COMPAT
 #include "../source/ggml.h"
 #endif
@@ -9,6 +10,7 @@
 namespace CpuCompute
 {
 	// A set of tensors for one decoder's layer
+	// The weight matrices are either FP16, or Q4 when the model was converted by Tools/quantizeModel; in both cases they're pre-packed into panels.
 	struct LayerDecoder
 	{
 		// decoder.blocks.*.attn_ln
@@ -91,7 +93,7 @@ namespace CpuCompute
 		// decoder.positional_embedding
 		Tensor positionalEmbedding;
 
-		// decoder.token_embedding
+		// decoder.token_embedding, always FP16 in the dense layout
 		Tensor tokenEmbedding;
 
 		// decoder.ln
@@ -99,9 +101,22 @@ namespace CpuCompute
 		// A vector of layers
 		std::vector<LayerDecoder> layers;
 
-		void setMemoryBuffer( LargeBuffer&& mem ) noexcept
+		// Which buffers of the decoder use large memory pages, set by the loader
+		eLargePages largePages = eLargePages::None;
+		// True to keep the attention caches of the contexts in INT8, set by the loader
+		bool int8KvCache = false;
+
+		// Size of the memory pages with the weights
+		size_t pageSize() const
+		{
+			return memory.pageSize();
+		}
+
+		// Some dense tensors may point directly into the memory mapped model file, in that case the mapping is retained as well
+		void setMemoryBuffer( LargeBuffer&& mem, MappedFile&& file ) noexcept
 		{
 			memory = std::move( mem );
+			mappedFile = std::move( file );
 #if TENSOR_GGML_COMPAT
 			makeCompatTensors();
 #endif
@@ -124,6 +139,8 @@ namespace CpuCompute
 	private:
 		// A smart pointer which owns the memory for all the above tensors
 		LargeBuffer memory;
+		// The model file, when some of the above tensors point into the mapped pages
+		MappedFile mappedFile;
 #if TENSOR_GGML_COMPAT
 		std::vector<ggml_tensor> ggml;
 #endif
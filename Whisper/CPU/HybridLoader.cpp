@@ -1,8 +1,16 @@
 #include "stdafx.h"
 #include "HybridLoader.h"
+#include "mulMat.h"
+#include "CpuTopology.h"
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 using namespace CpuCompute;
 using namespace ComLight;
 
+static inline const char* cstr( const CStringA& s ) { return s; }
+
 static void populateDecodeTensorsMap( CAtlMap<CStringA, Tensor*>& map, int layersDec, DecoderTensors& dec )
 {
 	dec.layers.resize( layersDec );
@@ -51,9 +59,12 @@ static void populateDecodeTensorsMap( CAtlMap<CStringA, Tensor*>& map, int layer
 	}
 }
 
-HybridLoader::HybridLoader( DecoderTensors& m, int countLayers ) :
-	destination( m )
+HybridLoader::HybridLoader( DecoderTensors& m, int countLayers, bool int8Weights, eLargePages largePages, MappedFile* mapping ) :
+	destination( m ),
+	quantizeWeights( int8Weights ),
+	mapping( mapping )
 {
+	destination.largePages = largePages;
 	populateDecodeTensorsMap( map, countLayers, destination );
 	pending.reserve( map.GetCount() );
 }
@@ -76,32 +87,233 @@ HRESULT HybridLoader::setupTensor( const CStringA& name, int n_dims, int ftype,
 	CHECK( stream->getPosition( pt.streamOffset ) );
 	pt.bufferOffset = bufferBytes;
 
-	size_t cbElement;
+	const size_t totalElts = (size_t)(uint32_t)ne[ 0 ] * (uint32_t)ne[ 1 ] * (uint32_t)ne[ 2 ];
+	size_t payloadBytes;
+	size_t cbElement = 1;
 	if( ftype == 0 )
 	{
 		rdi.setType( eDataType::FP32 );
 		cbElement = 4;
+		payloadBytes = totalElts * 4;
 	}
-	else
+	else if( ftype == 1 )
 	{
 		rdi.setType( eDataType::FP16 );
 		cbElement = 2;
+		payloadBytes = totalElts * 2;
+	}
+	else if( ftype == ftypeQ4 )
+	{
+		// 4-bit weights made by Tools/quantizeModel, the only consumer is mulMat
+		if( n_dims != 2 || &rdi == &destination.tokenEmbedding || 0 != ne[ 0 ] % q4BlockSize )
+		{
+			logError( u8"Tensor %s can't be quantized into 4-bit blocks", cstr( name ) );
+			return E_INVALIDARG;
+		}
+		if( !canQuantizeWeights() )
+		{
+			logError( u8"4-bit quantized models require a CPU with AVX2 support" );
+			return E_NOTIMPL;
+		}
+		rdi.setType( eDataType::Q4 );
+		payloadBytes = ( totalElts / q4BlockSize ) * sizeof( BlockQ4 );
+	}
+	else
+	{
+		logError( u8"Tensor %s has unsupported data type %i", cstr( name ), ftype );
+		return E_INVALIDARG;
 	}
 
-	const size_t totalElts = (size_t)(uint32_t)ne[ 0 ] * (uint32_t)ne[ 1 ] * (uint32_t)ne[ 2 ];
-	if( totalElts * cbElement > UINT_MAX )
+	if( payloadBytes > UINT_MAX )
 		return DISP_E_OVERFLOW;
 
-	size_t payloadBytes = cbElement * totalElts;
 	pt.payloadBytes = payloadBytes;
 	CHECK( stream->seek( payloadBytes, eSeekOrigin::Current ) );
 	postponedBytes += (int64_t)payloadBytes;
 
+	// FP16 and Q4 matrices are the weights multiplied by mulMat, the weights never change so we reshape them into panels right away.
+	// The exception is token embedding, addRows() method needs rows of that matrix.
+	if( ftype != 0 && n_dims == 2 && &rdi != &destination.tokenEmbedding )
+	{
+		pt.prePack = true;
+		// With the mapped file, the pre-packing reads the original layout straight from the mapped pages
+		if( nullptr == mapping )
+			maxPrePackBytes = std::max( maxPrePackBytes, payloadBytes );
+		if( ftype == ftypeQ4 )
+			payloadBytes = q4PanelsBytes( rdi );
+		else
+			payloadBytes = quantizeWeights ? quantizedPanelsBytes( rdi ) : prePackedBytes( rdi );
+	}
+	else if( nullptr != mapping )
+	{
+		// The dense tensors are consumed with unaligned loads, natural alignment of the elements is enough to use them without a copy.
+		// The ggml format doesn't pad the payloads, some tensors of the file are misaligned, these are copied into the buffer.
+		const uint8_t* rsi = mapping->payload( pt.streamOffset, payloadBytes );
+		if( nullptr != rsi && 0 == ( (size_t)rsi % cbElement ) )
+		{
+			pt.mapped = true;
+			return S_OK;
+		}
+	}
+
 	payloadBytes = ( payloadBytes + 31 ) & ( ~( (size_t)31 ) );
 	bufferBytes += payloadBytes;
 	return S_OK;
 }
 
+HRESULT HybridLoader::convertTensor( const PendingTensor& pt, const uint8_t* rsi, uint8_t* rdi ) const noexcept
+{
+	Tensor& dest = *pt.destPointer;
+	dest.setDataPointer( (void*)rsi );
+	if( dest.type() == eDataType::Q4 )
+	{
+		CHECK( prePackQ4Panels( rdi, dest ) );
+	}
+	else if( quantizeWeights )
+	{
+		CHECK( quantizePanels( rdi, dest ) );
+		dest.setType( eDataType::I8 );
+	}
+	else
+	{
+		CHECK( prePackPanels( (uint16_t*)rdi, dest ) );
+	}
+	dest.setDataPointer( rdi );
+	dest.setLayout( eTensorLayout::Panels );
+	return S_OK;
+}
+
+// Converts the weight matrices on worker threads, while the calling thread reads the next tensors and reports the progress in the original order.
+// Without worker threads, the conversions run synchronously in submit() method.
+class HybridLoader::Pipeline
+{
+	const HybridLoader& loader;
+	uint8_t* const buffer;
+
+	std::mutex mutex;
+	std::condition_variable cvJobs, cvDone;
+	// Indices of the pending tensors to convert
+	std::deque<size_t> queue;
+	// Source data and the staging slot of every pending tensor, the slot is nullptr for the memory mapped file
+	std::vector<std::pair<const uint8_t*, uint8_t*>> sources;
+	// Status of every pending tensor, S_FALSE while not converted yet
+	std::vector<HRESULT> results;
+	std::vector<uint8_t*> freeSlots;
+	bool stop = false;
+	std::vector<std::thread> threads;
+
+	void workerThread()
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		while( true )
+		{
+			cvJobs.wait( lock, [ this ]() { return stop || !queue.empty(); } );
+			if( stop )
+				return;
+			const size_t idx = queue.front();
+			queue.pop_front();
+			lock.unlock();
+
+			const PendingTensor& pt = loader.pending[ idx ];
+			const HRESULT hr = loader.convertTensor( pt, sources[ idx ].first, buffer + pt.bufferOffset );
+
+			lock.lock();
+			complete( idx, hr );
+		}
+	}
+
+	// Must be called with the mutex locked
+	void complete( size_t idx, HRESULT hr )
+	{
+		results[ idx ] = hr;
+		if( nullptr != sources[ idx ].second )
+			freeSlots.push_back( sources[ idx ].second );
+		cvDone.notify_all();
+	}
+
+public:
+	Pipeline( const HybridLoader& hl, uint8_t* rdi, size_t countWorkers, uint8_t* staging, size_t countSlots, size_t slotBytes ) :
+		loader( hl ),
+		buffer( rdi )
+	{
+		sources.resize( hl.pending.size() );
+		results.resize( hl.pending.size(), S_FALSE );
+		for( size_t i = 0; i < countSlots; i++ )
+			freeSlots.push_back( staging + i * slotBytes );
+		threads.reserve( countWorkers );
+		for( size_t i = 0; i < countWorkers; i++ )
+			threads.emplace_back( &Pipeline::workerThread, this );
+	}
+
+	~Pipeline()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ mutex };
+			stop = true;
+		}
+		cvJobs.notify_all();
+		for( auto& t : threads )
+			t.join();
+	}
+
+	// Wait for a free staging slot to read a tensor from the stream
+	uint8_t* acquireSlot()
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		cvDone.wait( lock, [ this ]() { return !freeSlots.empty(); } );
+		uint8_t* const p = freeSlots.back();
+		freeSlots.pop_back();
+		return p;
+	}
+
+	// Convert the tensor from the source data, slot is the staging slot to release after the conversion
+	void submit( size_t idx, const uint8_t* rsi, uint8_t* slot )
+	{
+		if( threads.empty() )
+		{
+			const PendingTensor& pt = loader.pending[ idx ];
+			const HRESULT hr = loader.convertTensor( pt, rsi, buffer + pt.bufferOffset );
+			sources[ idx ] = std::make_pair( rsi, slot );
+			complete( idx, hr );
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock{ mutex };
+			sources[ idx ] = std::make_pair( rsi, slot );
+			queue.push_back( idx );
+		}
+		cvJobs.notify_one();
+	}
+
+	// Mark the tensor which doesn't need a conversion as completed
+	void completed( size_t idx )
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		complete( idx, S_OK );
+	}
+
+	// True when the tensor is converted, or failed
+	bool isDone( size_t idx )
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		return S_FALSE != results[ idx ];
+	}
+
+	// Wait for the tensor to be converted, and return the status
+	HRESULT wait( size_t idx )
+	{
+		std::unique_lock<std::mutex> lock{ mutex };
+		cvDone.wait( lock, [ this, idx ]() { return S_FALSE != results[ idx ]; } );
+		return results[ idx ];
+	}
+};
+
+namespace
+{
+	// The conversions are bound by memory bandwidth, more threads don't help
+	constexpr size_t maxLoaderThreads = 8;
+}
+
 HRESULT HybridLoader::completeLoad( ComLight::iReadStream* stream, iLoaderProgressSink& progressSink )
 {
 	if( pending.size() != map.GetCount() )
@@ -111,30 +323,108 @@ HRESULT HybridLoader::completeLoad( ComLight::iReadStream* stream, iLoaderProgre
 	}
 
 	LargeBuffer buffer;
-	CHECK( buffer.allocate( bufferBytes ) );
-
-	uint8_t* rdi = buffer.pointer();
+	CHECK( buffer.allocate( bufferBytes, hasFlag( destination.largePages, eLargePages::Weights ) ) );
 
+	size_t countPrePack = 0;
 	for( const auto& pt : pending )
+		if( pt.prePack )
+			countPrePack++;
+
+	// The calling thread reads the tensors, the worker threads convert them; at least one worker even when the topology reports a single core, or none at all
+	const size_t cores = std::max( CpuTopology::instance().coresCount(), 2u );
+	const size_t countWorkers = std::min( { cores - 1, countPrePack, maxLoaderThreads } );
+
+	// Staging buffers for the weight matrices in the original layout, read from the stream.
+	// One slot more than the workers, so the calling thread reads the next matrix while all workers are busy.
+	LargeBuffer staging;
+	size_t countSlots = 0;
+	const size_t slotBytes = ( maxPrePackBytes + 63 ) & ( ~(size_t)63 );
+	if( 0 != maxPrePackBytes )
 	{
+		countSlots = countWorkers + 1;
+		CHECK( staging.allocate( slotBytes * countSlots ) );
+	}
+
+	size_t countMapped = 0;
+	size_t bytesMapped = 0;
+	// The pipeline must be destroyed before the buffers, the destructor stops the worker threads
+	Pipeline pipeline{ *this, buffer.pointer(), countWorkers, countSlots ? staging.pointer() : nullptr, countSlots, slotBytes };
+
+	// Report the progress in the original order of the tensors, as the conversions complete
+	size_t committed = 0;
+	auto commit = [ & ]( size_t end, bool wait ) -> HRESULT
+	{
+		for( ; committed < end; committed++ )
+		{
+			if( !wait && !pipeline.isDone( committed ) )
+				break;
+			CHECK( pipeline.wait( committed ) );
+			CHECK( progressSink.gotBytes( (int64_t)pending[ committed ].payloadBytes ) );
+		}
+		return S_OK;
+	};
+
+	for( size_t i = 0; i < pending.size(); i++ )
+	{
+		const PendingTensor& pt = pending[ i ];
 		if( pt.payloadBytes > INT_MAX )
 			return DISP_E_OVERFLOW;
-		CHECK( stream->seek( pt.streamOffset, eSeekOrigin::Begin ) );
 
-		int written = 0;
-		CHECK( stream->read( rdi, (int)pt.payloadBytes, written ) );
-		CHECK( progressSink.gotBytes( (int64_t)pt.payloadBytes ) );
+		// Source data in the mapped file, or nullptr to read from the stream
+		const uint8_t* rsi = nullptr;
+		if( nullptr != mapping )
+		{
+			rsi = mapping->payload( pt.streamOffset, pt.payloadBytes );
+			if( nullptr == rsi )
+				return E_EOF;
+		}
+		else
+			CHECK( stream->seek( pt.streamOffset, eSeekOrigin::Begin ) );
 
-		pt.destPointer->setDataPointer( rdi );
+		int written = 0;
+		if( pt.mapped )
+		{
+			// The mapped pages are read-only, and the tensors of the model are never written
+			pt.destPointer->setDataPointer( (void*)rsi );
+			countMapped++;
+			bytesMapped += pt.payloadBytes;
+			pipeline.completed( i );
+		}
+		else if( !pt.prePack )
+		{
+			uint8_t* rdi = buffer.pointer() + pt.bufferOffset;
+			if( nullptr != rsi )
+				memcpy( rdi, rsi, pt.payloadBytes );
+			else
+				CHECK( stream->read( rdi, (int)pt.payloadBytes, written ) );
+			pt.destPointer->setDataPointer( rdi );
+			pipeline.completed( i );
+		}
+		else if( nullptr != rsi )
+			pipeline.submit( i, rsi, nullptr );
+		else
+		{
+			uint8_t* const slot = pipeline.acquireSlot();
+			HRESULT hr = stream->read( slot, (int)pt.payloadBytes, written );
+			if( FAILED( hr ) )
+				return hr;
+			pipeline.submit( i, slot, slot );
+		}
 
-		const size_t cb = ( pt.payloadBytes + 31 ) & ( ~( (size_t)31 ) );
-		rdi += cb;
+		CHECK( commit( i + 1, false ) );
 	}
+	CHECK( commit( pending.size(), true ) );
 
 	CHECK( buffer.setReadOnly( bufferBytes ) );
-	destination.setMemoryBuffer( std::move( buffer ) );
+	MappedFile retained;
+	if( 0 != countMapped )
+		retained = std::move( *mapping );
+	destination.setMemoryBuffer( std::move( buffer ), std::move( retained ) );
 
 	constexpr double mulMb = 1.0 / ( 1 << 20 );
-	logDebug( u8"Loaded %zu decoder tensors, %g MB RAM", pending.size(), mulMb * (double)(int64_t)bufferBytes );
+	logDebug( u8"Loaded %zu decoder tensors, %g MB RAM in %zu KB pages%s, converted on %zu threads", pending.size(), mulMb * (double)(int64_t)bufferBytes,
+		destination.pageSize() / 1024, quantizeWeights ? u8", INT8 weights" : u8"", countWorkers + 1 );
+	if( 0 != countMapped )
+		logDebug( u8"%zu decoder tensors, %g MB, are used directly from the memory mapped model file", countMapped, mulMb * (double)(int64_t)bytesMapped );
 	return S_OK;
 }
\ No newline at end of file
@@ -16,6 +16,12 @@ namespace CpuCompute
 		DecoderTensors& destination;
 		CAtlMap<CStringA, Tensor*> map;
 		size_t bufferBytes = 0;
+		// Size of the largest tensor which needs to be pre-packed, these are loaded into a temporary buffer first
+		size_t maxPrePackBytes = 0;
+		// True to quantize the pre-packed FP16 weight matrices into eDataType::I8, the Q4 ones stay as they are
+		const bool quantizeWeights;
+		// Memory mapped model file, or nullptr to read the tensors from the stream
+		MappedFile* const mapping;
 
 		struct alignas( 32 ) PendingTensor
 		{
@@ -23,12 +29,22 @@ namespace CpuCompute
 			int64_t streamOffset = 0;
 			size_t bufferOffset = 0;
 			size_t payloadBytes = 0;
+			// True when the tensor is a weight matrix consumed by mulMat, stored in the buffer in the pre-packed panels layout
+			bool prePack = false;
+			// True when the tensor points directly into the mapped file, without a copy in the buffer
+			bool mapped = false;
 		};
 		std::vector<PendingTensor> pending;
 
+		// Pre-pack or quantize the weight matrix from the source data in the original layout, into the destination buffer
+		HRESULT convertTensor( const PendingTensor& pt, const uint8_t* rsi, uint8_t* rdi ) const noexcept;
+		class Pipeline;
+
 	public:
 
-		HybridLoader( DecoderTensors& m, int countLayers );
+		// When the mapping is provided, the loader reads the tensors from there, and points naturally aligned dense tensors directly into the mapped pages.
+		// When any tensor does, completeLoad() moves the mapping into the DecoderTensors.
+		HybridLoader( DecoderTensors& m, int countLayers, bool int8Weights = false, eLargePages largePages = eLargePages::None, MappedFile* mapping = nullptr );
 
 		HRESULT setupTensor( const CStringA& name, int n_dims, int ftype, const std::array<int, 4>& ne, ComLight::iReadStream* stream, int64_t& postponedBytes );
 
@@ -1,36 +1,136 @@
 #pragma once
 #include "Tensor.h"
 #include "LargeBuffer.h"
+#include "attention.h"
 #include "../Whisper/sModelParams.h"
 
 namespace CpuCompute
 {
+	// Paged KV cache of the self-attention.
+	// The memory is split into pages of a fixed count of positions, every slot is a decoded sequence with the table of the pages it uses.
+	// Slots can share the pages of the common prefix, the shared page is copied when a slot writes into it.
+	// Chunks of pages are allocated on demand, the memory grows with the tokens actually decoded.
+	// Released pages are reused by other slots; the chunks are only freed with the cache.
+	// The elements are either FP16, or INT8 with a scale for every head of every row.
 	class KvTensors
 	{
-		uint16_t* keys = nullptr;
-		uint16_t* values = nullptr;
-		uint32_t size = 0;
+	public:
+		// Positions in one page, equal to the block of the attention kernel so the blocks never cross the pages
+		static constexpr uint32_t pageTokens = attentionBlockSize;
+
+	private:
+		// Count of pages in a chunk of memory allocated from the OS
+		static constexpr uint32_t pagesPerChunk = 4;
+
+		struct sSlot
+		{
+			std::vector<uint32_t> pages;
+		};
+		std::vector<sSlot> slotsTable;
+		// Count of slots which reference every page
+		std::vector<uint16_t> refCounts;
+		// Unused pages, the lowest index on the back of the vector
+		std::vector<uint32_t> freePages;
+		std::vector<CpuCompute::LargeBuffer> chunks;
 
-		CpuCompute::LargeBuffer memory;
+		uint32_t n_state = 0, n_ctx = 0, n_layer = 0, n_head = 0;
+		// Elements in the keys of one layer of one page; the page has n_layer of these blocks for keys, then the same for values.
+		// For INT8 cache, the values are followed by n_layer blocks of the key scales, then n_layer blocks of the value scales.
+		size_t layerElements = 0;
+		// Scales in the keys of one layer of one page, zero for FP16 cache
+		size_t layerScales = 0;
+		size_t pageBytes = 0;
+		bool largePages = false;
+		bool int8 = false;
+
+		uint8_t* pagePointer( uint32_t page ) const
+		{
+			return chunks[ page / pagesPerChunk ].pointer() + ( page % pagesPerChunk ) * pageBytes;
+		}
+		HRESULT allocatePage( uint32_t& rdi );
+		void releasePage( uint32_t page );
+		// Pointer to the page with these rows, and index of the first row in that page
+		uint8_t* rowsPage( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows, uint32_t& row ) const;
+		size_t elementBytes() const
+		{
+			return int8 ? sizeof( int8_t ) : sizeof( uint16_t );
+		}
+		float* scalesPointer( uint8_t* page, size_t block ) const
+		{
+			return (float*)( page + layerElements * n_layer * 2 ) + block * layerScales;
+		}
 
 	public:
-		// Create these two large tensors, FP16 precision
-		HRESULT create( const Whisper::sModelParams& mp );
+		// Create an empty cache with the specified count of slots, FP16 or INT8 precision
+		HRESULT create( const Whisper::sModelParams& mp, bool largePages = false, uint32_t slots = 1, bool int8 = false );
+
+		bool quantized() const
+		{
+			return int8;
+		}
+		// Count of attention heads, INT8 cache has a separate scale for each head of every row
+		uint32_t heads() const
+		{
+			return n_head;
+		}
 
-		// A slice of model.memory_cross_k tensor
-		Tensor keysView( uint32_t len, uint32_t off ) const
+		uint32_t slots() const
 		{
-			if( len + off <= size )
-				return Tensor::fromData( keys + off, eDataType::FP16, len );
-			throw E_BOUNDS;
+			return (uint32_t)slotsTable.size();
 		}
 
-		// A slice of model.memory_cross_v tensor
-		Tensor valuesView( uint32_t len, uint32_t off ) const
+		// Share the first `length` positions of one slot with another one; the pages are copied later, when written
+		HRESULT copySlot( uint32_t source, uint32_t dest, uint32_t length );
+
+		// Make the positions [ n_past, n_past + N ) of the slot writable: allocate the missing pages, and copy the shared ones.
+		// The pages after these positions are released, restarting a slot at n_past = 0 drops the previous sequence.
+		HRESULT prepareWrite( uint32_t slot, uint32_t n_past, uint32_t N );
+
+		// Dense FP16 rows of the keys in a single page, the `rows` must not cross the end of the page
+		Tensor keysRows( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows ) const;
+		// Dense FP16 rows of the values in a single page, the `rows` must not cross the end of the page
+		Tensor valuesRows( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows ) const;
+
+		// Dense INT8 rows in a single page, and their [ n_head, rows ] scales
+		struct sQuantizedRows
+		{
+			int8_t* keys;
+			int8_t* values;
+			float* keyScales;
+			float* valueScales;
+		};
+		sQuantizedRows quantizedRows( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows ) const;
+
+		// Storage for the page pointers referenced by sAttentionPages structure
+		struct sPageTable
+		{
+			std::vector<const void*> keys, values;
+			std::vector<const float*> keyScales, valueScales;
+		};
+		// Collect pointers to the pages with the first `length` positions of the layer, for the attention kernel
+		void layerPages( uint32_t slot, uint32_t layer, uint32_t length, sPageTable& table, sAttentionPages& rdi ) const;
+
+		// Chunks of memory allocated so far
+		uint32_t chunksCount() const
+		{
+			return (uint32_t)chunks.size();
+		}
+		void* chunkPointer( uint32_t i ) const
+		{
+			return chunks[ i ].pointer();
+		}
+		size_t chunkBytes() const
+		{
+			return pageBytes * pagesPerChunk;
+		}
+
+		size_t bytes() const
+		{
+			return chunkBytes() * chunks.size();
+		}
+		size_t pageSize() const
 		{
-			if( len + off <= size )
-				return Tensor::fromData( values + off, eDataType::FP16, len );
-			throw E_BOUNDS;
+			return chunks.empty() ? 0 : chunks[ 0 ].pageSize();
 		}
 	};
-}
\ No newline at end of file
+}
@@ -2,18 +2,198 @@
 #include "KvTensors.h"
 using namespace CpuCompute;
 
-// Create these two large tensors, FP16 precision
-HRESULT KvTensors::create( const Whisper::sModelParams& mp )
+HRESULT KvTensors::create( const Whisper::sModelParams& mp, bool lp, uint32_t slots, bool quantize )
 {
-	const uint32_t n_mem = mp.n_text_layer * mp.n_text_ctx;
-	const uint32_t n_elements = mp.n_text_state * n_mem;
+	if( 0 == slots || 0 == mp.n_text_head || 0 != mp.n_text_state % mp.n_text_head )
+		return E_INVALIDARG;
 
-	const size_t cb = sizeof( uint16_t ) * (size_t)n_elements * 2;
-	CHECK( memory.allocate( cb ) );
+	chunks.clear();
+	refCounts.clear();
+	freePages.clear();
+	slotsTable.clear();
+	slotsTable.resize( slots );
 
-	uint16_t* pointer = (uint16_t*)memory.pointer();
-	keys = pointer;
-	values = pointer + n_elements;
-	size = n_elements;
+	n_state = mp.n_text_state;
+	n_ctx = mp.n_text_ctx;
+	n_layer = mp.n_text_layer;
+	n_head = mp.n_text_head;
+	int8 = quantize;
+	layerElements = (size_t)pageTokens * n_state;
+	layerScales = int8 ? (size_t)pageTokens * n_head : 0;
+	pageBytes = ( elementBytes() * layerElements + sizeof( float ) * layerScales ) * n_layer * 2;
+	largePages = lp;
 	return S_OK;
-}
\ No newline at end of file
+}
+
+HRESULT KvTensors::allocatePage( uint32_t& rdi )
+{
+	if( freePages.empty() )
+	{
+		LargeBuffer& chunk = chunks.emplace_back();
+		const HRESULT hr = chunk.allocate( chunkBytes(), largePages );
+		if( FAILED( hr ) )
+		{
+			chunks.pop_back();
+			return hr;
+		}
+
+		const uint32_t first = (uint32_t)refCounts.size();
+		refCounts.resize( first + pagesPerChunk, 0 );
+		for( uint32_t i = pagesPerChunk; i > 0; i-- )
+			freePages.push_back( first + i - 1 );
+	}
+
+	rdi = freePages.back();
+	freePages.pop_back();
+	refCounts[ rdi ] = 1;
+	return S_OK;
+}
+
+void KvTensors::releasePage( uint32_t page )
+{
+	assert( refCounts[ page ] > 0 );
+	refCounts[ page ]--;
+	if( 0 == refCounts[ page ] )
+		freePages.push_back( page );
+}
+
+HRESULT KvTensors::copySlot( uint32_t source, uint32_t dest, uint32_t length )
+{
+	if( source >= slotsTable.size() || dest >= slotsTable.size() || length > n_ctx )
+		return E_BOUNDS;
+	if( source == dest )
+		return S_FALSE;
+
+	const std::vector<uint32_t>& src = slotsTable[ source ].pages;
+	std::vector<uint32_t>& dst = slotsTable[ dest ].pages;
+	const size_t count = ( length + pageTokens - 1 ) / pageTokens;
+	if( count > src.size() )
+		return E_BOUNDS;
+
+	// Add references first, the slots may already share some of these pages
+	for( size_t i = 0; i < count; i++ )
+	{
+		if( refCounts[ src[ i ] ] == UINT16_MAX )
+			return DISP_E_OVERFLOW;
+		refCounts[ src[ i ] ]++;
+	}
+	for( uint32_t p : dst )
+		releasePage( p );
+	dst.assign( src.begin(), src.begin() + count );
+	return S_OK;
+}
+
+HRESULT KvTensors::prepareWrite( uint32_t slot, uint32_t n_past, uint32_t N )
+{
+	if( slot >= slotsTable.size() || n_past + N > n_ctx )
+		return E_BOUNDS;
+	std::vector<uint32_t>& pages = slotsTable[ slot ].pages;
+	const size_t count = ( n_past + N + pageTokens - 1 ) / pageTokens;
+
+	// Positions after the end of this write are stale, the decoder never reads them before writing them again.
+	// Release their pages, otherwise the memory would track the longest sequence ever decoded in the slot.
+	while( pages.size() > count )
+	{
+		releasePage( pages.back() );
+		pages.pop_back();
+	}
+
+	// Copy the shared pages this write will modify
+	for( size_t i = n_past / pageTokens; i < pages.size(); i++ )
+	{
+		const uint32_t page = pages[ i ];
+		if( refCounts[ page ] < 2 )
+			continue;
+		uint32_t copy;
+		CHECK( allocatePage( copy ) );
+		// Only the positions before n_past are valid, the rest of the page is either written by the decoder for all layers, or stale
+		if( i * pageTokens < n_past )
+			memcpy( pagePointer( copy ), pagePointer( page ), pageBytes );
+		releasePage( page );
+		pages[ i ] = copy;
+	}
+
+	while( pages.size() < count )
+	{
+		uint32_t page;
+		CHECK( allocatePage( page ) );
+		pages.push_back( page );
+	}
+	return S_OK;
+}
+
+uint8_t* KvTensors::rowsPage( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows, uint32_t& row ) const
+{
+	const std::vector<uint32_t>& pages = slotsTable[ slot ].pages;
+	const uint32_t idx = position / pageTokens;
+	row = position % pageTokens;
+	if( idx >= pages.size() || row + rows > pageTokens || layer >= n_layer )
+		throw E_BOUNDS;
+	return pagePointer( pages[ idx ] );
+}
+
+Tensor KvTensors::keysRows( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows ) const
+{
+	if( int8 )
+		throw E_NOTIMPL;
+	uint32_t row;
+	uint16_t* rdi = (uint16_t*)rowsPage( slot, layer, position, rows, row );
+	rdi += layer * layerElements + (size_t)row * n_state;
+	return Tensor::fromData( rdi, eDataType::FP16, rows * n_state );
+}
+
+Tensor KvTensors::valuesRows( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows ) const
+{
+	if( int8 )
+		throw E_NOTIMPL;
+	uint32_t row;
+	uint16_t* rdi = (uint16_t*)rowsPage( slot, layer, position, rows, row );
+	rdi += ( n_layer + layer ) * layerElements + (size_t)row * n_state;
+	return Tensor::fromData( rdi, eDataType::FP16, rows * n_state );
+}
+
+KvTensors::sQuantizedRows KvTensors::quantizedRows( uint32_t slot, uint32_t layer, uint32_t position, uint32_t rows ) const
+{
+	if( !int8 )
+		throw E_NOTIMPL;
+	uint32_t row;
+	uint8_t* page = rowsPage( slot, layer, position, rows, row );
+	sQuantizedRows res;
+	res.keys = (int8_t*)page + layer * layerElements + (size_t)row * n_state;
+	res.values = (int8_t*)page + ( n_layer + layer ) * layerElements + (size_t)row * n_state;
+	res.keyScales = scalesPointer( page, layer ) + (size_t)row * n_head;
+	res.valueScales = scalesPointer( page, n_layer + layer ) + (size_t)row * n_head;
+	return res;
+}
+
+void KvTensors::layerPages( uint32_t slot, uint32_t layer, uint32_t length, sPageTable& table, sAttentionPages& rdi ) const
+{
+	const std::vector<uint32_t>& pages = slotsTable[ slot ].pages;
+	const size_t count = ( length + pageTokens - 1 ) / pageTokens;
+	if( count > pages.size() || layer >= n_layer )
+		throw E_BOUNDS;
+
+	const size_t cbLayer = elementBytes() * layerElements;
+	table.keys.resize( count );
+	table.values.resize( count );
+	table.keyScales.resize( int8 ? count : 0 );
+	table.valueScales.resize( int8 ? count : 0 );
+	for( size_t i = 0; i < count; i++ )
+	{
+		uint8_t* p = pagePointer( pages[ i ] );
+		table.keys[ i ] = p + layer * cbLayer;
+		table.values[ i ] = p + ( n_layer + layer ) * cbLayer;
+		if( int8 )
+		{
+			table.keyScales[ i ] = scalesPointer( p, layer );
+			table.valueScales[ i ] = scalesPointer( p, n_layer + layer );
+		}
+	}
+
+	rdi.keys = table.keys.data();
+	rdi.values = table.values.data();
+	rdi.keyScales = int8 ? table.keyScales.data() : nullptr;
+	rdi.valueScales = int8 ? table.valueScales.data() : nullptr;
+	rdi.pageRows = pageTokens;
+	rdi.length = length;
+}
@@ -1,22 +1,116 @@
 #include "stdafx.h"
 #include "LargeBuffer.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fstream>
+#include <string>
+#endif
 using namespace CpuCompute;
 
+namespace
+{
+	constexpr size_t smallPageSize = 4096;
+
+	inline size_t roundUp( size_t cb, size_t page )
+	{
+		return ( cb + page - 1 ) / page * page;
+	}
+
+#ifdef _WIN32
+	// Size of the large page, or 0 when they're unavailable.
+	// Large pages require SeLockMemoryPrivilege, the function enables that privilege for the process on first call.
+	size_t largePageSize()
+	{
+		static const size_t cb = []() -> size_t
+		{
+			const size_t minimum = GetLargePageMinimum();
+			if( 0 == minimum )
+				return 0;
+
+			HANDLE token = nullptr;
+			if( !OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token ) )
+				return 0;
+
+			TOKEN_PRIVILEGES tp;
+			tp.PrivilegeCount = 1;
+			tp.Privileges[ 0 ].Attributes = SE_PRIVILEGE_ENABLED;
+			bool ok = LookupPrivilegeValue( nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[ 0 ].Luid );
+			// AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED code when the account doesn't have the privilege
+			ok = ok && AdjustTokenPrivileges( token, FALSE, &tp, 0, nullptr, nullptr ) && ERROR_SUCCESS == GetLastError();
+			CloseHandle( token );
+			if( ok )
+				return minimum;
+
+			logInfo( u8"Large memory pages are unavailable, the user account doesn't have SeLockMemoryPrivilege" );
+			return 0;
+		}();
+		return cb;
+	}
+#else
+	// Default size of the huge pages, from /proc/meminfo
+	size_t largePageSize()
+	{
+		static const size_t cb = []() -> size_t
+		{
+			std::ifstream f{ "/proc/meminfo" };
+			std::string line;
+			while( std::getline( f, line ) )
+			{
+				if( 0 != line.compare( 0, 13, "Hugepagesize:" ) )
+					continue;
+				return (size_t)std::stoull( line.substr( 13 ) ) * 1024;
+			}
+			return 0;
+		}();
+		return cb;
+	}
+#endif
+}
+
 void LargeBuffer::deallocate()
 {
 	if( nullptr == pv )
 		return;
+#ifdef _WIN32
 	VirtualFree( pv, 0, MEM_RELEASE );
+#else
+	munmap( pv, cbMapped );
+#endif
 	pv = nullptr;
+	cbMapped = 0;
+	cbPage = 0;
 }
 
-HRESULT LargeBuffer::allocate( size_t cb )
+#ifdef _WIN32
+HRESULT LargeBuffer::allocate( size_t cb, bool largePages )
 {
 	deallocate();
-	
+
+	if( largePages )
+	{
+		const size_t page = largePageSize();
+		if( 0 != page )
+		{
+			const size_t cbLarge = roundUp( cb, page );
+			pv = VirtualAlloc( nullptr, cbLarge, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE );
+			if( nullptr != pv )
+			{
+				cbMapped = cbLarge;
+				cbPage = page;
+				return S_OK;
+			}
+			// Large pages need physically contiguous memory, when it's fragmented the allocation fails
+			logWarningHr( getLastHr(), u8"VirtualAlloc with MEM_LARGE_PAGES failed, using normal pages" );
+		}
+	}
+
 	pv = VirtualAlloc( nullptr, cb, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
 	if( nullptr != pv )
+	{
+		cbMapped = cb;
+		cbPage = smallPageSize;
 		return S_OK;
+	}
 	return HRESULT_FROM_WIN32( GetLastError() );
 }
 
@@ -24,6 +118,8 @@ HRESULT LargeBuffer::setReadOnly( size_t cb )
 {
 	if( nullptr != pv )
 	{
+		if( cbPage != smallPageSize )
+			return S_FALSE;
 		DWORD op = 0;
 		if( VirtualProtect( pv, cb, PAGE_READONLY, &op ) )
 			return S_OK;
@@ -31,4 +127,49 @@ HRESULT LargeBuffer::setReadOnly( size_t cb )
 	}
 	else
 		return OLE_E_BLANK;
-}
\ No newline at end of file
+}
+#else
+HRESULT LargeBuffer::allocate( size_t cb, bool largePages )
+{
+	deallocate();
+
+	if( largePages )
+	{
+		const size_t page = largePageSize();
+		if( 0 != page )
+		{
+			const size_t cbLarge = roundUp( cb, page );
+			void* const p = mmap( nullptr, cbLarge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+			if( MAP_FAILED != p )
+			{
+				pv = p;
+				cbMapped = cbLarge;
+				cbPage = page;
+				return S_OK;
+			}
+			// The pool of huge pages is empty unless configured with vm.nr_hugepages
+		}
+	}
+
+	const size_t cbSmall = roundUp( cb, smallPageSize );
+	void* const p = mmap( nullptr, cbSmall, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( MAP_FAILED == p )
+		return E_OUTOFMEMORY;
+	pv = p;
+	cbMapped = cbSmall;
+	cbPage = smallPageSize;
+	// Transparent huge pages are not guaranteed, the page size reported for the buffer stays 4kb
+	if( largePages )
+		madvise( pv, cbSmall, MADV_HUGEPAGE );
+	return S_OK;
+}
+
+HRESULT LargeBuffer::setReadOnly( size_t cb )
+{
+	if( nullptr == pv )
+		return OLE_E_BLANK;
+	if( 0 == mprotect( pv, roundUp( cb, cbPage ), PROT_READ ) )
+		return S_OK;
+	return E_FAIL;
+}
+#endif
@@ -2,17 +2,40 @@
 
 namespace CpuCompute
 {
-	// A large memory buffer allocated with VirtualAlloc kernel API, bypassing the heap.
+	// Which of the large buffers of the hybrid decoder use large memory pages, a bitmask
+	enum struct eLargePages : uint8_t
+	{
+		None = 0,
+		// Weights of the decoder, allocated when the model is loaded
+		Weights = 1,
+		// KV cache of the self-attention, allocated per context
+		KvCache = 2,
+		// Scratch memory for the intermediate tensors, allocated per context
+		Compute = 4,
+	};
+
+	inline bool hasFlag( eLargePages mask, eLargePages bit )
+	{
+		return 0 != ( (uint8_t)mask & (uint8_t)bit );
+	}
+
+	// A large memory buffer allocated with VirtualAlloc kernel API, or mmap on Linux, bypassing the heap.
 	class LargeBuffer
 	{
 		void* pv = nullptr;
+		size_t cbMapped = 0;
+		size_t cbPage = 0;
 	public:
 		LargeBuffer() = default;
 		LargeBuffer( const LargeBuffer& ) = delete;
 		LargeBuffer( LargeBuffer&& that ) noexcept
 		{
 			pv = that.pv;
+			cbMapped = that.cbMapped;
+			cbPage = that.cbPage;
 			that.pv = nullptr;
+			that.cbMapped = 0;
+			that.cbPage = 0;
 		}
 		~LargeBuffer()
 		{
@@ -21,14 +44,19 @@ namespace CpuCompute
 		void operator=( LargeBuffer&& that ) noexcept
 		{
 			std::swap( pv, that.pv );
+			std::swap( cbMapped, that.cbMapped );
+			std::swap( cbPage, that.cbPage );
 		}
 		void operator=( const LargeBuffer& that ) = delete;
 
 		// Allocate buffer with specified count of bytes, and read+write memory protection
 		// The OS kernel guarantees zero-initialization of that memory.
-		HRESULT allocate( size_t cb );
+		// When largePages is true, the method tries large pages: MEM_LARGE_PAGES on Windows which needs SeLockMemoryPrivilege, MAP_HUGETLB on Linux.
+		// When they're not available it falls back to normal pages, on Linux advising the kernel to back the buffer with transparent huge pages.
+		HRESULT allocate( size_t cb, bool largePages = false );
 
 		// Change memory protection of the buffer to read only
+		// Returns S_FALSE for large pages on Windows, the protection of these pages can't be changed.
 		HRESULT setReadOnly( size_t cb );
 
 		// Unless the pointer is nullptr, deallocate the buffer
@@ -40,5 +68,11 @@ namespace CpuCompute
 			assert( nullptr != pv );
 			return (uint8_t*)pv;
 		}
+
+		// Size of the memory pages which back this buffer, 0 when the buffer is empty
+		size_t pageSize() const
+		{
+			return cbPage;
+		}
 	};
-}
\ No newline at end of file
+}
@@ -0,0 +1,92 @@
+#include "stdafx.h"
+#include "MappedFile.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#endif
+using namespace CpuCompute;
+
+#ifdef _WIN32
+HRESULT MappedFile::map( const wchar_t* path )
+{
+	unmap();
+
+	CHandle file{ CreateFileW( path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr ) };
+	if( INVALID_HANDLE_VALUE == file )
+	{
+		file.Detach();
+		return getLastHr();
+	}
+
+	LARGE_INTEGER length;
+	if( !GetFileSizeEx( file, &length ) )
+		return getLastHr();
+	if( 0 == length.QuadPart )
+		return E_EOF;
+
+	// The view keeps the mapping object alive, both handles can be closed as soon as the view is created
+	CHandle mapping{ CreateFileMappingW( file, nullptr, PAGE_READONLY, 0, 0, nullptr ) };
+	if( !mapping )
+		return getLastHr();
+
+	void* const p = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	if( nullptr == p )
+		return getLastHr();
+
+	pv = (const uint8_t*)p;
+	cb = (size_t)length.QuadPart;
+	return S_OK;
+}
+
+void MappedFile::unmap()
+{
+	if( nullptr == pv )
+		return;
+	UnmapViewOfFile( pv );
+	pv = nullptr;
+	cb = 0;
+}
+#else
+HRESULT MappedFile::map( const wchar_t* path )
+{
+	unmap();
+
+	const int fd = open( std::filesystem::path{ path }.c_str(), O_RDONLY | O_CLOEXEC );
+	if( fd < 0 )
+		return E_FAIL;
+
+	struct stat st;
+	if( 0 != fstat( fd, &st ) )
+	{
+		close( fd );
+		return E_FAIL;
+	}
+	if( 0 == st.st_size )
+	{
+		close( fd );
+		return E_EOF;
+	}
+
+	// The mapping stays valid after the file descriptor is closed
+	void* const p = mmap( nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( MAP_FAILED == p )
+		return E_OUTOFMEMORY;
+
+	pv = (const uint8_t*)p;
+	cb = (size_t)st.st_size;
+	return S_OK;
+}
+
+void MappedFile::unmap()
+{
+	if( nullptr == pv )
+		return;
+	munmap( (void*)pv, cb );
+	pv = nullptr;
+	cb = 0;
+}
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+namespace CpuCompute
+{
+	// A complete file mapped into memory for read-only access, with CreateFileMapping / MapViewOfFile kernel APIs on Windows, or mmap on Linux.
+	// The pages are backed by the OS file cache: when several processes load the same model, they share the physical memory.
+	class MappedFile
+	{
+		const uint8_t* pv = nullptr;
+		size_t cb = 0;
+	public:
+		MappedFile() = default;
+		MappedFile( const MappedFile& ) = delete;
+		MappedFile( MappedFile&& that ) noexcept
+		{
+			pv = that.pv;
+			cb = that.cb;
+			that.pv = nullptr;
+			that.cb = 0;
+		}
+		~MappedFile()
+		{
+			unmap();
+		}
+		void operator=( MappedFile&& that ) noexcept
+		{
+			std::swap( pv, that.pv );
+			std::swap( cb, that.cb );
+		}
+		void operator=( const MappedFile& that ) = delete;
+
+		// Map the complete file into the address space of the process
+		HRESULT map( const wchar_t* path );
+
+		// Unless empty, unmap the file
+		void unmap();
+
+		bool empty() const
+		{
+			return nullptr == pv;
+		}
+
+		// Size of the file in bytes
+		size_t size() const
+		{
+			return cb;
+		}
+
+		// Pointer to the specified range of the file, or nullptr when the file is not mapped, or the range is outside of the file
+		const uint8_t* payload( int64_t offset, size_t length ) const
+		{
+			if( nullptr == pv || offset < 0 || (size_t)offset > cb || length > cb - (size_t)offset )
+				return nullptr;
+			return pv + offset;
+		}
+	};
+}
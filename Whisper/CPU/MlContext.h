@@ -1,22 +1,75 @@
 #pragma once
 #include "Tensor.h"
 #include "ParallelForRunner.h"
+#include "mulMatEpilogue.h"
+#include "logitsSummary.h"
+#include "attention.h"
 
 namespace CpuCompute
 {
+	// Types of compute operations, for the profiler
+	enum struct eCpuOp : uint8_t
+	{
+		Norm,
+		MulMat,
+		Attention,
+		Logits,
+		SoftMax,
+		Elementwise,
+		Copy,
+	};
+	constexpr size_t countCpuOps = 7;
+	const char* cpuOpName( eCpuOp op );
+
+	// Profiler counters for the operations of the same type
+	struct sOpStats
+	{
+		size_t calls = 0;
+		// Sum of the thread counts chosen by the cost model
+		size_t threads = 0;
+		// Total time, in CPU timestamp counter units
+		uint64_t tsc = 0;
+	};
+
 	class MlContext
 	{
 		ParallelForRunner pfor;
 		iMemoryAllocator* allocator = nullptr;
+		std::array<sOpStats, countCpuOps> opStats;
+
+		// Picks the count of threads for the operation from the cost model, and updates the profiler counters
+		class OpRaii;
+
+		Tensor mulMatImpl( const Tensor& a, const Tensor& b, const sMulMatEpilogue* epilogue );
 
 	public:
 		MlContext( int threads );
 		MlContext( const MlContext& ) = delete;
 		~MlContext() = default;
 
-		HRESULT setThreadsCount( int threads )
+		HRESULT setThreadsCount( int threads, uint32_t spinMicroseconds = 0, bool pinThreads = false, uint32_t numaNode = 0 )
+		{
+			return pfor.setThreadsCount( threads, spinMicroseconds, pinThreads, numaNode );
+		}
+
+		uint32_t callerProcessor() const
+		{
+			return pfor.callerProcessor();
+		}
+
+		HRESULT firstTouch( void* pv, size_t cb )
+		{
+			return pfor.firstTouch( pv, cb );
+		}
+
+		// Profiler counters collected since the last call to resetOpStats()
+		const std::array<sOpStats, countCpuOps>& getOpStats() const
+		{
+			return opStats;
+		}
+		void resetOpStats()
 		{
-			return pfor.setThreadsCount( threads );
+			opStats.fill( sOpStats{} );
 		}
 
 		iMemoryAllocator* setAllocator( iMemoryAllocator* alloc )
@@ -41,9 +94,20 @@ namespace CpuCompute
 			fmaRepeat( cur, wb.w, wb.b );
 		}
 
+		// Fused norm( arg ) followed by fmaRepeat( wb ), computes each row while it's still in L1 cache
+		Tensor normFmaRepeat( const Tensor& arg, const TensorPair& wb );
+
 		// Multiply two matrices
 		Tensor mulMat( const Tensor& a, const Tensor& b );
 
+		// Fused versions of mulMat( wb.w, cur ) followed by addRepeat, addRepeatScale, or addRepeatGelu with wb.b
+		// The mulMat kernels apply the bias to the panels of the output matrix, saving a pass over the complete result
+		Tensor mulMatAddRepeat( const TensorPair& wb, const Tensor& cur );
+		Tensor mulMatAddRepeatScale( const TensorPair& wb, const Tensor& cur, float scaling );
+		Tensor mulMatAddRepeatGelu( const TensorPair& wb, const Tensor& cur );
+		// Fused mulMat( a, b ) followed by scale
+		Tensor mulMatScale( const Tensor& a, const Tensor& b, float scaling );
+
 		// cur = add( repeat( b, cur ), cur ); cur = scale(cur, scaling)
 		void addRepeatScale( Tensor& cur, const Tensor& b, float scaling );
 
@@ -67,5 +131,17 @@ namespace CpuCompute
 		Tensor permute( const Tensor& a, uint8_t axis0, uint8_t axis1, uint8_t axis2, uint8_t axis3 );
 
 		void copyInPlace( Tensor& dest, const Tensor& a, eDataType type, std::initializer_list<uint32_t> size );
+
+		// Fused multi-head attention over FP16 rows of the KV cache, returns [ n_state, N ] matrix with the heads merged.
+		// With the causal mask, it's equivalent to diagMaskInf( KQ, n_past ) in the unfused version.
+		Tensor attention( const Tensor& q, const Tensor& k, const Tensor& v, uint32_t n_head, uint32_t n_past, bool causalMask );
+		// Same as above, reading the rows of the KV cache through the table of pages
+		Tensor attention( const Tensor& q, const sAttentionPages& kv, uint32_t n_head, uint32_t n_past, bool causalMask );
+
+		// Quantize dense FP32 or FP16 rows of keys or values into INT8 numbers and the per-head scales, for the INT8 KV caches
+		void quantizeKv( const Tensor& source, int8_t* rdi, float* scales, uint32_t n_head );
+
+		// Fused softMax( mulMat( embedding, x ) ) for a single token, only computes the best tokens and the sums the sampling needs
+		void logitsSummary( sLogitsSummary& result, const Tensor& embedding, const Tensor& x, uint32_t tokenBeg );
 	};
 }
\ No newline at end of file
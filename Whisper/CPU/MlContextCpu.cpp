@@ -2,8 +2,55 @@
 #include "MlContext.h"
 #include "simdUtils.h"
 #include "mulMat.h"
+#include "attention.h"
+#include "../Utils/CpuProfiler.h"
 using namespace CpuCompute;
 
+const char* CpuCompute::cpuOpName( eCpuOp op )
+{
+	switch( op )
+	{
+#define V(x) case eCpuOp::x: return #x
+		V( Norm );
+		V( MulMat );
+		V( Attention );
+		V( Logits );
+		V( SoftMax );
+		V( Elementwise );
+		V( Copy );
+#undef V
+	}
+	assert( false );
+	return nullptr;
+}
+
+class MlContext::OpRaii
+{
+	ParallelForRunner& pfor;
+	sOpStats& stats;
+	const size_t threads;
+	const size_t prevLimit;
+	const int64_t tsc;
+
+public:
+	OpRaii( MlContext& context, eCpuOp op, const sOpCost& cost ) :
+		pfor( context.pfor ),
+		stats( context.opStats[ (uint8_t)op ] ),
+		threads( context.pfor.threadsForCost( cost ) ),
+		prevLimit( context.pfor.setThreadsLimit( threads ) ),
+		tsc( Whisper::tscNow() )
+	{
+		stats.calls++;
+		stats.threads += threads;
+	}
+	OpRaii( const OpRaii& ) = delete;
+	~OpRaii()
+	{
+		stats.tsc += (uint64_t)( Whisper::tscNow() - tsc );
+		pfor.setThreadsLimit( prevLimit );
+	}
+};
+
 MlContext::MlContext( int threads ) : pfor( threads )
 {
 }
@@ -107,7 +154,8 @@ namespace
 		}
 	};
 
-	inline const float* sourceRow( const float* rsi, const std::array<uint32_t, 3>& idx, size_t nb0, size_t nb1, size_t nb2 )
+	template<class E>
+	inline const E* sourceRow( const E* rsi, const std::array<uint32_t, 3>& idx, size_t nb0, size_t nb1, size_t nb2 )
 	{
 		const size_t r0 = idx[ 0 ] * nb0;
 		const size_t r1 = idx[ 1 ] * nb1;
@@ -116,6 +164,75 @@ namespace
 		return rsi;
 	}
 
+	// The count of threads is chosen by the cost model of the thread pool, see MlContext::OpRaii class.
+	// Each batch claimed by a thread of the pool has at least this count of elements, to amortize the overhead of claiming the batches.
+	constexpr size_t minElementsPerBatch = 2 * 1024;
+
+	// Adapter which runs a functor in the thread pool, the functor receives [ begin, end ) range of rows
+	template<class Func>
+	struct RowsContext : public iComputeRange
+	{
+		const Func& func;
+		RowsContext( const Func& f ) : func( f ) { }
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			if( i < end )
+				func( i, end );
+			return S_OK;
+		}
+	};
+
+	// Split rows of the specified length across threads of the pool
+	template<class Func>
+	inline HRESULT parallelRows( ParallelForRunner& pfor, size_t countRows, size_t rowLength, const Func& func )
+	{
+		const size_t minBatch = std::max( minElementsPerBatch / std::max( rowLength, (size_t)1 ), (size_t)1 );
+		RowsContext<Func> context{ func };
+		return pfor.parallelFor( context, countRows, minBatch );
+	}
+
+	// Flat elementwise operations are split into chunks of this count of elements, the chunks are then distributed across threads
+	constexpr size_t elementwiseChunk = 4 * 1024;
+
+	// Split elements of a dense vector across threads of the pool; the functor receives offset and count of the elements
+	template<class Func>
+	inline HRESULT parallelElements( ParallelForRunner& pfor, size_t length, const Func& func )
+	{
+		const size_t chunks = ( length + elementwiseChunk - 1 ) / elementwiseChunk;
+		return parallelRows( pfor, chunks, elementwiseChunk, [ & ]( size_t i, size_t end )
+			{
+				const size_t begin = i * elementwiseChunk;
+				end = std::min( end * elementwiseChunk, length );
+				func( begin, end - begin );
+			} );
+	}
+
+	// Run the functor for every row of the dense FP32 tensor, with indices of the matching row in the pattern tensor.
+	// This implements the repeat() part of fmaRepeat, addRepeat, addRepeatScale and addRepeatGelu operations.
+	template<class Func>
+	inline HRESULT parallelRepeat( ParallelForRunner& pfor, Tensor& cur, const Tensor& pattern, const Func& func )
+	{
+		const DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
+		const size_t innerRes = cur.ne[ 0 ];
+		float* const rdiBegin = cur.fp32();
+		const std::array<uint32_t, 3> nePattern{ pattern.ne[ 1 ], pattern.ne[ 2 ], pattern.ne[ 3 ] };
+
+		return parallelRows( pfor, helper.groupsCount(), innerRes, [ & ]( size_t i, size_t end )
+			{
+				std::array<uint32_t, 3> idx = helper.unpack( i );
+				float* rdi = rdiBegin + i * innerRes;
+				for( ; i < end; i++, helper.next( idx ), rdi += innerRes )
+				{
+					std::array<uint32_t, 3> idxPattern;
+					idxPattern[ 0 ] = idx[ 0 ] % nePattern[ 0 ];
+					idxPattern[ 1 ] = idx[ 1 ] % nePattern[ 1 ];
+					idxPattern[ 2 ] = idx[ 2 ] % nePattern[ 2 ];
+					func( rdi, idxPattern );
+				}
+			} );
+	}
+
 	struct NormContext : public iComputeRange
 	{
 		const float* source;
@@ -123,6 +240,9 @@ namespace
 		size_t inner;
 		DispatchHelper3 threads;
 		std::array<uint32_t, 3> nbInput;
+		// Optional weight and bias vectors of the layer normalization, when not nullptr the rows are computed with fmaRepeatRow() after norm()
+		const float* w = nullptr;
+		const float* b = nullptr;
 
 		HRESULT __stdcall compute( size_t i, size_t end ) const override final
 		{
@@ -134,10 +254,36 @@ namespace
 			{
 				const float* rsi = sourceRow( source, idx, nbInput[ 0 ], nbInput[ 1 ], nbInput[ 2 ] );
 				norm( rdi, temp, rsi, inner );
+				if( nullptr != w )
+					fmaRepeatRow( rdi, inner, w, b, inner );
 			}
 			return S_OK;
 		}
 	};
+
+	// True when the tensor is a dense FP32 vector of the specified length
+	inline bool isDenseVector( const Tensor& t, size_t length )
+	{
+		return t.type() == eDataType::FP32 && t.isContinuous() && t.ne[ 0 ] == length && t.countElements() == length;
+	}
+
+	// Cost of an operation which processes every element of a tensor
+	inline sOpCost elementwiseCost( size_t elements, double flopsPerElement, double bytesPerElement )
+	{
+		sOpCost res;
+		res.flops = (double)elements * flopsPerElement;
+		res.bytes = (double)elements * bytesPerElement;
+		return res;
+	}
+
+	// Size of the tensor data in memory, in bytes
+	inline double tensorBytes( const Tensor& t )
+	{
+		const double elements = (double)t.countElements();
+		if( t.type() == eDataType::Q4 )
+			return elements * ( 18.0 / 32.0 );
+		return elements * (double)elementSize( t.type() );
+	}
 }
 
 Tensor MlContext::norm( const Tensor& arg )
@@ -145,6 +291,33 @@ Tensor MlContext::norm( const Tensor& arg )
 	if( arg.type() != eDataType::FP32 || arg.nb[ 0 ] != 1 )
 		throw E_INVALIDARG;
 	Tensor res = createTensor( eDataType::FP32, arg.ne );
+	OpRaii op{ *this, eCpuOp::Norm, elementwiseCost( arg.countElements(), 8, 8 ) };
+
+	NormContext context;
+	context.source = arg.fp32();
+	context.result = res.fp32();
+	context.inner = arg.ne[ 0 ];
+	context.threads = DispatchHelper3( arg.ne[ 1 ], arg.ne[ 2 ], arg.ne[ 3 ] );
+	context.nbInput = { arg.nb[ 1 ], arg.nb[ 2 ], arg.nb[ 3 ] };
+
+	check( pfor.parallelFor( context, context.threads.groupsCount() ) );
+	return res;
+}
+
+Tensor MlContext::normFmaRepeat( const Tensor& arg, const TensorPair& wb )
+{
+	if( arg.type() != eDataType::FP32 || arg.nb[ 0 ] != 1 )
+		throw E_INVALIDARG;
+	if( !( isDenseVector( wb.w, arg.ne[ 0 ] ) && isDenseVector( wb.b, arg.ne[ 0 ] ) ) )
+	{
+		// The weights are not vectors of the same length as the rows, use the general-purpose version of fmaRepeat
+		Tensor res = norm( arg );
+		fmaRepeat( res, wb );
+		return res;
+	}
+
+	Tensor res = createTensor( eDataType::FP32, arg.ne );
+	OpRaii op{ *this, eCpuOp::Norm, elementwiseCost( arg.countElements(), 10, 8 ) };
 
 	NormContext context;
 	context.source = arg.fp32();
@@ -152,6 +325,8 @@ Tensor MlContext::norm( const Tensor& arg )
 	context.inner = arg.ne[ 0 ];
 	context.threads = DispatchHelper3( arg.ne[ 1 ], arg.ne[ 2 ], arg.ne[ 3 ] );
 	context.nbInput = { arg.nb[ 1 ], arg.nb[ 2 ], arg.nb[ 3 ] };
+	context.w = wb.w.fp32();
+	context.b = wb.b.fp32();
 
 	check( pfor.parallelFor( context, context.threads.groupsCount() ) );
 	return res;
@@ -168,28 +343,19 @@ void MlContext::fmaRepeat( Tensor& cur, const Tensor& w, const Tensor& b )
 	if( !isSameShape( w, b ) )
 		throw E_INVALIDARG;
 
-	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
-	std::array<uint32_t, 3> idx = { 0, 0, 0 };
-	const size_t countRows = helper.groupsCount();
-
 	const size_t innerRes = cur.ne[ 0 ];
 	const size_t innerPattern = w.ne[ 0 ];
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( cur.countElements(), 2, 8 ) };
 
-	float* rdi = cur.fp32();
-	for( size_t i = 0; i < countRows; i++, helper.next( idx ), rdi += innerRes )
-	{
-		std::array<uint32_t, 3> idxPattern;
-		idxPattern[ 0 ] = idx[ 0 ] % w.ne[ 1 ];
-		idxPattern[ 1 ] = idx[ 1 ] % w.ne[ 2 ];
-		idxPattern[ 2 ] = idx[ 2 ] % w.ne[ 3 ];
-
-		const float* s1 = sourceRow( w.fp32(), idxPattern, w.nb[ 1 ], w.nb[ 2 ], w.nb[ 3 ] );
-		const float* s2 = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
-		fmaRepeatRow( rdi, innerRes, s1, s2, innerPattern );
-	}
+	check( parallelRepeat( pfor, cur, w, [ & ]( float* rdi, const std::array<uint32_t, 3>& idxPattern )
+		{
+			const float* s1 = sourceRow( w.fp32(), idxPattern, w.nb[ 1 ], w.nb[ 2 ], w.nb[ 3 ] );
+			const float* s2 = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
+			fmaRepeatRow( rdi, innerRes, s1, s2, innerPattern );
+		} ) );
 }
 
-Tensor MlContext::mulMat( const Tensor& a, const Tensor& b )
+Tensor MlContext::mulMatImpl( const Tensor& a, const Tensor& b, const sMulMatEpilogue* epilogue )
 {
 	if( !DirectCompute::canMulMat( a, b ) )
 		throw E_INVALIDARG;
@@ -197,10 +363,109 @@ Tensor MlContext::mulMat( const Tensor& a, const Tensor& b )
 	std::array<uint32_t, 4> ne{ a.ne[ 1 ], b.ne[ 1 ], a.ne[ 2 ], b.ne[ 3 ] };
 	Tensor result = createTensor( eDataType::FP32, ne );
 
-	check( CpuCompute::mulMat( result, a, b, pfor ) );
+	sOpCost cost;
+	cost.flops = 2.0 * (double)a.ne[ 0 ] * (double)result.countElements();
+	cost.bytes = tensorBytes( a ) + tensorBytes( b ) + tensorBytes( result );
+	cost.fmaBound = true;
+	OpRaii op{ *this, eCpuOp::MulMat, cost };
+
+	check( CpuCompute::mulMat( result, a, b, pfor, epilogue ) );
 	return result;
 }
 
+Tensor MlContext::mulMat( const Tensor& a, const Tensor& b )
+{
+	return mulMatImpl( a, b, nullptr );
+}
+
+Tensor MlContext::mulMatAddRepeat( const TensorPair& wb, const Tensor& cur )
+{
+	if( !isDenseVector( wb.b, wb.w.ne[ 1 ] ) )
+	{
+		Tensor res = mulMat( wb.w, cur );
+		addRepeat( res, wb.b );
+		return res;
+	}
+	sMulMatEpilogue epilogue;
+	epilogue.bias = wb.b.fp32();
+	return mulMatImpl( wb.w, cur, &epilogue );
+}
+
+Tensor MlContext::mulMatAddRepeatScale( const TensorPair& wb, const Tensor& cur, float scaling )
+{
+	if( !isDenseVector( wb.b, wb.w.ne[ 1 ] ) )
+	{
+		Tensor res = mulMat( wb.w, cur );
+		addRepeatScale( res, wb.b, scaling );
+		return res;
+	}
+	sMulMatEpilogue epilogue;
+	epilogue.bias = wb.b.fp32();
+	epilogue.scale = scaling;
+	return mulMatImpl( wb.w, cur, &epilogue );
+}
+
+Tensor MlContext::mulMatAddRepeatGelu( const TensorPair& wb, const Tensor& cur )
+{
+	if( !isDenseVector( wb.b, wb.w.ne[ 1 ] ) )
+	{
+		Tensor res = mulMat( wb.w, cur );
+		addRepeatGelu( res, wb.b );
+		return res;
+	}
+	sMulMatEpilogue epilogue;
+	epilogue.bias = wb.b.fp32();
+	epilogue.gelu = true;
+	return mulMatImpl( wb.w, cur, &epilogue );
+}
+
+Tensor MlContext::mulMatScale( const Tensor& a, const Tensor& b, float scaling )
+{
+	sMulMatEpilogue epilogue;
+	epilogue.scale = scaling;
+	return mulMatImpl( a, b, &epilogue );
+}
+
+Tensor MlContext::attention( const Tensor& q, const Tensor& k, const Tensor& v, uint32_t n_head, uint32_t n_past, bool causalMask )
+{
+	Tensor result = createTensor( eDataType::FP32, { q.ne[ 0 ], q.ne[ 1 ] } );
+
+	// Each query row is multiplied by all rows of the keys, then by all rows of the values
+	sOpCost cost;
+	cost.flops = 4.0 * (double)q.countElements() * (double)( k.countElements() / std::max( q.ne[ 0 ], 1u ) );
+	cost.bytes = tensorBytes( k ) + tensorBytes( v ) + tensorBytes( q ) * 2;
+	cost.fmaBound = true;
+	OpRaii op{ *this, eCpuOp::Attention, cost };
+	check( CpuCompute::attention( result, q, k, v, n_head, n_past, causalMask, pfor ) );
+	return result;
+}
+
+Tensor MlContext::attention( const Tensor& q, const sAttentionPages& kv, uint32_t n_head, uint32_t n_past, bool causalMask )
+{
+	Tensor result = createTensor( eDataType::FP32, { q.ne[ 0 ], q.ne[ 1 ] } );
+
+	sOpCost cost;
+	cost.flops = 4.0 * (double)q.countElements() * (double)kv.length;
+	const size_t cbElement = ( nullptr != kv.keyScales ) ? sizeof( int8_t ) : sizeof( uint16_t );
+	cost.bytes = (double)kv.length * q.ne[ 0 ] * 2 * cbElement + tensorBytes( q ) * 2;
+	cost.fmaBound = true;
+	OpRaii op{ *this, eCpuOp::Attention, cost };
+	check( CpuCompute::attention( result, q, kv, n_head, n_past, causalMask, pfor ) );
+	return result;
+}
+
+void MlContext::quantizeKv( const Tensor& source, int8_t* rdi, float* scales, uint32_t n_head )
+{
+	OpRaii op{ *this, eCpuOp::Copy, elementwiseCost( source.countElements(), 0, (double)( elementSize( source.type() ) + 1 ) ) };
+	check( CpuCompute::quantizeKvRows( source, rdi, scales, n_head, pfor ) );
+}
+
+void MlContext::logitsSummary( sLogitsSummary& result, const Tensor& embedding, const Tensor& x, uint32_t tokenBeg )
+{
+	OpRaii op{ *this, eCpuOp::Logits, elementwiseCost( embedding.countElements(), 2, 2 ) };
+	check( CpuCompute::logitsSummary( result, embedding, x, tokenBeg, pfor ) );
+}
+
 // cur = add( repeat( b, cur ), cur ); cur = scale(cur, scaling)
 void MlContext::addRepeatScale( Tensor& cur, const Tensor& b, float scaling )
 {
@@ -209,25 +474,16 @@ void MlContext::addRepeatScale( Tensor& cur, const Tensor& b, float scaling )
 	if( !( cur.type() == eDataType::FP32 && b.type() == eDataType::FP32 ) )
 		throw E_INVALIDARG;
 
-	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
-	std::array<uint32_t, 3> idx = { 0, 0, 0 };
-	const size_t countRows = helper.groupsCount();
-
 	const size_t innerRes = (uint32_t)cur.ne[ 0 ];
 	const size_t innerPattern = (uint32_t)b.ne[ 0 ];
 
-	float* rdi = cur.fp32();
 	const __m256 scale = _mm256_set1_ps( scaling );
-	for( size_t i = 0; i < countRows; i++, helper.next( idx ), rdi += innerRes )
-	{
-		std::array<uint32_t, 3> idxPattern;
-		idxPattern[ 0 ] = idx[ 0 ] % (uint32_t)b.ne[ 1 ];
-		idxPattern[ 1 ] = idx[ 1 ] % (uint32_t)b.ne[ 2 ];
-		idxPattern[ 2 ] = idx[ 2 ] % (uint32_t)b.ne[ 3 ];
-
-		const float* source = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
-		addRepeatScaleRow( rdi, innerRes, source, innerPattern, scale );
-	}
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( cur.countElements(), 2, 8 ) };
+	check( parallelRepeat( pfor, cur, b, [ & ]( float* rdi, const std::array<uint32_t, 3>& idxPattern )
+		{
+			const float* source = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
+			addRepeatScaleRow( rdi, innerRes, source, innerPattern, scale );
+		} ) );
 }
 
 void MlContext::addRepeat( Tensor& cur, const Tensor& b )
@@ -237,24 +493,15 @@ void MlContext::addRepeat( Tensor& cur, const Tensor& b )
 	if( !( cur.type() == eDataType::FP32 && b.type() == eDataType::FP32 ) )
 		throw E_INVALIDARG;
 
-	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
-	std::array<uint32_t, 3> idx = { 0, 0, 0 };
-	const size_t countRows = helper.groupsCount();
-
 	const size_t innerRes = (uint32_t)cur.ne[ 0 ];
 	const size_t innerPattern = (uint32_t)b.ne[ 0 ];
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( cur.countElements(), 1, 8 ) };
 
-	float* rdi = cur.fp32();
-	for( size_t i = 0; i < countRows; i++, helper.next( idx ), rdi += innerRes )
-	{
-		std::array<uint32_t, 3> idxPattern;
-		idxPattern[ 0 ] = idx[ 0 ] % (uint32_t)b.ne[ 1 ];
-		idxPattern[ 1 ] = idx[ 1 ] % (uint32_t)b.ne[ 2 ];
-		idxPattern[ 2 ] = idx[ 2 ] % (uint32_t)b.ne[ 3 ];
-
-		const float* source = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
-		addRepeatRow( rdi, innerRes, source, innerPattern );
-	}
+	check( parallelRepeat( pfor, cur, b, [ & ]( float* rdi, const std::array<uint32_t, 3>& idxPattern )
+		{
+			const float* source = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
+			addRepeatRow( rdi, innerRes, source, innerPattern );
+		} ) );
 }
 
 // cur = scale(cur, scaling)
@@ -265,7 +512,12 @@ void MlContext::scale( Tensor& cur, float scaling )
 
 	const size_t len = cur.countElements();
 	const __m256 scale = _mm256_set1_ps( scaling );
-	scaleRow( cur.fp32(), len, scale );
+	float* const rdi = cur.fp32();
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( len, 1, 8 ) };
+	check( parallelElements( pfor, len, [ & ]( size_t offset, size_t count )
+		{
+			scaleRow( rdi + offset, count, scale );
+		} ) );
 }
 
 void MlContext::diagMaskInf( Tensor& cur, uint32_t n_past )
@@ -276,25 +528,31 @@ void MlContext::diagMaskInf( Tensor& cur, uint32_t n_past )
 	const size_t n = cur.countRows();
 	const size_t nc = cur.ne[ 0 ];
 	const size_t nr = cur.ne[ 1 ];
-	const size_t nz = n / nr;
+	float* const data = cur.fp32();
+	const size_t nb1 = cur.nb[ 1 ];
+	const size_t nb2 = cur.nb[ 2 ];
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( cur.countElements(), 0, 2 ) };
 
-	for( size_t k = 0; k < nz; k++ )
-	{
-		for( size_t j = 0; j < nr; j++ )
+	// Row r of the tensor is at the index ( k = r / nr, j = r % nr )
+	check( parallelRows( pfor, n, nc, [ & ]( size_t i, size_t end )
 		{
-			float* const rdi = cur.fp32() + k * cur.nb[ 2 ] + j * cur.nb[ 1 ];
-			// +1 because the original code checked for `if( i > n_past + j )`
-			// That's why the first index to write is ( n_past + j + 1 )
-			const size_t start = n_past + j + 1;
-			const ptrdiff_t len = (ptrdiff_t)nc - (ptrdiff_t)start;
-			if( len <= 0 )
-				continue;
-
-			// Generates a store string instruction (rep stosd).
-			// The magic number is negative infinity in FP32: https://www.h-schmidt.net/FloatConverter/IEEE754.html
-			__stosd( (DWORD*)( rdi + start ), 0xff800000u, (size_t)len );
-		}
-	}
+			for( ; i < end; i++ )
+			{
+				const size_t k = i / nr;
+				const size_t j = i % nr;
+				float* const rdi = data + k * nb2 + j * nb1;
+				// +1 because the original code checked for `if( i > n_past + j )`
+				// That's why the first index to write is ( n_past + j + 1 )
+				const size_t start = n_past + j + 1;
+				const ptrdiff_t len = (ptrdiff_t)nc - (ptrdiff_t)start;
+				if( len <= 0 )
+					continue;
+
+				// Generates a store string instruction (rep stosd).
+				// The magic number is negative infinity in FP32: https://www.h-schmidt.net/FloatConverter/IEEE754.html
+				__stosd( (DWORD*)( rdi + start ), 0xff800000u, (size_t)len );
+			}
+		} ) );
 }
 
 void MlContext::softMax( Tensor& cur, float inputScale )
@@ -324,6 +582,7 @@ void MlContext::softMax( Tensor& cur, float inputScale )
 	context.stride = cur.nb[ 1 ];
 
 	const size_t n = cur.countRows();
+	OpRaii op{ *this, eCpuOp::SoftMax, elementwiseCost( cur.countElements(), 24, 8 ) };
 	pfor.parallelFor( context, n );
 }
 
@@ -367,40 +626,48 @@ namespace
 		floatsUpcast( rdi, rsi, length );
 	}
 
+	// Copy [ i, end ) slice of the rows of the source tensor into the dense output tensor
 	template<class R, class S>
-	static void __declspec( noinline ) copyImpl( R* rdi, const S* rsi, const TensorShape& shape )
+	static void __declspec( noinline ) copyImpl( R* rdi, const S* rsi, const TensorShape& shape, size_t i, size_t end )
 	{
 		const bool continuousRows = shape.nb[ 0 ] == 1;
+		const DispatchHelper3 helper{ shape.ne[ 1 ], shape.ne[ 2 ], shape.ne[ 3 ] };
+		std::array<uint32_t, 3> idx = helper.unpack( i );
+		rdi += i * shape.ne[ 0 ];
 
-		for( size_t i03 = 0; i03 < shape.ne[ 3 ]; i03++, rsi += shape.nb[ 3 ] )
+		for( ; i < end; i++, helper.next( idx ) )
 		{
-			const S* source2 = rsi;
-			for( size_t i02 = 0; i02 < shape.ne[ 2 ]; i02++, source2 += shape.nb[ 2 ] )
+			const S* source1 = sourceRow( rsi, idx, shape.nb[ 1 ], shape.nb[ 2 ], shape.nb[ 3 ] );
+			// Performance optimization here: when the rows are dense, we can copy them much faster with memcpy()
+			// Or at least with AVX, when we need to convert between numeric types
+			if( continuousRows )
+			{
+				// This branch is very predictable, same outcome for all loop iterations
+				copyRow( rdi, source1, shape.ne[ 0 ] );
+				rdi += shape.ne[ 0 ];
+			}
+			else
 			{
-				const S* source1 = source2;
-				for( size_t i01 = 0; i01 < shape.ne[ 1 ]; i01++, source1 += shape.nb[ 1 ] )
+				const S* source0 = source1;
+				for( size_t i00 = 0; i00 < shape.ne[ 0 ]; i00++, source0 += shape.nb[ 0 ] )
 				{
-					// Performance optimization here: when the rows are dense, we can copy them much faster with memcpy()
-					// Or at least with AVX, when we need to convert between numeric types
-					if( continuousRows )
-					{
-						// This branch is very predictable, same outcome for all loop iterations
-						copyRow( rdi, source1, shape.ne[ 0 ] );
-						rdi += shape.ne[ 0 ];
-					}
-					else
-					{
-						const S* source0 = source1;
-						for( size_t i00 = 0; i00 < shape.ne[ 0 ]; i00++, source0 += shape.nb[ 0 ] )
-						{
-							copyElement( rdi, source0 );
-							rdi++;
-						}
-					}
+					copyElement( rdi, source0 );
+					rdi++;
 				}
 			}
 		}
 	}
+
+	// Copy all rows of the source tensor, distributing them across threads of the pool
+	template<class R, class S>
+	inline HRESULT copyRows( ParallelForRunner& pfor, R* rdi, const S* rsi, const TensorShape& shape )
+	{
+		const size_t countRows = (size_t)shape.ne[ 1 ] * shape.ne[ 2 ] * shape.ne[ 3 ];
+		return parallelRows( pfor, countRows, shape.ne[ 0 ], [ & ]( size_t i, size_t end )
+			{
+				copyImpl( rdi, rsi, shape, i, end );
+			} );
+	}
 }
 
 HRESULT MlContext::copyImpl( Tensor& result, const Tensor& source )
@@ -410,24 +677,37 @@ HRESULT MlContext::copyImpl( Tensor& result, const Tensor& source )
 
 	const eDataType typeResult = result.type();
 	const eDataType typeSource = source.type();
+	OpRaii op{ *this, eCpuOp::Copy, elementwiseCost( result.countElements(), 0, (double)( elementSize( typeResult ) + elementSize( typeSource ) ) ) };
 	if( source.isContinuous() )
 	{
 		const size_t elts = result.countElements();
 		if( typeResult == typeSource )
 		{
-			const size_t bytes = elts * elementSize( typeResult );
-			memcpy( result.data(), source.data(), bytes );
-			return S_OK;
+			const size_t cbElement = elementSize( typeResult );
+			uint8_t* const rdi = (uint8_t*)result.data();
+			const uint8_t* const rsi = (const uint8_t*)source.data();
+			return parallelElements( pfor, elts, [ & ]( size_t offset, size_t count )
+				{
+					memcpy( rdi + offset * cbElement, rsi + offset * cbElement, count * cbElement );
+				} );
 		}
 		if( typeSource == eDataType::FP16 && typeResult == eDataType::FP32 )
 		{
-			floatsUpcast( result.fp32(), source.fp16(), elts );
-			return S_OK;
+			float* const rdi = result.fp32();
+			const uint16_t* const rsi = source.fp16();
+			return parallelElements( pfor, elts, [ & ]( size_t offset, size_t count )
+				{
+					floatsUpcast( rdi + offset, rsi + offset, count );
+				} );
 		}
 		if( typeSource == eDataType::FP32 && typeResult == eDataType::FP16 )
 		{
-			floatsDowncast( result.fp16(), source.fp32(), elts );
-			return S_OK;
+			uint16_t* const rdi = result.fp16();
+			const float* const rsi = source.fp32();
+			return parallelElements( pfor, elts, [ & ]( size_t offset, size_t count )
+				{
+					floatsDowncast( rdi + offset, rsi + offset, count );
+				} );
 		}
 		return E_UNEXPECTED;
 	}
@@ -435,23 +715,19 @@ HRESULT MlContext::copyImpl( Tensor& result, const Tensor& source )
 	{
 		if( typeSource == eDataType::FP16 && typeResult == eDataType::FP16 )
 		{
-			::copyImpl( result.fp16(), source.fp16(), source );
-			return S_OK;
+			return copyRows( pfor, result.fp16(), source.fp16(), source );
 		}
 		if( typeSource == eDataType::FP32 && typeResult == eDataType::FP32 )
 		{
-			::copyImpl( result.fp32(), source.fp32(), source );
-			return S_OK;
+			return copyRows( pfor, result.fp32(), source.fp32(), source );
 		}
 		if( typeSource == eDataType::FP16 && typeResult == eDataType::FP32 )
 		{
-			::copyImpl( result.fp32(), source.fp16(), source );
-			return S_OK;
+			return copyRows( pfor, result.fp32(), source.fp16(), source );
 		}
 		if( typeSource == eDataType::FP32 && typeResult == eDataType::FP16 )
 		{
-			::copyImpl( result.fp16(), source.fp32(), source );
-			return S_OK;
+			return copyRows( pfor, result.fp16(), source.fp32(), source );
 		}
 		return E_UNEXPECTED;
 	}
@@ -554,7 +830,13 @@ void MlContext::addInPlace( Tensor& a, const Tensor& b )
 		throw E_NOTIMPL;
 
 	const size_t length = a.countElements();
-	addRowInPlace( a.fp32(), b.fp32(), length );
+	float* const rdi = a.fp32();
+	const float* const rsi = b.fp32();
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( length, 1, 12 ) };
+	check( parallelElements( pfor, length, [ & ]( size_t offset, size_t count )
+		{
+			addRowInPlace( rdi + offset, rsi + offset, count );
+		} ) );
 }
 
 Tensor MlContext::add( const Tensor& a, const Tensor& b )
@@ -564,7 +846,14 @@ Tensor MlContext::add( const Tensor& a, const Tensor& b )
 
 	Tensor res = createTensor( eDataType::FP32, a.ne );
 	const size_t length = a.countElements();
-	addRow( res.fp32(), a.fp32(), b.fp32(), length );
+	float* const rdi = res.fp32();
+	const float* const s1 = a.fp32();
+	const float* const s2 = b.fp32();
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( length, 1, 12 ) };
+	check( parallelElements( pfor, length, [ & ]( size_t offset, size_t count )
+		{
+			addRow( rdi + offset, s1 + offset, s2 + offset, count );
+		} ) );
 	return res;
 }
 
@@ -575,23 +864,12 @@ void MlContext::addRepeatGelu( Tensor& cur, const Tensor& b )
 	if( !( cur.type() == eDataType::FP32 && b.type() == eDataType::FP32 ) )
 		throw E_INVALIDARG;
 
-	DispatchHelper3 helper{ cur.ne[ 1 ], cur.ne[ 2 ], cur.ne[ 3 ] };
-	std::array<uint32_t, 3> idx = { 0, 0, 0 };
-	const size_t countRows = helper.groupsCount();
-
 	const size_t innerRes = (uint32_t)cur.ne[ 0 ];
 	const size_t innerPattern = (uint32_t)b.ne[ 0 ];
-	float* rdi = cur.fp32();
-	auto& lookupTables = getLookupTables();
-	for( size_t i = 0; i < countRows; i++, helper.next( idx ), rdi += innerRes )
-	{
-		std::array<uint32_t, 3> idxPattern;
-		idxPattern[ 0 ] = idx[ 0 ] % (uint32_t)b.ne[ 1 ];
-		idxPattern[ 1 ] = idx[ 1 ] % (uint32_t)b.ne[ 2 ];
-		idxPattern[ 2 ] = idx[ 2 ] % (uint32_t)b.ne[ 3 ];
-
-		const float* source = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
-		addRepeatGeluRow( rdi, innerRes, source, innerPattern, lookupTables );
-	}
-	return;
+	OpRaii op{ *this, eCpuOp::Elementwise, elementwiseCost( cur.countElements(), 20, 8 ) };
+	check( parallelRepeat( pfor, cur, b, [ & ]( float* rdi, const std::array<uint32_t, 3>& idxPattern )
+		{
+			const float* source = sourceRow( b.fp32(), idxPattern, b.nb[ 1 ], b.nb[ 2 ], b.nb[ 3 ] );
+			addRepeatGeluRow( rdi, innerRes, source, innerPattern );
+		} ) );
 }
\ No newline at end of file
@@ -1,83 +1,292 @@
 #include "stdafx.h"
 #include "ParallelForRunner.h"
+#include "CpuTopology.h"
+#include <chrono>
 using namespace CpuCompute;
 
 ParallelForRunner::ParallelForRunner( int threads ) :
-	maxThreads( threads )
+	maxThreads( 0 )
 {
-	if( maxThreads <= 1 )
+	check( setThreadsCount( threads ) );
+}
+
+HRESULT ParallelForRunner::setThreadsCount( int threads, uint32_t spinMicroseconds, bool pinThreads, uint32_t numaNode )
+{
+	this->spinMicroseconds.store( spinMicroseconds, std::memory_order_relaxed );
+	threads = std::max( threads, 1 );
+	if( threads == maxThreads && (size_t)threads == countWorkers + 1 && pinThreads == this->pinThreads && numaNode == this->numaNode )
+		return S_OK;
+
+	stopWorkers();
+	maxThreads = 1;
+	this->pinThreads = pinThreads;
+	this->numaNode = numaNode;
+	threadBuffers.resize( threads );
+
+	const CpuTopology& topology = CpuTopology::instance();
+	if( pinThreads )
 	{
-		threadBuffers.resize( 1 );
-		return;
+		topology.placeThreads( placement, (size_t)threads, numaNode );
+		// Count the leading threads on distinct physical cores, the placement puts SMT siblings after them
+		std::vector<bool> usedCores( topology.coresCount(), false );
+		coreThreads = 0;
+		for( uint32_t idx : placement )
+		{
+			auto it = std::lower_bound( topology.processors().begin(), topology.processors().end(), idx,
+				[]( const sLogicalProcessor& lp, uint32_t i ) { return lp.index < i; } );
+			if( it == topology.processors().end() || it->index != idx || usedCores[ it->core ] )
+				break;
+			usedCores[ it->core ] = true;
+			coreThreads++;
+		}
+		coreThreads = std::max( coreThreads, (size_t)1 );
+	}
+	else
+	{
+		placement.clear();
+		coreThreads = std::clamp( (size_t)topology.coresCount(), (size_t)1, (size_t)threads );
 	}
 
-	work = CreateThreadpoolWork( &workCallbackStatic, this, nullptr );
-	if( nullptr == work )
-		throw getLastHr();
-	threadBuffers.resize( maxThreads );
+	if( threads > 1 )
+		CHECK( startWorkers( (size_t)threads - 1 ) );
+	maxThreads = threads;
+	return calibrate();
 }
 
-HRESULT ParallelForRunner::setThreadsCount( int threads )
+namespace
 {
-	maxThreads = threads;
-	if( threads <= 1 )
+	// Every thread of the job needs this many times more work than the dispatch overhead
+	constexpr double workPerDispatch = 4;
+
+	struct EmptyJob : public iComputeRange
 	{
-		threadBuffers.resize( 1 );
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			return S_OK;
+		}
+	};
+}
+
+HRESULT ParallelForRunner::calibrate()
+{
+	if( maxThreads <= 1 )
 		return S_OK;
-	}
 
-	threadBuffers.resize( maxThreads );
-	if( nullptr == work )
-	{
-		work = CreateThreadpoolWork( &workCallbackStatic, this, nullptr );
-		if( nullptr == work )
-			return getLastHr();
-	}
+	EmptyJob job;
+	const size_t prevLimit = setThreadsLimit( 0 );
+	// The first job after the workers are started includes the latency of starting these threads
+	CHECK( parallelFor( job, maxThreads ) );
+
+	constexpr size_t reps = 32;
+	using namespace std::chrono;
+	const auto started = steady_clock::now();
+	for( size_t i = 0; i < reps; i++ )
+		CHECK( parallelFor( job, maxThreads ) );
+	const double ns = duration<double, std::nano>( steady_clock::now() - started ).count();
+	setThreadsLimit( prevLimit );
+
+	dispatchNs = std::clamp( ns / reps, 100.0, 100000.0 );
 	return S_OK;
 }
 
+size_t ParallelForRunner::threadsForCost( const sOpCost& cost ) const
+{
+	if( maxThreads <= 1 )
+		return 1;
+	// Estimated time of the operation on a single thread
+	const double ns = std::max( cost.flops / flopsPerNs, cost.bytes / bytesPerNs );
+	const double nth = ns / ( dispatchNs * workPerDispatch );
+	if( !( nth >= 1.0 ) )
+		return 1;
+	const size_t limit = cost.fmaBound ? coreThreads : (size_t)maxThreads;
+	return (size_t)std::min( nth, (double)limit );
+}
+
+namespace
+{
+	constexpr size_t pageSize = 4096;
+
+	struct FirstTouchJob : public iComputeRange
+	{
+		volatile uint8_t* pointer;
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			// Read and write back one byte of every page, that way it doesn't matter if some pages have been touched before
+			for( ; i < end; i++ )
+			{
+				volatile uint8_t* p = pointer + i * pageSize;
+				*p = *p;
+			}
+			return S_OK;
+		}
+	};
+}
+
+HRESULT ParallelForRunner::firstTouch( void* pv, size_t cb )
+{
+	if( nullptr == pv )
+		return E_POINTER;
+	FirstTouchJob job;
+	job.pointer = (volatile uint8_t*)pv;
+	// Batches of 2MB, to keep whole large pages on the same thread
+	return parallelFor( job, ( cb + pageSize - 1 ) / pageSize, 512 );
+}
+
 ParallelForRunner::~ParallelForRunner()
 {
-	if( nullptr != work )
+	stopWorkers();
+}
+
+HRESULT ParallelForRunner::startWorkers( size_t count )
+{
+	assert( 0 == countWorkers );
+	try
 	{
-		if( S_FALSE == status )
-			WaitForThreadpoolWorkCallbacks( work, FALSE );
-		CloseThreadpoolWork( work );
+		workers = std::make_unique<Worker[]>( count );
+		shuttingDown = false;
+		for( ; countWorkers < count; countWorkers++ )
+			workers[ countWorkers ].thread = std::thread( &ParallelForRunner::workerThread, this, countWorkers + 1 );
+		return S_OK;
+	}
+	catch( const std::bad_alloc& )
+	{
+		stopWorkers();
+		return E_OUTOFMEMORY;
+	}
+	catch( const std::system_error& )
+	{
+		stopWorkers();
+		return E_FAIL;
 	}
 }
 
-namespace
+void ParallelForRunner::stopWorkers()
 {
-	thread_local uint32_t currentThreadIndex = UINT_MAX;
+	if( !workers )
+		return;
+
+	shuttingDown = true;
+	for( size_t i = 0; i < countWorkers; i++ )
+	{
+		Worker& w = workers[ i ];
+		w.generation.fetch_add( 1, std::memory_order_release );
+		w.generation.notify_one();
+	}
+	for( size_t i = 0; i < countWorkers; i++ )
+		workers[ i ].thread.join();
+
+	workers.reset();
+	countWorkers = 0;
+	shuttingDown = false;
 }
 
-void ParallelForRunner::runBatch( size_t ith ) noexcept
+namespace
 {
-	currentThreadIndex = (uint32_t)ith;
-	const size_t begin = ( ith * countItems ) / countThreads;
-	const size_t end = ( ( ith + 1 ) * countItems ) / countThreads;
+	thread_local uint32_t currentThreadIndex = UINT_MAX;
 
-	HRESULT hr = E_UNEXPECTED;
-	try
+	// Wait until the value is different from the old one: spin first, then park the thread in the OS kernel
+	template<class T>
+	void spinThenWait( const std::atomic<T>& value, T old, uint32_t spinMicroseconds ) noexcept
 	{
-		hr = computeRange->compute( begin, end );
+		if( 0 != spinMicroseconds )
+		{
+			using namespace std::chrono;
+			const auto deadline = steady_clock::now() + microseconds( spinMicroseconds );
+			do
+			{
+				// Only query the clock once in a while, it's relatively expensive
+				for( size_t i = 0; i < 64; i++ )
+				{
+					if( value.load( std::memory_order_acquire ) != old )
+						return;
+					_mm_pause();
+				}
+			}
+			while( steady_clock::now() < deadline );
+		}
+		value.wait( old, std::memory_order_acquire );
 	}
-	catch( HRESULT code )
+}
+
+void ParallelForRunner::workerThread( size_t ith ) noexcept
+{
+	if( pinThreads )
+		pinCurrentThread( placement[ ith ] );
+
+	Worker& w = workers[ ith - 1 ];
+	uint32_t seen = 0;
+	while( true )
 	{
-		hr = code;
+		spinThenWait( w.generation, seen, spinMicroseconds.load( std::memory_order_relaxed ) );
+		seen = w.generation.load( std::memory_order_acquire );
+		if( shuttingDown )
+			return;
+
+		runBatch( ith );
+
+		if( 1 == pending.fetch_sub( 1, std::memory_order_acq_rel ) )
+			pending.notify_one();
 	}
-	catch( const std::bad_alloc& )
+}
+
+bool ParallelForRunner::claimRange( size_t& begin, size_t& end ) noexcept
+{
+	size_t pos = nextItem.load( std::memory_order_relaxed );
+	while( true )
 	{
-		hr = E_OUTOFMEMORY;
+		if( pos >= countItems )
+			return false;
+
+		// Guided scheduling: large chunks at the start to reduce the overhead, small chunks at the end to balance the load
+		const size_t remaining = countItems - pos;
+		size_t chunk = remaining / ( countThreads * 2 );
+		chunk = std::max( chunk, minBatch );
+		chunk = std::min( chunk, remaining );
+		if( nextItem.compare_exchange_weak( pos, pos + chunk, std::memory_order_relaxed ) )
+		{
+			begin = pos;
+			end = pos + chunk;
+			return true;
+		}
 	}
-	catch( const std::exception& )
+}
+
+void ParallelForRunner::runBatch( size_t ith ) noexcept
+{
+	currentThreadIndex = (uint32_t)ith;
+
+	HRESULT hr = S_OK;
+	size_t begin, end;
+	while( claimRange( begin, end ) )
 	{
-		hr = E_FAIL;
+		try
+		{
+			hr = computeRange->compute( begin, end );
+		}
+		catch( HRESULT code )
+		{
+			hr = code;
+		}
+		catch( const std::bad_alloc& )
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		catch( const std::exception& )
+		{
+			hr = E_FAIL;
+		}
+		if( FAILED( hr ) )
+			break;
 	}
 	currentThreadIndex = UINT_MAX;
 	if( SUCCEEDED( hr ) )
 		return;
-	InterlockedCompareExchange( &status, hr, S_FALSE );
+
+	// Keep the first error code, and stop other threads from claiming more work
+	HRESULT expected = S_FALSE;
+	status.compare_exchange_strong( expected, hr );
+	nextItem.store( countItems, std::memory_order_relaxed );
 }
 
 void* ParallelForRunner::threadLocalBuffer( size_t cb )
@@ -105,39 +314,48 @@ void* ParallelForRunner::threadLocalBuffer( size_t cb )
 	}
 }
 
-void __stdcall ParallelForRunner::workCallbackStatic( PTP_CALLBACK_INSTANCE Instance, void* pv, PTP_WORK Work ) noexcept
-{
-	ParallelForRunner& context = *(ParallelForRunner*)pv;
-	const size_t ith = (uint32_t)( InterlockedIncrement( &context.threadIndex ) );
-	context.runBatch( ith );
-}
-
 HRESULT ParallelForRunner::parallelFor( iComputeRange& compute, size_t length, size_t minBatch )
 {
-	if( maxThreads <= 1 )
+	assert( minBatch > 0 );
+	size_t nth = length / std::max( minBatch, (size_t)1 );
+	nth = std::min( nth, (size_t)(uint32_t)maxThreads );
+	if( 0 != threadsLimit )
+		nth = std::min( nth, threadsLimit );
+
+	if( nth <= 1 )
 	{
+		// When the length is smaller than the batch, run the complete job on the calling thread
 		currentThreadIndex = 0;
 		const HRESULT hr1 = compute.compute( 0, length );
 		currentThreadIndex = UINT_MAX;
 		return hr1;
 	}
-	assert( minBatch > 0 );
-
-	size_t nth = length / minBatch;
-	nth = std::min( nth, (size_t)(uint32_t)maxThreads );
 
 	computeRange = &compute;
 	countItems = length;
 	countThreads = nth;
-	threadIndex = 0;
+	this->minBatch = minBatch;
+	nextItem.store( 0, std::memory_order_relaxed );
 	status = S_FALSE;
+	pending.store( (uint32_t)( nth - 1 ), std::memory_order_relaxed );
 
+	// The release semantic of the increment publishes the fields above to the workers
 	for( size_t i = 1; i < nth; i++ )
-		SubmitThreadpoolWork( work );
+	{
+		Worker& w = workers[ i - 1 ];
+		w.generation.fetch_add( 1, std::memory_order_release );
+		w.generation.notify_one();
+	}
 	runBatch( 0 );
 
-	if( nth > 1 )
-		WaitForThreadpoolWorkCallbacks( work, FALSE );
+	const uint32_t spin = spinMicroseconds.load( std::memory_order_relaxed );
+	while( true )
+	{
+		const uint32_t p = pending.load( std::memory_order_acquire );
+		if( 0 == p )
+			break;
+		spinThenWait( pending, p, spin );
+	}
 
 	computeRange = nullptr;
 	const HRESULT hr = status;
@@ -1,5 +1,8 @@
 #pragma once
 #include "LargeBuffer.h"
+#include <atomic>
+#include <thread>
+#include <memory>
 
 namespace CpuCompute
 {
@@ -10,15 +13,61 @@ namespace CpuCompute
 		HRESULT __stdcall compute( size_t begin, size_t end ) const;
 	};
 
+	// Estimated cost of a compute operation, used to choose the count of threads for that operation
+	struct sOpCost
+	{
+		// Count of floating point operations
+		double flops = 0;
+		// Count of bytes loaded from or stored to memory
+		double bytes = 0;
+		// True when the operation saturates the FMA units of the core, these don't benefit from the SMT siblings
+		bool fmaBound = false;
+	};
+
 	// Similar to ThreadPoolWork in parallelFor.h, optimized to be used as a direct replacement of OpenMP pool.
+	// Owns a set of persistent worker threads, and distributes the work in chunks claimed dynamically from an atomic counter.
+	// The size of these chunks decreases as the job progresses, a slow or preempted thread no longer delays the complete job.
+	// Between jobs, the idle threads spin for a configurable time before parking in the OS kernel, so back-to-back jobs dispatch in microseconds.
 	class alignas( 64 ) ParallelForRunner
 	{
 	public:
 		ParallelForRunner( int threads );
 		~ParallelForRunner();
 
-		HRESULT setThreadsCount( int threads );
+		// spinMicroseconds is how long idle threads spin waiting for the next job or for other threads to complete, 0 disables spinning.
+		// When pinThreads is true, the threads are pinned to the logical processors of the specified NUMA node, see CpuTopology.placeThreads
+		HRESULT setThreadsCount( int threads, uint32_t spinMicroseconds = 0, bool pinThreads = false, uint32_t numaNode = 0 );
+
+		int threadsCount() const
+		{
+			return maxThreads;
+		}
+
+		// Estimate the count of threads for the operation of the specified cost, in [ 1 .. threadsCount() ] interval.
+		// Small operations are not worth the overhead of dispatching the job to the worker threads.
+		size_t threadsForCost( const sOpCost& cost ) const;
+
+		// When the threads are pinned, the logical processor for the thread #0 of the pool, which is the calling thread of parallelFor() method.
+		// Otherwise UINT_MAX.
+		uint32_t callerProcessor() const
+		{
+			return placement.empty() ? UINT_MAX : placement[ 0 ];
+		}
+
+		// Touch every memory page of the buffer from the threads of the pool.
+		// The OS kernel allocates physical pages on the NUMA node of the thread which first accessed them, this method places the buffer next to the pool.
+		HRESULT firstTouch( void* pv, size_t cb );
 
+		// Limit count of threads used by the subsequent parallelFor() calls, 0 means no limit
+		size_t setThreadsLimit( size_t limit )
+		{
+			const size_t prev = threadsLimit;
+			threadsLimit = limit;
+			return prev;
+		}
+
+		// Call compute.compute() for non-overlapping ranges which cover [ 0, length ) interval.
+		// Unless the complete job runs on the calling thread, every range has at least minBatch elements, except maybe the last one.
 		HRESULT parallelFor( iComputeRange& compute, size_t length, size_t minBatch = 1 );
 
 		// Allocate a temporary buffer for the calling thread.
@@ -28,10 +77,20 @@ namespace CpuCompute
 	private:
 
 		int maxThreads;
-		PTP_WORK work = nullptr;
 		iComputeRange* computeRange = nullptr;
 		size_t countItems = 0;
 		size_t countThreads = 0;
+		size_t minBatch = 1;
+		size_t threadsLimit = 0;
+		// Count of the first threads which run on distinct physical cores
+		size_t coreThreads = 1;
+
+		// Parameters of the cost model: throughput of a single thread, and the overhead of dispatching a job to the workers.
+		// The dispatch overhead is measured when the worker threads are started.
+		double flopsPerNs = 16;
+		double bytesPerNs = 8;
+		double dispatchNs = 2000;
+		HRESULT calibrate();
 
 		// Aligning by cache lines.
 		// Avoiding cache line sharing between CPU cores improves performance, despite wasting a few bytes of memory.
@@ -42,11 +101,36 @@ namespace CpuCompute
 		};
 		std::vector<ThreadBuffer> threadBuffers;
 
-		alignas( 64 ) volatile long threadIndex = 0;
-		volatile HRESULT status = S_OK;
+		// The worker threads, the calling thread of parallelFor() method is the thread #0 and it has no worker
+		struct alignas( 64 ) Worker
+		{
+			// Incremented to wake up the thread for the next job
+			std::atomic<uint32_t> generation = 0;
+			std::thread thread;
+		};
+		std::unique_ptr<Worker[]> workers;
+		size_t countWorkers = 0;
+		bool shuttingDown = false;
+		bool pinThreads = false;
+		uint32_t numaNode = 0;
+		// When pinned, logical processors for the threads of the pool
+		std::vector<uint32_t> placement;
+		std::atomic<uint32_t> spinMicroseconds = 0;
+
+		// Index of the first item not yet claimed by any thread
+		alignas( 64 ) std::atomic<size_t> nextItem = 0;
+		// Count of workers which haven't yet finished the current job
+		alignas( 64 ) std::atomic<uint32_t> pending = 0;
+		std::atomic<HRESULT> status = S_OK;
+
+		HRESULT startWorkers( size_t count );
+		void stopWorkers();
+
+		// Claim the next chunk of the job; returns false when there's no more work
+		bool claimRange( size_t& begin, size_t& end ) noexcept;
 
 		void runBatch( size_t ith ) noexcept;
 
-		static void __stdcall workCallbackStatic( PTP_CALLBACK_INSTANCE Instance, void* pv, PTP_WORK Work ) noexcept;
+		void workerThread( size_t ith ) noexcept;
 	};
 }
\ No newline at end of file
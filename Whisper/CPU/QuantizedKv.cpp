@@ -0,0 +1,84 @@
+#include "stdafx.h"
+#include "QuantizedKv.h"
+using namespace CpuCompute;
+
+HRESULT QuantizedKv::create( const Whisper::sModelParams& mp, bool largePages )
+{
+	if( 0 == mp.n_text_head || 0 != mp.n_text_state % mp.n_text_head )
+		return E_INVALIDARG;
+	n_state = mp.n_text_state;
+	n_layer = mp.n_text_layer;
+	n_head = mp.n_text_head;
+	n_audio_ctx = mp.n_audio_ctx;
+	length = 0;
+
+	// INT8 keys, INT8 values, FP32 scales of the keys, FP32 scales of the values
+	const size_t rows = (size_t)n_layer * n_audio_ctx;
+	const size_t cb = ( rows * n_state + rows * n_head * sizeof( float ) ) * 2;
+	CHECK( buffer.allocate( cb, largePages ) );
+	cbBuffer = cb;
+
+	keys.resize( n_layer );
+	values.resize( n_layer );
+	keyScales.resize( n_layer );
+	valueScales.resize( n_layer );
+	return S_OK;
+}
+
+HRESULT QuantizedKv::quantize( MlContext& ml, const Tensor& keysFp16, const Tensor& valuesFp16, uint32_t M )
+{
+	if( 0 == cbBuffer )
+		return OLE_E_BLANK;
+	if( 0 == M || M > n_audio_ctx )
+		return E_BOUNDS;
+
+	const size_t rows = (size_t)n_layer * n_audio_ctx;
+	int8_t* const rdiKeys = (int8_t*)buffer.pointer();
+	int8_t* const rdiValues = rdiKeys + rows * n_state;
+	float* const rdiKeyScales = (float*)( rdiValues + rows * n_state );
+	float* const rdiValueScales = rdiKeyScales + rows * n_head;
+
+	const uint32_t countRows = n_layer * M;
+	if( keysFp16.countElements() != (size_t)countRows * n_state || valuesFp16.countElements() != (size_t)countRows * n_state )
+		return E_INVALIDARG;
+
+	// The source tensors are dense layers of M rows, the output has the same layout
+	length = 0;
+	try
+	{
+		Tensor k, v;
+		check( k.attach( keysFp16.data(), eDataType::FP16, { n_state, countRows } ) );
+		check( v.attach( valuesFp16.data(), eDataType::FP16, { n_state, countRows } ) );
+		ml.quantizeKv( k, rdiKeys, rdiKeyScales, n_head );
+		ml.quantizeKv( v, rdiValues, rdiValueScales, n_head );
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+
+	for( uint32_t il = 0; il < n_layer; il++ )
+	{
+		const size_t row = (size_t)il * M;
+		keys[ il ] = rdiKeys + row * n_state;
+		values[ il ] = rdiValues + row * n_state;
+		keyScales[ il ] = rdiKeyScales + row * n_head;
+		valueScales[ il ] = rdiValueScales + row * n_head;
+	}
+	length = M;
+	return S_OK;
+}
+
+sAttentionPages QuantizedKv::layer( uint32_t il ) const
+{
+	if( il >= n_layer || 0 == length )
+		throw E_BOUNDS;
+	sAttentionPages res;
+	res.keys = &keys[ il ];
+	res.values = &values[ il ];
+	res.keyScales = &keyScales[ il ];
+	res.valueScales = &valueScales[ il ];
+	res.pageRows = length;
+	res.length = length;
+	return res;
+}
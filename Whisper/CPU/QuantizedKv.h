@@ -0,0 +1,48 @@
+#pragma once
+#include "MlContext.h"
+#include "LargeBuffer.h"
+#include "../Whisper/sModelParams.h"
+
+namespace CpuCompute
+{
+	// INT8 copy of the cross-attention keys and values, produced by the encoder in FP16.
+	// Every decoded token streams all of them, the INT8 numbers with a scale for every head of every row halve that memory traffic.
+	class QuantizedKv
+	{
+		LargeBuffer buffer;
+		size_t cbBuffer = 0;
+		uint32_t n_state = 0, n_layer = 0, n_head = 0, n_audio_ctx = 0;
+		// Count of rows in every layer, 0 when empty
+		uint32_t length = 0;
+
+		// Pointers to the first row of every layer, in the format expected by sAttentionPages
+		std::vector<const void*> keys, values;
+		std::vector<const float*> keyScales, valueScales;
+
+	public:
+		// Allocate the memory for the longest audio context of the model
+		HRESULT create( const Whisper::sModelParams& mp, bool largePages = false );
+
+		// Quantize the first M rows of every layer, keys and values are FP16 tensors with [ n_state, M, n_layer ] elements
+		HRESULT quantize( MlContext& ml, const Tensor& keysFp16, const Tensor& valuesFp16, uint32_t M );
+
+		// Discard the content, the encoder has produced new keys and values
+		void clear()
+		{
+			length = 0;
+		}
+		// Count of rows quantized by the last quantize() call, 0 when empty
+		uint32_t rows() const
+		{
+			return length;
+		}
+
+		// Keys and values of the layer as a single page, for the attention kernel
+		sAttentionPages layer( uint32_t il ) const;
+
+		size_t bytes() const
+		{
+			return cbBuffer;
+		}
+	};
+}
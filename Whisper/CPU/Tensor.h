@@ -37,12 +37,24 @@ namespace CpuCompute
 	};
 #endif
 
+	// Memory layout of the tensor's payload
+	enum struct eTensorLayout : uint8_t
+	{
+		// Regular tensor, elements are addressed with the strides in TensorShape::nb field
+		Dense = 0,
+		// FP16 matrix reshaped at load time into column-major panels of prePackedPanelHeight rows, the layout consumed by mulMat kernels.
+		// The size in TensorShape::ne field is the logical size of the matrix, the strides are meaningless.
+		// eDataType::I8 tensors are always in this layout, with per-row scales after the elements of every panel, see mulMatInt8.h for details.
+		Panels = 1,
+	};
+
 	// A functional equivalent of ggml_tensor structure, designed for use from C++
 	class Tensor : public TensorShape
 	{
 		void* m_data = nullptr;
 
 		eDataType m_type = (eDataType)0xFF;
+		eTensorLayout m_layout = eTensorLayout::Dense;
 
 #if TENSOR_INTERNAL_ALLOC
 		// True when the memory block was allocated internally by this class
@@ -81,6 +93,7 @@ namespace CpuCompute
 		static Tensor fromData( void* pointer, eDataType type, uint32_t length );
 
 		eDataType type() const { return m_type; }
+		eTensorLayout layout() const { return m_layout; }
 		void* data() const { return m_data; }
 
 		uint16_t* fp16()
@@ -118,6 +131,10 @@ namespace CpuCompute
 		{
 			m_data = pv;
 		}
+		void setLayout( eTensorLayout lt )
+		{
+			m_layout = lt;
+		}
 
 #if TENSOR_GGML_COMPAT
 		// Compatibility with GGML's tensors, for testing and lulz
@@ -83,6 +83,7 @@ Tensor::Tensor( const Tensor& that )
 	store( nb, that.stridesVec() );
 	m_data = that.m_data;
 	m_type = that.m_type;
+	m_layout = that.m_layout;
 #if TENSOR_INTERNAL_ALLOC
 	if( that.ownsMemory && nullptr != m_data )
 	{
@@ -100,6 +101,7 @@ Tensor::Tensor( Tensor&& that ) noexcept
 	store( nb, that.stridesVec() );
 	m_data = that.m_data;
 	m_type = that.m_type;
+	m_layout = that.m_layout;
 #if TENSOR_INTERNAL_ALLOC
 	ownsMemory = that.ownsMemory;
 	that.ownsMemory = false;
@@ -118,6 +120,7 @@ void Tensor::operator=( const Tensor& that )
 	store( nb, that.stridesVec() );
 	m_data = that.m_data;
 	m_type = that.m_type;
+	m_layout = that.m_layout;
 #if TENSOR_INTERNAL_ALLOC
 	if( that.ownsMemory && nullptr != m_data )
 	{
@@ -139,6 +142,7 @@ void Tensor::operator=( Tensor&& that ) noexcept
 	store( nb, that.stridesVec() );
 	m_data = that.m_data;
 	m_type = that.m_type;
+	m_layout = that.m_layout;
 	that.m_data = nullptr;
 #if TENSOR_INTERNAL_ALLOC
 	ownsMemory = that.ownsMemory;
@@ -159,6 +163,7 @@ HRESULT Tensor::create( eDataType type, const std::array<uint32_t, 4>& sizeEleme
 	store( ne, load( sizeElements ) );
 	TensorShape::setDenseStrides();
 	this->m_type = type;
+	m_layout = eTensorLayout::Dense;
 
 	if( nullptr != alloc )
 	{
@@ -276,6 +281,7 @@ HRESULT Tensor::attach( void* pointer, eDataType type, std::initializer_list<uin
 
 	m_data = pointer;
 	this->m_type = type;
+	m_layout = eTensorLayout::Dense;
 #if TENSOR_INTERNAL_ALLOC
 	ownsMemory = false;
 #endif
@@ -284,7 +290,7 @@ HRESULT Tensor::attach( void* pointer, eDataType type, std::initializer_list<uin
 
 Tensor Tensor::reshape3d( uint32_t ne0, uint32_t ne1, uint32_t ne2 ) const
 {
-	if( !isContinuous() )
+	if( m_layout != eTensorLayout::Dense || !isContinuous() )
 		throw E_NOTIMPL;
 	if( countElements() != ne0 * ne1 * ne2 )
 		throw E_INVALIDARG;
@@ -0,0 +1,369 @@
+#include "stdafx.h"
+#include "attention.h"
+#include "simdUtils.h"
+using namespace CpuCompute;
+
+namespace
+{
+	// Count of keys in the block. The scores of the block are computed first, then the block updates the running maximum,
+	// this way the accumulators are rescaled at most once per block instead of once per key.
+	constexpr size_t blockSize = attentionBlockSize;
+
+	__forceinline float horizontalMax( __m256 vec )
+	{
+		__m128 v = _mm256_extractf128_ps( vec, 1 );
+		v = _mm_max_ps( v, _mm256_castps256_ps128( vec ) );
+		v = _mm_max_ps( v, _mm_movehl_ps( v, v ) );
+		v = _mm_max_ss( v, _mm_movehdup_ps( v ) );
+		return _mm_cvtss_f32( v );
+	}
+
+	__forceinline float horizontalSum( __m256 vec )
+	{
+		__m128 v = _mm256_extractf128_ps( vec, 1 );
+		v = _mm_add_ps( v, _mm256_castps256_ps128( vec ) );
+		v = _mm_add_ps( v, _mm_movehl_ps( v, v ) );
+		v = _mm_add_ss( v, _mm_movehdup_ps( v ) );
+		return _mm_cvtss_f32( v );
+	}
+
+	__forceinline __m256 load8( const uint16_t* rsi )
+	{
+		return _mm256_cvtph_ps( _mm_loadu_si128( ( const __m128i* )rsi ) );
+	}
+
+	__forceinline __m256 load8( const int8_t* rsi )
+	{
+		return _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( _mm_loadl_epi64( ( const __m128i* )rsi ) ) );
+	}
+
+	// Dot products of 4 rows of FP16 or INT8 keys with the query, the head size is 8 * vectors
+	template<size_t vectors, class E>
+	__forceinline __m128 dot4( const std::array<__m256, vectors>& q, const E* k, size_t stride )
+	{
+		__m256 a0 = _mm256_mul_ps( q[ 0 ], load8( k ) );
+		__m256 a1 = _mm256_mul_ps( q[ 0 ], load8( k + stride ) );
+		__m256 a2 = _mm256_mul_ps( q[ 0 ], load8( k + stride * 2 ) );
+		__m256 a3 = _mm256_mul_ps( q[ 0 ], load8( k + stride * 3 ) );
+		for( size_t i = 1; i < vectors; i++ )
+		{
+			const E* rsi = k + i * 8;
+			a0 = _mm256_fmadd_ps( q[ i ], load8( rsi ), a0 );
+			a1 = _mm256_fmadd_ps( q[ i ], load8( rsi + stride ), a1 );
+			a2 = _mm256_fmadd_ps( q[ i ], load8( rsi + stride * 2 ), a2 );
+			a3 = _mm256_fmadd_ps( q[ i ], load8( rsi + stride * 3 ), a3 );
+		}
+		// Transpose and add, into [ a0, a1, a2, a3 ] horizontal sums
+		const __m256 h01 = _mm256_hadd_ps( a0, a1 );
+		const __m256 h23 = _mm256_hadd_ps( a2, a3 );
+		const __m256 h = _mm256_hadd_ps( h01, h23 );
+		return _mm_add_ps( _mm256_castps256_ps128( h ), _mm256_extractf128_ps( h, 1 ) );
+	}
+
+	template<size_t vectors, class E>
+	__forceinline float dot1( const std::array<__m256, vectors>& q, const E* k )
+	{
+		__m256 acc = _mm256_mul_ps( q[ 0 ], load8( k ) );
+		for( size_t i = 1; i < vectors; i++ )
+			acc = _mm256_fmadd_ps( q[ i ], load8( k + i * 8 ), acc );
+		__m128 v = _mm256_extractf128_ps( acc, 1 );
+		v = _mm_add_ps( v, _mm256_castps256_ps128( acc ) );
+		v = _mm_add_ps( v, _mm_movehl_ps( v, v ) );
+		v = _mm_add_ss( v, _mm_movehdup_ps( v ) );
+		return _mm_cvtss_f32( v );
+	}
+
+	struct AttentionContext : public iComputeRange
+	{
+		float* result;
+		const float* q;
+		// Pages of the keys and values, the blocks never cross the pages
+		const void* const* k;
+		const void* const* v;
+		// Scales of the INT8 pages, nullptr for FP16
+		const float* const* kScales;
+		const float* const* vScales;
+		size_t pageRows;
+		// Row stride of all 4 tensors, in elements
+		size_t n_state;
+		// Count of rows in the KV cache
+		size_t length;
+		uint32_t n_head, n_past, N;
+		bool causalMask;
+
+		// Compute attention output of one head for one token
+		template<size_t vectors, class E>
+		void computeHead( size_t head, size_t token ) const;
+
+		template<size_t vectors, class E>
+		HRESULT computeRange( size_t i, size_t end ) const
+		{
+			for( ; i < end; i++ )
+			{
+				// The index is [ head, token ], with tokens being the minor dimension, to keep the threads on different heads
+				const size_t head = i / N;
+				const size_t token = i % N;
+				computeHead<vectors, E>( head, token );
+			}
+			return S_OK;
+		}
+
+		template<class E>
+		HRESULT computeRange( size_t i, size_t end ) const
+		{
+			switch( n_state / n_head )
+			{
+			case 32:
+				return computeRange<4, E>( i, end );
+			case 64:
+				return computeRange<8, E>( i, end );
+			case 128:
+				return computeRange<16, E>( i, end );
+			}
+			return E_NOTIMPL;
+		}
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			if( nullptr != kScales )
+				return computeRange<int8_t>( i, end );
+			return computeRange<uint16_t>( i, end );
+		}
+	};
+
+	template<size_t vectors, class E>
+	void AttentionContext::computeHead( size_t head, size_t token ) const
+	{
+		constexpr bool quantized = std::is_same_v<E, int8_t>;
+		constexpr size_t headSize = vectors * 8;
+		const size_t offset = head * headSize;
+
+		std::array<__m256, vectors> query;
+		const float* rsiQ = q + token * n_state + offset;
+		for( size_t i = 0; i < vectors; i++ )
+			query[ i ] = _mm256_loadu_ps( rsiQ + i * 8 );
+
+		// Same as diagMaskInf(): the token at index j attends to the first n_past + j + 1 keys
+		const size_t count = causalMask ? std::min( length, (size_t)n_past + token + 1 ) : length;
+
+		std::array<__m256, vectors> acc;
+		for( size_t i = 0; i < vectors; i++ )
+			acc[ i ] = _mm256_setzero_ps();
+		float runningMax = -INFINITY;
+		float runningSum = 0;
+
+		alignas( 32 ) std::array<float, blockSize> scores;
+		for( size_t block = 0; block < count; block += blockSize )
+		{
+			const size_t len = std::min( blockSize, count - block );
+			const size_t page = block / pageRows;
+			const size_t row = block % pageRows;
+			const E* const rsiK = (const E*)k[ page ] + row * n_state + offset;
+			const E* rsiV = (const E*)v[ page ] + row * n_state + offset;
+
+			// Scores of the block
+			size_t t = 0;
+			for( ; t + 4 <= len; t += 4 )
+				_mm_store_ps( &scores[ t ], dot4( query, rsiK + t * n_state, n_state ) );
+			for( ; t < len; t++ )
+				scores[ t ] = dot1( query, rsiK + t * n_state );
+			if constexpr( quantized )
+			{
+				const float* ks = kScales[ page ] + row * n_head + head;
+				for( t = 0; t < len; t++ )
+					scores[ t ] *= ks[ t * n_head ];
+			}
+
+			// Update the running maximum, rescale the accumulators when it grows
+			__m256 mv = _mm256_set1_ps( -INFINITY );
+			for( t = 0; t + 8 <= len; t += 8 )
+				mv = _mm256_max_ps( mv, _mm256_load_ps( &scores[ t ] ) );
+			float blockMax = horizontalMax( mv );
+			for( ; t < len; t++ )
+				blockMax = std::max( blockMax, scores[ t ] );
+
+			if( blockMax > runningMax )
+			{
+				if( runningMax != -INFINITY )
+				{
+					const float mul = _mm256_cvtss_f32( expApprox( _mm256_set1_ps( runningMax - blockMax ) ) );
+					const __m256 mulVec = _mm256_set1_ps( mul );
+					for( size_t i = 0; i < vectors; i++ )
+						acc[ i ] = _mm256_mul_ps( acc[ i ], mulVec );
+					runningSum *= mul;
+				}
+				runningMax = blockMax;
+			}
+
+			// Replace the scores with exp( score - max ), the lanes past the end of the block are masked out
+			const __m256 maxVec = _mm256_set1_ps( runningMax );
+			__m256 sumVec = _mm256_setzero_ps();
+			for( t = 0; t < len; t += 8 )
+			{
+				__m256 e = expApprox( _mm256_sub_ps( _mm256_load_ps( &scores[ t ] ), maxVec ) );
+				if( t + 8 > len )
+					e = _mm256_and_ps( e, loadTailMaskFloats( len - t ) );
+				_mm256_store_ps( &scores[ t ], e );
+				sumVec = _mm256_add_ps( sumVec, e );
+			}
+			runningSum += horizontalSum( sumVec );
+
+			// Accumulate exp( score - max ) * values
+			const float* vs = quantized ? vScales[ page ] + row * n_head + head : nullptr;
+			for( t = 0; t < len; t++, rsiV += n_state )
+			{
+				const __m256 pv = quantized ? _mm256_set1_ps( scores[ t ] * vs[ t * n_head ] ) : _mm256_broadcast_ss( &scores[ t ] );
+				for( size_t i = 0; i < vectors; i++ )
+					acc[ i ] = _mm256_fmadd_ps( pv, load8( rsiV + i * 8 ), acc[ i ] );
+			}
+		}
+
+		// Normalize, and store into the merged [ n_state, N ] output matrix
+		const __m256 finalScale = _mm256_set1_ps( ( runningSum > 0 ) ? 1.0f / runningSum : 0.0f );
+		float* rdi = result + token * n_state + offset;
+		for( size_t i = 0; i < vectors; i++ )
+			_mm256_storeu_ps( rdi + i * 8, _mm256_mul_ps( acc[ i ], finalScale ) );
+	}
+}
+
+HRESULT CpuCompute::attention( Tensor& result, const Tensor& q, const Tensor& k, const Tensor& v,
+	uint32_t n_head, uint32_t n_past, bool causalMask, ParallelForRunner& pfor )
+{
+	if( k.type() != eDataType::FP16 || v.type() != eDataType::FP16 )
+		return E_INVALIDARG;
+	if( !( k.isContinuous() && v.isContinuous() ) )
+		return E_INVALIDARG;
+
+	const uint32_t n_state = q.ne[ 0 ];
+	const size_t kvElements = k.countElements();
+	if( kvElements != v.countElements() || 0 == n_state || 0 != kvElements % n_state || 0 == kvElements )
+		return E_INVALIDARG;
+
+	// A single page with all the rows
+	const void* keys = k.fp16();
+	const void* values = v.fp16();
+	sAttentionPages pages;
+	pages.keys = &keys;
+	pages.values = &values;
+	pages.length = (uint32_t)( kvElements / n_state );
+	pages.pageRows = pages.length;
+	return attention( result, q, pages, n_head, n_past, causalMask, pfor );
+}
+
+HRESULT CpuCompute::attention( Tensor& result, const Tensor& q, const sAttentionPages& kv,
+	uint32_t n_head, uint32_t n_past, bool causalMask, ParallelForRunner& pfor )
+{
+	if( q.type() != eDataType::FP32 || result.type() != eDataType::FP32 )
+		return E_INVALIDARG;
+	if( !( q.isContinuous() && result.isContinuous() ) )
+		return E_INVALIDARG;
+
+	const uint32_t n_state = q.ne[ 0 ];
+	const uint32_t N = q.ne[ 1 ];
+	if( 0 == n_head || 0 != n_state % n_head )
+		return E_INVALIDARG;
+	const uint32_t headSize = n_state / n_head;
+	if( headSize != 32 && headSize != 64 && headSize != 128 )
+		return E_NOTIMPL;
+
+	if( 0 == kv.length || 0 == kv.pageRows )
+		return E_INVALIDARG;
+	if( kv.pageRows < kv.length && 0 != kv.pageRows % blockSize )
+		return E_INVALIDARG;
+	if( ( nullptr == kv.keyScales ) != ( nullptr == kv.valueScales ) )
+		return E_INVALIDARG;
+	if( result.countElements() != q.countElements() )
+		return E_INVALIDARG;
+
+	AttentionContext context;
+	context.result = result.fp32();
+	context.q = q.fp32();
+	context.k = kv.keys;
+	context.v = kv.values;
+	context.kScales = kv.keyScales;
+	context.vScales = kv.valueScales;
+	context.pageRows = kv.pageRows;
+	context.n_state = n_state;
+	context.length = kv.length;
+	context.n_head = n_head;
+	context.n_past = n_past;
+	context.N = N;
+	context.causalMask = causalMask;
+
+	return pfor.parallelFor( context, (size_t)n_head * N );
+}
+
+namespace
+{
+	inline float loadFloat( const float* rsi )
+	{
+		return *rsi;
+	}
+	inline float loadFloat( const uint16_t* rsi )
+	{
+		return _cvtsh_ss( *rsi );
+	}
+
+	// Symmetric quantization, the scale maps the largest absolute value of the head to 127
+	template<class E>
+	inline void quantizeRow( const E* rsi, int8_t* rdi, float* scales, uint32_t n_state, uint32_t n_head )
+	{
+		const uint32_t headSize = n_state / n_head;
+		for( uint32_t h = 0; h < n_head; h++, rsi += headSize, rdi += headSize )
+		{
+			float maxAbs = 0;
+			for( uint32_t i = 0; i < headSize; i++ )
+				maxAbs = std::max( maxAbs, std::abs( loadFloat( rsi + i ) ) );
+			const float scale = maxAbs / 127.0f;
+			const float inv = ( maxAbs > 0 ) ? 127.0f / maxAbs : 0.0f;
+			for( uint32_t i = 0; i < headSize; i++ )
+				rdi[ i ] = (int8_t)std::lrintf( loadFloat( rsi + i ) * inv );
+			scales[ h ] = scale;
+		}
+	}
+
+	template<class E>
+	struct QuantizeContext : public iComputeRange
+	{
+		const E* rsi;
+		int8_t* rdi;
+		float* scales;
+		uint32_t n_state, n_head;
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			for( ; i < end; i++ )
+				quantizeRow( rsi + i * n_state, rdi + i * n_state, scales + i * n_head, n_state, n_head );
+			return S_OK;
+		}
+	};
+
+	template<class E>
+	HRESULT quantizeRows( const E* rsi, int8_t* rdi, float* scales, size_t rows, uint32_t n_state, uint32_t n_head, ParallelForRunner& pfor )
+	{
+		QuantizeContext<E> context;
+		context.rsi = rsi;
+		context.rdi = rdi;
+		context.scales = scales;
+		context.n_state = n_state;
+		context.n_head = n_head;
+		return pfor.parallelFor( context, rows, 64 );
+	}
+}
+
+HRESULT CpuCompute::quantizeKvRows( const Tensor& source, int8_t* rdi, float* scales, uint32_t n_head, ParallelForRunner& pfor )
+{
+	const uint32_t n_state = source.ne[ 0 ];
+	if( !source.isContinuous() || 0 == n_head || 0 != n_state % n_head )
+		return E_INVALIDARG;
+	const size_t rows = source.countElements() / n_state;
+
+	switch( source.type() )
+	{
+	case eDataType::FP32:
+		return quantizeRows( source.fp32(), rdi, scales, rows, n_state, n_head, pfor );
+	case eDataType::FP16:
+		return quantizeRows( source.fp16(), rdi, scales, rows, n_state, n_head, pfor );
+	}
+	return E_NOTIMPL;
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+#include "ParallelForRunner.h"
+#include "Tensor.h"
+
+namespace CpuCompute
+{
+	// The kernel streams the keys in blocks of that many rows
+	constexpr uint32_t attentionBlockSize = 32;
+
+	// Rows of the keys and values split into pages of the same count of rows.
+	// The pageRows must be a multiple of attentionBlockSize, unless the complete KV cache is a single page.
+	struct sAttentionPages
+	{
+		// FP16 rows, or INT8 rows when the scales are not nullptr
+		const void* const* keys;
+		const void* const* values;
+		// INT8 KV cache only: [ pageRows, n_head ] scales of every page, the value of the element is int8 * scale
+		const float* const* keyScales = nullptr;
+		const float* const* valueScales = nullptr;
+		uint32_t pageRows;
+		// Total count of rows
+		uint32_t length;
+	};
+
+	// Fused multi-head attention, equivalent to the following sequence of GGML operations:
+	// KQ = mulMat( K, Q ), optional diagMaskInf( KQ, n_past ), softMax( KQ ), KQV = mulMat( V_trans, KQ ), then merging the heads into [ n_state, N ] matrix.
+	// q is the dense FP32 matrix [ n_state, N ], k and v are dense FP16 tensors with n_state * L elements, the rows of the KV cache.
+	// The result is the dense FP32 matrix [ n_state, N ], it needs to be allocated by the caller.
+	// The keys are streamed in blocks, with online softmax; the intermediate KQ matrix is never stored in memory.
+	HRESULT attention( Tensor& result, const Tensor& q, const Tensor& k, const Tensor& v,
+		uint32_t n_head, uint32_t n_past, bool causalMask, ParallelForRunner& pfor );
+
+	// Same as above, reading the FP16 or INT8 rows of the KV cache through the table of pages. The INT8 rows are dequantized in registers.
+	HRESULT attention( Tensor& result, const Tensor& q, const sAttentionPages& kv,
+		uint32_t n_head, uint32_t n_past, bool causalMask, ParallelForRunner& pfor );
+
+	// Quantize dense FP32 or FP16 rows of keys or values into INT8, with a separate scale for every head of every row.
+	// The output is [ n_state, rows ] INT8 numbers, and [ n_head, rows ] scales.
+	HRESULT quantizeKvRows( const Tensor& source, int8_t* rdi, float* scales, uint32_t n_head, ParallelForRunner& pfor );
+}
\ No newline at end of file
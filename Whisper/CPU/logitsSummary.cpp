@@ -0,0 +1,247 @@
+#include "stdafx.h"
+#include "logitsSummary.h"
+#include "simdUtils.h"
+using namespace CpuCompute;
+
+namespace
+{
+	// Count of vocabulary rows in a chunk. Every chunk produces a partial summary, merged at the end;
+	// the count of chunks doesn't depend on the count of threads, so the result is deterministic.
+	constexpr size_t chunkRows = 256;
+
+	// The best K logits, sorted in descending order
+	struct TopK
+	{
+		std::array<sTokenProb, logitsTopK> arr;
+
+		void clear()
+		{
+			for( sTokenProb& e : arr )
+				e = sTokenProb{ -INFINITY, -1 };
+		}
+
+		void add( float val, int id )
+		{
+			if( !( val > arr[ logitsTopK - 1 ].p ) )
+				return;
+			size_t i = logitsTopK - 1;
+			for( ; i > 0 && val > arr[ i - 1 ].p; i-- )
+				arr[ i ] = arr[ i - 1 ];
+			arr[ i ] = sTokenProb{ val, id };
+		}
+
+		void add( const TopK& that )
+		{
+			for( const sTokenProb& e : that.arr )
+				add( e.p, e.id );
+		}
+	};
+
+	struct Partial
+	{
+		float max;
+		// Sums of exp( logit - max ) for all tokens, timestamps, and initial timestamps
+		double sumAll, sumTimestamps, sumInitial;
+		TopK text, timestamps, initial;
+	};
+
+	__forceinline __m256 load8( const uint16_t* rsi )
+	{
+		return _mm256_cvtph_ps( _mm_loadu_si128( ( const __m128i* )rsi ) );
+	}
+
+	// Dot products of 4 FP16 rows with the FP32 vector
+	__forceinline __m128 dot4( const float* x, const uint16_t* rows, size_t stride, size_t length )
+	{
+		__m256 a0 = _mm256_setzero_ps();
+		__m256 a1 = _mm256_setzero_ps();
+		__m256 a2 = _mm256_setzero_ps();
+		__m256 a3 = _mm256_setzero_ps();
+		for( size_t i = 0; i < length; i += 8 )
+		{
+			const __m256 xv = _mm256_loadu_ps( x + i );
+			a0 = _mm256_fmadd_ps( xv, load8( rows + i ), a0 );
+			a1 = _mm256_fmadd_ps( xv, load8( rows + stride + i ), a1 );
+			a2 = _mm256_fmadd_ps( xv, load8( rows + stride * 2 + i ), a2 );
+			a3 = _mm256_fmadd_ps( xv, load8( rows + stride * 3 + i ), a3 );
+		}
+		const __m256 h01 = _mm256_hadd_ps( a0, a1 );
+		const __m256 h23 = _mm256_hadd_ps( a2, a3 );
+		const __m256 h = _mm256_hadd_ps( h01, h23 );
+		return _mm_add_ps( _mm256_castps256_ps128( h ), _mm256_extractf128_ps( h, 1 ) );
+	}
+
+	__forceinline float dot1( const float* x, const uint16_t* row, size_t length )
+	{
+		__m256 acc = _mm256_setzero_ps();
+		for( size_t i = 0; i < length; i += 8 )
+			acc = _mm256_fmadd_ps( _mm256_loadu_ps( x + i ), load8( row + i ), acc );
+		__m128 v = _mm256_extractf128_ps( acc, 1 );
+		v = _mm_add_ps( v, _mm256_castps256_ps128( acc ) );
+		v = _mm_add_ps( v, _mm_movehl_ps( v, v ) );
+		v = _mm_add_ss( v, _mm_movehdup_ps( v ) );
+		return _mm_cvtss_f32( v );
+	}
+
+	inline double sumRange( const float* rsi, size_t begin, size_t end )
+	{
+		double res = 0;
+		for( size_t i = begin; i < end; i++ )
+			res += rsi[ i ];
+		return res;
+	}
+
+	struct SummaryContext : public iComputeRange
+	{
+		const uint16_t* embedding;
+		const float* x;
+		size_t n_state, n_vocab;
+		size_t tokenBeg, initialEnd;
+		Partial* partials;
+
+		void computeChunk( size_t chunk ) const;
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			for( ; i < end; i++ )
+				computeChunk( i );
+			return S_OK;
+		}
+	};
+
+	void SummaryContext::computeChunk( size_t chunk ) const
+	{
+		const size_t begin = chunk * chunkRows;
+		const size_t count = std::min( chunkRows, n_vocab - begin );
+		alignas( 32 ) std::array<float, chunkRows> logits;
+		alignas( 32 ) std::array<float, chunkRows> exps;
+
+		// Logits of the chunk
+		const uint16_t* rsi = embedding + begin * n_state;
+		size_t i = 0;
+		for( ; i + 4 <= count; i += 4, rsi += n_state * 4 )
+			_mm_store_ps( &logits[ i ], dot4( x, rsi, n_state, n_state ) );
+		for( ; i < count; i++, rsi += n_state )
+			logits[ i ] = dot1( x, rsi, n_state );
+
+		Partial& res = partials[ chunk ];
+		float max = -INFINITY;
+		for( i = 0; i < count; i++ )
+			max = std::max( max, logits[ i ] );
+		res.max = max;
+
+		// Exponents relative to the maximum of the chunk, zeros past the end
+		const __m256 maxVec = _mm256_set1_ps( max );
+		for( i = 0; i < count; i += 8 )
+		{
+			__m256 e = expApprox( _mm256_sub_ps( _mm256_load_ps( &logits[ i ] ), maxVec ) );
+			if( i + 8 > count )
+				e = _mm256_and_ps( e, loadTailMaskFloats( count - i ) );
+			_mm256_store_ps( &exps[ i ], e );
+		}
+
+		// Sums over the intersections of the chunk with the ranges
+		const size_t end = begin + count;
+		res.sumAll = sumRange( exps.data(), 0, count );
+		const size_t tsBegin = std::clamp( tokenBeg, begin, end ) - begin;
+		res.sumTimestamps = sumRange( exps.data(), tsBegin, count );
+		const size_t initialBegin = tsBegin;
+		const size_t initialLast = std::clamp( initialEnd, begin, end ) - begin;
+		res.sumInitial = sumRange( exps.data(), initialBegin, std::max( initialBegin, initialLast ) );
+
+		// Top-K tokens
+		res.text.clear();
+		res.timestamps.clear();
+		res.initial.clear();
+		for( i = 0; i < count; i++ )
+		{
+			const size_t id = begin + i;
+			const float val = logits[ i ];
+			if( id < tokenBeg )
+				res.text.add( val, (int)id );
+			else
+			{
+				res.timestamps.add( val, (int)id );
+				if( id < initialEnd )
+					res.initial.add( val, (int)id );
+			}
+		}
+	}
+
+	// Convert the best logits into probabilities
+	inline void makeProbs( std::array<sTokenProb, logitsTopK>& rdi, const TopK& rsi, float max, double mulSum )
+	{
+		for( size_t i = 0; i < logitsTopK; i++ )
+		{
+			const sTokenProb& e = rsi.arr[ i ];
+			rdi[ i ].id = e.id;
+			rdi[ i ].p = ( e.id >= 0 ) ? (float)( std::exp( (double)e.p - max ) * mulSum ) : 0.0f;
+		}
+	}
+}
+
+HRESULT CpuCompute::logitsSummary( sLogitsSummary& result, const Tensor& embedding, const Tensor& x, uint32_t tokenBeg, ParallelForRunner& pfor )
+{
+	result.valid = false;
+	if( embedding.type() != eDataType::FP16 || x.type() != eDataType::FP32 )
+		return E_INVALIDARG;
+	if( !( embedding.isContinuous() && x.isContinuous() ) )
+		return E_INVALIDARG;
+	const size_t n_state = embedding.ne[ 0 ];
+	const size_t n_vocab = embedding.ne[ 1 ];
+	if( x.countElements() != n_state || tokenBeg > n_vocab )
+		return E_INVALIDARG;
+	if( 0 != n_state % 8 )
+		return E_NOTIMPL;
+
+	const size_t countChunks = ( n_vocab + chunkRows - 1 ) / chunkRows;
+	std::vector<Partial> partials;
+	try
+	{
+		partials.resize( countChunks );
+	}
+	catch( const std::bad_alloc& )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	SummaryContext context;
+	context.embedding = embedding.fp16();
+	context.x = x.fp32();
+	context.n_state = n_state;
+	context.n_vocab = n_vocab;
+	context.tokenBeg = tokenBeg;
+	context.initialEnd = std::min( n_vocab, (size_t)tokenBeg + initialTimestamps );
+	context.partials = partials.data();
+	CHECK( pfor.parallelFor( context, countChunks ) );
+
+	// Merge the partial results
+	float max = -INFINITY;
+	for( const Partial& p : partials )
+		max = std::max( max, p.max );
+
+	double sumAll = 0, sumTimestamps = 0, sumInitial = 0;
+	TopK text, timestamps, initial;
+	text.clear();
+	timestamps.clear();
+	initial.clear();
+	for( const Partial& p : partials )
+	{
+		const double mul = std::exp( (double)p.max - max );
+		sumAll += p.sumAll * mul;
+		sumTimestamps += p.sumTimestamps * mul;
+		sumInitial += p.sumInitial * mul;
+		text.add( p.text );
+		timestamps.add( p.timestamps );
+		initial.add( p.initial );
+	}
+
+	const double mulSum = 1.0 / sumAll;
+	makeProbs( result.text, text, max, mulSum );
+	makeProbs( result.timestamps, timestamps, max, mulSum );
+	makeProbs( result.initial, initial, max, mulSum );
+	result.sumTimestamps = sumTimestamps * mulSum;
+	result.sumInitial = sumInitial * mulSum;
+	result.valid = true;
+	return S_OK;
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#pragma once
+#include "ParallelForRunner.h"
+#include "Tensor.h"
+
+namespace CpuCompute
+{
+	// Count of the best tokens in the summary, equal to top_k of the sampling in ContextImpl::sampleBest
+	constexpr size_t logitsTopK = 4;
+
+	// Count of timestamp tokens allowed for the first token of the segment; the initial timestamp cannot be larger than 100
+	constexpr uint32_t initialTimestamps = 101;
+
+	struct sTokenProb
+	{
+		float p;
+		int id;
+	};
+
+	// Everything the sampling needs from the probabilities of the last token, without the complete vector of n_vocab probabilities
+	struct sLogitsSummary
+	{
+		// The best tokens in descending order of probabilities, for 3 ranges of the vocabulary:
+		// text tokens [ 0, token_beg ), timestamps [ token_beg, n_vocab ), and initial timestamps [ token_beg, token_beg + initialTimestamps )
+		std::array<sTokenProb, logitsTopK> text, timestamps, initial;
+		// Sum of probabilities of the timestamps, and of the initial timestamps
+		double sumTimestamps, sumInitial;
+		// Set by the decoder when it computed this summary instead of the complete vector of probabilities
+		bool valid = false;
+	};
+
+	// Fused vocabulary projection, softmax, and top-K: result = summary( softMax( mulMat( embedding, x ) ) )
+	// embedding is the dense FP16 matrix [ n_state, n_vocab ], x is the FP32 vector of the last token with n_state elements, n_state must be a multiple of 8.
+	// The logits are computed in chunks of rows distributed across threads, every chunk is reduced into running maximum, sums of exponents, and top-K tokens while in L1 cache.
+	HRESULT logitsSummary( sLogitsSummary& result, const Tensor& embedding, const Tensor& x, uint32_t tokenBeg, ParallelForRunner& pfor );
+}
\ No newline at end of file
@@ -1,54 +1,163 @@
 ﻿#include "stdafx.h"
 #include "mulMat.h"
 #include "mulMatImpl.h"
+#include "mulMatInt8.h"
+#include "mulMatTuner.h"
+#include "simdUtils.h"
 using namespace CpuCompute;
 
 namespace
 {
 	template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
-	static HRESULT mulMatImpl( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor )
+	static HRESULT mulMatImpl( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
 	{
 		MulMatImpl<panelHeightRegs, tileWidthFloats> impl{ result, a, b, pfor };
+		impl.setEpilogue( epilogue );
 		return impl.run( pfor );
 	}
+
+	template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+	static HRESULT mulMatImplAvx512( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
+	{
+		MulMatImplAvx512<panelHeightRegs, tileWidthFloats> impl{ result, a, b, pfor };
+		impl.setEpilogue( epilogue );
+		return impl.run( pfor );
+	}
+
+	template<uint8_t tileWidthFloats>
+	static HRESULT mulMatImplQ4( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
+	{
+		MulMatImplQ4<tileWidthFloats> impl{ result, a, b, pfor };
+		impl.setEpilogue( epilogue );
+		return impl.run( pfor );
+	}
+
+	// The Q4 kernels dequantize the panel once per column, wider tiles amortize that cost over more rows of the second matrix
+	// However, the tile of 4 vectors * 2 columns plus the panel and the scales already use all 16 vector registers
+	static HRESULT mulMatQ4( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
+	{
+		if( b.ne[ 1 ] == 1 )
+			return mulMatImplQ4<1>( result, a, b, pfor, epilogue );
+		else
+			return mulMatImplQ4<2>( result, a, b, pfor, epilogue );
+	}
+
+	// AVX-512 version of the dispatch, 512-bit vectors have twice as many lanes, and there're twice as many registers for the accumulators.
+	// For this reason the panels are taller, and the tiles are wider.
+	static HRESULT mulMatAvx512( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
+	{
+		// Panels of 32 rows need 2 vectors, panels of 16 rows 1 vector
+		if( a.ne[ 1 ] >= 32 )
+		{
+			if( b.ne[ 1 ] == 1 )
+				return mulMatImplAvx512<4, 1>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] == 2 )
+				return mulMatImplAvx512<4, 2>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] == 3 )
+				return mulMatImplAvx512<4, 3>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] == 4 )
+				return mulMatImplAvx512<4, 4>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] < 12 )
+				return mulMatImplAvx512<4, 8>( result, a, b, pfor, epilogue );
+			else
+				return mulMatImplAvx512<4, 12>( result, a, b, pfor, epilogue );
+		}
+		else
+		{
+			if( b.ne[ 1 ] == 1 )
+				return mulMatImplAvx512<2, 1>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] == 2 )
+				return mulMatImplAvx512<2, 2>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] == 3 )
+				return mulMatImplAvx512<2, 3>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] == 4 )
+				return mulMatImplAvx512<2, 4>( result, a, b, pfor, epilogue );
+			else if( b.ne[ 1 ] < 12 )
+				return mulMatImplAvx512<2, 8>( result, a, b, pfor, epilogue );
+			else
+				return mulMatImplAvx512<2, 12>( result, a, b, pfor, epilogue );
+		}
+	}
 }
 
-HRESULT CpuCompute::mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor )
+HRESULT CpuCompute::mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
 {
-	if( a.type() != eDataType::FP16 )
-		return E_NOTIMPL;
 	if( b.type() != eDataType::FP32 )
 		return E_NOTIMPL;
+	if( a.type() == eDataType::I8 )
+		return mulMatInt8( result, a, b, pfor, epilogue );
+	if( a.type() == eDataType::Q4 )
+		return mulMatQ4( result, a, b, pfor, epilogue );
+	if( a.type() != eDataType::FP16 )
+		return E_NOTIMPL;
+
+	const HRESULT hrTuned = mulMatTuned( result, a, b, pfor, epilogue );
+	if( hrTuned != S_FALSE )
+		return hrTuned;
+
+	// return mulMatImpl<1, 1>( result, a, b, pfor, epilogue );
 
-	// return mulMatImpl<1, 1>( result, a, b, pfor );
+	if( MulMatBase::haveAvx512 )
+		return mulMatAvx512( result, a, b, pfor, epilogue );
 
 	if( b.ne[ 1 ] == 1 )
 	{
 		// Multiplying by a single row
 		if( a.ne[ 1 ] >= 32 )
-			return mulMatImpl<4, 1>( result, a, b, pfor );
+			return mulMatImpl<4, 1>( result, a, b, pfor, epilogue );
 		else
-			return mulMatImpl<1, 1>( result, a, b, pfor );
+			return mulMatImpl<1, 1>( result, a, b, pfor, epilogue );
 	}
 	else if( b.ne[ 1 ] == 2 )
 	{
 		if( a.ne[ 1 ] >= 32 )
-			return mulMatImpl<4, 2>( result, a, b, pfor );
+			return mulMatImpl<4, 2>( result, a, b, pfor, epilogue );
 		else
-			return mulMatImpl<1, 2>( result, a, b, pfor );
+			return mulMatImpl<1, 2>( result, a, b, pfor, epilogue );
 	}
 	else if( b.ne[ 1 ] == 3 )
 	{
 		if( a.ne[ 1 ] >= 16 )
-			return mulMatImpl<2, 3>( result, a, b, pfor );
+			return mulMatImpl<2, 3>( result, a, b, pfor, epilogue );
 		else
-			return mulMatImpl<1, 3>( result, a, b, pfor );
+			return mulMatImpl<1, 3>( result, a, b, pfor, epilogue );
 	}
 	else
 	{
 		if( a.ne[ 1 ] >= 16 )
-			return mulMatImpl<2, 4>( result, a, b, pfor );
+			return mulMatImpl<2, 4>( result, a, b, pfor, epilogue );
 		else
-			return mulMatImpl<1, 4>( result, a, b, pfor );
+			return mulMatImpl<1, 4>( result, a, b, pfor, epilogue );
+	}
+}
+
+void sMulMatEpilogue::apply( float* rdi, size_t firstRow, size_t height, size_t width, size_t stride ) const
+{
+	if( nullptr == bias )
+	{
+		// No bias, only the scale
+		const __m256 scaleVec = _mm256_set1_ps( scale );
+		for( size_t i = 0; i < width; i++, rdi += stride )
+			scaleRow( rdi, height, scaleVec );
+		return;
+	}
+
+	const float* const b = bias + firstRow;
+	if( gelu )
+	{
+		assert( scale == 1.0f );
+		for( size_t i = 0; i < width; i++, rdi += stride )
+			addRepeatGeluRow( rdi, height, b, height );
+	}
+	else if( scale != 1.0f )
+	{
+		const __m256 scaleVec = _mm256_set1_ps( scale );
+		for( size_t i = 0; i < width; i++, rdi += stride )
+			addRepeatScaleRow( rdi, height, b, height, scaleVec );
+	}
+	else
+	{
+		for( size_t i = 0; i < width; i++, rdi += stride )
+			addRepeatRow( rdi, height, b, height );
 	}
 }
\ No newline at end of file
@@ -1,10 +1,63 @@
 #pragma once
 #include "ParallelForRunner.h"
 #include "Tensor.h"
+#include "BlockQ4.h"
+#include "mulMatEpilogue.h"
 
 namespace CpuCompute
 {
-	HRESULT mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor );
+	// When the first argument has eTensorLayout::Panels layout, the implementation consumes the pre-packed panels directly, skipping the per-call reshape
+	// The first argument can also be eDataType::I8 matrix made with quantizePanels() function, or eDataType::Q4 matrix made with prePackQ4Panels()
+	// The optional epilogue is applied to the output matrix by the kernels, see sMulMatEpilogue structure for details
+	HRESULT mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue = nullptr );
+
+	// Enable the autotuner for FP16 matrices. On first use of every distinct shape, mulMat benchmarks all kernels and thread counts, then uses the fastest one.
+	// The results are saved into a text file in %LOCALAPPDATA%\Whisper, one file per CPU model, and loaded back by this function.
+	HRESULT enableMulMatAutotune();
+
+	// Height of the panels in pre-packed matrices, in elements.
+	// Equal to the tallest panel used by the kernels, the shorter panels are sliced from these with a larger stride.
+	constexpr uint32_t prePackedPanelHeight = 32;
+
+	// Count of bytes needed to store the FP16 matrix in the pre-packed layout, the height is rounded up to prePackedPanelHeight
+	size_t prePackedBytes( const TensorShape& shape );
+
+	// Reshape a dense FP16 matrix into the pre-packed layout.
+	// The output buffer needs prePackedBytes() bytes of memory, aligned by 32 bytes.
+	HRESULT prePackPanels( uint16_t* rdi, const Tensor& a );
+
+	// True when the CPU supports the INT8 kernels, i.e. has AVX2
+	bool canQuantizeWeights();
+
+	// Count of bytes needed to store the FP16 matrix quantized into INT8 panels, including the per-row scales
+	size_t quantizedPanelsBytes( const TensorShape& shape );
+
+	// Quantize a dense FP16 matrix into INT8 panels with per-row scales, the layout consumed by mulMat when the first argument is eDataType::I8.
+	// The output buffer needs quantizedPanelsBytes() bytes of memory, aligned by 32 bytes.
+	HRESULT quantizePanels( void* rdi, const Tensor& a );
+
+	// Bytes in one block of the pre-packed Q4 panel: 32 FP16 row scales, then 32 columns of 16 bytes.
+	// Byte r of every column contains row r in the low 4 bits, and row r + 16 in the high 4 bits.
+	constexpr uint32_t q4PanelBlockBytes = prePackedPanelHeight * 2 + q4BlockSize * 16;
+
+	// Count of bytes needed to store the Q4 matrix in the pre-packed layout, the height is rounded up to prePackedPanelHeight
+	size_t q4PanelsBytes( const TensorShape& shape );
+
+	// Reshape a dense Q4 matrix, rows made of BlockQ4 structures as stored in the model file, into the panels consumed by mulMat.
+	// The output buffer needs q4PanelsBytes() bytes of memory, aligned by 32 bytes.
+	HRESULT prePackQ4Panels( void* rdi, const Tensor& a );
+
+	// Measure performance of mulMat with and without pre-packed panels, for a few shapes of the decoder's weight matrices.
+	// The results are printed into the log.
+	HRESULT dbgBenchmarkPrePackedMulMat( int threads );
+
+	// Compare performance and accuracy of INT8 mulMat against the pre-packed FP16 version, for the same shapes.
+	// The results are printed into the log.
+	HRESULT dbgCompareInt8MulMat( int threads );
+
+	// Sweep every FP32 input of expApprox and geluApprox, and compare them against the double precision formulas.
+	// The maximum errors are printed into the log, they back the bounds documented in simdUtils.h
+	HRESULT dbgCheckExpGelu( int threads );
 }
 
 #if TENSOR_GGML_COMPAT
@@ -0,0 +1,321 @@
+#include "stdafx.h"
+#include <random>
+#include <cmath>
+#include "mulMat.h"
+#include "simdUtils.h"
+#include "../Utils/CpuProfiler.h"
+using namespace CpuCompute;
+
+namespace
+{
+	struct sBenchmarkShape
+	{
+		const char* name;
+		uint32_t width, height;
+	};
+
+	// Weight matrices of the medium model's decoder, n_text_state = 1024
+	static const std::array<sBenchmarkShape, 2> s_shapes =
+	{
+		sBenchmarkShape{ "mlp0", 1024, 4096 },
+		sBenchmarkShape{ "attnQuery", 1024, 1024 },
+	};
+
+	// Count of tokens in the second argument; decode steps usually have 1 token, the first step of each segment has a few of them
+	static const std::array<uint32_t, 3> s_tokens = { 1, 2, 4 };
+
+	constexpr size_t iterations = 200;
+
+	// Allocate a dense tensor in the buffer
+	HRESULT createTensor( Tensor& t, LargeBuffer& buffer, eDataType type, std::initializer_list<uint32_t> size, size_t cb )
+	{
+		CHECK( buffer.allocate( cb ) );
+		return t.attach( buffer.pointer(), type, size );
+	}
+
+	void fillRandom( float* rdi, size_t length, std::mt19937& gen )
+	{
+		std::uniform_real_distribution<float> distribution{ -1.0f, 1.0f };
+		for( size_t i = 0; i < length; i++ )
+			rdi[ i ] = distribution( gen );
+	}
+
+	// Run the multiplication a few times, return average microseconds per call
+	HRESULT measure( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, double& us )
+	{
+		// Warm up caches, and the thread-local buffers
+		CHECK( mulMat( result, a, b, pfor ) );
+
+		Whisper::CpuProfiler profiler;
+		for( size_t i = 0; i < iterations; i++ )
+			CHECK( mulMat( result, a, b, pfor ) );
+		// CpuProfiler measures time in 100-nanosecond ticks
+		us = 0.1 * (double)(int64_t)profiler.elapsed() / (double)iterations;
+		return S_OK;
+	}
+
+	float maxAbsDiff( const float* a, const float* b, size_t length )
+	{
+		float res = 0;
+		for( size_t i = 0; i < length; i++ )
+			res = std::max( res, std::abs( a[ i ] - b[ i ] ) );
+		return res;
+	}
+
+	// Root mean square of the difference, divided by root mean square of the reference vector
+	double relativeRmsError( const float* reference, const float* b, size_t length )
+	{
+		double sumDiff = 0, sumRef = 0;
+		for( size_t i = 0; i < length; i++ )
+		{
+			const double diff = (double)b[ i ] - (double)reference[ i ];
+			sumDiff += diff * diff;
+			sumRef += (double)reference[ i ] * (double)reference[ i ];
+		}
+		if( sumRef <= 0 )
+			return 0;
+		return std::sqrt( sumDiff / sumRef );
+	}
+}
+
+HRESULT CpuCompute::dbgBenchmarkPrePackedMulMat( int threads )
+{
+	ParallelForRunner pfor{ threads };
+	std::mt19937 gen{ 0 };
+
+	for( const auto& shape : s_shapes )
+	{
+		const size_t elementsA = (size_t)shape.width * shape.height;
+
+		// Matrix A in the original layout
+		LargeBuffer bufferA;
+		Tensor a;
+		CHECK( createTensor( a, bufferA, eDataType::FP16, { shape.width, shape.height }, elementsA * 2 ) );
+		{
+			std::vector<float> temp( elementsA );
+			fillRandom( temp.data(), elementsA, gen );
+			floatsDowncast( a.fp16(), temp.data(), elementsA );
+		}
+
+		// Same matrix, pre-packed
+		LargeBuffer bufferPacked;
+		CHECK( bufferPacked.allocate( prePackedBytes( a ) ) );
+		CHECK( prePackPanels( (uint16_t*)bufferPacked.pointer(), a ) );
+		Tensor packed = a;
+		packed.setDataPointer( bufferPacked.pointer() );
+		packed.setLayout( eTensorLayout::Panels );
+
+		for( uint32_t tokens : s_tokens )
+		{
+			const size_t elementsB = (size_t)shape.width * tokens;
+			const size_t elementsResult = (size_t)shape.height * tokens;
+
+			LargeBuffer bufferB, bufferResult1, bufferResult2;
+			Tensor b, result1, result2;
+			CHECK( createTensor( b, bufferB, eDataType::FP32, { shape.width, tokens }, elementsB * 4 ) );
+			fillRandom( b.fp32(), elementsB, gen );
+			CHECK( createTensor( result1, bufferResult1, eDataType::FP32, { shape.height, tokens }, elementsResult * 4 ) );
+			CHECK( createTensor( result2, bufferResult2, eDataType::FP32, { shape.height, tokens }, elementsResult * 4 ) );
+
+			double usBefore, usAfter;
+			CHECK( measure( result1, a, b, pfor, usBefore ) );
+			CHECK( measure( result2, packed, b, pfor, usAfter ) );
+
+			const float diff = maxAbsDiff( result1.fp32(), result2.fp32(), elementsResult );
+			logInfo( u8"mulMat %s [ %i, %i ] * [ %i, %i ]: %g µs repacked, %g µs pre-packed, %.3g%% faster, max.abs.diff %g",
+				shape.name, (int)shape.width, (int)shape.height, (int)shape.width, (int)tokens,
+				usBefore, usAfter, ( usBefore / usAfter - 1.0 ) * 100.0, diff );
+		}
+	}
+	return S_OK;
+}
+
+HRESULT CpuCompute::dbgCompareInt8MulMat( int threads )
+{
+	if( !canQuantizeWeights() )
+	{
+		logError( u8"INT8 weights require a CPU with AVX2 support" );
+		return HRESULT_FROM_WIN32( ERROR_NOT_SUPPORTED );
+	}
+
+	ParallelForRunner pfor{ threads };
+	std::mt19937 gen{ 0 };
+
+	for( const auto& shape : s_shapes )
+	{
+		const size_t elementsA = (size_t)shape.width * shape.height;
+
+		LargeBuffer bufferA;
+		Tensor a;
+		CHECK( createTensor( a, bufferA, eDataType::FP16, { shape.width, shape.height }, elementsA * 2 ) );
+		{
+			std::vector<float> temp( elementsA );
+			fillRandom( temp.data(), elementsA, gen );
+			floatsDowncast( a.fp16(), temp.data(), elementsA );
+		}
+
+		// The FP16 version, pre-packed
+		LargeBuffer bufferPacked;
+		CHECK( bufferPacked.allocate( prePackedBytes( a ) ) );
+		CHECK( prePackPanels( (uint16_t*)bufferPacked.pointer(), a ) );
+		Tensor packed = a;
+		packed.setDataPointer( bufferPacked.pointer() );
+		packed.setLayout( eTensorLayout::Panels );
+
+		// The INT8 version
+		LargeBuffer bufferQuantized;
+		CHECK( bufferQuantized.allocate( quantizedPanelsBytes( a ) ) );
+		CHECK( quantizePanels( bufferQuantized.pointer(), a ) );
+		Tensor quantized = a;
+		quantized.setDataPointer( bufferQuantized.pointer() );
+		quantized.setType( eDataType::I8 );
+		quantized.setLayout( eTensorLayout::Panels );
+
+		for( uint32_t tokens : s_tokens )
+		{
+			const size_t elementsB = (size_t)shape.width * tokens;
+			const size_t elementsResult = (size_t)shape.height * tokens;
+
+			LargeBuffer bufferB, bufferResult1, bufferResult2;
+			Tensor b, result1, result2;
+			CHECK( createTensor( b, bufferB, eDataType::FP32, { shape.width, tokens }, elementsB * 4 ) );
+			fillRandom( b.fp32(), elementsB, gen );
+			CHECK( createTensor( result1, bufferResult1, eDataType::FP32, { shape.height, tokens }, elementsResult * 4 ) );
+			CHECK( createTensor( result2, bufferResult2, eDataType::FP32, { shape.height, tokens }, elementsResult * 4 ) );
+
+			double usFp16, usInt8;
+			CHECK( measure( result1, packed, b, pfor, usFp16 ) );
+			CHECK( measure( result2, quantized, b, pfor, usInt8 ) );
+
+			const float diff = maxAbsDiff( result1.fp32(), result2.fp32(), elementsResult );
+			const double rel = relativeRmsError( result1.fp32(), result2.fp32(), elementsResult );
+			logInfo( u8"mulMat %s [ %i, %i ] * [ %i, %i ]: %g µs FP16, %g µs INT8, %.3g%% faster, max.abs.diff %g, relative RMS error %g",
+				shape.name, (int)shape.width, (int)shape.height, (int)shape.width, (int)tokens,
+				usFp16, usInt8, ( usFp16 / usInt8 - 1.0 ) * 100.0, diff, rel );
+		}
+	}
+	return S_OK;
+}
+
+namespace
+{
+	// Maximum errors of expApprox and geluApprox, compared to the double precision formulas
+	struct sApproxErrors
+	{
+		double expRelative = 0, expAt = 0;
+		double geluAbsolute = 0, geluAbsoluteAt = 0;
+		// Absolute error divided by max( | x |, 1 )
+		double geluScaled = 0, geluScaledAt = 0;
+
+		void merge( const sApproxErrors& that )
+		{
+			if( that.expRelative > expRelative )
+			{
+				expRelative = that.expRelative;
+				expAt = that.expAt;
+			}
+			if( that.geluAbsolute > geluAbsolute )
+			{
+				geluAbsolute = that.geluAbsolute;
+				geluAbsoluteAt = that.geluAbsoluteAt;
+			}
+			if( that.geluScaled > geluScaled )
+			{
+				geluScaled = that.geluScaled;
+				geluScaledAt = that.geluScaledAt;
+			}
+		}
+	};
+
+	// FP32 bit patterns in one job of the sweep
+	constexpr size_t sweepBatch = 1 << 16;
+
+	// Every job computes both functions for a batch of FP32 bit patterns
+	class ApproxSweep : public iComputeRange
+	{
+		std::vector<sApproxErrors>& results;
+
+	public:
+		ApproxSweep( std::vector<sApproxErrors>& r ) : results( r ) { }
+
+		HRESULT __stdcall compute( size_t i, size_t end ) const override final
+		{
+			const double geluScale = std::sqrt( 2.0 / 3.14159265358979323846 );
+			alignas( 32 ) std::array<uint32_t, 8> bits;
+			alignas( 32 ) std::array<float, 8> ex, gelu;
+			for( ; i < end; i++ )
+			{
+				sApproxErrors& res = results[ i ];
+				const size_t first = i * sweepBatch;
+				for( size_t j = 0; j < sweepBatch; j += 8 )
+				{
+					for( size_t k = 0; k < 8; k++ )
+						bits[ k ] = (uint32_t)( first + j + k );
+					const __m256 x = _mm256_load_ps( (const float*)bits.data() );
+					_mm256_store_ps( ex.data(), expApprox( x ) );
+					_mm256_store_ps( gelu.data(), geluApprox( x ) );
+
+					for( size_t k = 0; k < 8; k++ )
+					{
+						const float xf = ( (const float*)bits.data() )[ k ];
+						if( !std::isfinite( xf ) )
+							continue;
+						const double xd = xf;
+
+						// The documented range of expApprox
+						if( xf >= -87.3365402f && xf <= 88.0f )
+						{
+							const double e = std::exp( xd );
+							const double rel = std::abs( (double)ex[ k ] - e ) / e;
+							if( rel > res.expRelative )
+							{
+								res.expRelative = rel;
+								res.expAt = xd;
+							}
+						}
+
+						const double g = 0.5 * xd * ( 1.0 + std::tanh( geluScale * ( xd + 0.044715 * xd * xd * xd ) ) );
+						const double abs = std::abs( (double)gelu[ k ] - g );
+						if( abs > res.geluAbsolute )
+						{
+							res.geluAbsolute = abs;
+							res.geluAbsoluteAt = xd;
+						}
+						const double scaled = abs / std::max( std::abs( xd ), 1.0 );
+						if( scaled > res.geluScaled )
+						{
+							res.geluScaled = scaled;
+							res.geluScaledAt = xd;
+						}
+					}
+				}
+			}
+			return S_OK;
+		}
+	};
+}
+
+HRESULT CpuCompute::dbgCheckExpGelu( int threads )
+{
+	ParallelForRunner pfor{ threads };
+
+	// Sweep all 2^32 FP32 bit patterns, the documented error bounds are maximums over every finite input
+	constexpr size_t countBatches = ( (size_t)1 << 32 ) / sweepBatch;
+	std::vector<sApproxErrors> results( countBatches );
+	ApproxSweep sweep{ results };
+
+	Whisper::CpuProfiler profiler;
+	CHECK( pfor.parallelFor( sweep, countBatches ) );
+	// CpuProfiler measures time in 100-nanosecond ticks
+	const double seconds = 1E-7 * (double)(int64_t)profiler.elapsed();
+
+	sApproxErrors total;
+	for( const auto& r : results )
+		total.merge( r );
+
+	logInfo( u8"expApprox on [ -87.3, 88 ]: max.relative error %g at x = %g", total.expRelative, total.expAt );
+	logInfo( u8"geluApprox: max.abs.diff %g at x = %g, max.abs.diff / max( |x|, 1 ) %g at x = %g",
+		total.geluAbsolute, total.geluAbsoluteAt, total.geluScaled, total.geluScaledAt );
+	logInfo( u8"expApprox and geluApprox: swept 2^32 inputs in %g seconds", seconds );
+	return S_OK;
+}
\ No newline at end of file
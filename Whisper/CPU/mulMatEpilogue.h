@@ -0,0 +1,19 @@
+#pragma once
+
+namespace CpuCompute
+{
+	// Optional elementwise operation fused into mulMat: result = gelu( ( result + repeat( bias ) ) * scale ), the GELU is optional.
+	// The kernels apply it to every panel of the output matrix as soon as the panel is computed, while these numbers are still in L1 cache.
+	// This saves one or two complete passes over the output matrix, compared to separate addRepeat / addRepeatScale / addRepeatGelu operations.
+	struct sMulMatEpilogue
+	{
+		// The bias vector, with result.ne[ 0 ] elements; added to every column of the output matrix. When nullptr, the epilogue only applies the scale.
+		const float* bias = nullptr;
+		float scale = 1.0f;
+		// Apply GELU activation after the bias; incompatible with the scale
+		bool gelu = false;
+
+		// Apply to the block of the output matrix with the specified height and width, the first row of the block is at the index firstRow
+		void apply( float* rdi, size_t firstRow, size_t height, size_t width, size_t stride ) const;
+	};
+}
\ No newline at end of file
@@ -359,4 +359,74 @@ HRESULT MulMatBase::transposePanelAvx2( uint16_t* rdi, size_t i, size_t m2, size
 			transpose8PartialAvx2( rdi, length, lastPanel, rsi, stridesA[ 1 ], resultStride );
 	}
 	return S_OK;
+}
+namespace
+{
+	// Keep the low 16 bits in 32-bit lanes of both vectors, and pack them into 16 FP16 values in the correct order
+	__forceinline __m256i packLow16( __m256i a, __m256i b )
+	{
+		const __m256i lowMask = _mm256_set1_epi32( 0xFFFF );
+		a = _mm256_and_si256( a, lowMask );
+		b = _mm256_and_si256( b, lowMask );
+		// vpackusdw works within 128-bit lanes, the permute puts 64-bit pieces in place
+		const __m256i packed = _mm256_packus_epi32( a, b );
+		return _mm256_permute4x64_epi64( packed, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+	}
+}
+
+// The gather instructions load 32-bit lanes, the upper half of each lane is the next element of the row.
+// That's why the last column of the panel is loaded with scalar code, the element after that column might be outside of the source buffer.
+HRESULT MulMatBase::gatherPanelAvx2( uint16_t* rdi, size_t i, size_t m2, size_t m3 ) const
+{
+	const size_t heightFloats = (size_t)panelHeightRegisters * 8;
+	i *= heightFloats;
+	assert( length > 0 && i < resultSize[ 0 ] );
+	const size_t height = std::min( heightFloats, (size_t)resultSize[ 0 ] - i );
+	const size_t strideElement = stridesA[ 0 ];
+	const size_t strideRow = stridesA[ 1 ];
+
+	const uint16_t* rsi = (const uint16_t*)pa;
+	rsi += m3 * stridesA[ 3 ];
+	rsi += m2 * stridesA[ 2 ];
+	rsi += i * strideRow;
+
+	// Byte offsets of the rows, and the masks to skip rows below the bottom of the matrix; masked lanes are gathered as zeros
+	std::array<__m256i, 4> offsets, masks;
+	const __m256i rowStrideBytes = _mm256_set1_epi32( (int)( strideRow * sizeof( uint16_t ) ) );
+	const __m256i heightVec = _mm256_set1_epi32( (int)height );
+	__m256i row = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+	for( size_t r = 0; r < panelHeightRegisters; r++ )
+	{
+		offsets[ r ] = _mm256_mullo_epi32( row, rowStrideBytes );
+		masks[ r ] = _mm256_cmpgt_epi32( heightVec, row );
+		row = _mm256_add_epi32( row, _mm256_set1_epi32( 8 ) );
+	}
+
+	const __m256i zero = _mm256_setzero_si256();
+	uint16_t* const rdiEnd = rdi + ( length - 1 ) * heightFloats;
+	if( panelHeightRegisters == 1 )
+	{
+		for( ; rdi < rdiEnd; rdi += heightFloats, rsi += strideElement )
+		{
+			const __m256i v = _mm256_mask_i32gather_epi32( zero, (const int*)rsi, offsets[ 0 ], masks[ 0 ], 1 );
+			_mm_store_si128( ( __m128i* )rdi, _mm256_castsi256_si128( packLow16( v, v ) ) );
+		}
+	}
+	else
+	{
+		for( ; rdi < rdiEnd; rdi += heightFloats, rsi += strideElement )
+		{
+			for( size_t r = 0; r < panelHeightRegisters; r += 2 )
+			{
+				const __m256i v0 = _mm256_mask_i32gather_epi32( zero, (const int*)rsi, offsets[ r ], masks[ r ], 1 );
+				const __m256i v1 = _mm256_mask_i32gather_epi32( zero, (const int*)rsi, offsets[ r + 1 ], masks[ r + 1 ], 1 );
+				_mm256_store_si256( ( __m256i* )( rdi + r * 8 ), packLow16( v0, v1 ) );
+			}
+		}
+	}
+
+	// The last column
+	for( size_t r = 0; r < heightFloats; r++ )
+		rdi[ r ] = ( r < height ) ? rsi[ r * strideRow ] : 0;
+	return S_OK;
 }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include "stdafx.h"
+#include <immintrin.h>
+#include "mulMatImpl.h"
+using namespace CpuCompute;
+
+// This source file is compiled with AVX-512 code generation, the code is only called when MulMatBase::haveAvx512 is true.
+// Deliberately not including mulMat.kernel.hpp and mulMatUtils.hpp here, the non-inlined functions from these headers would have been compiled for AVX-512.
+namespace
+{
+	// Count of FP32 lanes in a 512-bit vector
+	constexpr size_t floatsPerReg = 16;
+
+	// Similar to ResultTile in mulMat.kernel.hpp, using 512-bit vectors.
+	// AVX-512 has 32 vector registers, the largest tile we instantiate is 2x12 = 24 accumulators, plus 2 registers for the panel and 1 for the broadcasted B value.
+	// The kernels are generic loops with compile-time trip counts, the compiler unrolls them completely.
+	template<uint8_t panelRegs, uint8_t tileWidth>
+	struct ResultTile512
+	{
+		std::array<__m512, (size_t)panelRegs * tileWidth> arr;
+
+		__forceinline void setZero()
+		{
+			for( size_t i = 0; i < arr.size(); i++ )
+				arr[ i ] = _mm512_setzero_ps();
+		}
+
+		// Accumulate products of the panel column by tileWidth elements of the B matrix
+		__forceinline void kernel( const std::array<__m512, panelRegs>& panel, const float* rsi, size_t stride )
+		{
+			for( size_t c = 0; c < tileWidth; c++ )
+			{
+				// vbroadcastss with memory operand
+				const __m512 b = _mm512_set1_ps( rsi[ c * stride ] );
+				for( size_t r = 0; r < panelRegs; r++ )
+					arr[ c * panelRegs + r ] = _mm512_fmadd_ps( panel[ r ], b, arr[ c * panelRegs + r ] );
+			}
+		}
+
+		// Same as above, for the last incomplete tile of the panel
+		__forceinline void kernelPartial( const std::array<__m512, panelRegs>& panel, const float* rsi, size_t stride, size_t rem )
+		{
+			assert( rem > 0 && rem < tileWidth );
+			for( size_t c = 0; c < rem; c++ )
+			{
+				const __m512 b = _mm512_set1_ps( rsi[ c * stride ] );
+				for( size_t r = 0; r < panelRegs; r++ )
+					arr[ c * panelRegs + r ] = _mm512_fmadd_ps( panel[ r ], b, arr[ c * panelRegs + r ] );
+			}
+		}
+
+		// Store [ w, h ] block of the tile into the output matrix
+		__forceinline void store( float* rdi, size_t w, size_t h, size_t stride ) const
+		{
+			assert( w > 0 && w <= panelRegs * floatsPerReg );
+			assert( h > 0 && h <= tileWidth );
+
+			if( w == panelRegs * floatsPerReg )
+			{
+				for( size_t c = 0; c < h; c++, rdi += stride )
+					for( size_t r = 0; r < panelRegs; r++ )
+						_mm512_storeu_ps( rdi + r * floatsPerReg, arr[ c * panelRegs + r ] );
+			}
+			else
+			{
+				// AVX-512 has masked stores for all vectors, use that for the incomplete panel at the bottom of the matrix
+				std::array<__mmask16, panelRegs> masks;
+				for( size_t r = 0; r < panelRegs; r++ )
+				{
+					const ptrdiff_t count = std::clamp( (ptrdiff_t)w - (ptrdiff_t)( r * floatsPerReg ), (ptrdiff_t)0, (ptrdiff_t)floatsPerReg );
+					masks[ r ] = (__mmask16)( ( 1u << count ) - 1 );
+				}
+				for( size_t c = 0; c < h; c++, rdi += stride )
+					for( size_t r = 0; r < panelRegs; r++ )
+						_mm512_mask_storeu_ps( rdi + r * floatsPerReg, masks[ r ], arr[ c * panelRegs + r ] );
+			}
+		}
+	};
+
+	// Load and upcast a column of the panel.
+	// The panel is either in the thread-local buffer, or pre-packed, both are aligned by 32 bytes.
+	template<size_t panelRegs>
+	__forceinline void loadPanel( const uint16_t* rsi, std::array<__m512, panelRegs>& dest )
+	{
+		for( size_t r = 0; r < panelRegs; r++ )
+		{
+			const __m256i i = _mm256_load_si256( ( const __m256i* )( rsi + r * floatsPerReg ) );
+			dest[ r ] = _mm512_cvtph_ps( i );
+		}
+	}
+}
+
+template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+HRESULT __stdcall MulMatImplAvx512<panelHeightRegs, tileWidthFloats>::compute( size_t i, size_t end ) const noexcept
+{
+	// Same algorithm as MulMatImpl::compute, see comments in that method
+	constexpr uint8_t panelRegs = panelHeightRegs / 2;
+	constexpr size_t panelHeightFloats = panelHeightRegs * 8;
+	uint16_t* const panelBuffer = ( nullptr != pfnMakePanel ) ? (uint16_t*)runner.threadLocalBuffer( floatsPerPanel() * 2 ) : nullptr;
+	const size_t resultStride = resultStrides[ 0 ];
+	const size_t panelStride = this->panelStride;
+
+	const size_t length = this->length;
+	const std::array<size_t, 2> stridesB{ this->stridesB[ 0 ], this->stridesB[ 1 ] };
+
+	for( ; i < end; i++ )
+	{
+		const size_t iPanel = i % countPanels;
+		size_t j = i / countPanels;
+		const size_t m2 = j % (size_t)resultSize[ 2 ];
+		const size_t m3 = j / (size_t)resultSize[ 2 ];
+
+		const uint16_t* panel;
+		if( nullptr != pfnMakePanel )
+		{
+			CHECK( ( this->*pfnMakePanel )( panelBuffer, iPanel, m2, m3 ) );
+			panel = panelBuffer;
+		}
+		else
+			panel = getPrePackedPanel( iPanel );
+
+		const float* pb = getLayerB( m2, m3 );
+		float* const rdiPanel = getPanelDest( iPanel, m2, m3 );
+		float* rdi = rdiPanel;
+
+		const size_t storeWidth = std::min( panelHeightFloats, (size_t)resultSize[ 0 ] - iPanel * panelHeightFloats );
+		std::array<__m512, panelRegs> vecPanel;
+		ResultTile512<panelRegs, tileWidthFloats> tile;
+
+		const uint16_t* const rsiAEnd = panel + length * panelStride;
+		for( j = 0; j < completeTilesPerPanel; j++, pb += tileWidthFloats * stridesB[ 1 ], rdi += resultStride * tileWidthFloats )
+		{
+			tile.setZero();
+			const float* rsiB = pb;
+			for( const uint16_t* rsiA = panel; rsiA < rsiAEnd; rsiA += panelStride, rsiB += stridesB[ 0 ] )
+			{
+				loadPanel( rsiA, vecPanel );
+				tile.kernel( vecPanel, rsiB, stridesB[ 1 ] );
+			}
+			tile.store( rdi, storeWidth, tileWidthFloats, resultStride );
+		}
+
+		if( 0 != lastColumnsInPanel )
+		{
+			tile.setZero();
+			const float* rsiB = pb;
+			for( const uint16_t* rsiA = panel; rsiA < rsiAEnd; rsiA += panelStride, rsiB += stridesB[ 0 ] )
+			{
+				loadPanel( rsiA, vecPanel );
+				tile.kernelPartial( vecPanel, rsiB, stridesB[ 1 ], lastColumnsInPanel );
+			}
+			tile.store( rdi, storeWidth, lastColumnsInPanel, resultStride );
+		}
+
+		if( nullptr != epilogue )
+			epilogue->apply( rdiPanel, iPanel * panelHeightFloats, storeWidth, resultSize[ 1 ], resultStride );
+	}
+	return S_OK;
+}
+
+// Instantiate the templates we need
+template class MulMatImplAvx512<4, 1>;
+template class MulMatImplAvx512<2, 1>;
+template class MulMatImplAvx512<4, 2>;
+template class MulMatImplAvx512<2, 2>;
+template class MulMatImplAvx512<4, 3>;
+template class MulMatImplAvx512<2, 3>;
+template class MulMatImplAvx512<4, 4>;
+template class MulMatImplAvx512<2, 4>;
+template class MulMatImplAvx512<4, 8>;
+template class MulMatImplAvx512<2, 8>;
+template class MulMatImplAvx512<4, 12>;
+template class MulMatImplAvx512<2, 12>;
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include <intrin.h>
 #include "mulMatImpl.h"
+#include "mulMat.h"
 #include "mulMat.kernel.hpp"
 
 #define DBG_TRACK_TEMPLATE_INSTANTIATION 0
@@ -21,6 +22,24 @@ namespace
 		return ( cpuInfo[ 1 ] & ( 1 << 5 ) ) != 0;
 	}
 
+	bool checkAvx512Support()
+	{
+		int cpuInfo[ 4 ];
+		__cpuid( cpuInfo, 1 );
+		// OSXSAVE bit, without it we can't call xgetbv
+		if( 0 == ( cpuInfo[ 2 ] & ( 1 << 27 ) ) )
+			return false;
+
+		__cpuid( cpuInfo, 7 );
+		// AVX512F bit
+		if( 0 == ( cpuInfo[ 1 ] & ( 1 << 16 ) ) )
+			return false;
+
+		// The OS must save and restore the complete state of AVX-512 registers: SSE, AVX, opmask, upper halves of ZMM0-15, and ZMM16-31
+		constexpr uint64_t osMask = 0b11100110;
+		return ( _xgetbv( 0 ) & osMask ) == osMask;
+	}
+
 	// a / b, rounded up to the next integer
 	inline uint32_t divRoundUp( uint32_t a, uint32_t b )
 	{
@@ -30,6 +49,7 @@ namespace
 }
 
 const bool MulMatBase::haveAvx2 = checkAvx2Support();
+const bool MulMatBase::haveAvx512 = checkAvx512Support();
 
 MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, uint8_t panelHeightRegs, uint8_t tileWidthFloats ) :
 	resultPointer( result.fp32() ),
@@ -53,7 +73,28 @@ MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, Parall
 
 	// Pick a method which reshapes a panel of the matrix A into the shape we need to compute the product
 	// Store the pointer to that method in the field of this class
-	if( a.nb[ 0 ] == 1 )
+	panelStride = (uint32_t)panelHeightRegs * 8;
+	if( a.type() == eDataType::Q4 )
+	{
+		// 4-bit weights are always pre-packed by prePackQ4Panels(), MulMatImplQ4 kernels consume complete blocks of 32 panel columns
+		if( a.layout() != eTensorLayout::Panels || a.ne[ 2 ] != 1 || a.ne[ 3 ] != 1 )
+			throw E_NOTIMPL;
+		if( panelHeightRegs * 8 != prePackedPanelHeight || 0 != length % q4BlockSize )
+			throw E_NOTIMPL;
+		panelStride = 0;
+		pfnMakePanel = nullptr;
+	}
+	else if( a.layout() == eTensorLayout::Panels )
+	{
+		// The matrix was reshaped when loading the model, the kernels gonna read panels directly from there
+		// Pre-packed panels are only implemented for 2D matrices
+		if( a.ne[ 2 ] != 1 || a.ne[ 3 ] != 1 )
+			throw E_NOTIMPL;
+		static_assert( prePackedPanelHeight % 32 == 0 );
+		panelStride = prePackedPanelHeight;
+		pfnMakePanel = nullptr;
+	}
+	else if( a.nb[ 0 ] == 1 )
 	{
 		if( haveAvx2 )
 			pfnMakePanel = &MulMatBase::transposePanelAvx2;
@@ -77,6 +118,8 @@ MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, Parall
 			throw E_NOTIMPL;
 		}
 	}
+	else if( haveAvx2 && (size_t)( panelHeightRegs * 8 - 1 ) * a.nb[ 1 ] * sizeof( uint16_t ) <= INT_MAX )
+		pfnMakePanel = &MulMatBase::gatherPanelAvx2;
 	else
 		pfnMakePanel = &MulMatBase::gatherPanel;
 
@@ -93,10 +136,25 @@ MulMatBase::MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, Parall
 #endif
 }
 
-HRESULT MulMatBase::run( ParallelForRunner& pfor )
+HRESULT MulMatBase::run( ParallelForRunner& pfor, uint32_t maxThreads )
 {
 	size_t length = (size_t)countPanels * resultSize[ 2 ] * resultSize[ 3 ];
-	return pfor.parallelFor( *this, length );
+	size_t minBatch = 1;
+	if( 0 != maxThreads )
+		minBatch = std::max( ( length + maxThreads - 1 ) / maxThreads, (size_t)1 );
+	return pfor.parallelFor( *this, length, minBatch );
+}
+
+const uint16_t* MulMatBase::getPrePackedPanel( size_t i ) const
+{
+	// Index of the first row of the panel in the matrix
+	i *= (size_t)panelHeightRegisters * 8;
+	const uint16_t* rsi = (const uint16_t*)pa;
+	// Pre-packed panels are taller than, or equal to, the panels consumed by the kernels.
+	// Skip complete pre-packed panels, then offset within the column of the pre-packed panel
+	rsi += ( i / prePackedPanelHeight ) * prePackedPanelHeight * length;
+	rsi += i % prePackedPanelHeight;
+	return rsi;
 }
 
 const float* MulMatBase::getLayerB( size_t m2, size_t m3 ) const
@@ -111,10 +169,11 @@ const float* MulMatBase::getLayerB( size_t m2, size_t m3 ) const
 template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
 HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t i, size_t end ) const noexcept
 {
-	// Allocate a thread-local buffer for the transposed panel
+	// Allocate a thread-local buffer for the transposed panel, unless the matrix A is pre-packed
 	constexpr size_t panelHeightFloats = panelHeightRegs * 8;
-	uint16_t* const panel = (uint16_t*)runner.threadLocalBuffer( floatsPerPanel() * 2 );
+	uint16_t* const panelBuffer = ( nullptr != pfnMakePanel ) ? (uint16_t*)runner.threadLocalBuffer( floatsPerPanel() * 2 ) : nullptr;
 	const size_t resultStride = resultStrides[ 0 ];
+	const size_t panelStride = this->panelStride;
 
 	// Load a few numbers from this class into local variables, while upcasting from DWORD into size_t
 	const size_t length = this->length;
@@ -130,12 +189,20 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 		const size_t m2 = j % (size_t)resultSize[ 2 ];
 		const size_t m3 = j / (size_t)resultSize[ 2 ];
 
-		CHECK( ( this->*pfnMakePanel )( panel, iPanel, m2, m3 ) );
-		// We got a column-major panel in the thread local buffer, of size [ length, panelHeightRegs * 8 ]
+		const uint16_t* panel;
+		if( nullptr != pfnMakePanel )
+		{
+			CHECK( ( this->*pfnMakePanel )( panelBuffer, iPanel, m2, m3 ) );
+			panel = panelBuffer;
+		}
+		else
+			panel = getPrePackedPanel( iPanel );
+		// We got a column-major panel, of size [ length, panelHeightRegs * 8 ], columns are panelStride elements apart
 		// Hopefully, these buffers should all fit at least in L3 cache
 		// The longest matrix I saw in the debugger had 4096 elements, with panelHeightRegs = 4 that's 256 kb of data in the panel
 		const float* pb = getLayerB( m2, m3 );
-		float* rdi = getPanelDest( iPanel, m2, m3 );
+		float* const rdiPanel = getPanelDest( iPanel, m2, m3 );
+		float* rdi = rdiPanel;
 
 		const size_t storeWidth = std::min( panelHeightFloats, (size_t)resultSize[ 0 ] - iPanel * panelHeightFloats );
 		std::array<__m256, panelHeightRegs> vecPanel;
@@ -148,10 +215,10 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 		{
 			setZero( tile.arr );
 			const uint16_t* rsiA = panel;
-			const uint16_t* const rsiAEnd = panel + length * panelHeightFloats;
+			const uint16_t* const rsiAEnd = panel + length * panelStride;
 			const float* rsiB = pb;
 			// This loop runs for `length` iterations, iterates over the first dimensions of both matrices, accumulating these dot products we're after
-			for( ; rsiA < rsiAEnd; rsiA += panelHeightFloats, rsiB += stridesB[ 0 ] )
+			for( ; rsiA < rsiAEnd; rsiA += panelStride, rsiB += stridesB[ 0 ] )
 			{
 				loadPanel( rsiA, vecPanel );
 				tile.kernel( vecPanel, rsiB, stridesB[ 1 ] );
@@ -163,15 +230,18 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 		{
 			setZero( tile.arr );
 			const uint16_t* rsiA = panel;
-			const uint16_t* rsiAEnd = panel + length * panelHeightFloats;
+			const uint16_t* rsiAEnd = panel + length * panelStride;
 			const float* rsiB = pb;
-			for( ; rsiA < rsiAEnd; rsiA += panelHeightFloats, rsiB += stridesB[ 0 ] )
+			for( ; rsiA < rsiAEnd; rsiA += panelStride, rsiB += stridesB[ 0 ] )
 			{
 				loadPanel( rsiA, vecPanel );
 				tile.kernelPartial( vecPanel, rsiB, stridesB[ 1 ], lastColumnsInPanel );
 			}
 			tile.store( rdi, storeWidth, lastColumnsInPanel, resultStride );
 		}
+
+		if( nullptr != epilogue )
+			epilogue->apply( rdiPanel, iPanel * panelHeightFloats, storeWidth, resultSize[ 1 ], resultStride );
 #else
 		// This version bypasses horizontal tiling, instead implements a brute force algorithm to multiply the current panel by the complete B matrix
 		// Not terribly efficient, only implemented for debugging purposes
@@ -182,9 +252,8 @@ HRESULT __stdcall MulMatImpl<panelHeightRegs, tileWidthFloats>::compute( size_t
 			setZero( tile );
 
 			const uint16_t* rsiA = panel;
-			const uint16_t* const rsiAEnd = panel + length * panelHeightFloats;
 			const float* rsiB = pb;
-			for( size_t k = 0; k < length; k++, rsiA += panelHeightFloats, rsiB += stridesB[ 0 ] )
+			for( size_t k = 0; k < length; k++, rsiA += panelStride, rsiB += stridesB[ 0 ] )
 			{
 				loadPanel( rsiA, vecPanel );
 				const __m256 b = _mm256_broadcast_ss( rsiB );
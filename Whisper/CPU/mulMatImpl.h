@@ -6,6 +6,7 @@
 // https://link.springer.com/article/10.1007/s11227-022-05003-3
 #include "ParallelForRunner.h"
 #include "Tensor.h"
+#include "mulMatEpilogue.h"
 
 namespace CpuCompute
 {
@@ -49,9 +50,17 @@ namespace CpuCompute
 		// Same as tileWidthFloats template argument - width of the tile, in floats
 		uint8_t tileWidth;
 
+		// Distance between columns of the panel consumed by the kernels, in FP16 elements.
+		// Equal to panel height for the thread-local buffers, or prePackedPanelHeight when the first matrix is pre-packed.
+		uint32_t panelStride;
+
 		// Method pointer to reshape a panel from the source matrix into a thread-local buffer
+		// nullptr when the first matrix is pre-packed, then the kernels read panels directly from that matrix
 		using pfnTransposePanel = HRESULT( MulMatBase::* )( uint16_t* rdi, size_t i, size_t m2, size_t m3 ) const;
 		pfnTransposePanel pfnMakePanel;
+
+		// Optional elementwise operation applied to the panels of the output matrix, nullptr when none
+		const sMulMatEpilogue* epilogue = nullptr;
 		// The object which implements multithreading for this job, and supplies memory for thread-local buffers
 		ParallelForRunner& runner;
 
@@ -69,10 +78,13 @@ namespace CpuCompute
 		HRESULT copyPanelColumnMajor16( uint16_t* rdi, size_t i, size_t m2, size_t m3 ) const;
 		HRESULT copyPanelColumnMajor32( uint16_t* rdi, size_t i, size_t m2, size_t m3 ) const;
 		// Transpose a panel of the first matrix for irregular layout of that matrix, when neither rows nor columns are at sequential addresses.
-		// This one ain't implemented yet.
 		HRESULT gatherPanel( uint16_t* rdi, size_t i, size_t m2, size_t m3 ) const;
+		// Same as above, using AVX2 gather instructions; requires ( panelHeight - 1 ) * stridesA[ 1 ] to fit in int32 byte offsets
+		HRESULT gatherPanelAvx2( uint16_t* rdi, size_t i, size_t m2, size_t m3 ) const;
 
 		const uint16_t* getPanelA( size_t i, size_t m2, size_t m3 ) const;
+		// Pointer to the first element of the panel in the pre-packed first matrix
+		const uint16_t* getPrePackedPanel( size_t i ) const;
 		// Pointer to the first element of the second source matrix in the specified layer
 		const float* getLayerB( size_t m2, size_t m3 ) const;
 
@@ -89,7 +101,16 @@ namespace CpuCompute
 		static const bool haveAvx2;
 	public:
 		MulMatBase( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, uint8_t panelHeightRegs, uint8_t tileWidthFloats );
-		HRESULT run( ParallelForRunner& pfor );
+		// When maxThreads is not zero, the work is split into no more than that count of batches, to run on fewer threads of the pool
+		HRESULT run( ParallelForRunner& pfor, uint32_t maxThreads = 0 );
+
+		void setEpilogue( const sMulMatEpilogue* e )
+		{
+			epilogue = e;
+		}
+
+		// True when both CPU and OS support AVX-512F, the mulMat() function then uses MulMatImplAvx512 kernels
+		static const bool haveAvx512;
 	};
 
 	// This class actually contains the kernels implementations
@@ -103,4 +124,33 @@ namespace CpuCompute
 			MulMatBase( result, a, b, pfor, panelHeightRegs, tileWidthFloats )
 		{ }
 	};
+
+	// Same as above, using AVX-512 kernels.
+	// The panelHeightRegs template argument is in AVX vectors like in the base class, must be even because the kernels use 16-float vectors.
+	// The implementation is in a separate source file, compiled with AVX-512 code generation
+	template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+	class MulMatImplAvx512 : public MulMatBase
+	{
+		static_assert( 0 == panelHeightRegs % 2 );
+		HRESULT __stdcall compute( size_t i, size_t end ) const noexcept override final;
+
+	public:
+		MulMatImplAvx512( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor ) :
+			MulMatBase( result, a, b, pfor, panelHeightRegs, tileWidthFloats )
+		{ }
+	};
+
+	// Kernels for eDataType::Q4 first matrix, pre-packed with prePackQ4Panels() function.
+	// The panels are always 32 rows = 4 AVX vectors, the kernels dequantize the weights in registers, right before the FMA instructions.
+	// The implementation is in a separate source file, compiled with AVX2 code generation
+	template<uint8_t tileWidthFloats>
+	class MulMatImplQ4 : public MulMatBase
+	{
+		HRESULT __stdcall compute( size_t i, size_t end ) const noexcept override final;
+
+	public:
+		MulMatImplQ4( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor ) :
+			MulMatBase( result, a, b, pfor, 4, tileWidthFloats )
+		{ }
+	};
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include <intrin.h>
 #include "mulMatImpl.h"
+#include "mulMat.h"
 #include "mulMatUtils.hpp"
 using namespace CpuCompute;
 
@@ -239,16 +240,17 @@ HRESULT MulMatBase::copyPanelColumnMajor32( uint16_t* rdi, size_t i, size_t m2,
 
 HRESULT MulMatBase::gatherPanel( uint16_t* rdi, size_t i, size_t m2, size_t m3 ) const
 {
-	// BTW, I never saw this method called.
+	// Scalar fallback for CPUs without AVX2, and for views with huge row strides
 	const size_t heightFloats = (size_t)panelHeightRegisters * 8;
 	const size_t length = this->length;
+	i *= heightFloats;
 
 	zeroAlignedMemory( rdi, length * heightFloats * sizeof( uint16_t ) );
 
 	const size_t height = std::min( heightFloats, resultSize[ 0 ] - i );
 	const size_t strideElement = stridesA[ 0 ];
 	const size_t strideRow = stridesA[ 1 ];
-	const uint16_t* rsi = getPanelA( i * heightFloats, m2, m3 );
+	const uint16_t* rsi = getPanelA( i, m2, m3 );
 
 	if( strideElement < strideRow )
 	{
@@ -271,4 +273,110 @@ HRESULT MulMatBase::gatherPanel( uint16_t* rdi, size_t i, size_t m2, size_t m3 )
 		}
 	}
 	return S_OK;
+}
+
+size_t CpuCompute::prePackedBytes( const TensorShape& shape )
+{
+	size_t panels = ( (size_t)shape.ne[ 1 ] + prePackedPanelHeight - 1 ) / prePackedPanelHeight;
+	return panels * prePackedPanelHeight * shape.ne[ 0 ] * sizeof( uint16_t );
+}
+
+HRESULT CpuCompute::prePackPanels( uint16_t* rdi, const Tensor& a )
+{
+	if( a.type() != eDataType::FP16 || a.layout() != eTensorLayout::Dense )
+		return E_INVALIDARG;
+	if( a.nb[ 0 ] != 1 || a.ne[ 2 ] != 1 || a.ne[ 3 ] != 1 )
+		return E_NOTIMPL;
+	if( 0 != ( (size_t)rdi ) % 32 )
+		return E_INVALIDARG;
+
+	// Same as MulMatBase::transposePanel, for all panels of the matrix, with the tallest panels used by the kernels
+	constexpr size_t heightFloats = prePackedPanelHeight;
+	const size_t length = a.ne[ 0 ];
+	const size_t height = a.ne[ 1 ];
+	const size_t stride = a.nb[ 1 ];
+	const uint16_t* rsi = a.fp16();
+
+	for( size_t i = 0; i < height; i += heightFloats, rdi += heightFloats * length, rsi += heightFloats * stride )
+	{
+		const size_t rows = std::min( heightFloats, height - i );
+		if( rows < heightFloats )
+		{
+			// A partial panel, at the bottom of the matrix
+			zeroAlignedMemory( rdi, heightFloats * length * sizeof( uint16_t ) );
+		}
+
+		uint16_t* rdiPanel = rdi;
+		const uint16_t* rsiPanel = rsi;
+		const size_t completeBlocks = rows / 8;
+		for( size_t j = 0; j < completeBlocks; j++, rdiPanel += 8, rsiPanel += 8 * stride )
+			transpose8( rdiPanel, length, rsiPanel, stride, heightFloats );
+
+		const size_t lastBlock = rows % 8;
+		if( 0 != lastBlock )
+			transpose8Partial( rdiPanel, length, lastBlock, rsiPanel, stride, heightFloats );
+	}
+	return S_OK;
+}
+
+size_t CpuCompute::q4PanelsBytes( const TensorShape& shape )
+{
+	size_t panels = ( (size_t)shape.ne[ 1 ] + prePackedPanelHeight - 1 ) / prePackedPanelHeight;
+	return panels * ( shape.ne[ 0 ] / q4BlockSize ) * q4PanelBlockBytes;
+}
+
+HRESULT CpuCompute::prePackQ4Panels( void* rdi, const Tensor& a )
+{
+	if( a.type() != eDataType::Q4 || a.layout() != eTensorLayout::Dense )
+		return E_INVALIDARG;
+	if( a.ne[ 2 ] != 1 || a.ne[ 3 ] != 1 )
+		return E_NOTIMPL;
+	if( 0 != a.ne[ 0 ] % q4BlockSize || 0 != ( (size_t)rdi ) % 32 )
+		return E_INVALIDARG;
+
+	// The model file has rows of blocks, the kernels want columns of 32 rows within each block.
+	// This only runs once when loading the model, not performance critical, the simple scalar code is good enough.
+	const size_t blocksPerRow = a.ne[ 0 ] / q4BlockSize;
+	const size_t height = a.ne[ 1 ];
+	const BlockQ4* rsi = (const BlockQ4*)a.data();
+	uint8_t* rdiPanel = (uint8_t*)rdi;
+
+	for( size_t i = 0; i < height; i += prePackedPanelHeight )
+	{
+		const size_t rows = std::min( (size_t)prePackedPanelHeight, height - i );
+		if( rows < prePackedPanelHeight )
+		{
+			// A partial panel, at the bottom of the matrix. Zero scales make the missing rows zeros
+			zeroAlignedMemory( rdiPanel, blocksPerRow * q4PanelBlockBytes );
+		}
+
+		for( size_t b = 0; b < blocksPerRow; b++, rdiPanel += q4PanelBlockBytes )
+		{
+			uint16_t* const scales = (uint16_t*)rdiPanel;
+			uint8_t* const columns = rdiPanel + prePackedPanelHeight * sizeof( uint16_t );
+			for( size_t r = 0; r < rows; r++ )
+			{
+				const BlockQ4& block = rsi[ ( i + r ) * blocksPerRow + b ];
+				scales[ r ] = block.scale;
+				uint8_t* const rdiRow = columns + ( r % 16 );
+				for( size_t k = 0; k < 16; k++ )
+				{
+					// Element k of the block is in the low 4 bits of values[ k ], element k + 16 in the high 4 bits
+					const uint8_t e0 = block.values[ k ] & 0x0F;
+					const uint8_t e1 = block.values[ k ] >> 4;
+					if( r < 16 )
+					{
+						rdiRow[ k * 16 ] = e0;
+						rdiRow[ ( k + 16 ) * 16 ] = e1;
+					}
+					else
+					{
+						rdiRow[ k * 16 ] |= ( e0 << 4 );
+						rdiRow[ ( k + 16 ) * 16 ] |= ( e1 << 4 );
+					}
+				}
+			}
+		}
+	}
+	return S_OK;
 }
\ No newline at end of file
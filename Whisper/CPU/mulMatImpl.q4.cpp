@@ -0,0 +1,104 @@
+#include "stdafx.h"
+#include "mulMatImpl.h"
+#include "mulMat.h"
+#include "mulMat.kernel.hpp"
+using namespace CpuCompute;
+
+// This source file is compiled with AVX2 code generation, the hybrid model only loads Q4 weights when the CPU supports AVX2.
+namespace
+{
+	// Upcast 32 FP16 scales from the start of the pre-packed block
+	__forceinline void loadScales( const uint8_t* rsi, std::array<__m256, 4>& dest )
+	{
+		loadPanel( (const uint16_t*)rsi, dest );
+	}
+
+	// Upcast a column of the panel, 32 numbers packed into 16 bytes, into 4 vectors of FP32 in [ -8 .. +7 ] interval
+	__forceinline void loadColumn( const uint8_t* rsi, std::array<__m256, 4>& dest )
+	{
+		const __m128i bytes = _mm_load_si128( ( const __m128i* )rsi );
+		const __m128i lowMask = _mm_set1_epi8( 0x0F );
+		const __m128i offset = _mm_set1_epi8( 8 );
+
+		// Unpack 4-bit unsigned numbers into bytes, and subtract 8 to make them signed
+		const __m128i r0 = _mm_sub_epi8( _mm_and_si128( bytes, lowMask ), offset );
+		const __m128i r1 = _mm_sub_epi8( _mm_and_si128( _mm_srli_epi16( bytes, 4 ), lowMask ), offset );
+
+		dest[ 0 ] = _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( r0 ) );
+		dest[ 1 ] = _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( _mm_unpackhi_epi64( r0, r0 ) ) );
+		dest[ 2 ] = _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( r1 ) );
+		dest[ 3 ] = _mm256_cvtepi32_ps( _mm256_cvtepi8_epi32( _mm_unpackhi_epi64( r1, r1 ) ) );
+	}
+
+	// Compute the complete tile of the output matrix, by iterating over all blocks of the panel
+	// The scales are the same for all 32 columns of the block, the inner loop accumulates unscaled products, the scales are applied once per block.
+	template<uint8_t tileWidthFloats, bool partial>
+	__forceinline void computeTile( ResultTile<4, tileWidthFloats>& tile, const uint8_t* panel, size_t blocks,
+		const float* rsiB, size_t strideB0, size_t strideB1, size_t remainder )
+	{
+		setZero( tile.arr );
+		ResultTile<4, tileWidthFloats> blockTile;
+		std::array<__m256, 4> scales, vecPanel;
+		for( size_t b = 0; b < blocks; b++ )
+		{
+			loadScales( panel, scales );
+			panel += prePackedPanelHeight * sizeof( uint16_t );
+			setZero( blockTile.arr );
+			for( size_t k = 0; k < q4BlockSize; k++, panel += 16, rsiB += strideB0 )
+			{
+				loadColumn( panel, vecPanel );
+				if constexpr( partial )
+					blockTile.kernelPartial( vecPanel, rsiB, strideB1, remainder );
+				else
+					blockTile.kernel( vecPanel, rsiB, strideB1 );
+			}
+			for( size_t i = 0; i < tile.arr.size(); i++ )
+				tile.arr[ i ] = _mm256_fmadd_ps( blockTile.arr[ i ], scales[ i % 4 ], tile.arr[ i ] );
+		}
+	}
+}
+
+template<uint8_t tileWidthFloats>
+HRESULT __stdcall MulMatImplQ4<tileWidthFloats>::compute( size_t i, size_t end ) const noexcept
+{
+	constexpr size_t panelHeightFloats = prePackedPanelHeight;
+	const size_t resultStride = resultStrides[ 0 ];
+	const size_t blocks = length / q4BlockSize;
+	const size_t panelBytes = blocks * q4PanelBlockBytes;
+	const std::array<size_t, 2> stridesB{ this->stridesB[ 0 ], this->stridesB[ 1 ] };
+
+	for( ; i < end; i++ )
+	{
+		const size_t iPanel = i % countPanels;
+		size_t j = i / countPanels;
+		const size_t m2 = j % (size_t)resultSize[ 2 ];
+		const size_t m3 = j / (size_t)resultSize[ 2 ];
+
+		// The first matrix is 2D, all layers of the second one are multiplied by the same panel
+		const uint8_t* panel = (const uint8_t*)pa + iPanel * panelBytes;
+		const float* pb = getLayerB( m2, m3 );
+		float* const rdiPanel = getPanelDest( iPanel, m2, m3 );
+		float* rdi = rdiPanel;
+		const size_t storeWidth = std::min( panelHeightFloats, (size_t)resultSize[ 0 ] - iPanel * panelHeightFloats );
+
+		ResultTile<4, tileWidthFloats> tile;
+		for( j = 0; j < completeTilesPerPanel; j++, pb += tileWidthFloats * stridesB[ 1 ], rdi += resultStride * tileWidthFloats )
+		{
+			computeTile<tileWidthFloats, false>( tile, panel, blocks, pb, stridesB[ 0 ], stridesB[ 1 ], 0 );
+			tile.store( rdi, storeWidth, tileWidthFloats, resultStride );
+		}
+
+		if( 0 != lastColumnsInPanel )
+		{
+			computeTile<tileWidthFloats, true>( tile, panel, blocks, pb, stridesB[ 0 ], stridesB[ 1 ], lastColumnsInPanel );
+			tile.store( rdi, storeWidth, lastColumnsInPanel, resultStride );
+		}
+
+		if( nullptr != epilogue )
+			epilogue->apply( rdiPanel, iPanel * panelHeightFloats, storeWidth, resultSize[ 1 ], resultStride );
+	}
+	return S_OK;
+}
+
+template class MulMatImplQ4<1>;
+template class MulMatImplQ4<2>;
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "stdafx.h"
+#include <immintrin.h>
+#include "mulMatInt8.h"
+using namespace CpuCompute;
+
+// This source file is compiled with AVX2 code generation, the code is only called when the weights were quantized, which requires AVX2.
+namespace
+{
+	// Accumulators for [ 32, tileWidth ] block of the output matrix, 4 vectors of int32 lanes per column.
+	// Each tile column needs 4 accumulators, tileWidth = 2 uses 8 of the 16 available registers, the rest are for the panel and temporaries.
+	template<uint8_t tileWidth>
+	struct TileInt8
+	{
+		std::array<__m256i, (size_t)4 * tileWidth> arr;
+
+		__forceinline void compute( const uint8_t* panel, size_t groups, const int8_t* rsiB, size_t strideB )
+		{
+			for( size_t i = 0; i < arr.size(); i++ )
+				arr[ i ] = _mm256_setzero_si256();
+			const __m256i ones = _mm256_set1_epi16( 1 );
+
+			for( size_t g = 0; g < groups; g++, panel += 128, rsiB += 4 )
+			{
+				// Broadcast 4 bytes from each row of the second matrix
+				std::array<__m256i, tileWidth> b;
+				for( size_t c = 0; c < tileWidth; c++ )
+					b[ c ] = _mm256_set1_epi32( *(const int*)( rsiB + c * strideB ) );
+
+				for( size_t r = 0; r < 4; r++ )
+				{
+					const __m256i a = _mm256_load_si256( ( const __m256i* )( panel + r * 32 ) );
+					const __m256i absA = _mm256_abs_epi8( a );
+					for( size_t c = 0; c < tileWidth; c++ )
+					{
+						// vpmaddubsw multiplies unsigned bytes by signed ones; moving signs from A to B keeps the products unchanged.
+						// The sums of 2 products fit in int16 without saturation, because both sides were quantized into [ -127, +127 ] interval.
+						const __m256i prod = _mm256_maddubs_epi16( absA, _mm256_sign_epi8( b[ c ], a ) );
+						arr[ c * 4 + r ] = _mm256_add_epi32( arr[ c * 4 + r ], _mm256_madd_epi16( prod, ones ) );
+					}
+				}
+			}
+		}
+
+		// Convert the tile to FP32, apply scales of both matrices, and store [ height, tileWidth ] block into the output matrix
+		__forceinline void store( float* rdi, size_t resultStride, const float* scalesA, const float* scalesB, size_t height ) const
+		{
+			for( size_t c = 0; c < tileWidth; c++, rdi += resultStride )
+			{
+				const __m256 sb = _mm256_broadcast_ss( scalesB + c );
+				if( height == 32 )
+				{
+					for( size_t r = 0; r < 4; r++ )
+					{
+						const __m256 scale = _mm256_mul_ps( _mm256_load_ps( scalesA + r * 8 ), sb );
+						_mm256_storeu_ps( rdi + r * 8, _mm256_mul_ps( _mm256_cvtepi32_ps( arr[ c * 4 + r ] ), scale ) );
+					}
+				}
+				else
+				{
+					// The last panel of the matrix
+					alignas( 32 ) std::array<float, 32> temp;
+					for( size_t r = 0; r < 4; r++ )
+					{
+						const __m256 scale = _mm256_mul_ps( _mm256_load_ps( scalesA + r * 8 ), sb );
+						_mm256_store_ps( &temp[ r * 8 ], _mm256_mul_ps( _mm256_cvtepi32_ps( arr[ c * 4 + r ] ), scale ) );
+					}
+					memcpy( rdi, temp.data(), height * 4 );
+				}
+			}
+		}
+	};
+}
+
+HRESULT __stdcall MulMatInt8Avx2::compute( size_t i, size_t end ) const noexcept
+{
+	const size_t groups = this->groups;
+	const size_t strideB = groups * 4;
+	const size_t width = this->width;
+
+	for( ; i < end; i++ )
+	{
+		const uint8_t* const panel = getPanel( i );
+		const float* const scalesA = (const float*)( panel + groups * 128 );
+		const size_t height = panelHeight( i );
+		float* const rdiPanel = getPanelDest( i );
+		float* rdi = rdiPanel;
+		const int8_t* rsiB = pb;
+		const float* sb = scalesB;
+
+		size_t j = 0;
+		TileInt8<2> tile;
+		for( ; j + 2 <= width; j += 2, rdi += resultStride * 2, rsiB += strideB * 2, sb += 2 )
+		{
+			tile.compute( panel, groups, rsiB, strideB );
+			tile.store( rdi, resultStride, scalesA, sb, height );
+		}
+		if( j < width )
+		{
+			TileInt8<1> last;
+			last.compute( panel, groups, rsiB, strideB );
+			last.store( rdi, resultStride, scalesA, sb, height );
+		}
+
+		if( nullptr != epilogue )
+			epilogue->apply( rdiPanel, i * 32, height, width, resultStride );
+	}
+	return S_OK;
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+#include "stdafx.h"
+#include <immintrin.h>
+#include "mulMatInt8.h"
+using namespace CpuCompute;
+
+// This source file is compiled with AVX-512 code generation, the code is only called when MulMatInt8Base::haveVnni is true.
+namespace
+{
+	// Accumulators for [ 32, tileWidth ] block of the output matrix, 2 vectors of int32 lanes per column.
+	template<uint8_t tileWidth>
+	struct TileVnni
+	{
+		std::array<__m512i, (size_t)2 * tileWidth> arr;
+
+		__forceinline void compute( const uint8_t* panel, size_t groups, const int8_t* rsiB, size_t strideB )
+		{
+			for( size_t i = 0; i < arr.size(); i++ )
+				arr[ i ] = _mm512_setzero_si512();
+			// vpdpbusd multiplies unsigned bytes by signed ones.
+			// Flipping the high bit converts signed bytes of B into unsigned, adding 128; the store() method then subtracts 128 * sum( A )
+			const __m512i flipSigns = _mm512_set1_epi32( (int)0x80808080u );
+
+			for( size_t g = 0; g < groups; g++, panel += 128, rsiB += 4 )
+			{
+				const __m512i a0 = _mm512_loadu_si512( panel );
+				const __m512i a1 = _mm512_loadu_si512( panel + 64 );
+				for( size_t c = 0; c < tileWidth; c++ )
+				{
+					__m512i b = _mm512_set1_epi32( *(const int*)( rsiB + c * strideB ) );
+					b = _mm512_xor_si512( b, flipSigns );
+					arr[ c * 2 ] = _mm512_dpbusd_epi32( arr[ c * 2 ], b, a0 );
+					arr[ c * 2 + 1 ] = _mm512_dpbusd_epi32( arr[ c * 2 + 1 ], b, a1 );
+				}
+			}
+		}
+
+		__forceinline void store( float* rdi, size_t resultStride, const float* scalesA, const float* scalesB, size_t height ) const
+		{
+			const int* sumsA = (const int*)( scalesA + 32 );
+			const __m512i corr0 = _mm512_slli_epi32( _mm512_loadu_si512( sumsA ), 7 );
+			const __m512i corr1 = _mm512_slli_epi32( _mm512_loadu_si512( sumsA + 16 ), 7 );
+			const __m512 sa0 = _mm512_loadu_ps( scalesA );
+			const __m512 sa1 = _mm512_loadu_ps( scalesA + 16 );
+
+			// The last panel of the matrix is incomplete, use masked stores for that one
+			const __mmask16 mask0 = (__mmask16)( ( 1u << std::min( height, (size_t)16 ) ) - 1 );
+			const __mmask16 mask1 = (__mmask16)( ( 1u << ( std::max( height, (size_t)16 ) - 16 ) ) - 1 );
+
+			for( size_t c = 0; c < tileWidth; c++, rdi += resultStride )
+			{
+				const __m512 sb = _mm512_set1_ps( scalesB[ c ] );
+				__m512 v0 = _mm512_cvtepi32_ps( _mm512_sub_epi32( arr[ c * 2 ], corr0 ) );
+				__m512 v1 = _mm512_cvtepi32_ps( _mm512_sub_epi32( arr[ c * 2 + 1 ], corr1 ) );
+				v0 = _mm512_mul_ps( v0, _mm512_mul_ps( sa0, sb ) );
+				v1 = _mm512_mul_ps( v1, _mm512_mul_ps( sa1, sb ) );
+				if( height == 32 )
+				{
+					_mm512_storeu_ps( rdi, v0 );
+					_mm512_storeu_ps( rdi + 16, v1 );
+				}
+				else
+				{
+					_mm512_mask_storeu_ps( rdi, mask0, v0 );
+					_mm512_mask_storeu_ps( rdi + 16, mask1, v1 );
+				}
+			}
+		}
+	};
+
+	template<uint8_t tileWidth>
+	__forceinline void computeTile( float* rdi, size_t resultStride, const uint8_t* panel, size_t groups, const float* scalesA,
+		const int8_t* rsiB, size_t strideB, const float* scalesB, size_t height )
+	{
+		TileVnni<tileWidth> tile;
+		tile.compute( panel, groups, rsiB, strideB );
+		tile.store( rdi, resultStride, scalesA, scalesB, height );
+	}
+}
+
+HRESULT __stdcall MulMatInt8Vnni::compute( size_t i, size_t end ) const noexcept
+{
+	const size_t groups = this->groups;
+	const size_t strideB = groups * 4;
+	const size_t width = this->width;
+
+	for( ; i < end; i++ )
+	{
+		const uint8_t* const panel = getPanel( i );
+		const float* const scalesA = (const float*)( panel + groups * 128 );
+		const size_t height = panelHeight( i );
+		float* const rdiPanel = getPanelDest( i );
+		float* rdi = rdiPanel;
+		const int8_t* rsiB = pb;
+		const float* sb = scalesB;
+
+		// There're 32 vector registers, the widest tile uses 16 of them for accumulators.
+		// The remainder columns are handled with narrower tiles.
+		size_t j = 0;
+		for( ; j + 8 <= width; j += 8, rdi += resultStride * 8, rsiB += strideB * 8, sb += 8 )
+			computeTile<8>( rdi, resultStride, panel, groups, scalesA, rsiB, strideB, sb, height );
+		if( j + 4 <= width )
+		{
+			computeTile<4>( rdi, resultStride, panel, groups, scalesA, rsiB, strideB, sb, height );
+			j += 4;
+			rdi += resultStride * 4;
+			rsiB += strideB * 4;
+			sb += 4;
+		}
+		if( j + 2 <= width )
+		{
+			computeTile<2>( rdi, resultStride, panel, groups, scalesA, rsiB, strideB, sb, height );
+			j += 2;
+			rdi += resultStride * 2;
+			rsiB += strideB * 2;
+			sb += 2;
+		}
+		if( j < width )
+			computeTile<1>( rdi, resultStride, panel, groups, scalesA, rsiB, strideB, sb, height );
+
+		if( nullptr != epilogue )
+			epilogue->apply( rdiPanel, i * 32, height, width, resultStride );
+	}
+	return S_OK;
+}
\ No newline at end of file
@@ -0,0 +1,237 @@
+#include "stdafx.h"
+#include <intrin.h>
+#include "mulMatInt8.h"
+#include "mulMat.h"
+#include "simdUtils.h"
+using namespace CpuCompute;
+
+namespace
+{
+	bool checkVnniSupport()
+	{
+		int cpuInfo[ 4 ];
+		__cpuid( cpuInfo, 1 );
+		// OSXSAVE bit, without it we can't call xgetbv
+		if( 0 == ( cpuInfo[ 2 ] & ( 1 << 27 ) ) )
+			return false;
+
+		__cpuidex( cpuInfo, 7, 0 );
+		// AVX512F bit
+		if( 0 == ( cpuInfo[ 1 ] & ( 1 << 16 ) ) )
+			return false;
+		// AVX512_VNNI bit
+		if( 0 == ( cpuInfo[ 2 ] & ( 1 << 11 ) ) )
+			return false;
+
+		// Same as in checkAvx512Support() function in mulMatImpl.cpp
+		constexpr uint64_t osMask = 0b11100110;
+		return ( _xgetbv( 0 ) & osMask ) == osMask;
+	}
+
+	// Count of 4-byte groups in the quantized rows of the specified length
+	inline size_t countGroups( size_t length )
+	{
+		return ( length + 3 ) / 4;
+	}
+
+	// Size of a single INT8 panel in bytes: the quantized elements, then 32 scales, then 32 sums
+	inline size_t panelBytes( size_t length )
+	{
+		return countGroups( length ) * 128 + 32 * 4 * 2;
+	}
+
+	__forceinline float horizontalMax( __m256 vec )
+	{
+		__m128 v = _mm256_extractf128_ps( vec, 1 );
+		v = _mm_max_ps( v, _mm256_castps256_ps128( vec ) );
+		v = _mm_max_ps( v, _mm_movehl_ps( v, v ) );
+		v = _mm_max_ss( v, _mm_movehdup_ps( v ) );
+		return _mm_cvtss_f32( v );
+	}
+
+	__forceinline int horizontalSum( __m128i vec )
+	{
+		vec = _mm_hadd_epi32( vec, vec );
+		vec = _mm_hadd_epi32( vec, vec );
+		return _mm_cvtsi128_si32( vec );
+	}
+
+	// Quantize a row of FP32 numbers into signed bytes in [ -127, +127 ] interval, using symmetric scaling.
+	// Stores groups of 4 bytes with the specified stride; the last incomplete group is padded with zeros.
+	// Returns the scaling factor, and sum of the quantized values.
+	float quantizeRow( uint8_t* rdi, size_t groupStride, const float* rsi, size_t length, int& sum )
+	{
+		const size_t lengthAligned = length & ~(size_t)7;
+		const size_t rem = length % 8;
+		alignas( 32 ) std::array<float, 8> tail;
+		if( 0 != rem )
+		{
+			_mm256_store_ps( tail.data(), _mm256_setzero_ps() );
+			memcpy( tail.data(), rsi + lengthAligned, rem * 4 );
+		}
+
+		// First pass: maximum absolute value
+		const __m256 absMask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7FFFFFFF ) );
+		__m256 ax = _mm256_setzero_ps();
+		for( size_t i = 0; i < lengthAligned; i += 8 )
+			ax = _mm256_max_ps( ax, _mm256_and_ps( _mm256_loadu_ps( rsi + i ), absMask ) );
+		if( 0 != rem )
+			ax = _mm256_max_ps( ax, _mm256_and_ps( _mm256_load_ps( tail.data() ), absMask ) );
+		const float maxAbs = horizontalMax( ax );
+
+		// Second pass: scale, round to nearest, and pack into bytes
+		const __m256 mul = _mm256_set1_ps( ( maxAbs > 0 ) ? 127.0f / maxAbs : 0.0f );
+		const size_t groups = countGroups( length );
+		__m128i sumVec = _mm_setzero_si128();
+		auto quantize = [ & ]( __m256 v, size_t g )
+		{
+			const __m256i iv = _mm256_cvtps_epi32( _mm256_mul_ps( v, mul ) );
+			const __m128i low = _mm256_castsi256_si128( iv );
+			const __m128i high = _mm256_extractf128_si256( iv, 1 );
+			sumVec = _mm_add_epi32( sumVec, _mm_add_epi32( low, high ) );
+			__m128i bytes = _mm_packs_epi32( low, high );
+			bytes = _mm_packs_epi16( bytes, bytes );
+			*(int*)( rdi + g * groupStride ) = _mm_cvtsi128_si32( bytes );
+			if( g + 1 < groups )
+				*(int*)( rdi + ( g + 1 ) * groupStride ) = _mm_extract_epi32( bytes, 1 );
+		};
+
+		for( size_t i = 0; i < lengthAligned; i += 8 )
+			quantize( _mm256_loadu_ps( rsi + i ), i / 4 );
+		if( 0 != rem )
+			quantize( _mm256_load_ps( tail.data() ), lengthAligned / 4 );
+
+		sum = horizontalSum( sumVec );
+		return maxAbs * ( 1.0f / 127.0f );
+	}
+
+	// Temporary buffers for the quantized second matrix.
+	// They are owned by the thread which calls mulMat(), the pool threads only read them.
+	struct QuantizedRows
+	{
+		std::vector<int8_t> values;
+		std::vector<float> scales;
+	};
+	thread_local QuantizedRows ts_quantizedRows;
+}
+
+const bool MulMatInt8Base::haveVnni = checkVnniSupport();
+
+bool CpuCompute::canQuantizeWeights()
+{
+	int cpuInfo[ 4 ];
+	__cpuid( cpuInfo, 7 );
+	// AVX2 bit
+	return ( cpuInfo[ 1 ] & ( 1 << 5 ) ) != 0;
+}
+
+size_t CpuCompute::quantizedPanelsBytes( const TensorShape& shape )
+{
+	const size_t panels = ( (size_t)shape.ne[ 1 ] + 31 ) / 32;
+	return panels * panelBytes( shape.ne[ 0 ] );
+}
+
+HRESULT CpuCompute::quantizePanels( void* rdi, const Tensor& a )
+{
+	if( a.type() != eDataType::FP16 || a.layout() != eTensorLayout::Dense )
+		return E_INVALIDARG;
+	if( a.nb[ 0 ] != 1 || a.ne[ 2 ] != 1 || a.ne[ 3 ] != 1 )
+		return E_NOTIMPL;
+	if( 0 != ( (size_t)rdi ) % 32 )
+		return E_INVALIDARG;
+
+	const size_t length = a.ne[ 0 ];
+	const size_t height = a.ne[ 1 ];
+	const size_t stride = a.nb[ 1 ];
+	const size_t groups = countGroups( length );
+	const size_t cbPanel = panelBytes( length );
+	const uint16_t* rsi = a.fp16();
+
+	std::vector<float> temp;
+	try
+	{
+		temp.resize( length );
+	}
+	catch( const std::bad_alloc& )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	uint8_t* panel = (uint8_t*)rdi;
+	for( size_t i = 0; i < height; i += 32, panel += cbPanel, rsi += 32 * stride )
+	{
+		const size_t rows = std::min( (size_t)32, height - i );
+		if( rows < 32 )
+		{
+			// A partial panel, at the bottom of the matrix
+			memset( panel, 0, cbPanel );
+		}
+
+		float* const scales = (float*)( panel + groups * 128 );
+		int* const sums = (int*)( scales + 32 );
+		for( size_t r = 0; r < rows; r++ )
+		{
+			floatsUpcast( temp.data(), rsi + r * stride, length );
+			scales[ r ] = quantizeRow( panel + r * 4, 128, temp.data(), length, sums[ r ] );
+		}
+	}
+	return S_OK;
+}
+
+MulMatInt8Base::MulMatInt8Base( Tensor& result, const Tensor& a, const Tensor& b ) :
+	resultPointer( result.fp32() ),
+	pa( (const uint8_t*)a.data() )
+{
+	if( a.type() != eDataType::I8 || a.layout() != eTensorLayout::Panels )
+		throw E_INVALIDARG;
+	// INT8 weights are only implemented for 2D matrices, that's what the hybrid decoder needs
+	if( a.ne[ 2 ] != 1 || a.ne[ 3 ] != 1 || b.ne[ 2 ] != 1 || b.ne[ 3 ] != 1 )
+		throw E_NOTIMPL;
+	if( b.nb[ 0 ] != 1 || result.nb[ 0 ] != 1 )
+		throw E_NOTIMPL;
+	if( a.ne[ 0 ] != b.ne[ 0 ] || result.ne[ 0 ] != a.ne[ 1 ] || result.ne[ 1 ] != b.ne[ 1 ] )
+		throw E_INVALIDARG;
+
+	const size_t length = a.ne[ 0 ];
+	height = a.ne[ 1 ];
+	width = b.ne[ 1 ];
+	resultStride = result.nb[ 1 ];
+	groups = (uint32_t)countGroups( length );
+	countPanels = ( height + 31 ) / 32;
+	panelBytes = ::panelBytes( length );
+
+	// Quantize the second matrix.
+	// That matrix is tiny compared to the weights, doing that on the calling thread before dispatching the job.
+	QuantizedRows& qr = ts_quantizedRows;
+	const size_t rowBytes = (size_t)groups * 4;
+	qr.values.resize( rowBytes * width );
+	qr.scales.resize( width );
+	int sum;
+	const float* rsi = b.fp32();
+	for( size_t i = 0; i < width; i++ )
+		qr.scales[ i ] = quantizeRow( (uint8_t*)&qr.values[ i * rowBytes ], 4, rsi + i * b.nb[ 1 ], length, sum );
+
+	pb = qr.values.data();
+	scalesB = qr.scales.data();
+}
+
+HRESULT MulMatInt8Base::run( ParallelForRunner& pfor )
+{
+	return pfor.parallelFor( *this, countPanels );
+}
+
+HRESULT CpuCompute::mulMatInt8( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
+{
+	if( MulMatInt8Base::haveVnni )
+	{
+		MulMatInt8Vnni impl{ result, a, b };
+		impl.setEpilogue( epilogue );
+		return impl.run( pfor );
+	}
+	else
+	{
+		MulMatInt8Avx2 impl{ result, a, b };
+		impl.setEpilogue( epilogue );
+		return impl.run( pfor );
+	}
+}
\ No newline at end of file
@@ -0,0 +1,103 @@
+#pragma once
+// Matrix multiplication for INT8-quantized weights.
+// Decoding a single token is bound by memory bandwidth, reading these weights. Compared to FP16, INT8 weights halve the bytes loaded per token.
+//
+// The layout of eDataType::I8 matrices is similar to FP16 pre-packed panels, with a few differences.
+// Each panel contains prePackedPanelHeight = 32 rows of the matrix, and has the following structure:
+// 1. ceil( length / 4 ) groups of 128 bytes. Each group contains 4 consecutive elements of all 32 rows, row-major, i.e. [ 4, 32 ] block of bytes.
+//   These groups of 4 bytes are exactly what VNNI and maddubs instructions need. The elements past the end of the rows are zeros.
+// 2. 32 FP32 scaling factors, one per row. The source elements were quantized with round( x / scale ), and clamped into [ -127, +127 ] interval.
+// 3. 32 int32 numbers, sums of the quantized elements in each row. The VNNI kernel needs them to correct the result for unsigned bytes.
+// Rows past the end of the matrix are zeros, including these scales and sums.
+#include "ParallelForRunner.h"
+#include "Tensor.h"
+#include "mulMatEpilogue.h"
+
+namespace CpuCompute
+{
+	// Multiply INT8 weights by the FP32 matrix.
+	// The second matrix is quantized on the fly, with one scale per row of that matrix
+	HRESULT mulMatInt8( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue = nullptr );
+
+	// Abstract base class for INT8 implementations
+	class MulMatInt8Base : public iComputeRange
+	{
+	protected:
+		// Pointer to the payload of the output matrix, and the distance between rows of that matrix, in floats
+		float* const resultPointer;
+		size_t resultStride;
+
+		// Height of the output matrix, equal to height of the weights matrix
+		uint32_t height;
+		// Width of the output matrix, equal to height of the second matrix
+		uint32_t width;
+
+		// Count of 4-byte groups in the rows of both quantized matrices
+		uint32_t groups;
+		// Count of panels in the first matrix
+		uint32_t countPanels;
+
+		// Pointer to the first panel of the weights matrix, and size of the panels in bytes
+		const uint8_t* const pa;
+		size_t panelBytes;
+
+		// The second matrix quantized into signed bytes, rows are `groups * 4` bytes long, zero-padded
+		const int8_t* pb;
+		// Scaling factors for the rows of the second matrix
+		const float* scalesB;
+
+		// Optional elementwise operation applied to the panels of the output matrix, nullptr when none
+		const sMulMatEpilogue* epilogue = nullptr;
+
+		const uint8_t* getPanel( size_t i ) const
+		{
+			return pa + i * panelBytes;
+		}
+
+		float* getPanelDest( size_t i ) const
+		{
+			return resultPointer + i * 32;
+		}
+
+		// Count of the valid rows in the panel, can be less than 32 for the last panel of the matrix
+		size_t panelHeight( size_t i ) const
+		{
+			return std::min( (size_t)32, (size_t)height - i * 32 );
+		}
+
+	public:
+		MulMatInt8Base( Tensor& result, const Tensor& a, const Tensor& b );
+		HRESULT run( ParallelForRunner& pfor );
+
+		void setEpilogue( const sMulMatEpilogue* e )
+		{
+			epilogue = e;
+		}
+
+		// True when both CPU and OS support AVX512F and AVX512_VNNI instructions
+		static const bool haveVnni;
+	};
+
+	// AVX2 implementation, uses vpmaddubsw instruction
+	class MulMatInt8Avx2 : public MulMatInt8Base
+	{
+		HRESULT __stdcall compute( size_t i, size_t end ) const noexcept override final;
+
+	public:
+		MulMatInt8Avx2( Tensor& result, const Tensor& a, const Tensor& b ) :
+			MulMatInt8Base( result, a, b )
+		{ }
+	};
+
+	// AVX-512 implementation, uses vpdpbusd instruction
+	// Implemented in a separate source file, compiled with AVX-512 code generation
+	class MulMatInt8Vnni : public MulMatInt8Base
+	{
+		HRESULT __stdcall compute( size_t i, size_t end ) const noexcept override final;
+
+	public:
+		MulMatInt8Vnni( Tensor& result, const Tensor& a, const Tensor& b ) :
+			MulMatInt8Base( result, a, b )
+		{ }
+	};
+}
\ No newline at end of file
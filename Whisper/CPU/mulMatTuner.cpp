@@ -0,0 +1,456 @@
+#include "stdafx.h"
+#include "mulMatTuner.h"
+#include "mulMat.h"
+#include "mulMatImpl.h"
+#include "../Utils/CpuProfiler.h"
+#include <intrin.h>
+#include <atlfile.h>
+#include <atlstr.h>
+#include <Shlobj.h>
+#include <unordered_map>
+using namespace CpuCompute;
+
+namespace
+{
+	template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+	HRESULT runAvx( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue, uint32_t threads )
+	{
+		MulMatImpl<panelHeightRegs, tileWidthFloats> impl{ result, a, b, pfor };
+		impl.setEpilogue( epilogue );
+		return impl.run( pfor, threads );
+	}
+
+	template<uint8_t panelHeightRegs, uint8_t tileWidthFloats>
+	HRESULT runAvx512( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue, uint32_t threads )
+	{
+		MulMatImplAvx512<panelHeightRegs, tileWidthFloats> impl{ result, a, b, pfor };
+		impl.setEpilogue( epilogue );
+		return impl.run( pfor, threads );
+	}
+
+	using pfnKernel = HRESULT( * )( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue, uint32_t threads );
+
+	struct sKernel
+	{
+		// The cache file identifies kernels by these names, unlike indices in this table they're stable across versions of the DLL
+		const char* name;
+		pfnKernel pfn;
+		bool avx512;
+	};
+
+	// All instantiations of the FP16 kernels
+	static const std::array<sKernel, 20> s_kernels =
+	{
+		sKernel{ "avx-4x1", &runAvx<4, 1>, false },
+		sKernel{ "avx-1x1", &runAvx<1, 1>, false },
+		sKernel{ "avx-4x2", &runAvx<4, 2>, false },
+		sKernel{ "avx-1x2", &runAvx<1, 2>, false },
+		sKernel{ "avx-2x3", &runAvx<2, 3>, false },
+		sKernel{ "avx-1x3", &runAvx<1, 3>, false },
+		sKernel{ "avx-2x4", &runAvx<2, 4>, false },
+		sKernel{ "avx-1x4", &runAvx<1, 4>, false },
+
+		sKernel{ "avx512-4x1", &runAvx512<4, 1>, true },
+		sKernel{ "avx512-2x1", &runAvx512<2, 1>, true },
+		sKernel{ "avx512-4x2", &runAvx512<4, 2>, true },
+		sKernel{ "avx512-2x2", &runAvx512<2, 2>, true },
+		sKernel{ "avx512-4x3", &runAvx512<4, 3>, true },
+		sKernel{ "avx512-2x3", &runAvx512<2, 3>, true },
+		sKernel{ "avx512-4x4", &runAvx512<4, 4>, true },
+		sKernel{ "avx512-2x4", &runAvx512<2, 4>, true },
+		sKernel{ "avx512-4x8", &runAvx512<4, 8>, true },
+		sKernel{ "avx512-2x8", &runAvx512<2, 8>, true },
+		sKernel{ "avx512-4x12", &runAvx512<4, 12>, true },
+		sKernel{ "avx512-2x12", &runAvx512<2, 12>, true },
+	};
+
+	int findKernel( const char* name )
+	{
+		for( size_t i = 0; i < s_kernels.size(); i++ )
+			if( 0 == strcmp( name, s_kernels[ i ].name ) )
+				return (int)i;
+		return -1;
+	}
+
+	// Memory layout of the first argument, the kernels reshape these panels with different methods
+	enum struct eLayoutA : uint32_t
+	{
+		Panels = 0,
+		Rows = 1,
+		Columns = 2,
+		Strided = 3,
+	};
+
+	// The key of the tuning table
+	struct sShapeKey
+	{
+		// Height of the first matrix, height of the second matrix, and length of the dot products
+		uint32_t m, n, k;
+		// Count of 2D slices in the result
+		uint32_t layers;
+		eLayoutA layout;
+		// Count of threads in the pool
+		uint32_t threads;
+
+		bool operator==( const sShapeKey& that ) const
+		{
+			return 0 == memcmp( this, &that, sizeof( sShapeKey ) );
+		}
+	};
+	static_assert( sizeof( sShapeKey ) == 24 );
+
+	struct ShapeKeyHash
+	{
+		size_t operator()( const sShapeKey& key ) const
+		{
+			// FNV-1a over the 6 integers
+			const uint32_t* rsi = (const uint32_t*)&key;
+			uint64_t h = 0xcbf29ce484222325ull;
+			for( size_t i = 0; i < 6; i++ )
+			{
+				h ^= rsi[ i ];
+				h *= 0x100000001b3ull;
+			}
+			return (size_t)h;
+		}
+	};
+
+	// The value of the tuning table
+	struct sTuning
+	{
+		// Index in s_kernels table
+		uint8_t kernel;
+		// Maximum count of threads for MulMatBase::run, 0 = all threads of the pool
+		uint32_t threads;
+	};
+
+	inline uint32_t roundUpPowerOf2( uint32_t x )
+	{
+		if( x <= 1 )
+			return 1;
+		unsigned long idx;
+		_BitScanReverse( &idx, x - 1 );
+		return 2u << idx;
+	}
+
+	sShapeKey makeKey( const Tensor& a, const Tensor& b, const ParallelForRunner& pfor )
+	{
+		sShapeKey key;
+		key.m = a.ne[ 1 ];
+		key.n = b.ne[ 1 ];
+		key.k = a.ne[ 0 ];
+		key.layers = b.ne[ 2 ] * b.ne[ 3 ];
+		if( a.layout() == eTensorLayout::Panels )
+			key.layout = eLayoutA::Panels;
+		else if( a.nb[ 0 ] == 1 )
+			key.layout = eLayoutA::Rows;
+		else if( a.nb[ 1 ] == 1 )
+			key.layout = eLayoutA::Columns;
+		else
+			key.layout = eLayoutA::Strided;
+		key.threads = (uint32_t)std::max( pfor.threadsCount(), 0 );
+
+		// Count of tokens varies a lot, so are the sizes of the attention matrices which depend on the count of past tokens.
+		// Round these dimensions to reduce count of distinct shapes, otherwise the tuner would run the benchmark on every decoded token.
+		// The weight matrices have a few fixed shapes, these dimensions are exact.
+		key.n = roundUpPowerOf2( key.n );
+		if( key.layout != eLayoutA::Panels )
+		{
+			key.m = roundUpPowerOf2( key.m );
+			key.k = roundUpPowerOf2( key.k );
+			key.layers = roundUpPowerOf2( key.layers );
+		}
+		return key;
+	}
+
+	inline const char* cstr( const CStringA& s ) { return s; }
+	inline const wchar_t* cstr( const CString& s ) { return s; }
+
+	CStringA cpuBrandString()
+	{
+		std::array<int, 12> regs;
+		__cpuid( &regs[ 0 ], 0x80000000 );
+		if( (uint32_t)regs[ 0 ] < 0x80000004 )
+			return "Unknown CPU";
+		__cpuid( &regs[ 0 ], 0x80000002 );
+		__cpuid( &regs[ 4 ], 0x80000003 );
+		__cpuid( &regs[ 8 ], 0x80000004 );
+		std::array<char, sizeof( regs ) + 1> str;
+		memcpy( str.data(), regs.data(), sizeof( regs ) );
+		str[ sizeof( regs ) ] = '\0';
+		CStringA res{ str.data() };
+		res.Trim();
+		return res;
+	}
+
+	class MulMatTuner
+	{
+		CComAutoCriticalSection critSec;
+		using Lock = CComCritSecLock<CComAutoCriticalSection>;
+		std::unordered_map<sShapeKey, sTuning, ShapeKeyHash> table;
+		CStringA cpuName;
+		CString cachePath;
+		volatile bool enabled = false;
+
+		HRESULT makeCachePath();
+		HRESULT loadCache();
+		HRESULT saveCache() const;
+		HRESULT benchmark( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue, sTuning& tuning ) const;
+
+	public:
+		HRESULT enable();
+
+		bool isEnabled() const
+		{
+			return enabled;
+		}
+
+		HRESULT mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue );
+	};
+
+	HRESULT MulMatTuner::makeCachePath()
+	{
+		cpuName = cpuBrandString();
+		// The file name includes a hash of the CPU model, the first line of the file contains the complete string
+		uint32_t hash = 0x811c9dc5u;
+		for( int i = 0; i < cpuName.GetLength(); i++ )
+		{
+			hash ^= (uint8_t)cpuName[ i ];
+			hash *= 0x01000193u;
+		}
+
+		wchar_t* appData = nullptr;
+		HRESULT hr = SHGetKnownFolderPath( FOLDERID_LocalAppData, 0, nullptr, &appData );
+		if( FAILED( hr ) )
+			return hr;
+		CString dir = appData;
+		CoTaskMemFree( appData );
+		dir += L"\\Whisper";
+		const int status = SHCreateDirectoryEx( nullptr, dir, nullptr );
+		if( ERROR_SUCCESS != status && ERROR_ALREADY_EXISTS != status )
+			return HRESULT_FROM_WIN32( status );
+		cachePath.Format( L"%s\\mulMat-%08X.txt", cstr( dir ), hash );
+		return S_OK;
+	}
+
+	HRESULT MulMatTuner::loadCache()
+	{
+		CAtlFile file;
+		HRESULT hr = file.Create( cachePath, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING );
+		if( FAILED( hr ) )
+			return S_FALSE;	// No cache yet, it will be created after the first benchmark
+
+		ULONGLONG cb;
+		CHECK( file.GetSize( cb ) );
+		if( cb > 1 << 20 )
+			return E_INVALIDARG;
+		CStringA text;
+		char* buffer = text.GetBufferSetLength( (int)cb );
+		hr = file.Read( buffer, (DWORD)cb );
+		text.ReleaseBuffer();
+		CHECK( hr );
+
+		int pos = 0;
+		CStringA line = text.Tokenize( "\r\n", pos );
+		if( line != "# " + cpuName )
+		{
+			logWarning( u8"mulMat tuning cache was made on a different CPU, ignoring the file" );
+			return S_FALSE;
+		}
+
+		size_t loaded = 0;
+		for( line = text.Tokenize( "\r\n", pos ); pos >= 0; line = text.Tokenize( "\r\n", pos ) )
+		{
+			if( line.IsEmpty() || line[ 0 ] == '#' )
+				continue;
+			sShapeKey key;
+			uint32_t layout, threads;
+			char name[ 32 ];
+			const int fields = sscanf_s( line, "%u %u %u %u %u %u %31s %u", &key.m, &key.n, &key.k, &key.layers, &layout, &key.threads,
+				name, (unsigned)_countof( name ), &threads );
+			if( fields != 8 || layout > (uint32_t)eLayoutA::Strided )
+				continue;
+			key.layout = (eLayoutA)layout;
+			const int idx = findKernel( name );
+			if( idx < 0 )
+				continue;
+			if( s_kernels[ idx ].avx512 && !MulMatBase::haveAvx512 )
+				continue;
+			table[ key ] = sTuning{ (uint8_t)idx, threads };
+			loaded++;
+		}
+		logDebug( u8"Loaded %zu mulMat tuning entries", loaded );
+		return S_OK;
+	}
+
+	HRESULT MulMatTuner::saveCache() const
+	{
+		if( cachePath.IsEmpty() )
+			return S_FALSE;
+		CStringA text;
+		text.Format( "# %s\r\n# m n k layers layout poolThreads kernel threads\r\n", cstr( cpuName ) );
+		CStringA line;
+		for( const auto& e : table )
+		{
+			const sShapeKey& k = e.first;
+			line.Format( "%u %u %u %u %u %u %s %u\r\n", k.m, k.n, k.k, k.layers, (uint32_t)k.layout, k.threads,
+				s_kernels[ e.second.kernel ].name, e.second.threads );
+			text += line;
+		}
+
+		CAtlFile file;
+		CHECK( file.Create( cachePath, GENERIC_WRITE, 0, CREATE_ALWAYS ) );
+		return file.Write( cstr( text ), (DWORD)text.GetLength() );
+	}
+
+	HRESULT MulMatTuner::enable()
+	{
+		Lock lock{ critSec };
+		if( enabled )
+			return S_FALSE;
+		HRESULT hr = makeCachePath();
+		if( SUCCEEDED( hr ) )
+			hr = loadCache();
+		if( FAILED( hr ) )
+		{
+			// The tuner still works without the cache, it just needs to repeat these benchmarks in every process
+			logWarning( u8"Unable to load mulMat tuning cache, error %08X", hr );
+			cachePath.Empty();
+		}
+		enabled = true;
+		return S_OK;
+	}
+
+	constexpr size_t benchmarkIterations = 5;
+
+	HRESULT MulMatTuner::benchmark( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue, sTuning& tuning ) const
+	{
+		// Thread counts to try: all threads of the pool, half of them, and a quarter.
+		// Small matrices often run faster on fewer threads, the overhead of waking up the threads exceeds the gain.
+		std::array<uint32_t, 3> threadCounts = { 0, 0, 0 };
+		size_t countThreadOptions = 1;
+		const uint32_t poolThreads = (uint32_t)std::max( pfor.threadsCount(), 1 );
+		for( uint32_t t = poolThreads / 2; t >= 1 && countThreadOptions < threadCounts.size(); t /= 2 )
+			threadCounts[ countThreadOptions++ ] = t;
+
+		int64_t bestTime = INT64_MAX;
+		for( size_t i = 0; i < s_kernels.size(); i++ )
+		{
+			const sKernel& kernel = s_kernels[ i ];
+			if( kernel.avx512 && !MulMatBase::haveAvx512 )
+				continue;
+
+			for( size_t j = 0; j < countThreadOptions; j++ )
+			{
+				const uint32_t threads = threadCounts[ j ];
+				// The first call warms up caches and thread-local buffers, also tells whether the kernel supports these arguments
+				HRESULT hr;
+				try
+				{
+					hr = kernel.pfn( result, a, b, pfor, epilogue, threads );
+				}
+				catch( HRESULT code )
+				{
+					hr = code;
+				}
+				if( hr == E_NOTIMPL )
+					break;
+				CHECK( hr );
+
+				int64_t time = INT64_MAX;
+				for( size_t k = 0; k < benchmarkIterations; k++ )
+				{
+					const int64_t start = Whisper::tscNow();
+					CHECK( kernel.pfn( result, a, b, pfor, epilogue, threads ) );
+					time = std::min( time, Whisper::tscNow() - start );
+				}
+				if( time < bestTime )
+				{
+					bestTime = time;
+					tuning.kernel = (uint8_t)i;
+					tuning.threads = threads;
+				}
+			}
+		}
+		if( bestTime == INT64_MAX )
+			return S_FALSE;
+
+		constexpr double usMul = 0.1;
+		logDebug( u8"mulMat autotune [ %i, %i ] * [ %i, %i ]: %s, %i threads, %g µs", (int)a.ne[ 0 ], (int)a.ne[ 1 ], (int)b.ne[ 0 ], (int)b.ne[ 1 ],
+			s_kernels[ tuning.kernel ].name, (int)( tuning.threads ? tuning.threads : poolThreads ), usMul * (double)(int64_t)Whisper::ticksFromTsc( (uint64_t)bestTime ) );
+		return S_OK;
+	}
+
+	HRESULT MulMatTuner::mulMat( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
+	{
+		const sShapeKey key = makeKey( a, b, pfor );
+		sTuning tuning;
+		{
+			Lock lock{ critSec };
+			auto it = table.find( key );
+			if( it != table.end() )
+				tuning = it->second;
+			else
+				tuning.kernel = UINT8_MAX;
+		}
+
+		if( tuning.kernel == UINT8_MAX )
+		{
+			// The benchmark runs without the lock, different contexts might tune the same shape in parallel, the last one wins
+			const HRESULT hr = benchmark( result, a, b, pfor, epilogue, tuning );
+			if( hr != S_OK )
+				return hr;
+
+			Lock lock{ critSec };
+			table[ key ] = tuning;
+			const HRESULT hrSave = saveCache();
+			if( FAILED( hrSave ) )
+				logWarning( u8"Unable to save mulMat tuning cache, error %08X", hrSave );
+			// The last benchmark iteration was not necessarily the winner, however all kernels compute the same product into the result tensor
+			return S_OK;
+		}
+
+		return s_kernels[ tuning.kernel ].pfn( result, a, b, pfor, epilogue, tuning.threads );
+	}
+
+	// Lift the thread limit which the cost model of MlContext sets for the operation, and restore it in the destructor
+	class NoThreadsLimitRaii
+	{
+		ParallelForRunner& pfor;
+		const size_t prevLimit;
+
+	public:
+		NoThreadsLimitRaii( ParallelForRunner& p ) : pfor( p ), prevLimit( p.setThreadsLimit( 0 ) ) { }
+		NoThreadsLimitRaii( const NoThreadsLimitRaii& ) = delete;
+		~NoThreadsLimitRaii()
+		{
+			pfor.setThreadsLimit( prevLimit );
+		}
+	};
+
+	MulMatTuner& tuner()
+	{
+		static MulMatTuner instance;
+		return instance;
+	}
+}
+
+HRESULT CpuCompute::enableMulMatAutotune()
+{
+	return tuner().enable();
+}
+
+HRESULT CpuCompute::mulMatTuned( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue )
+{
+	MulMatTuner& t = tuner();
+	if( !t.isEnabled() )
+		return S_FALSE;
+	if( a.type() != eDataType::FP16 || b.type() != eDataType::FP32 )
+		return S_FALSE;
+
+	// The tuned entries carry their own thread count. Without lifting the limit, parallelFor would clamp the options of the benchmark,
+	// several of them would run the same count of threads, and the cache would contain thread counts which never ran.
+	// With the limit lifted, the cached thread counts don't depend on the cost model, the cache key doesn't need it.
+	NoThreadsLimitRaii noLimit{ pfor };
+	return t.mulMat( result, a, b, pfor, epilogue );
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+#pragma once
+#include "ParallelForRunner.h"
+#include "Tensor.h"
+#include "mulMatEpilogue.h"
+
+namespace CpuCompute
+{
+	// When the autotuner is enabled, compute FP16 mulMat with the kernel and thread count which won the benchmark for that shape.
+	// The first call with every distinct shape runs the benchmark, and saves the winner into the cache file.
+	// Returns S_FALSE when the tuner is disabled, or the arguments are not supported by the tuner; the caller should then use the default dispatch.
+	HRESULT mulMatTuned( Tensor& result, const Tensor& a, const Tensor& b, ParallelForRunner& pfor, const sMulMatEpilogue* epilogue = nullptr );
+}
\ No newline at end of file
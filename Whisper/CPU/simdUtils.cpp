@@ -1,6 +1,5 @@
 #include "stdafx.h"
 #include "simdUtils.h"
-#include "../ML/LookupTablesData.h"
 #include <cmath>
 #include <memory>
 
@@ -468,21 +467,7 @@ void addRepeatRow( float* rdi, size_t len, const float* b, size_t lenPattern )
 	}
 }
 
-namespace
-{
-	__forceinline __m256 gelu( __m256 x, const DirectCompute::LookupTablesData& lookup )
-	{
-		__m128i iv = _mm256_cvtps_ph( x, 0 );
-		alignas( 16 ) std::array<uint16_t, 8> arr;
-		_mm_store_si128( ( __m128i* )arr.data(), iv );
-		for( uint16_t& a : arr )
-			a = lookup.gelu[ a ];
-		iv = _mm_load_si128( ( __m128i* )arr.data() );
-		return _mm256_cvtph_ps( iv );
-	}
-}
-
-void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern, const DirectCompute::LookupTablesData& lookup )
+void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern )
 {
 	float* rdiEndAligned = rdi + ( len & maskAlign8 );
 	const size_t rem = len % 8;
@@ -494,7 +479,7 @@ void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern
 		{
 			__m256 v = _mm256_loadu_ps( rdi );
 			v = _mm256_add_ps( v, v2 );
-			v = gelu( v, lookup );
+			v = geluApprox( v );
 			_mm256_storeu_ps( rdi, v );
 		}
 		if( 0 != rem )
@@ -502,7 +487,7 @@ void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern
 			const __m256i mask = loadTailMaskInt( rem );
 			__m256 v = _mm256_maskload_ps( rdi, mask );
 			v = _mm256_add_ps( v, v2 );
-			v = gelu( v, lookup );
+			v = geluApprox( v );
 			_mm256_maskstore_ps( rdi, mask, v );
 		}
 		return;
@@ -514,7 +499,7 @@ void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern
 			__m256 v = _mm256_loadu_ps( rdi );
 			__m256 v2 = _mm256_loadu_ps( b );
 			v = _mm256_add_ps( v, v2 );
-			v = gelu( v, lookup );
+			v = geluApprox( v );
 			_mm256_storeu_ps( rdi, v );
 		}
 		if( 0 != rem )
@@ -523,7 +508,7 @@ void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern
 			__m256 v = _mm256_maskload_ps( rdi, mask );
 			__m256 v2 = _mm256_maskload_ps( b, mask );
 			v = _mm256_add_ps( v, v2 );
-			v = gelu( v, lookup );
+			v = geluApprox( v );
 			_mm256_maskstore_ps( rdi, mask, v );
 		}
 		return;
@@ -556,8 +541,6 @@ void __vectorcall scaleRow( float* rdi, size_t len, const __m256 scale )
 
 namespace
 {
-	using DirectCompute::LookupTablesData;
-
 	__forceinline float horizontalMax( __m256 vec )
 	{
 		__m128 v = _mm256_extractf128_ps( vec, 1 );
@@ -567,28 +550,22 @@ namespace
 		return _mm_cvtss_f32( v );
 	}
 
-	__forceinline float _cvtsh_ss( uint16_t f16 )
+	// Upcast 8 floats to FP64, and add to the accumulators
+	__forceinline void addPrecise( __m256d& acc0, __m256d& acc1, __m256 v )
 	{
-		__m128i i = _mm_cvtsi32_si128( f16 );
-		__m128 f = _mm_cvtph_ps( i );
-		return _mm_cvtss_f32( f );
+		acc0 = _mm256_add_pd( acc0, _mm256_cvtps_pd( _mm256_castps256_ps128( v ) ) );
+		acc1 = _mm256_add_pd( acc1, _mm256_cvtps_pd( _mm256_extractf128_ps( v, 1 ) ) );
 	}
 
-	__forceinline uint16_t _cvtss_sh( float f, int rounding )
+	__forceinline double horizontalSum( __m256d acc0, __m256d acc1 )
 	{
-		assert( 0 == rounding );
-		__m128 v = _mm_set_ss( f );
-		__m128i i = _mm_cvtps_ph( v, 0 );
-		return (uint16_t)(uint32_t)_mm_cvtsi128_si32( i );
+		acc0 = _mm256_add_pd( acc0, acc1 );
+		__m128d v = _mm_add_pd( _mm256_castpd256_pd128( acc0 ), _mm256_extractf128_pd( acc0, 1 ) );
+		v = _mm_add_sd( v, _mm_unpackhi_pd( v, v ) );
+		return _mm_cvtsd_f64( v );
 	}
 }
 
-const LookupTablesData& getLookupTables()
-{
-	static const std::unique_ptr<LookupTablesData> res = std::make_unique<LookupTablesData>();
-	return *res;
-}
-
 void softMax( float* rdi, size_t length, const float inputScale )
 {
 	float* const rdiBegin = rdi;
@@ -611,30 +588,27 @@ void softMax( float* rdi, size_t length, const float inputScale )
 	}
 
 	// Second pass: apply initial scale, compute the exponent, and compute total sum over the row
-	const LookupTablesData& lookup = getLookupTables();
-	const float maxScalar = horizontalMax( max );
-
-	float* const rdiEnd = rdiBegin + length;
-	double sum = 0;
-	for( rdi = rdiBegin; rdi < rdiEnd; rdi++ )
-	{
-		// Possible to vectorize, but relatively hard
-		// An easy way is upcast the complete lookup table to FP32 and then use two _mm256_i32gather_ps instructions per iteration
-		// However, that instruction is from AVX2 set. Let's hope this loop won't be a bottleneck.
-		float f = *rdi;
-		if( f != -INFINITY )
-		{
-			f = ( f - maxScalar ) * inputScale;
-			uint16_t f16 = _cvtss_sh( f, 0 );
-			f16 = lookup.exponent[ f16 ];
-			f = _cvtsh_ss( f16 );
-			sum += f;
-		}
-		else
-			f = 0;
-
-		*rdi = f;
+	// The -INFINITY elements produced by diagMaskInf() become zeros, expApprox() returns 0 for these inputs
+	const __m256 maxVec = _mm256_set1_ps( horizontalMax( max ) );
+	const __m256 scaleVec = _mm256_set1_ps( inputScale );
+	__m256d sum0 = _mm256_setzero_pd();
+	__m256d sum1 = _mm256_setzero_pd();
+	for( rdi = rdiBegin; rdi < rdiEndAligned; rdi += 8 )
+	{
+		__m256 v = _mm256_loadu_ps( rdi );
+		v = expApprox( _mm256_mul_ps( _mm256_sub_ps( v, maxVec ), scaleVec ) );
+		_mm256_storeu_ps( rdi, v );
+		addPrecise( sum0, sum1, v );
+	}
+	if( 0 != remainder )
+	{
+		__m256 v = _mm256_maskload_ps( rdi, tailMask );
+		v = expApprox( _mm256_mul_ps( _mm256_sub_ps( v, maxVec ), scaleVec ) );
+		v = _mm256_and_ps( v, _mm256_castsi256_ps( tailMask ) );
+		_mm256_maskstore_ps( rdi, tailMask, v );
+		addPrecise( sum0, sum1, v );
 	}
+	const double sum = horizontalSum( sum0, sum1 );
 
 	// Final pass: apply the final scale
 	const __m256 finalScale = _mm256_set1_ps( (float)( 1.0 / sum ) );
@@ -39,12 +39,7 @@ void __vectorcall addRepeatScaleRow( float* rdi, size_t len, const float* b, siz
 void addRepeatRow( float* rdi, size_t len, const float* b, size_t lenPattern );
 void __vectorcall scaleRow( float* rdi, size_t len, const __m256 scale );
 
-namespace DirectCompute
-{
-	struct LookupTablesData;
-}
-const DirectCompute::LookupTablesData& getLookupTables();
-void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern, const DirectCompute::LookupTablesData& lookup );
+void addRepeatGeluRow( float* rdi, size_t len, const float* b, size_t lenPattern );
 
 void softMax( float* rdi, size_t length, const float inputScale );
 
@@ -74,6 +69,54 @@ __forceinline __m256i loadTailMaskInt( size_t remainder )
 	return _mm256_loadu_si256( ( const __m256i* )( rsi - remainder ) );
 }
 
+// Compute exp( x ) for 8 FP32 numbers.
+// Cephes-style range reduction x = n * ln( 2 ) + r with | r | <= ln( 2 ) / 2, then a polynomial of degree 5 for exp( r ), and 2^n made with integer math.
+// The maximum relative error is 8.5E-8, under 1 ULP, for x in [ -87.3, 88 ] interval; dbgCheckExpGelu() in mulMatBench.cpp sweeps every FP32 input to verify.
+// Inputs above 88 are clamped to 88, inputs below -87.3 including -INFINITY return 0.
+// Only needs AVX and FMA3, the 2^n is assembled in 128-bit halves because 256-bit integer shifts are from AVX2.
+__forceinline __m256 expApprox( __m256 x )
+{
+	const __m256 lowLimit = _mm256_set1_ps( -87.3365402f );
+	const __m256 highLimit = _mm256_set1_ps( 88.0f );
+	const __m256 validMask = _mm256_cmp_ps( x, lowLimit, _CMP_GE_OQ );
+	x = _mm256_min_ps( _mm256_max_ps( x, lowLimit ), highLimit );
+
+	// n = round( x / ln( 2 ) ), r = x - n * ln( 2 ); the ln( 2 ) is split into 2 numbers to keep the precision of the subtraction
+	const __m256 n = _mm256_round_ps( _mm256_mul_ps( x, _mm256_set1_ps( 1.44269504088896341f ) ), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC );
+	__m256 r = _mm256_fnmadd_ps( n, _mm256_set1_ps( 0.693359375f ), x );
+	r = _mm256_fnmadd_ps( n, _mm256_set1_ps( -2.12194440e-4f ), r );
+
+	__m256 p = _mm256_set1_ps( 1.9875691500e-4f );
+	p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( 1.3981999507e-3f ) );
+	p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( 8.3334519073e-3f ) );
+	p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( 4.1665795894e-2f ) );
+	p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( 1.6666665459e-1f ) );
+	p = _mm256_fmadd_ps( p, r, _mm256_set1_ps( 5.0000001201e-1f ) );
+	p = _mm256_fmadd_ps( p, _mm256_mul_ps( r, r ), r );
+	p = _mm256_add_ps( p, _mm256_set1_ps( 1.0f ) );
+
+	// 2^n, by moving the biased integer into the exponent bits
+	const __m256i ni = _mm256_cvtps_epi32( n );
+	const __m128i bias = _mm_set1_epi32( 127 );
+	const __m128i lo = _mm_slli_epi32( _mm_add_epi32( _mm256_castsi256_si128( ni ), bias ), 23 );
+	const __m128i hi = _mm_slli_epi32( _mm_add_epi32( _mm256_extractf128_si256( ni, 1 ), bias ), 23 );
+	const __m256 pow2 = _mm256_castsi256_ps( _mm256_set_m128i( hi, lo ) );
+
+	return _mm256_and_ps( _mm256_mul_ps( p, pow2 ), validMask );
+}
+
+// GELU activation for 8 FP32 numbers, the tanh approximation used by Whisper: 0.5 * x * ( 1 + tanh( sqrt( 2 / pi ) * ( x + 0.044715 * x^3 ) ) )
+// Computed as x / ( 1 + exp( -2 * u ) ) where u is the argument of the tanh, that's the same function with a single exponent and no cancellation.
+// The maximum absolute error compared to the double precision formula is 1.4E-7 * max( | x |, 1 ), for all finite x; see dbgCheckExpGelu().
+__forceinline __m256 geluApprox( __m256 x )
+{
+	const __m256 one = _mm256_set1_ps( 1.0f );
+	// -2 * sqrt( 2 / pi ) * x * ( 1 + 0.044715 * x^2 )
+	__m256 u = _mm256_fmadd_ps( _mm256_mul_ps( x, x ), _mm256_set1_ps( 0.044715f ), one );
+	u = _mm256_mul_ps( _mm256_mul_ps( u, x ), _mm256_set1_ps( -1.59576912160573071f ) );
+	return _mm256_div_ps( x, _mm256_add_ps( expApprox( u ), one ) );
+}
+
 void floatsUpcast( float* rdi, const uint16_t* rsi, size_t length );
 
 void floatsDowncast( uint16_t* rdi, const float* rsi, size_t length );
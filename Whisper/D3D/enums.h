@@ -9,13 +9,25 @@ namespace DirectCompute
 		FP16,
 		FP32,
 		U32,
+		// Signed bytes, only used by CPU tensors of the hybrid model, for INT8-quantized decoder weights
+		I8,
+		// 4-bit blocks with FP16 scales, only used by CPU tensors of the hybrid model.
+		// The elementSize() function is meaningless for this type, the blocks of 32 elements take 18 bytes.
+		Q4,
 	};
 
 	inline size_t elementSize( eDataType dt )
 	{
-		assert( dt == eDataType::FP16 || dt == eDataType::FP32 || dt == eDataType::U32 );
+		assert( dt == eDataType::FP16 || dt == eDataType::FP32 || dt == eDataType::U32 || dt == eDataType::I8 );
 
-		return ( dt == eDataType::FP16 ) ? 2 : 4;
+		switch( dt )
+		{
+		case eDataType::FP16:
+			return 2;
+		case eDataType::I8:
+			return 1;
+		}
+		return 4;
 	}
 
 	DXGI_FORMAT viewFormat( eDataType dt );
@@ -0,0 +1,183 @@
+#include "stdafx.h"
+#include "DecodeEngine.h"
+#include "../CPU/CpuTopology.h"
+
+#if BUILD_HYBRID_VERSION
+DecodeEngine::DecodeEngine( const CpuCompute::DecoderTensors& m, const Whisper::sModelParams& mp ) :
+	node( CpuCompute::CpuTopology::instance().nextNode() ),
+	ml( 1 ),
+	model( m ),
+	parameters( mp )
+{ }
+
+HRESULT DecodeEngine::create()
+{
+	// One thread per physical core of the node, the placement puts the caller thread #0 on the first core
+	const uint32_t cores = CpuCompute::CpuTopology::instance().coresOnNode( node );
+	CHECK( ml.setThreadsCount( (int)std::max( cores, 1u ), spinMicroseconds, true, node ) );
+
+	try
+	{
+		// The scheduler thread doesn't allocate these vectors, reserve them upfront
+		batch.reserve( maxBatch );
+		tokens.reserve( maxBatch );
+		sequences.reserve( maxBatch );
+		scheduler = std::thread( [ this ] { threadMain(); } );
+	}
+	catch( const std::bad_alloc& )
+	{
+		return E_OUTOFMEMORY;
+	}
+	catch( const std::exception& )
+	{
+		return E_FAIL;
+	}
+	logDebug( u8"DecodeEngine: %u threads on NUMA node %u", cores, node );
+	return S_OK;
+}
+
+DecodeEngine::~DecodeEngine()
+{
+	{
+		std::lock_guard<std::mutex> lk( lock );
+		stopping = true;
+	}
+	wakeup.notify_all();
+	if( scheduler.joinable() )
+		scheduler.join();
+
+	// The contexts hold references to the model, normally the queue is empty by now
+	for( sPending& p : queue )
+		p.promise.set_value( E_ABORT );
+}
+
+std::future<HRESULT> DecodeEngine::submit( const sStep& step )
+{
+	std::future<HRESULT> res;
+	{
+		std::lock_guard<std::mutex> lk( lock );
+		sPending& p = queue.emplace_back();
+		p.step = step;
+		res = p.promise.get_future();
+	}
+	wakeup.notify_one();
+	return res;
+}
+
+void DecodeEngine::threadMain()
+{
+	setCurrentThreadName( "Whisper.dll Decode Engine Thread" );
+	// The scheduler is the thread #0 of the pool, it stays pinned for the lifetime of the engine
+	const uint32_t processor = ml.callerProcessor();
+	if( UINT_MAX != processor && FAILED( CpuCompute::pinCurrentThread( processor ) ) )
+		logWarning( u8"DecodeEngine: unable to pin the scheduler thread" );
+
+	while( true )
+	{
+		{
+			std::unique_lock<std::mutex> lk( lock );
+			wakeup.wait( lk, [ this ] { return stopping || !queue.empty(); } );
+			if( stopping )
+				return;
+
+			// Continuous batching: the contexts in the previous batch are sampling their next tokens, give them a moment to submit the next steps
+			if( queue.size() < expectedSteps )
+				wakeup.wait_for( lk, batchingDelay, [ this ] { return stopping || queue.size() >= expectedSteps; } );
+			if( stopping )
+				return;
+
+			const size_t count = std::min( queue.size(), maxBatch );
+			batch.clear();
+			for( size_t i = 0; i < count; i++ )
+			{
+				batch.push_back( std::move( queue.front() ) );
+				queue.pop_front();
+			}
+			expectedSteps = std::min( count + queue.size(), maxBatch );
+		}
+
+		// Every promise of the batch must be fulfilled, the contexts are blocked waiting for them
+		HRESULT hr;
+		try
+		{
+			hr = runBatch();
+		}
+		catch( HRESULT code )
+		{
+			hr = code;
+		}
+		catch( const std::bad_alloc& )
+		{
+			hr = E_OUTOFMEMORY;
+		}
+		catch( const std::exception& )
+		{
+			hr = E_FAIL;
+		}
+		catch( ... )
+		{
+			hr = E_UNEXPECTED;
+		}
+		for( sPending& p : batch )
+			p.promise.set_value( hr );
+	}
+}
+
+HRESULT DecodeEngine::getGraph( uint32_t steps, DecodeGraph*& rdi )
+{
+	auto it = graphs.find( steps );
+	if( it == graphs.end() )
+	{
+		std::unique_ptr<DecodeGraph> graph = std::make_unique<DecodeGraph>();
+		CHECK( graph->build( model, parameters, 1, 1, steps ) );
+		it = graphs.emplace( steps, std::move( graph ) ).first;
+	}
+	rdi = it->second.get();
+
+	const size_t cb = rdi->scratchBytes();
+	if( cb > scratchCapacity )
+	{
+		CHECK( scratch.allocate( cb, hasFlag( model.largePages, CpuCompute::eLargePages::Compute ) ) );
+		scratchCapacity = cb;
+		logDebug( u8"DecodeEngine: %zu bytes of scratch memory for %u steps", cb, steps );
+	}
+	return S_OK;
+}
+
+HRESULT DecodeEngine::runBatch()
+{
+	const uint32_t steps = (uint32_t)batch.size();
+	tokens.clear();
+	sequences.clear();
+	for( const sPending& p : batch )
+	{
+		tokens.push_back( p.step.token );
+		sequences.push_back( p.step.sequence );
+	}
+
+	DecodeGraph* graph;
+	CHECK( getGraph( steps, graph ) );
+
+	DecodeGraph::sRunParams rp;
+	rp.tokens = tokens.data();
+	rp.sequences = sequences.data();
+	// The merged steps compute the complete probabilities, the token_beg is only used by the logits summary
+	rp.tokenBeg = 0;
+	rp.summary = nullptr;
+	graph->run( ml, scratch.pointer(), rp, probs );
+
+	// The probabilities of the steps are consecutive rows of the output
+	const size_t n_vocab = (size_t)parameters.n_vocab;
+	if( probs.size() != n_vocab * steps )
+		return E_UNEXPECTED;
+	for( uint32_t i = 0; i < steps; i++ )
+	{
+		const float* rsi = probs.data() + i * n_vocab;
+		batch[ i ].step.probs->assign( rsi, rsi + n_vocab );
+	}
+
+	// The operations of the merged steps can't be attributed to the profilers of individual contexts
+	ml.resetOpStats();
+	return S_OK;
+}
+#endif
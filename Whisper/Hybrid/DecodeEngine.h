@@ -0,0 +1,81 @@
+#pragma once
+#include "DecodeGraph.h"
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+
+// Decoder shared by all contexts of the hybrid model.
+// The contexts submit their single-token steps into a queue, the scheduler thread merges the pending steps of different contexts into a single pass over the weights.
+// Every step has its own KV cache, position, and cross-attention buffers; the matrix multiplications are batched, the attention runs per step.
+// On CPU the decoder is bound by the memory bandwidth consumed by the weights, this way the throughput scales with the count of concurrent streams.
+class DecodeEngine
+{
+public:
+	struct sStep
+	{
+		int token;
+		// The caller must call prepareWrite() on the KV cache, and keep all these buffers alive until the step completes
+		DecodeGraph::sSequence sequence;
+		// Receives n_vocab probabilities
+		std::vector<float>* probs;
+	};
+
+	DecodeEngine( const CpuCompute::DecoderTensors& model, const Whisper::sModelParams& mp );
+	~DecodeEngine();
+	DecodeEngine( const DecodeEngine& ) = delete;
+
+	// Start the thread pool pinned to the physical cores of the NUMA node picked for the engine, then the scheduler thread
+	HRESULT create();
+
+	// NUMA node of the engine threads, the contexts which submit their steps place their KV caches on that node
+	uint32_t numaNode() const
+	{
+		return node;
+	}
+
+	// Queue the step; the future completes after the scheduler has decoded the batch with this step
+	std::future<HRESULT> submit( const sStep& step );
+
+private:
+	// Maximum count of steps merged into a single pass
+	static constexpr size_t maxBatch = 16;
+	// How long the scheduler waits for the rest of the contexts which were in the previous batch
+	static constexpr std::chrono::microseconds batchingDelay{ 1000 };
+	// The engine has a single thread configuration regardless of the contexts, the idle workers spin between the steps of the batches
+	static constexpr uint32_t spinMicroseconds = 100;
+
+	struct sPending
+	{
+		sStep step;
+		std::promise<HRESULT> promise;
+	};
+
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::deque<sPending> queue;
+	bool stopping = false;
+	std::thread scheduler;
+
+	const uint32_t node;
+	// The rest of the fields are only used by the scheduler thread
+	CpuCompute::MlContext ml;
+	const CpuCompute::DecoderTensors& model;
+	const Whisper::sModelParams parameters;
+	// Captured decoder steps, the key is the count of steps in the batch
+	std::map<uint32_t, std::unique_ptr<DecodeGraph>> graphs;
+	CpuCompute::LargeBuffer scratch;
+	size_t scratchCapacity = 0;
+	// Count of steps in the previous batch, the contexts which were decoding usually submit their next steps shortly
+	size_t expectedSteps = 1;
+	std::vector<sPending> batch;
+	std::vector<int> tokens;
+	std::vector<DecodeGraph::sSequence> sequences;
+	std::vector<float> probs;
+
+	void threadMain();
+	HRESULT getGraph( uint32_t steps, DecodeGraph*& rdi );
+	HRESULT runBatch();
+};
@@ -0,0 +1,487 @@
+#include "stdafx.h"
+#include "DecodeGraph.h"
+#include "../Utils/Trace/tracing.h"
+using namespace CpuCompute;
+
+#if BUILD_HYBRID_VERSION
+namespace
+{
+	// Offsets of the intermediate tensors are aligned by cache lines
+	constexpr size_t valueAlignment = 64;
+
+	inline size_t valueBytes( uint32_t ne0, uint32_t ne1 )
+	{
+		const size_t cb = (size_t)ne0 * ne1 * 4;
+		return ( cb + valueAlignment - 1 ) & ~( valueAlignment - 1 );
+	}
+}
+
+uint16_t DecodeGraph::addValue( uint32_t ne0, uint32_t ne1 )
+{
+	if( values.size() >= noValue )
+		throw E_BOUNDS;
+	sValue& v = values.emplace_back();
+	v.ne0 = ne0;
+	v.ne1 = ne1;
+	v.parent = noValue;
+	v.firstRow = 0;
+	v.firstOp = UINT_MAX;
+	v.lastOp = 0;
+	v.offset = 0;
+	return (uint16_t)( values.size() - 1 );
+}
+
+uint16_t DecodeGraph::addView( uint16_t parent, uint32_t firstRow, uint32_t rows )
+{
+	const uint32_t ne0 = values[ parent ].ne0;
+	assert( firstRow + rows <= values[ parent ].ne1 );
+	const uint16_t id = addValue( ne0, rows );
+	values[ id ].parent = parent;
+	values[ id ].firstRow = firstRow;
+	return id;
+}
+
+void DecodeGraph::touch( uint16_t id )
+{
+	if( id == noValue )
+		return;
+	// Accessing a view accesses the memory of the parent
+	while( values[ id ].parent != noValue )
+		id = values[ id ].parent;
+
+	const uint32_t idx = (uint32_t)ops.size() - 1;
+	sValue& v = values[ id ];
+	v.firstOp = std::min( v.firstOp, idx );
+	v.lastOp = std::max( v.lastOp, idx );
+}
+
+DecodeGraph::sOp& DecodeGraph::addOp( eOp op, uint32_t layer, uint16_t dest, uint16_t src0, uint16_t src1 )
+{
+	sOp& res = ops.emplace_back();
+	res.op = op;
+	res.layer = layer;
+	res.dest = dest;
+	res.src0 = src0;
+	res.src1 = src1;
+	res.scale = 1.0f;
+	res.weights = nullptr;
+	res.matrix = nullptr;
+	res.trace = nullptr;
+	res.inputTrace = nullptr;
+
+	touch( dest );
+	touch( src0 );
+	touch( src1 );
+	return res;
+}
+
+HRESULT DecodeGraph::build( const DecoderTensors& m, const Whisper::sModelParams& mp, uint32_t tokens, uint32_t n_logits, uint32_t beams )
+{
+	if( 0 == tokens || tokens > mp.n_text_ctx || mp.n_text_layer > m.layers.size() || 0 == beams )
+		return E_INVALIDARG;
+	if( beams > 1 )
+	{
+		if( 1 != tokens )
+			return E_INVALIDARG;
+		n_logits = beams;
+	}
+
+	model = &m;
+	n_tokens = tokens;
+	n_beams = beams;
+	// Rows in the intermediate tensors
+	const uint32_t N = tokens * beams;
+	n_state = mp.n_text_state;
+	n_head = mp.n_text_head;
+	n_ctx = mp.n_text_ctx;
+	ops.clear();
+	values.clear();
+	tensors.clear();
+	boundTo = nullptr;
+
+	const uint32_t n_layer = mp.n_text_layer;
+	const float scaling = computeScaling( (int)n_state, (int)n_head );
+	sOp* op;
+
+	try
+	{
+		uint16_t inpL = addValue( n_state, N );
+		addOp( eOp::AddRows, 0, inpL ).trace = "dec-rows";
+
+		for( uint32_t il = 0; il < n_layer; il++ )
+		{
+			const LayerDecoder& layer = m.layers[ il ];
+
+			// norm
+			uint16_t cur = addValue( n_state, N );
+			op = &addOp( eOp::Norm, il, cur, inpL );
+			op->weights = &layer.attnLn0;
+			op->inputTrace = "dec-inpL";
+			op->trace = "dec-norm";
+
+			// self-attention, the bias and the scale are applied by the mulMat kernels
+			const uint16_t q = addValue( layer.attnQuery.w.ne[ 1 ], N );
+			op = &addOp( eOp::MulMatAddRepeatScale, il, q, cur );
+			op->weights = &layer.attnQuery;
+			op->scale = scaling;
+			op->trace = "dec-Qcur-1";
+
+			// note: no bias for Key
+			const uint16_t k = addValue( layer.attnKey.ne[ 1 ], N );
+			op = &addOp( eOp::MulMatScale, il, k, cur );
+			op->matrix = &layer.attnKey;
+			op->scale = scaling;
+			op->trace = "dec-Kcur";
+
+			const uint16_t v = addValue( layer.attnValue.w.ne[ 1 ], N );
+			op = &addOp( eOp::MulMatAddRepeat, il, v, cur );
+			op->weights = &layer.attnValue;
+			op->trace = "dec-Vcur";
+
+			// store key and value to memory
+			addOp( eOp::StoreKv, il, noValue, k, v );
+
+			// Fused mulMat( K, Q ), diagMaskInf, softMax, mulMat( V_trans, KQ ), and merging the heads
+			cur = addValue( n_state, N );
+			addOp( eOp::SelfAttention, il, cur, q ).trace = "dec-KQV-merged";
+
+			uint16_t proj = addValue( layer.attnLn1.w.ne[ 1 ], N );
+			addOp( eOp::MulMatAddRepeat, il, proj, cur ).weights = &layer.attnLn1;
+
+			// add the input
+			const uint16_t inpCA = addValue( n_state, N );
+			addOp( eOp::Add, il, inpCA, proj, inpL );
+
+			// norm
+			cur = addValue( n_state, N );
+			addOp( eOp::Norm, il, cur, inpCA ).weights = &layer.crossAttnLn0;
+
+			// cross-attention
+			const uint16_t qc = addValue( layer.crossAttnQuery.w.ne[ 1 ], N );
+			op = &addOp( eOp::MulMatAddRepeatScale, il, qc, cur );
+			op->weights = &layer.crossAttnQuery;
+			op->scale = scaling;
+
+			// Kcross is already scaled
+			cur = addValue( n_state, N );
+			addOp( eOp::CrossAttention, il, cur, qc ).trace = "dec-KQV-merged";
+
+			// projection, then add the input
+			const uint16_t inpFF = addValue( layer.crossAttnLn1.w.ne[ 1 ], N );
+			addOp( eOp::MulMatAddRepeat, il, inpFF, cur ).weights = &layer.crossAttnLn1;
+			addOp( eOp::AddInPlace, il, inpFF, inpFF, inpCA );
+
+			// feed-forward network
+			cur = addValue( n_state, N );
+			addOp( eOp::Norm, il, cur, inpFF ).weights = &layer.mlpLn;
+
+			const uint16_t hidden = addValue( layer.mlp0.w.ne[ 1 ], N );
+			addOp( eOp::MulMatAddRepeatGelu, il, hidden, cur ).weights = &layer.mlp0;
+
+			const uint16_t out = addValue( layer.mlp1.w.ne[ 1 ], N );
+			addOp( eOp::MulMatAddRepeat, il, out, hidden ).weights = &layer.mlp1;
+
+			// output from this layer
+			addOp( eOp::AddInPlace, il, out, out, inpFF );
+			inpL = out;
+		}
+
+		if( 0 == n_logits && 1 == beams )
+		{
+			// Fused vocabulary projection, softmax and top-K, the 51865 probabilities are never written to memory
+			const uint16_t last = addView( inpL, N - 1, 1 );
+			const uint16_t cur = addValue( n_state, 1 );
+			addOp( eOp::Norm, n_layer, cur, last ).weights = &m.ln;
+			addOp( eOp::LogitsSummary, n_layer, noValue, cur );
+			result = noValue;
+		}
+		else
+		{
+			// The vocabulary projection is the largest matrix of the model, only compute it for the tokens the caller needs.
+			// All the computations below are independent for every token, slicing the last rows of the input is equivalent to slicing the output.
+			n_logits = std::min( n_logits, N );
+			if( n_logits < N )
+				inpL = addView( inpL, N - n_logits, n_logits );
+
+			const uint16_t cur = addValue( n_state, n_logits );
+			addOp( eOp::Norm, n_layer, cur, inpL ).weights = &m.ln;
+
+			result = addValue( m.tokenEmbedding.ne[ 1 ], n_logits );
+			addOp( eOp::MulMat, n_layer, result, cur ).matrix = &m.tokenEmbedding;
+			// logits -> probs
+			addOp( eOp::SoftMax, n_layer, result, result );
+		}
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+	catch( const std::bad_alloc& )
+	{
+		return E_OUTOFMEMORY;
+	}
+
+	planMemory();
+	return S_OK;
+}
+
+void DecodeGraph::planMemory()
+{
+	// Greedy by size: place the largest tensors first, each one at the lowest offset which doesn't overlap placed tensors with intersecting lifetimes.
+	// An operation touches both inputs and the output, the output never overlaps the inputs.
+	std::vector<uint16_t> order;
+	order.reserve( values.size() );
+	for( size_t i = 0; i < values.size(); i++ )
+		if( values[ i ].parent == noValue && values[ i ].firstOp != UINT_MAX )
+			order.push_back( (uint16_t)i );
+
+	std::stable_sort( order.begin(), order.end(), [ this ]( uint16_t a, uint16_t b )
+		{
+			return valueBytes( values[ a ].ne0, values[ a ].ne1 ) > valueBytes( values[ b ].ne0, values[ b ].ne1 );
+		} );
+
+	std::vector<std::pair<size_t, size_t>> conflicts;
+	cbScratch = 0;
+	for( size_t i = 0; i < order.size(); i++ )
+	{
+		sValue& v = values[ order[ i ] ];
+		const size_t cb = valueBytes( v.ne0, v.ne1 );
+
+		conflicts.clear();
+		for( size_t j = 0; j < i; j++ )
+		{
+			const sValue& p = values[ order[ j ] ];
+			if( p.firstOp <= v.lastOp && v.firstOp <= p.lastOp )
+				conflicts.emplace_back( p.offset, p.offset + valueBytes( p.ne0, p.ne1 ) );
+		}
+		std::sort( conflicts.begin(), conflicts.end() );
+
+		size_t offset = 0;
+		for( const auto& c : conflicts )
+		{
+			if( offset + cb <= c.first )
+				break;
+			offset = std::max( offset, c.second );
+		}
+		v.offset = offset;
+		cbScratch = std::max( cbScratch, offset + cb );
+	}
+}
+
+void DecodeGraph::bind( uint8_t* scratch )
+{
+	tensors.resize( values.size() );
+	// Views are created after their parents, a single pass is enough
+	for( size_t i = 0; i < values.size(); i++ )
+	{
+		const sValue& v = values[ i ];
+		uint8_t* pointer;
+		if( v.parent == noValue )
+			pointer = scratch + v.offset;
+		else
+			pointer = (uint8_t*)tensors[ v.parent ].data() + (size_t)v.firstRow * v.ne0 * 4;
+		check( tensors[ i ].attach( pointer, eDataType::FP32, { v.ne0, v.ne1 } ) );
+	}
+	boundTo = scratch;
+}
+
+Tensor DecodeGraph::beamRows( uint16_t id, uint32_t beam ) const
+{
+	const sValue& v = values[ id ];
+	uint8_t* pointer = (uint8_t*)tensors[ id ].data() + (size_t)beam * n_tokens * v.ne0 * 4;
+	Tensor res;
+	check( res.attach( pointer, eDataType::FP32, { v.ne0, n_tokens } ) );
+	return res;
+}
+
+void DecodeGraph::storeKv( MlContext& ml, KvTensors& kv, uint32_t slot, uint32_t layer, uint32_t n_past, const Tensor& k, const Tensor& v )
+{
+	const uint32_t ne0 = k.ne[ 0 ];
+	const uint32_t N = k.ne[ 1 ];
+	// The rows may span multiple pages of the cache
+	for( uint32_t i = 0; i < N; )
+	{
+		const uint32_t pos = n_past + i;
+		const uint32_t rows = std::min( KvTensors::pageTokens - pos % KvTensors::pageTokens, N - i );
+		Tensor kSource, vSource;
+		check( kSource.attach( (float*)k.data() + (size_t)i * ne0, eDataType::FP32, { ne0, rows } ) );
+		check( vSource.attach( (float*)v.data() + (size_t)i * ne0, eDataType::FP32, { ne0, rows } ) );
+		if( kv.quantized() )
+		{
+			const KvTensors::sQuantizedRows dest = kv.quantizedRows( slot, layer, pos, rows );
+			ml.quantizeKv( kSource, dest.keys, dest.keyScales, kv.heads() );
+			ml.quantizeKv( vSource, dest.values, dest.valueScales, kv.heads() );
+		}
+		else
+		{
+			Tensor kDest = kv.keysRows( slot, layer, pos, rows );
+			Tensor vDest = kv.valuesRows( slot, layer, pos, rows );
+			check( ml.copyImpl( kDest, kSource ) );
+			check( ml.copyImpl( vDest, vSource ) );
+		}
+		i += rows;
+	}
+}
+
+// Returns the planned memory for the output of the current operation
+class DecodeGraph::OutputAllocator : public iMemoryAllocator
+{
+public:
+	void* next = nullptr;
+	size_t capacity = 0;
+
+	virtual void* allocate( size_t cb, size_t align ) override final
+	{
+		if( nullptr != next && cb <= capacity )
+		{
+			void* const res = next;
+			next = nullptr;
+			return res;
+		}
+		logError( u8"DecodeGraph: an operation allocated memory outside of the plan" );
+		throw E_UNEXPECTED;
+	}
+};
+
+void DecodeGraph::run( MlContext& ml, uint8_t* scratch, const sRunParams& rp, std::vector<float>& probs )
+{
+	if( scratch != boundTo )
+		bind( scratch );
+
+	OutputAllocator alloc;
+	struct AllocatorRaii
+	{
+		MlContext& ml;
+		iMemoryAllocator* const prev;
+		AllocatorRaii( MlContext& m, iMemoryAllocator* a ) : ml( m ), prev( m.setAllocator( a ) ) { }
+		~AllocatorRaii() { ml.setAllocator( prev ); }
+	};
+	AllocatorRaii raii{ ml, &alloc };
+
+	const uint32_t N = n_tokens;
+	// Bytes in the rows of one beam, for [ n_state, N ] tensors
+	const size_t cbBeam = (size_t)n_state * N * 4;
+	const sSequence* const seq = rp.sequences;
+
+	// Beams of the same context share the keys and values of the cross-attention, they are computed by a single call
+	bool sharedCross = true;
+	for( uint32_t b = 1; b < n_beams; b++ )
+		if( seq[ b ].kvCross != seq[ 0 ].kvCross || seq[ b ].crossInt8 != seq[ 0 ].crossInt8 || seq[ b ].M != seq[ 0 ].M )
+			sharedCross = false;
+	auto crossAttention = [ & ]( const sSequence& s, const Tensor& q, uint32_t layer )
+	{
+		// Same fused operator without the causal mask, streams the 1500 rows of the audio features once per token
+		if( nullptr != s.crossInt8 )
+		{
+			ml.attention( q, s.crossInt8->layer( layer ), n_head, 0, false );
+			return;
+		}
+		const uint32_t len = s.M * n_state;
+		const uint32_t off = layer * len;
+		ml.attention( q, s.kvCross->keysView( len, off ), s.kvCross->valuesView( len, off ), n_head, 0, false );
+	};
+
+	for( const sOp& op : ops )
+	{
+		if( 0 == op.layer && nullptr != op.inputTrace )
+			Tracing::tensor( op.inputTrace, tensors[ op.src0 ] );
+
+		if( op.dest != noValue )
+		{
+			const sValue& v = values[ op.dest ];
+			alloc.next = tensors[ op.dest ].data();
+			alloc.capacity = (size_t)v.ne0 * v.ne1 * 4;
+		}
+
+		switch( op.op )
+		{
+		case eOp::AddRows:
+			// Every sequence has its own tokens and position
+			for( uint32_t b = 0; b < n_beams; b++ )
+			{
+				alloc.next = (uint8_t*)tensors[ op.dest ].data() + b * cbBeam;
+				alloc.capacity = cbBeam;
+				ml.addRows( model->tokenEmbedding, model->positionalEmbedding, rp.tokens + b * N, (int)N, (int)seq[ b ].n_past );
+			}
+			break;
+		case eOp::Norm:
+			ml.normFmaRepeat( tensors[ op.src0 ], *op.weights );
+			break;
+		case eOp::MulMatAddRepeat:
+			ml.mulMatAddRepeat( *op.weights, tensors[ op.src0 ] );
+			break;
+		case eOp::MulMatAddRepeatScale:
+			ml.mulMatAddRepeatScale( *op.weights, tensors[ op.src0 ], op.scale );
+			break;
+		case eOp::MulMatAddRepeatGelu:
+			ml.mulMatAddRepeatGelu( *op.weights, tensors[ op.src0 ] );
+			break;
+		case eOp::MulMatScale:
+			ml.mulMatScale( *op.matrix, tensors[ op.src0 ], op.scale );
+			break;
+		case eOp::StoreKv:
+			for( uint32_t b = 0; b < n_beams; b++ )
+				storeKv( ml, *seq[ b ].kv, seq[ b ].slot, op.layer, seq[ b ].n_past, beamRows( op.src0, b ), beamRows( op.src1, b ) );
+			break;
+		case eOp::SelfAttention:
+		{
+			// Every sequence attends to the pages of its own slot of the KV cache
+			sAttentionPages pages;
+			for( uint32_t b = 0; b < n_beams; b++ )
+			{
+				alloc.next = (uint8_t*)tensors[ op.dest ].data() + b * cbBeam;
+				alloc.capacity = cbBeam;
+				seq[ b ].kv->layerPages( seq[ b ].slot, op.layer, seq[ b ].n_past + N, pageTable, pages );
+				ml.attention( beamRows( op.src0, b ), pages, n_head, seq[ b ].n_past, true );
+			}
+			break;
+		}
+		case eOp::CrossAttention:
+			if( sharedCross )
+			{
+				crossAttention( seq[ 0 ], tensors[ op.src0 ], op.layer );
+				break;
+			}
+			for( uint32_t b = 0; b < n_beams; b++ )
+			{
+				alloc.next = (uint8_t*)tensors[ op.dest ].data() + b * cbBeam;
+				alloc.capacity = cbBeam;
+				crossAttention( seq[ b ], beamRows( op.src0, b ), op.layer );
+			}
+			break;
+		case eOp::Add:
+			ml.add( tensors[ op.src0 ], tensors[ op.src1 ] );
+			break;
+		case eOp::AddInPlace:
+			alloc.next = nullptr;
+			ml.addInPlace( tensors[ op.src0 ], tensors[ op.src1 ] );
+			break;
+		case eOp::MulMat:
+			ml.mulMat( *op.matrix, tensors[ op.src0 ] );
+			break;
+		case eOp::SoftMax:
+			alloc.next = nullptr;
+			ml.softMax( tensors[ op.src0 ] );
+			break;
+		case eOp::LogitsSummary:
+			ml.logitsSummary( *rp.summary, model->tokenEmbedding, tensors[ op.src0 ], rp.tokenBeg );
+			break;
+		default:
+			throw E_UNEXPECTED;
+		}
+
+		if( 0 == op.layer && nullptr != op.trace )
+			Tracing::tensor( op.trace, tensors[ op.dest ] );
+	}
+
+	if( result == noValue )
+	{
+		probs.clear();
+		return;
+	}
+	const Tensor& res = tensors[ result ];
+	const float* rsi = res.fp32();
+	probs.assign( rsi, rsi + res.countElements() );
+	Tracing::vector( "probs", probs );
+}
+#endif
@@ -0,0 +1,139 @@
+#pragma once
+#include "../CPU/MlContext.h"
+#include "../CPU/DecoderTensors.h"
+#include "../CPU/KvTensors.h"
+#include "../CPU/QuantizedKv.h"
+#include "KeyValueDownloader.h"
+
+// Operations of one decoder step, captured once and replayed for the subsequent tokens.
+// Shapes of all intermediate tensors only depend on the count of tokens and the count of output rows, n_past only moves the views of the KV cache.
+// A liveness-based planner assigns fixed offsets in a single scratch buffer to these intermediate tensors.
+// The replay still calls the MlContext methods, which validate the shapes and wrap the outputs into Tensor objects; their allocations are served from the plan.
+class DecodeGraph
+{
+	enum struct eOp : uint8_t
+	{
+		// dest = token embedding + positional embedding
+		AddRows,
+		// dest = normFmaRepeat( src0, weights )
+		Norm,
+		// dest = mulMat( weights.w, src0 ) + weights.b, with the optional scale or GELU applied by the mulMat kernels
+		MulMatAddRepeat,
+		MulMatAddRepeatScale,
+		MulMatAddRepeatGelu,
+		// dest = mulMat( matrix, src0 ) * scale
+		MulMatScale,
+		// Copy src0 into the keys, and src1 into the values of the KV cache
+		StoreKv,
+		// dest = attention( src0, KV cache ) with the causal mask
+		SelfAttention,
+		// dest = attention( src0, cross-attention buffers ) without the mask
+		CrossAttention,
+		// dest = src0 + src1
+		Add,
+		// src0 += src1, dest is the same value as src0
+		AddInPlace,
+		// dest = mulMat( matrix, src0 )
+		MulMat,
+		// softMax( src0 ) in place
+		SoftMax,
+		// Fused vocabulary projection, softmax and top-K of src0
+		LogitsSummary,
+	};
+
+	struct sOp
+	{
+		eOp op;
+		uint32_t layer;
+		uint16_t dest, src0, src1;
+		float scale;
+		const CpuCompute::TensorPair* weights;
+		const CpuCompute::Tensor* matrix;
+		// Name for the debug traces, only used for the first layer
+		const char* trace;
+		// Name for the debug trace of src0, recorded before the operation runs
+		const char* inputTrace;
+	};
+
+	// An intermediate FP32 matrix of the graph
+	struct sValue
+	{
+		uint32_t ne0, ne1;
+		// When not noValue, this one is a view of the rows of the parent value, starting at firstRow, without memory of its own
+		uint16_t parent;
+		uint32_t firstRow;
+		// Indices of the first and the last operations which access the memory of this value
+		uint32_t firstOp, lastOp;
+		// Offset in the scratch buffer
+		size_t offset;
+	};
+	static constexpr uint16_t noValue = 0xFFFF;
+
+	std::vector<sOp> ops;
+	std::vector<sValue> values;
+	std::vector<CpuCompute::Tensor> tensors;
+	uint16_t result = noValue;
+	size_t cbScratch = 0;
+	uint8_t* boundTo = nullptr;
+
+	const CpuCompute::DecoderTensors* model = nullptr;
+	uint32_t n_tokens = 0, n_state = 0, n_head = 0, n_ctx = 0;
+	// Count of independent sequences decoded by a single replay, every one of them has n_tokens rows in the intermediate tensors.
+	// These sequences may belong to different contexts, only the matrix multiplications are batched; the attention runs per sequence.
+	uint32_t n_beams = 1;
+
+	uint16_t addValue( uint32_t ne0, uint32_t ne1 );
+	uint16_t addView( uint16_t parent, uint32_t firstRow, uint32_t rows );
+	void touch( uint16_t id );
+	sOp& addOp( eOp op, uint32_t layer, uint16_t dest, uint16_t src0 = noValue, uint16_t src1 = noValue );
+	void planMemory();
+	void bind( uint8_t* scratch );
+	// Rows of the intermediate tensor which belong to the beam
+	CpuCompute::Tensor beamRows( uint16_t id, uint32_t beam ) const;
+
+	// Pointers to the pages of the KV cache for the self-attention
+	CpuCompute::KvTensors::sPageTable pageTable;
+	// Copy the N rows of keys and values into the pages of the slot, starting at n_past position, quantizing them for INT8 cache
+	static void storeKv( CpuCompute::MlContext& ml, CpuCompute::KvTensors& kv, uint32_t slot, uint32_t layer, uint32_t n_past,
+		const CpuCompute::Tensor& k, const CpuCompute::Tensor& v );
+
+	class OutputAllocator;
+
+public:
+	// Capture the decoder step for the count of tokens.
+	// n_logits is the count of the last rows which need the probabilities, 0 to compute the logits summary of the last token instead.
+	// When beams > 1, the graph decodes a single token for each of these sequences, and computes the probabilities for all of them; N must be 1, n_logits is ignored.
+	HRESULT build( const CpuCompute::DecoderTensors& model, const Whisper::sModelParams& mp, uint32_t N, uint32_t n_logits, uint32_t beams = 1 );
+
+	// Count of bytes in the scratch buffer required to run this graph
+	size_t scratchBytes() const
+	{
+		return cbScratch;
+	}
+
+	// Caches of one decoded sequence
+	struct sSequence
+	{
+		CpuCompute::KvTensors* kv;
+		uint32_t slot;
+		uint32_t n_past;
+		// Keys and values of the cross-attention: the INT8 copy when not nullptr, otherwise the FP16 staging buffers
+		const KeyValueDownloader::ReadMap* kvCross;
+		const CpuCompute::QuantizedKv* crossInt8;
+		uint32_t M;
+	};
+
+	struct sRunParams
+	{
+		// n_tokens * beams elements, tokens of the sequences are consecutive
+		const int* tokens;
+		// `beams` elements
+		const sSequence* sequences;
+		uint32_t tokenBeg;
+		CpuCompute::sLogitsSummary* summary;
+	};
+
+	// Replay the operations. The scratch buffer must have at least scratchBytes() bytes, it's only used while this method runs.
+	// The caller must call kv.prepareWrite() for all sequences.
+	void run( CpuCompute::MlContext& ml, uint8_t* scratch, const sRunParams& rp, std::vector<float>& probs );
+};
@@ -2,7 +2,10 @@
 #include <immintrin.h>
 #include <optional>
 #include "HybridContext.h"
+#include "../CPU/mulMat.h"
+#include "../CPU/CpuTopology.h"
 #include "../Utils/Trace/tracing.h"
+#include "../Utils/ProfileCollection.h"
 
 #if BUILD_HYBRID_VERSION
 #ifndef __AVX__
@@ -27,327 +30,169 @@ namespace
 		return 1;
 #endif
 	}
-
-	constexpr size_t MB = 1u << 20;
 }
 
 HybridContext::HybridContext( const Whisper::WhisperModel& wm ) :
 	ml( threadsCount( 0 ) ),
 	model( wm.shared->hybridTensors ),
-	whisperModel( wm )
+	whisperModel( wm ),
+	// With the shared decoder, the KV cache of this context goes to the node of the engine threads which read it
+	numaNode( wm.shared->decodeEngine ? wm.shared->decodeEngine->numaNode() : CpuCompute::CpuTopology::instance().nextNode() ),
+	engine( wm.shared->decodeEngine.get() )
 { }
 
-namespace
-{
-	enum struct eModelType : uint8_t
-	{
-		Tiny = 0,
-		Base = 1,
-		Small = 2,
-		Medium = 3,
-		Large = 4,
-	};
-
-	static HRESULT detectModelType( const Whisper::sModelParams& modelParams, eModelType& mt )
-	{
-		switch( modelParams.n_audio_layer )
-		{
-		case 4:
-			mt = eModelType::Tiny;
-			return S_OK;
-		case 6:
-			mt = eModelType::Base;
-			return S_OK;
-		case 12:
-			mt = eModelType::Small;
-			return S_OK;
-		case 24:
-			mt = eModelType::Medium;
-			return S_OK;
-		case 32:
-			mt = eModelType::Large;
-			return S_OK;
-		}
-		logError( u8"Unrecognized model" );
-		return E_INVALIDARG;
-	}
-
-	struct alignas( 2 ) RamMB
-	{
-		uint8_t dec, decLayer;
-		constexpr RamMB( uint8_t d, uint8_t dl ) : dec( d ), decLayer( dl ) { }
-
-		__m128i loadBytes() const
-		{
-			__m128i v = _mm_loadu_si16( this );
-			// Upcast bytes to int64_t. That instruction can load directly from memory, too bad VC++ optimized doesn't care
-			v = _mm_cvtepu8_epi64( v );
-			// Scale from megabytes into bytes, the multiplier is obviously 2^20
-			v = _mm_slli_epi64( v, 20 );
-			return v;
-		}
-	};
-
-	// The magic numbers are from MEM_REQ_DECODE and MEM_REQ_DECODE_LAYER red/black maps in the reference version,
-	// near the top of whisper.cpp source file
-	static const std::array<RamMB, 5> s_memRequirements =
-	{
-		RamMB{ 200, 32 },	// Tiny
-		RamMB{ 202, 44 },	// Base
-		RamMB{ 204, 64 },	// Small
-		RamMB{ 206, 84 },	// Medium
-		RamMB{ 208, 110 },	// Large
-	};
-}
-
 HRESULT HybridContext::create()
 {
-	// Allocate buffers for compute
-	// We know they're large, so bypassing the heap
-	eModelType modelType;
-	CHECK( detectModelType( whisperModel.parameters, modelType ) );
-
-	const __m128i bytes = s_memRequirements.at( (uint8_t)modelType ).loadBytes();
-	CHECK( allocCompute.create( _mm_cvtsi128_si64( bytes ) ) );
-	CHECK( allocComputeLayer.create( _mm_extract_epi64( bytes, 1 ) ) );
-
 	// Create staging buffers to download output from encoder stage,
 	// in the reference version they're named memory_cross_k / memory_cross_v
 	CHECK( kvCross.create( whisperModel.parameters ) );
 
 	// Create RAM buffers for memory_k / memory_v
-	CHECK( kv.create( whisperModel.parameters ) );
+	const bool kvLargePages = hasFlag( model.largePages, CpuCompute::eLargePages::KvCache );
+	CHECK( kv.create( whisperModel.parameters, kvLargePages, 1, model.int8KvCache ) );
+	if( model.int8KvCache )
+		CHECK( kvCrossInt8.create( whisperModel.parameters, kvLargePages ) );
+
+	// Capture the graph for the most common case, decoding a single token into the logits summary.
+	// That graph sizes the scratch buffer for the intermediate tensors, the longer prompts grow the buffer as needed.
+	DecodeGraph* graph;
+	CHECK( getGraph( 1, 0, 1, graph ) );
+
+#if 0
+	CHECK( CpuCompute::dbgBenchmarkPrePackedMulMat( threadsCount( 0 ) ) );
+	CHECK( CpuCompute::dbgCompareInt8MulMat( threadsCount( 0 ) ) );
+	CHECK( CpuCompute::dbgCheckExpGelu( threadsCount( 0 ) ) );
+#endif
 
 	return S_OK;
 }
 
-class HybridContext::SetAllocatorRaii
+HRESULT HybridContext::getGraph( uint32_t N, uint32_t n_logits, uint32_t beams, DecodeGraph*& rdi )
 {
-	HybridContext& context;
-	CpuCompute::iMemoryAllocator* prevAlloc;
-	CpuCompute::iArenaAllocator* newAlloc;
-public:
-
-	SetAllocatorRaii( HybridContext* owner, CpuCompute::iArenaAllocator& a ) :
-		context( *owner )
+	const uint64_t key = ( (uint64_t)beams << 48 ) | ( (uint64_t)N << 32 ) | n_logits;
+	auto it = graphs.find( key );
+	if( it == graphs.end() )
 	{
-		prevAlloc = context.ml.setAllocator( &a );
-		newAlloc = &a;
+		std::unique_ptr<DecodeGraph> graph = std::make_unique<DecodeGraph>();
+		CHECK( graph->build( model, whisperModel.parameters, N, n_logits, beams ) );
+		it = graphs.emplace( key, std::move( graph ) ).first;
 	}
-	~SetAllocatorRaii()
+	rdi = it->second.get();
+
+	const size_t cb = rdi->scratchBytes();
+	if( cb > scratchCapacity )
 	{
-		context.ml.setAllocator( prevAlloc );
-		newAlloc->resetArena();
+		CHECK( scratch.allocate( cb, hasFlag( model.largePages, CpuCompute::eLargePages::Compute ) ) );
+		scratchCapacity = cb;
+		logDebug( u8"HybridContext: %zu bytes of scratch memory for %i tokens", cb, (int)( N * beams ) );
 	}
-};
+	return S_OK;
+}
 
 HRESULT HybridContext::decode( const int* tokens, const int n_tokens, const int n_past, const sDecParams& dp, std::vector<float>& probs )
 {
-	CHECK( ml.setThreadsCount( dp.n_threads ) );
+	CHECK( ml.setThreadsCount( dp.n_threads, dp.spinMicroseconds, dp.pinThreads, numaNode ) );
 
-	// whisper_decode
-	const auto& hparams = whisperModel.parameters;
-	const uint32_t n_vocab = hparams.n_vocab;
+	std::optional<CpuCompute::ThreadAffinityRaii> pinCaller;
+	if( dp.pinThreads )
+		pinCaller.emplace( ml.callerProcessor() );
 
-	const uint32_t n_ctx = hparams.n_text_ctx;
-	const uint32_t n_state = hparams.n_text_state;
-	const uint32_t n_head = hparams.n_text_head;
-	const uint32_t n_layer = hparams.n_text_layer;
+	// whisper_decode
+	if( n_tokens <= 0 || n_past < 0 || 0 == dp.beams )
+		return E_INVALIDARG;
+	if( dp.beams > 1 && ( 1 != n_tokens || nullptr != dp.summary || nullptr == dp.slots ) )
+		return E_INVALIDARG;
 
-	const uint32_t N = n_tokens;
-	const uint32_t M = dp.M;
+	// Allocate the pages of the KV cache for the new tokens, and copy the pages shared with other slots
+	for( uint32_t b = 0; b < dp.beams; b++ )
+		CHECK( kv.prepareWrite( ( nullptr != dp.slots ) ? dp.slots[ b ] : 0, (uint32_t)n_past, (uint32_t)n_tokens ) );
 
-	SetAllocatorRaii ac{ this, allocCompute };
-	using namespace CpuCompute;
-	Tensor cur = ml.addRows( model.tokenEmbedding, model.positionalEmbedding, tokens, n_tokens, n_past );
-	Tracing::tensor( "dec-rows", cur );
+	if( dp.pinThreads )
+	{
+		// Place physical pages of the new chunks of the KV cache on the NUMA node of the threads.
+		// The decoder weights are shared by all contexts of the model, they stay on the node of the thread which loaded them.
+		for( ; placedChunks < kv.chunksCount(); placedChunks++ )
+			CHECK( ml.firstTouch( kv.chunkPointer( placedChunks ), kv.chunkBytes() ) );
+	}
 
-	Tensor inpL = cur;
+	const uint32_t M = (uint32_t)dp.M;
 	auto kvCross = this->kvCross.map();
-
-	for( uint32_t il = 0; il < n_layer; il++ )
+	if( model.int8KvCache )
 	{
-		if( 0 == il ) Tracing::tensor( "dec-inpL", inpL );
-		const auto& layer = model.layers[ il ];
-		SetAllocatorRaii acLayer{ this, allocComputeLayer };
-
-		// norm
-		Tensor cur = ml.norm( inpL );
-		ml.fmaRepeat( cur, layer.attnLn0 );
-		if( 0 == il ) Tracing::tensor( "dec-norm", cur );
-
-		// self-attention
+		// The encoder has produced new keys and values since the previous call, or this window has a different count of them
+		if( kvCrossInt8.rows() != M )
 		{
-			Tensor Qcur = ml.mulMat( layer.attnQuery.w, cur );
-			if( 0 == il ) Tracing::tensor( "dec-Qcur-0", Qcur );
-			const float scaling = computeScaling( (int)n_state, (int)n_head );
-			ml.addRepeatScale( Qcur, layer.attnQuery.b, scaling );
-			if( 0 == il ) Tracing::tensor( "dec-Qcur-1", Qcur );
-
-			// note: no bias for Key
-			Tensor Kcur = ml.mulMat( layer.attnKey, cur );
-			ml.scale( Kcur, scaling );
-			if( 0 == il ) Tracing::tensor( "dec-Kcur", Kcur );
-
-			Tensor Vcur = ml.mulMat( layer.attnValue.w, cur );
-			ml.addRepeat( Vcur, layer.attnValue.b );
-			if( 0 == il ) Tracing::tensor( "dec-Vcur", Vcur );
-
-			// store key and value to memory
-			{
-				const uint32_t len = N * n_state;
-				const uint32_t off = n_state * ( (uint32_t)il * n_ctx + n_past );
-				Tensor k = kv.keysView( len, off );
-				Tensor v = kv.valuesView( len, off );
-
-				CHECK( ml.copyImpl( k, Kcur ) );
-				CHECK( ml.copyImpl( v, Vcur ) );
-			}
-
-			// ------
-			Tensor Q = ml.permute( ml.copy( Qcur, eDataType::FP32, { n_state / n_head, n_head, N } ), 0, 2, 1, 3 );
-			Tensor K = ml.permute( kv.keysView( ( n_past + N ) * n_state, (uint32_t)il * n_ctx * n_state )
-				.reshape3d( n_state / n_head, n_head, n_past + N ),
-				0, 2, 1, 3 );
-			Tensor KQ = ml.mulMat( K, Q );
-			if( 0 == il ) Tracing::tensor( "dec-KQ-0", KQ );
-			ml.diagMaskInf( KQ, n_past );
-			if( 0 == il ) Tracing::tensor( "dec-KQ-1", KQ );
-			ml.softMax( KQ );
-			if( 0 == il ) Tracing::tensor( "dec-KQ-2", KQ );
-
-			Tensor V_trans = ml.permute(
-				kv.valuesView( ( n_past + N ) * n_state, (uint32_t)il * n_ctx * n_state )
-				.reshape3d( n_state / n_head, n_head, n_past + N ),
-				1, 2, 0, 3 );
-
-			Tensor KQV = ml.mulMat( V_trans, KQ );
-			if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
-
-			Tensor KQV_merged = ml.permute( KQV, 0, 2, 1, 3 );
-			ml.copyInPlace( cur, KQV_merged, eDataType::FP32, { n_state, N } );
-		}
-
-		{
-			cur = ml.mulMat( layer.attnLn1.w, cur );
-			ml.addRepeat( cur, layer.attnLn1.b );
-		}
-
-		// add the input
-		Tensor inpCA = ml.add( cur, inpL );
-
-		// norm
-		{
-			cur = ml.norm( inpCA );
-			ml.fmaRepeat( cur, layer.crossAttnLn0 );
+			const uint32_t len = (uint32_t)whisperModel.parameters.n_text_layer * M * (uint32_t)whisperModel.parameters.n_text_state;
+			CHECK( kvCrossInt8.quantize( ml, kvCross.keysView( len, 0 ), kvCross.valuesView( len, 0 ), M ) );
 		}
+	}
 
-		// cross-attention
-		{
-			Tensor Qcur = ml.mulMat( layer.crossAttnQuery.w, cur );
-			ml.addRepeatScale( Qcur, layer.crossAttnQuery.b, computeScaling( (int)n_state, (int)n_head ) );
-
-			// Kcross is already scaled
-			const uint32_t len = M * n_state;
-			const uint32_t off = (uint32_t)il * len;
-			Tensor Kcross = kvCross.keysView( len, off ).reshape3d( n_state / n_head, n_head, M );
-			Tensor Vcross = kvCross.valuesView( len, off ).reshape3d( n_state / n_head, n_head, M );
-
-			// ------
-			Tensor Q = ml.permute( ml.copy( Qcur, eDataType::FP32, { n_state / n_head, n_head, N } ), 0, 2, 1, 3 );
-			Tensor K = ml.permute( Kcross, 0, 2, 1, 3 );
-			Tensor KQ = ml.mulMat( K, Q );
-			ml.softMax( KQ );
-			Tensor V_trans = ml.permute( Vcross, 1, 2, 0, 3 );
-			Tensor KQV = ml.mulMat( V_trans, KQ );
-			if( 0 == il ) Tracing::tensor( "dec-KQV", KQV );
-			Tensor KQV_merged = ml.permute( KQV, 0, 2, 1, 3 );
-
-			ml.copyInPlace( cur, KQV_merged, eDataType::FP32, { n_state, N } );
-		}
-
-		// projection
-		{
-			cur = ml.mulMat( layer.crossAttnLn1.w, cur );
-			ml.addRepeat( cur, layer.crossAttnLn1.b );
-		}
-		// add the input
-		ml.addInPlace( cur, inpCA );
-		Tensor inpFF = cur;
-
-		// feed-forward network
-		{
-			// norm
-			cur = ml.norm( inpFF );
-			ml.fmaRepeat( cur, layer.mlpLn );
-
-			cur = ml.mulMat( layer.mlp0.w, cur );
-			ml.addRepeatGelu( cur, layer.mlp0.b );
-
-			// The mulMat() below creates a tensor for the output of this layer.
-			// We have a special memory storage for these tensors, that's how they survive resets of per-layer arenas
-			allocLayerOutput.resetArena();
-			ml.setAllocator( &allocLayerOutput );
-
-			// projection
-			cur = ml.mulMat( layer.mlp1.w, cur );
-			ml.addRepeat( cur, layer.mlp1.b );
-		}
+	sequences.resize( dp.beams );
+	for( uint32_t b = 0; b < dp.beams; b++ )
+	{
+		DecodeGraph::sSequence& s = sequences[ b ];
+		s.kv = &kv;
+		s.slot = ( nullptr != dp.slots ) ? dp.slots[ b ] : 0;
+		s.n_past = (uint32_t)n_past;
+		s.kvCross = &kvCross;
+		s.crossInt8 = model.int8KvCache ? &kvCrossInt8 : nullptr;
+		s.M = M;
+	}
 
-		// output from this layer
-		ml.addInPlace( cur, inpFF );
-		inpL = cur;
+	if( nullptr != engine && 1 == n_tokens && 1 == dp.beams )
+	{
+		// Single-token step of a single sequence: submit into the decoder shared by all contexts of the model, which merges it with the steps of other contexts.
+		// The KV caches and the mapped cross-attention buffers stay alive while this thread waits for the result.
+		if( nullptr != dp.summary )
+			dp.summary->valid = false;
+		DecodeEngine::sStep step;
+		step.token = tokens[ 0 ];
+		step.sequence = sequences[ 0 ];
+		step.probs = &probs;
+		return engine->submit( step ).get();
 	}
 
-	// norm
-	cur = ml.norm( inpL );
-	ml.fmaRepeat( cur, model.ln );
+	// When computing the summary, the n_logits is ignored, and the graph ends with the fused vocabulary projection
+	uint32_t n_logits = 0;
+	if( nullptr == dp.summary )
+		n_logits = ( dp.n_logits > 0 && dp.n_logits < n_tokens ) ? (uint32_t)dp.n_logits : (uint32_t)n_tokens;
 
-	cur = ml.mulMat( model.tokenEmbedding, cur );
+	DecodeGraph* graph;
+	CHECK( getGraph( (uint32_t)n_tokens, n_logits, dp.beams, graph ) );
 
-	// logits -> probs
-	ml.softMax( cur );
+	DecodeGraph::sRunParams rp;
+	rp.tokens = tokens;
+	rp.sequences = sequences.data();
+	rp.tokenBeg = (uint32_t)whisperModel.shared->vocab.token_beg;
+	rp.summary = dp.summary;
+	graph->run( ml, scratch.pointer(), rp, probs );
+	return S_OK;
+}
 
-	const float* rsi = cur.fp32();
-	probs.assign( rsi, rsi + cur.countElements() );
-	Tracing::vector( "probs", probs );
+HRESULT HybridContext::reserveSlots( uint32_t count )
+{
+	if( count == kv.slots() )
+		return S_OK;
+	CHECK( kv.create( whisperModel.parameters, hasFlag( model.largePages, CpuCompute::eLargePages::KvCache ), count, model.int8KvCache ) );
+	// The new memory has not been touched by the pinned threads yet
+	placedChunks = 0;
 	return S_OK;
 }
 
-void* HybridContext::AllocSingle::allocate( size_t cb, size_t align )
+void HybridContext::flushOpStats( Whisper::ProfileCollection& profiler )
 {
-	if( !allocated )
+	const auto& stats = ml.getOpStats();
+	for( size_t i = 0; i < stats.size(); i++ )
 	{
-		allocated = true;
-		if( cb <= capacity )
-		{
-			CpuCompute::dbgMarkUninitializedMemory( buffer.pointer(), capacity );
-			return buffer.pointer();
-		}
-		else
-		{
-			HRESULT hr = buffer.allocate( cb );
-			if( SUCCEEDED( hr ) )
-			{
-				capacity = cb;
-				CpuCompute::dbgMarkUninitializedMemory( buffer.pointer(), capacity );
-				return buffer.pointer();
-			}
-			logErrorHr( hr, u8"HybridContext.AllocSingle.allocate" );
-			throw hr;
-		}
-	}
-	else
-	{
-		logError( u8"HybridContext.AllocSingle only supports 1 tensor" );
-		throw E_UNEXPECTED;
+		const CpuCompute::sOpStats& s = stats[ i ];
+		if( 0 == s.calls )
+			continue;
+		auto& measure = profiler.measure( (CpuCompute::eCpuOp)i );
+		measure.count += s.calls;
+		measure.totalTicks += Whisper::ticksFromTsc( s.tsc );
+		measure.totalThreads += s.threads;
 	}
+	ml.resetOpStats();
 }
 
-void HybridContext::AllocSingle::resetArena()
-{
-	allocated = false;
-	if( capacity > 0 )
-		CpuCompute::dbgMarkFreedMemory( buffer.pointer(), capacity );
-}
 #endif
\ No newline at end of file
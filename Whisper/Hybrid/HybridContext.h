@@ -1,35 +1,44 @@
 #pragma once
 #include "../Whisper/WhisperModel.h"
 #include "../CPU/MlContext.h"
-#include "../CPU/BufferAllocator.h"
 #include "KeyValueDownloader.h"
 #include "../CPU/KvTensors.h"
+#include "../CPU/QuantizedKv.h"
+#include "DecodeGraph.h"
+#include "DecodeEngine.h"
+#include <map>
+
+namespace Whisper
+{
+	class ProfileCollection;
+}
 
 // This version of the hybrid context uses the new, custom-built kernels
 class HybridContext
 {
 	CpuCompute::MlContext ml;
-	CpuCompute::VirtualAllocator allocCompute, allocComputeLayer;
-	
-	class AllocSingle : public CpuCompute::iArenaAllocator
-	{
-		CpuCompute::LargeBuffer buffer;
-		size_t capacity = 0;
-		bool allocated = false;
-		// Inherited via iArenaAllocator
-		virtual void* allocate( size_t cb, size_t align ) override final;
-
-	public:
-		virtual void resetArena() override final;
-	};
-	AllocSingle allocLayerOutput;
+
+	// Captured decoder steps, the key is ( count of beams, count of tokens, count of logits ) packed into uint64_t
+	std::map<uint64_t, std::unique_ptr<DecodeGraph>> graphs;
+	// Memory for the intermediate tensors, shared by all graphs
+	CpuCompute::LargeBuffer scratch;
+	size_t scratchCapacity = 0;
+
+	HRESULT getGraph( uint32_t N, uint32_t n_logits, uint32_t beams, DecodeGraph*& rdi );
 
 	const CpuCompute::DecoderTensors& model;
 	const Whisper::WhisperModel& whisperModel;
 	KeyValueDownloader kvCross;
+	// INT8 copy of kvCross, only used when the model has int8KvCache flag; quantized on the first decode() after downloadKeyValues()
+	CpuCompute::QuantizedKv kvCrossInt8;
 	CpuCompute::KvTensors kv;
-
-	class SetAllocatorRaii;
+	// NUMA node for the threads of this context, only used when these threads are pinned
+	const uint32_t numaNode;
+	// Count of the KV cache chunks which were first touched from the pinned threads
+	uint32_t placedChunks = 0;
+	// Decoder shared by all contexts of the model, nullptr unless the model was loaded with HybridSharedDecoder flag
+	DecodeEngine* const engine;
+	std::vector<DecodeGraph::sSequence> sequences;
 
 public:
 
@@ -39,6 +48,7 @@ public:
 
 	HRESULT downloadKeyValues( const DirectCompute::KeyValueBuffers& source )
 	{
+		kvCrossInt8.clear();
 		return kvCross.download( source );
 	}
 
@@ -46,7 +56,52 @@ public:
 	{
 		int n_threads;
 		int M;
+		// Count of the last tokens to compute the probabilities for, the output vector contains n_logits * n_vocab numbers
+		// Values outside of [ 1 .. n_tokens ] interval are interpreted as n_tokens
+		int n_logits;
+		// When not nullptr, only compute the summary of the probabilities for the last token, and leave the output vector empty
+		CpuCompute::sLogitsSummary* summary = nullptr;
+		// When greater than 1, decode a single token for each of these beams in one pass, the output vector contains beams * n_vocab numbers.
+		// In that mode n_tokens must be 1, tokens has `beams` elements, and the summary is not supported.
+		uint32_t beams = 1;
+		// Slots of the KV cache for every beam, nullptr to use the first slot
+		const uint32_t* slots = nullptr;
+		// Parameters of the thread pool, see ParallelForRunner.setThreadsCount
+		// When pinned, the threads run on the NUMA node assigned to this context, and the calling thread is pinned for the duration of decode()
+		uint32_t spinMicroseconds = 0;
+		bool pinThreads = false;
 	};
 
 	HRESULT decode( const int* tokens, const int n_tokens, const int n_past, const sDecParams& dp, std::vector<float>& probs_out );
+
+	// Set the count of independent sequences in the KV cache, discards the content of the cache
+	HRESULT reserveSlots( uint32_t count );
+	uint32_t slotsCount() const
+	{
+		return kv.slots();
+	}
+	// Share the first `length` positions of the KV cache from one slot with another one, the pages are copied when written
+	HRESULT copySlot( uint32_t source, uint32_t dest, uint32_t length )
+	{
+		return kv.copySlot( source, dest, length );
+	}
+
+	// Move the counters of the compute operations into the profiler
+	void flushOpStats( Whisper::ProfileCollection& profiler );
+
+	// Bytes of system RAM used by the KV cache and the intermediate tensors
+	size_t memoryUsage() const
+	{
+		return kv.bytes() + kvCrossInt8.bytes() + scratchCapacity;
+	}
+
+	// Sizes of the memory pages which back the weights, the KV cache, and the intermediate tensors; 0 for the buffers not allocated yet
+	struct sMemoryPages
+	{
+		size_t weights, kvCache, compute;
+	};
+	sMemoryPages memoryPages() const
+	{
+		return sMemoryPages{ model.pageSize(), kv.pageSize(), scratch.pageSize() };
+	}
 };
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "GpuProfiler.h"
 #include "../Whisper/WhisperModel.h"
 #include "../D3D/shaderNames.h"
+#include "../CPU/MlContext.h"
 using namespace Whisper;
 
 ProfileCollection::Measure& ProfileCollection::measure( DirectCompute::eProfilerBlock which )
@@ -27,6 +28,14 @@ ProfileCollection::Measure& ProfileCollection::measure( eCpuBlock which )
 	return measures[ key ];
 }
 
+ProfileCollection::Measure& ProfileCollection::measure( CpuCompute::eCpuOp which )
+{
+	uint32_t key = (uint8_t)which;
+	key |= 0x40000;
+	CComCritSecLock<CComAutoCriticalSection> lock{ critSec };
+	return measures[ key ];
+}
+
 #if PROFILER_COLLECT_TAGS
 ProfileCollection::Measure& ProfileCollection::measure( DirectCompute::eComputeShader which, uint16_t tag )
 {
@@ -91,6 +100,11 @@ namespace
 		return DirectCompute::computeShaderName( (DirectCompute::eComputeShader)id );
 	}
 
+	static const char* printCpuOp( uint16_t id )
+	{
+		return CpuCompute::cpuOpName( (CpuCompute::eCpuOp)id );
+	}
+
 	static pfnPrintEnum printSectionStart( uint16_t type )
 	{
 		switch( type )
@@ -104,6 +118,9 @@ namespace
 		case 3:
 			logInfo( u8"    Compute Shaders" );
 			return &printShader;
+		case 4:
+			logInfo( u8"    CPU Decoder Operations" );
+			return &printCpuOp;
 		default:
 			return nullptr;
 		}
@@ -164,6 +181,8 @@ void ProfileCollection::Measure::print( const char* name ) const
 		PrintedTime avg = (double)totalTicks / (double)(int64_t)count;
 		logInfo( u8"%s\t%g %s, %zu calls, %g %s average", name, total.value, total.unit, count, avg.value, avg.unit );
 	}
+	if( 0 != totalThreads )
+		logInfo( u8"\t%.2f threads average", (double)(int64_t)totalThreads / (double)(int64_t)count );
 }
 
 #if PROFILER_COLLECT_TAGS
@@ -204,17 +223,17 @@ void ProfileCollection::print()
 	}
 
 	std::sort( keysTemp.begin(), keysTemp.end() );
-	auto it = std::lower_bound( keysTemp.begin(), keysTemp.end(), 0x30000u );
-	if( it != keysTemp.end() )
+	// Sort compute shaders and CPU decoder operations by time, separately
+	auto lambda = [ this ]( uint32_t a, uint32_t b )
 	{
-		auto lambda = [ this ]( uint32_t a, uint32_t b )
-		{
-			const uint64_t ta = measures.Lookup( a )->m_value.totalTicks;
-			const uint64_t tb = measures.Lookup( b )->m_value.totalTicks;
-			return ta > tb;
-		};
-		std::stable_sort( it, keysTemp.end(), lambda );
-	}
+		const uint64_t ta = measures.Lookup( a )->m_value.totalTicks;
+		const uint64_t tb = measures.Lookup( b )->m_value.totalTicks;
+		return ta > tb;
+	};
+	auto it = std::lower_bound( keysTemp.begin(), keysTemp.end(), 0x30000u );
+	auto itOps = std::lower_bound( it, keysTemp.end(), 0x40000u );
+	std::stable_sort( it, itOps, lambda );
+	std::stable_sort( itOps, keysTemp.end(), lambda );
 
 #if PROFILER_COLLECT_TAGS
 	taggedKeysTemp.clear();
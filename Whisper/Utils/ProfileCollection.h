@@ -7,6 +7,10 @@ namespace DirectCompute
 	enum struct eComputeShader : uint16_t;
 	enum struct eProfilerBlock : uint16_t;
 }
+namespace CpuCompute
+{
+	enum struct eCpuOp : uint8_t;
+}
 
 namespace Whisper
 {
@@ -37,11 +41,14 @@ namespace Whisper
 			size_t count = 0;
 			// 100-nanosecond ticks
 			uint64_t totalTicks = 0;
+			// Sum of the thread counts, only used for the operations of the hybrid decoder
+			uint64_t totalThreads = 0;
 
 			void reset()
 			{
 				count = 0;
 				totalTicks = 0;
+				totalThreads = 0;
 			}
 
 			void print( const char* name ) const;
@@ -56,6 +63,7 @@ namespace Whisper
 		Measure& measure( DirectCompute::eProfilerBlock which );
 		Measure& measure( DirectCompute::eComputeShader which );
 		Measure& measure( eCpuBlock which );
+		Measure& measure( CpuCompute::eCpuOp which );
 #if PROFILER_COLLECT_TAGS
 		Measure& measure( DirectCompute::eComputeShader which, uint16_t tag );
 #endif
@@ -0,0 +1,247 @@
+#include "stdafx.h"
+#include "ReadStream.h"
+
+ReadStream::~ReadStream()
+{
+	if( nullptr != work )
+	{
+		WaitForThreadpoolWorkCallbacks( work, FALSE );
+		CloseThreadpoolWork( work );
+		work = nullptr;
+	}
+}
+
+HRESULT ReadStream::open( const wchar_t* path, size_t bufferBytes )
+{
+	if( file )
+		return HRESULT_CODE( ERROR_ALREADY_INITIALIZED );
+	if( bufferBytes < 4096 || bufferBytes > INT_MAX )
+		return E_INVALIDARG;
+
+	CHECK( file.Create( path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN ) );
+	CHECK( file.GetSize( *(ULONGLONG*)&fileLength ) );
+
+	try
+	{
+		for( Buffer& b : buffers )
+			b.data = std::make_unique<uint8_t[]>( bufferBytes );
+	}
+	catch( const std::bad_alloc& )
+	{
+		return E_OUTOFMEMORY;
+	}
+	bufferSize = bufferBytes;
+
+	work = CreateThreadpoolWork( &readAheadCallback, this, nullptr );
+	if( nullptr == work )
+		return getLastHr();
+
+	// Start with an empty current buffer at the start of the file, the first read() fills it
+	current = 0;
+	readPos = 0;
+	buffers[ 0 ].offset = 0;
+	buffers[ 0 ].length = 0;
+	return S_OK;
+}
+
+HRESULT ReadStream::readAt( void* rdi, int64_t offset, size_t cb, size_t& cbRead ) noexcept
+{
+	// Positional read. On a synchronous handle ReadFile also moves the file pointer, but this class never uses that pointer.
+	// The caller makes sure the main thread and the read-ahead callback never read concurrently.
+	OVERLAPPED ov;
+	memset( &ov, 0, sizeof( ov ) );
+	ov.Offset = (DWORD)(uint64_t)offset;
+	ov.OffsetHigh = (DWORD)( (uint64_t)offset >> 32 );
+	DWORD cbDone = 0;
+	cbRead = 0;
+	if( !ReadFile( file, rdi, (DWORD)cb, &cbDone, &ov ) )
+		return getLastHr();
+	cbRead = cbDone;
+	return S_OK;
+}
+
+HRESULT ReadStream::fill( Buffer& buffer, int64_t offset ) noexcept
+{
+	buffer.offset = offset;
+	buffer.length = 0;
+	if( offset >= fileLength )
+		return buffer.status = S_OK;
+
+	const size_t cb = std::min( bufferSize, (size_t)( fileLength - offset ) );
+	return buffer.status = readAt( buffer.data.get(), offset, cb, buffer.length );
+}
+
+void __stdcall ReadStream::readAheadCallback( PTP_CALLBACK_INSTANCE Instance, PVOID pv, PTP_WORK Work )
+{
+	ReadStream& rs = *(ReadStream*)pv;
+	// The current index doesn't change while the read-ahead is pending, the main thread waits for completion before switching buffers
+	rs.fill( rs.buffers[ rs.current ^ 1 ], rs.readAheadOffset );
+}
+
+void ReadStream::submitReadAhead()
+{
+	const Buffer& src = buffers[ current ];
+	const int64_t next = src.offset + (int64_t)src.length;
+	if( next >= fileLength )
+		return;
+	readAheadOffset = next;
+	readAheadPending = true;
+	SubmitThreadpoolWork( work );
+}
+
+void ReadStream::waitReadAhead()
+{
+	if( !readAheadPending )
+		return;
+	WaitForThreadpoolWorkCallbacks( work, FALSE );
+	readAheadPending = false;
+}
+
+bool ReadStream::switchToReadAhead( int64_t offset )
+{
+	// The read-ahead buffer is only valid after the pending IO completes
+	const bool hadReadAhead = readAheadPending;
+	waitReadAhead();
+	Buffer& other = buffers[ current ^ 1 ];
+	if( !hadReadAhead || FAILED( other.status ) || offset < other.offset || offset >= other.offset + (int64_t)other.length )
+		return false;
+	current ^= 1;
+	readPos = (size_t)( offset - other.offset );
+	return true;
+}
+
+void ReadStream::dropBuffer( int64_t offset )
+{
+	Buffer& curr = buffers[ current ];
+	curr.offset = offset;
+	curr.length = 0;
+	readPos = 0;
+}
+
+HRESULT ReadStream::moveTo( int64_t offset )
+{
+	if( offset < 0 )
+		return E_INVALIDARG;
+	Buffer& curr = buffers[ current ];
+	if( offset >= curr.offset && offset < curr.offset + (int64_t)curr.length )
+	{
+		readPos = (size_t)( offset - curr.offset );
+		return S_OK;
+	}
+
+	if( switchToReadAhead( offset ) )
+	{
+		// Sequential access, the next chunk is already there
+		submitReadAhead();
+		return S_OK;
+	}
+
+	// Random access, the first read, or the read-ahead failed: load the chunk synchronously
+	CHECK( fill( curr, offset ) );
+	readPos = 0;
+	submitReadAhead();
+	return S_OK;
+}
+
+HRESULT ReadStream::readDirect( uint8_t* rdi, int64_t offset, size_t cb, size_t& cbRead )
+{
+	cbRead = 0;
+	if( offset < fileLength )
+	{
+		cb = std::min( cb, (size_t)( fileLength - offset ) );
+		CHECK( readAt( rdi, offset, cb, cbRead ) );
+	}
+	// The next read continues after these bytes, the buffer is loaded on demand
+	dropBuffer( offset + (int64_t)cbRead );
+	return S_OK;
+}
+
+HRESULT ReadStream::read( void* lpBuffer, int nNumberOfBytesToRead, int& lpNumberOfBytesRead )
+{
+	lpNumberOfBytesRead = 0;
+	if( nNumberOfBytesToRead < 0 )
+		return E_INVALIDARG;
+	if( nullptr == work )
+		return OLE_E_BLANK;
+
+	uint8_t* rdi = (uint8_t*)lpBuffer;
+	size_t remaining = (size_t)nNumberOfBytesToRead;
+	while( remaining > 0 )
+	{
+		const Buffer& buffer = buffers[ current ];
+		if( readPos >= buffer.length )
+		{
+			const int64_t pos = buffer.offset + (int64_t)buffer.length;
+			if( pos >= fileLength )
+				break;	// End of file, the caller gets less bytes than requested
+			if( remaining < bufferSize )
+			{
+				CHECK( moveTo( pos ) );
+				continue;
+			}
+
+			// Large read: consume the chunk which was already read ahead, then read the rest straight into the destination
+			if( switchToReadAhead( pos ) )
+				continue;
+			size_t cbRead;
+			CHECK( readDirect( rdi, pos, remaining, cbRead ) );
+			if( 0 == cbRead )
+				break;
+			rdi += cbRead;
+			remaining -= cbRead;
+			continue;
+		}
+
+		const size_t cb = std::min( remaining, buffer.length - readPos );
+		memcpy( rdi, buffer.data.get() + readPos, cb );
+		rdi += cb;
+		readPos += cb;
+		remaining -= cb;
+	}
+
+	lpNumberOfBytesRead = nNumberOfBytesToRead - (int)remaining;
+	return S_OK;
+}
+
+HRESULT ReadStream::seek( int64_t offset, ComLight::eSeekOrigin origin )
+{
+	if( nullptr == work )
+		return OLE_E_BLANK;
+
+	int64_t pos;
+	switch( origin )
+	{
+	case ComLight::eSeekOrigin::Begin:
+		pos = offset;
+		break;
+	case ComLight::eSeekOrigin::Current:
+		pos = buffers[ current ].offset + (int64_t)readPos + offset;
+		break;
+	case ComLight::eSeekOrigin::End:
+		pos = fileLength + offset;
+		break;
+	default:
+		return E_INVALIDARG;
+	}
+	if( pos < 0 )
+		return HRESULT_FROM_WIN32( ERROR_NEGATIVE_SEEK );
+
+	Buffer& curr = buffers[ current ];
+	if( pos >= curr.offset && pos <= curr.offset + (int64_t)curr.length )
+	{
+		// Within the current buffer, or right past the end of it; the next read() will switch buffers
+		readPos = (size_t)( pos - curr.offset );
+		return S_OK;
+	}
+
+	// Use the read-ahead chunk when it has the data, otherwise drop the buffer without loading anything.
+	// When the model is memory-mapped, the loader seeks over every tensor, and the next read may be far away or never happen.
+	// Seeking past the end is allowed, just like with the files; reads will return 0 bytes
+	if( switchToReadAhead( pos ) )
+	{
+		submitReadAhead();
+		return S_OK;
+	}
+	dropBuffer( pos );
+	return S_OK;
+}
@@ -4,34 +4,74 @@
 #define WIN32_LEAN_AND_MEAN
 #include <atlfile.h>
 
+// Buffered read-only file stream with asynchronous read-ahead.
+// Two buffers: read() consumes the current one, while the thread pool fills the other one with the next chunk of the file.
+// This way the small reads of the tensor headers don't call the kernel, and parsing overlaps with the disk or network IO.
 class ReadStream : public ComLight::ObjectRoot<ComLight::iReadStream>
 {
+	struct Buffer
+	{
+		std::unique_ptr<uint8_t[]> data;
+		// Offset of the first byte in the file
+		int64_t offset = 0;
+		// Count of valid bytes in the buffer, less than the capacity at the end of the file
+		size_t length = 0;
+		// Status of the last fill operation
+		HRESULT status = S_OK;
+	};
+
 	CAtlFile file;
-	// TODO: implement a buffer in this class, at least 256kb
+	int64_t fileLength = 0;
+	size_t bufferSize = 0;
+	std::array<Buffer, 2> buffers;
+	// Index of the buffer consumed by read(), the other one is for the read-ahead
+	uint8_t current = 0;
+	// Position of the next read() in the current buffer
+	size_t readPos = 0;
+	PTP_WORK work = nullptr;
+	// True when the read-ahead of the other buffer was submitted to the thread pool, and not yet waited for
+	bool readAheadPending = false;
+	// Offset in the file for the read-ahead; the background thread doesn't access the current buffer
+	int64_t readAheadOffset = 0;
 
-	HRESULT COMLIGHTCALL read( void* lpBuffer, int nNumberOfBytesToRead, int& lpNumberOfBytesRead ) override final
-	{
-		return file.Read( lpBuffer, (DWORD)nNumberOfBytesToRead, *(DWORD*)&lpNumberOfBytesRead );
-	}
-	HRESULT COMLIGHTCALL seek( int64_t offset, ComLight::eSeekOrigin origin ) override final
-	{
-		return file.Seek( offset, (uint8_t)origin );
-	}
+	// Synchronously read bytes at the specified offset in the file
+	HRESULT readAt( void* rdi, int64_t offset, size_t cb, size_t& cbRead ) noexcept;
+	// Synchronously fill the buffer with the data at the specified offset in the file
+	HRESULT fill( Buffer& buffer, int64_t offset ) noexcept;
+	static void __stdcall readAheadCallback( PTP_CALLBACK_INSTANCE Instance, PVOID pv, PTP_WORK Work );
+	// Start reading the chunk which follows the current buffer into the other buffer
+	void submitReadAhead();
+	// Wait for the read-ahead to complete
+	void waitReadAhead();
+	// Wait for the read-ahead, and make it current if it contains the specified offset; a failed read-ahead is ignored, the caller reads synchronously
+	bool switchToReadAhead( int64_t offset );
+	// Make the current buffer empty, positioned at the specified offset in the file
+	void dropBuffer( int64_t offset );
+	// Make the data at the specified offset in the file current
+	HRESULT moveTo( int64_t offset );
+	// Read bytes bypassing the buffers, then position the empty current buffer after them
+	HRESULT readDirect( uint8_t* rdi, int64_t offset, size_t cb, size_t& cbRead );
+
+	HRESULT COMLIGHTCALL read( void* lpBuffer, int nNumberOfBytesToRead, int& lpNumberOfBytesRead ) override final;
+	HRESULT COMLIGHTCALL seek( int64_t offset, ComLight::eSeekOrigin origin ) override final;
 	HRESULT COMLIGHTCALL getPosition( int64_t& position ) override final
 	{
-		return file.GetPosition( *(ULONGLONG*)&position );
+		position = buffers[ current ].offset + (int64_t)readPos;
+		return S_OK;
 	}
 	HRESULT COMLIGHTCALL getLength( int64_t& length ) override final
 	{
-		return file.GetSize( *(ULONGLONG*)&length );
+		length = fileLength;
+		return S_OK;
 	}
 
 public:
+	static constexpr size_t defaultBufferSize = 1 << 20;
 
-	HRESULT open( const wchar_t* path )
-	{
-		if( file )
-			return HRESULT_CODE( ERROR_ALREADY_INITIALIZED );
-		return file.Create( path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN );
-	}
-};
\ No newline at end of file
+	ReadStream() = default;
+	ReadStream( const ReadStream& ) = delete;
+	~ReadStream();
+
+	// Open the file, the stream allocates two buffers of the specified size
+	HRESULT open( const wchar_t* path, size_t bufferBytes = defaultBufferSize );
+};
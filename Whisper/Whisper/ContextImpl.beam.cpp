@@ -0,0 +1,477 @@
+#include "stdafx.h"
+#include "ContextImpl.h"
+#include "../Utils/LZ4/lz4.h"
+using namespace Whisper;
+
+#define WHISPER_CHUNK_SIZE  30
+
+namespace
+{
+	// A partial hypothesis of the beam search, or a candidate of the temperature fallback
+	struct sBeam
+	{
+		std::vector<sTokenData> tokens;
+		double sumLogProb = 0;
+		// Slot of the KV cache with the keys and values of these tokens
+		uint32_t slot = 0;
+		// Index of the parent hypothesis in the previous step
+		uint32_t parent = 0;
+		// Same as the local variables of the greedy sampling loop in runFullImpl
+		int result_len = 0;
+		int seek_delta = 0;
+		bool has_ts = false;
+	};
+
+	// A possible continuation of a hypothesis
+	struct sCandidate
+	{
+		double score;
+		uint32_t parent;
+		sTokenData token;
+	};
+
+	enum struct eBeamState : uint8_t
+	{
+		Live,
+		Finished,
+		Failed,
+	};
+
+	// The rules of ContextImpl::sampleBest: the initial timestamp cannot be larger than 100,
+	// when the timestamps are more probable than any text token only the timestamps are sampled, and the special tokens are skipped.
+	// Returns the end of the timestamp tokens, and initializes the timestamp fields of the proto token.
+	int timestampRules( const Vocabulary& vocab, const float* probs, int n_vocab, bool forceTimestamp, bool isInitial, sTokenData& proto, bool& timestampsOnly )
+	{
+		const int tsEnd = isInitial ? std::min( vocab.token_beg + 101, n_vocab ) : n_vocab;
+
+		double max_tx = -1.0;
+		for( int i = 0; i < vocab.token_beg; i++ )
+			max_tx = std::max( max_tx, (double)probs[ i ] );
+
+		double sum_ts = 0.0;
+		double max_ts = -1.0;
+		proto = { 0 };
+		for( int i = vocab.token_beg; i < tsEnd; i++ )
+		{
+			sum_ts += probs[ i ];
+			if( probs[ i ] > max_ts )
+			{
+				max_ts = probs[ i ];
+				proto.tid = i;
+			}
+		}
+		proto.pt = (float)( max_ts / ( sum_ts + 1e-10 ) );
+		proto.ptsum = (float)sum_ts;
+		timestampsOnly = sum_ts > max_tx || forceTimestamp;
+		return tsEnd;
+	}
+
+	inline bool isSpecialToken( const Vocabulary& vocab, int i )
+	{
+		return i == vocab.token_sot || i == vocab.token_solm || i == vocab.token_not;
+	}
+
+	// Collect the most probable tokens of a row, with the same rules as ContextImpl::sampleBest
+	void topTokens( const Vocabulary& vocab, const float* probs, int n_vocab, bool forceTimestamp, bool isInitial, size_t count,
+		std::vector<std::pair<float, whisper_token>>& tmp, std::vector<sTokenData>& rdi )
+	{
+		sTokenData proto;
+		bool timestampsOnly;
+		const int tsEnd = timestampRules( vocab, probs, n_vocab, forceTimestamp, isInitial, proto, timestampsOnly );
+
+		tmp.clear();
+		if( !timestampsOnly )
+		{
+			for( int i = 0; i < vocab.token_beg; i++ )
+			{
+				if( isSpecialToken( vocab, i ) )
+					continue;
+				tmp.emplace_back( probs[ i ], i );
+			}
+		}
+		for( int i = vocab.token_beg; i < tsEnd; i++ )
+			tmp.emplace_back( probs[ i ], i );
+
+		count = std::min( count, tmp.size() );
+		std::partial_sort( tmp.begin(), tmp.begin() + count, tmp.end(),
+			[]( const std::pair<float, whisper_token>& a, const std::pair<float, whisper_token>& b ) {
+				return a.first > b.first;
+			} );
+
+		rdi.clear();
+		for( size_t i = 0; i < count; i++ )
+		{
+			sTokenData& td = rdi.emplace_back( proto );
+			td.id = tmp[ i ].second;
+			td.p = tmp[ i ].first;
+		}
+	}
+
+	// Sample a token from the probabilities raised to the power 1 / temperature, which is softmax( logits / temperature ), with the same rules as ContextImpl::sampleBest.
+	// The p field of the result is the probability at the temperature 1, the log-probabilities of the candidates are comparable across temperatures.
+	sTokenData sampleToken( const Vocabulary& vocab, const float* probs, int n_vocab, bool forceTimestamp, bool isInitial, float temperature,
+		std::mt19937& rng, std::vector<double>& weights )
+	{
+		sTokenData result;
+		bool timestampsOnly;
+		const int tsEnd = timestampRules( vocab, probs, n_vocab, forceTimestamp, isInitial, result, timestampsOnly );
+
+		const double exponent = 1.0 / temperature;
+		weights.assign( tsEnd, 0.0 );
+		double total = 0;
+		if( !timestampsOnly )
+		{
+			for( int i = 0; i < vocab.token_beg; i++ )
+			{
+				if( isSpecialToken( vocab, i ) )
+					continue;
+				const double w = std::pow( (double)probs[ i ], exponent );
+				weights[ i ] = w;
+				total += w;
+			}
+		}
+		for( int i = vocab.token_beg; i < tsEnd; i++ )
+		{
+			const double w = std::pow( (double)probs[ i ], exponent );
+			weights[ i ] = w;
+			total += w;
+		}
+
+		// Inverse transform sampling; when the weights underflow, fall back to the last non-zero one
+		double u = std::uniform_real_distribution<double>( 0.0, total )( rng );
+		int id = tsEnd - 1;
+		for( int i = 0; i < tsEnd; i++ )
+		{
+			if( weights[ i ] <= 0 )
+				continue;
+			id = i;
+			u -= weights[ i ];
+			if( u < 0 )
+				break;
+		}
+		result.id = id;
+		result.p = probs[ id ];
+		return result;
+	}
+
+	// Apply the rules of the greedy sampling loop in runFullImpl to the token appended to the hypothesis
+	eBeamState advanceBeam( const Vocabulary& vocab, const sFullParams& params, sBeam& beam, const sTokenData& token, int i, int seek, int seek_end, int n_max )
+	{
+		// timestamp token - update sliding window
+		if( token.id > vocab.token_beg )
+		{
+			const int seek_delta_new = 2 * ( token.id - vocab.token_beg );
+
+			// do not allow to go back in time
+			if( beam.has_ts && beam.seek_delta > seek_delta_new && beam.result_len < i )
+				return eBeamState::Finished;
+
+			beam.seek_delta = seek_delta_new;
+			beam.result_len = i + 1;
+			beam.has_ts = true;
+		}
+
+		beam.tokens.push_back( token );
+		beam.sumLogProb += std::log( std::max( token.p, FLT_MIN ) );
+
+		// end of segment
+		if( token.id == vocab.token_eot ||
+			( params.max_tokens > 0 && i >= params.max_tokens ) ||
+			( beam.has_ts && seek + beam.seek_delta + 100 >= seek_end ) )
+		{
+			if( beam.result_len == 0 )
+			{
+				if( seek + beam.seek_delta + 100 >= seek_end )
+					beam.result_len = i + 1;
+				else
+					return eBeamState::Failed;
+			}
+
+			if( params.flag( eFullParamsFlags::SingleSegment ) )
+			{
+				beam.result_len = i + 1;
+				beam.seek_delta = 100 * WHISPER_CHUNK_SIZE;
+			}
+			return eBeamState::Finished;
+		}
+
+		// Out of the context, same repetition loop detection as the greedy version
+		if( i == n_max - 1 )
+		{
+			if( beam.result_len == 0 || beam.seek_delta < 100 * WHISPER_CHUNK_SIZE / 2 )
+				return eBeamState::Failed;
+			return eBeamState::Finished;
+		}
+		return eBeamState::Live;
+	}
+
+	// Average log-probability of the tokens, the score to pick the final hypothesis
+	inline double averageLogProb( const sBeam& b )
+	{
+		return b.sumLogProb / (double)std::max( b.tokens.size(), (size_t)1 );
+	}
+
+	// Copy the hypothesis with the best score into the outputs of the decoding loop
+	void pickBest( const std::vector<sBeam>& finished, std::vector<sTokenData>& tokens_cur, int& result_len, int& seek_delta )
+	{
+		const sBeam* best = &finished[ 0 ];
+		for( const sBeam& b : finished )
+			if( averageLogProb( b ) > averageLogProb( *best ) )
+				best = &b;
+
+		tokens_cur = best->tokens;
+		result_len = best->result_len;
+		seek_delta = best->seek_delta;
+	}
+
+	// Ratio of the UTF-8 bytes of the text to the size of that text compressed with LZ4.
+	// The reference Whisper uses zlib; LZ4 compresses slightly worse, but the repetition loops have very high ratios with either of them.
+	double compressionRatio( const std::string& text )
+	{
+		if( text.empty() )
+			return 0;
+		std::vector<char> buffer( (size_t)LZ4_compressBound( (int)text.size() ) );
+		const int cb = LZ4_compress_default( text.data(), buffer.data(), (int)text.size(), (int)buffer.size() );
+		if( cb <= 0 )
+			return 0;
+		return (double)text.size() / (double)cb;
+	}
+}
+
+HRESULT ContextImpl::beamSearch( const sFullParams& params, const std::vector<whisper_token>& prompt, int seek, int seek_end,
+	std::vector<sTokenData>& tokens_cur, int& result_len, int& seek_delta, bool& failed )
+{
+	const Vocabulary& vocab = model.shared->vocab;
+	const int n_vocab = (int)model.parameters.n_vocab;
+	const uint32_t beamWidth = (uint32_t)params.beam_search.beam_width;
+	const size_t n_best = (size_t)std::clamp( params.beam_search.n_best, 1, params.beam_search.beam_width );
+	const int n_max = model.parameters.n_text_ctx / 2 - 4;
+
+	// The prompt goes into the slot 0 of the KV cache
+	int n_past = 0;
+	CHECK( decode( prompt.data(), prompt.size(), n_past, params, true ) );
+	n_past += (int)prompt.size();
+
+	std::vector<sBeam> live, nextLive, finished;
+	{
+		sBeam& b = live.emplace_back();
+		b.seek_delta = seek_delta;
+	}
+
+	auto advance = [ & ]( sBeam& beam, const sTokenData& token, int i )
+	{
+		return advanceBeam( vocab, params, beam, token, i, seek, seek_end, n_max );
+	};
+
+	std::vector<sCandidate> candidates;
+	std::vector<sTokenData> rowTokens;
+	std::vector<std::pair<float, whisper_token>> tmp;
+	std::vector<uint8_t> claimed;
+	std::vector<int> nextTokens;
+	std::vector<uint32_t> nextSlots;
+	const DirectCompute::sDecodeParams dp = decodeParams( 0, params );
+
+	try
+	{
+		for( int i = 0; i < n_max && !live.empty(); i++ )
+		{
+			{
+				auto p = profiler.cpuBlock( eCpuBlock::Sample );
+
+				// The probabilities of the live beams are the last rows of the output
+				candidates.clear();
+				const float* const rows = probs.data() + probs.size() - live.size() * n_vocab;
+				for( uint32_t b = 0; b < (uint32_t)live.size(); b++ )
+				{
+					// One more candidate than the width, so a finished hypothesis is replaced with the next best one
+					topTokens( vocab, rows + (size_t)b * n_vocab, n_vocab, i == 0, i == 0, beamWidth + 1, tmp, rowTokens );
+					for( const sTokenData& td : rowTokens )
+						candidates.push_back( sCandidate{ live[ b ].sumLogProb + std::log( std::max( td.p, FLT_MIN ) ), b, td } );
+				}
+				std::stable_sort( candidates.begin(), candidates.end(),
+					[]( const sCandidate& a, const sCandidate& b ) { return a.score > b.score; } );
+
+				nextLive.clear();
+				for( const sCandidate& c : candidates )
+				{
+					if( nextLive.size() >= beamWidth )
+						break;
+					sBeam beam = live[ c.parent ];
+					const eBeamState state = advance( beam, c.token, i );
+					if( state == eBeamState::Live )
+					{
+						beam.parent = c.parent;
+						nextLive.push_back( std::move( beam ) );
+					}
+					else if( state == eBeamState::Finished )
+						finished.push_back( std::move( beam ) );
+				}
+			}
+
+			if( finished.size() >= n_best || nextLive.empty() )
+				break;
+
+			// The first child of every parent inherits the slot of the parent, the rest of them copy the prefix into unused slots
+			claimed.assign( beamWidth, 0 );
+			for( sBeam& b : nextLive )
+			{
+				b.slot = UINT_MAX;
+				const uint32_t ps = live[ b.parent ].slot;
+				if( 0 == claimed[ ps ] )
+				{
+					claimed[ ps ] = 1;
+					b.slot = ps;
+				}
+			}
+			uint32_t nextFree = 0;
+			for( sBeam& b : nextLive )
+			{
+				if( b.slot != UINT_MAX )
+					continue;
+				while( 0 != claimed[ nextFree ] )
+					nextFree++;
+				claimed[ nextFree ] = 1;
+				context.copyKvSlot( live[ b.parent ].slot, nextFree, (uint32_t)n_past, dp );
+				b.slot = nextFree;
+			}
+
+			// Decode the last tokens of all beams as a single batch
+			nextTokens.clear();
+			nextSlots.clear();
+			for( const sBeam& b : nextLive )
+			{
+				nextTokens.push_back( b.tokens.back().id );
+				nextSlots.push_back( b.slot );
+			}
+			live.swap( nextLive );
+			CHECK( decodeBeams( nextTokens.data(), nextSlots.data(), (uint32_t)live.size(), n_past, params ) );
+			n_past++;
+		}
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+
+	if( finished.empty() )
+	{
+		failed = true;
+		return S_OK;
+	}
+
+	// Pick the hypothesis with the best average log-probability of the tokens
+	pickBest( finished, tokens_cur, result_len, seek_delta );
+	failed = false;
+	return S_OK;
+}
+
+HRESULT ContextImpl::sampleCandidates( const sFullParams& params, const std::vector<whisper_token>& prompt, float temperature, int seek, int seek_end,
+	std::vector<sTokenData>& tokens_cur, int& result_len, int& seek_delta, bool& failed )
+{
+	const Vocabulary& vocab = model.shared->vocab;
+	const int n_vocab = (int)model.parameters.n_vocab;
+	const uint32_t count = (uint32_t)std::max( params.best_of, 1 );
+	const int n_max = model.parameters.n_text_ctx / 2 - 4;
+
+	// The prompt goes into the slot 0 of the KV cache, the rest of the candidates share the pages of that slot
+	int n_past = 0;
+	CHECK( decode( prompt.data(), prompt.size(), n_past, params, true ) );
+	n_past += (int)prompt.size();
+
+	std::vector<sBeam> live( count ), finished;
+	for( uint32_t b = 0; b < count; b++ )
+	{
+		live[ b ].slot = b;
+		live[ b ].seek_delta = seek_delta;
+	}
+
+	std::vector<double> weights;
+	std::vector<int> nextTokens;
+	std::vector<uint32_t> nextSlots;
+	const DirectCompute::sDecodeParams dp = decodeParams( 0, params );
+
+	try
+	{
+		for( uint32_t b = 1; b < count; b++ )
+			context.copyKvSlot( 0, b, (uint32_t)n_past, dp );
+
+		for( int i = 0; i < n_max && !live.empty(); i++ )
+		{
+			{
+				auto p = profiler.cpuBlock( eCpuBlock::Sample );
+
+				// On the first step all candidates sample from the last row of the prompt, then every live candidate has a row of its own
+				const size_t rowsCount = ( 0 == i ) ? 1 : live.size();
+				const float* const rows = probs.data() + probs.size() - rowsCount * n_vocab;
+				size_t liveCount = 0;
+				for( size_t b = 0; b < live.size(); b++ )
+				{
+					const float* row = ( 0 == i ) ? rows : rows + b * n_vocab;
+					const sTokenData token = sampleToken( vocab, row, n_vocab, i == 0, i == 0, temperature, rng, weights );
+					const eBeamState state = advanceBeam( vocab, params, live[ b ], token, i, seek, seek_end, n_max );
+					if( state == eBeamState::Live )
+					{
+						if( liveCount != b )
+							live[ liveCount ] = std::move( live[ b ] );
+						liveCount++;
+					}
+					else if( state == eBeamState::Finished )
+						finished.push_back( std::move( live[ b ] ) );
+				}
+				live.resize( liveCount );
+			}
+
+			if( live.empty() )
+				break;
+
+			// Decode the last tokens of the live candidates as a single batch
+			nextTokens.clear();
+			nextSlots.clear();
+			for( const sBeam& b : live )
+			{
+				nextTokens.push_back( b.tokens.back().id );
+				nextSlots.push_back( b.slot );
+			}
+			CHECK( decodeBeams( nextTokens.data(), nextSlots.data(), (uint32_t)live.size(), n_past, params ) );
+			n_past++;
+		}
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+
+	if( finished.empty() )
+	{
+		failed = true;
+		return S_OK;
+	}
+
+	pickBest( finished, tokens_cur, result_len, seek_delta );
+	failed = false;
+	return S_OK;
+}
+
+bool ContextImpl::needsFallback( const sFullParams& params, const std::vector<sTokenData>& tokens, int result_len ) const
+{
+	const Vocabulary& vocab = model.shared->vocab;
+	const size_t len = std::min( tokens.size(), (size_t)std::max( result_len, 0 ) );
+	if( 0 == len )
+		return false;
+
+	double sumLogProb = 0;
+	std::string text;
+	for( size_t i = 0; i < len; i++ )
+	{
+		sumLogProb += std::log( std::max( tokens[ i ].p, FLT_MIN ) );
+		if( tokens[ i ].id < vocab.token_eot )
+			text += vocab.string( tokens[ i ].id );
+	}
+
+	// Log-probabilities are never positive, non-negative thresholds disable the check
+	if( params.logprob_thold < 0 && sumLogProb / (double)len < params.logprob_thold )
+		return true;
+	if( params.compression_ratio_thold > 0 && compressionRatio( text ) > params.compression_ratio_thold )
+		return true;
+	return false;
+}
@@ -43,9 +43,8 @@ HRESULT ContextImpl::encode( iSpectrogram& mel, int seek )
 	}
 }
 
-HRESULT ContextImpl::decode( const int* tokens, size_t length, int n_past, int threads )
+DirectCompute::sDecodeParams ContextImpl::decodeParams( int n_past, const sFullParams& params ) const
 {
-	// whisper_decode
 	using namespace DirectCompute;
 	sDecodeParams dp;
 	dp.n_state = model.parameters.n_audio_state;
@@ -55,10 +54,39 @@ HRESULT ContextImpl::decode( const int* tokens, size_t length, int n_past, int t
 	dp.M = exp_n_audio_ctx > 0 ? exp_n_audio_ctx : model.parameters.n_audio_ctx;
 	dp.n_text_layer = model.parameters.n_text_layer;
 	dp.n_vocab = model.parameters.n_vocab;
+	// sampleBest() and sampleTimestamp() only use the probabilities of the last token
+	dp.n_logits = 1;
+	dp.kvSlot = 0;
+	dp.cpuSpinMicroseconds = params.cpuSpinMicroseconds;
+	dp.cpuPinThreads = params.flag( eFullParamsFlags::PinCpuThreads );
+	return dp;
+}
+
+HRESULT ContextImpl::decode( const int* tokens, size_t length, int n_past, const sFullParams& params, bool fullProbs )
+{
+	// whisper_decode
+	const DirectCompute::sDecodeParams dp = decodeParams( n_past, params );
+	logitsSummary.valid = false;
+
+	try
+	{
+		context.decode( tokens, (int)length, dp, probs, params.cpuThreads, fullProbs ? nullptr : &logitsSummary );
+		return S_OK;
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+}
+
+HRESULT ContextImpl::decodeBeams( const int* tokens, const uint32_t* slots, uint32_t beams, int n_past, const sFullParams& params )
+{
+	const DirectCompute::sDecodeParams dp = decodeParams( n_past, params );
+	logitsSummary.valid = false;
 
 	try
 	{
-		context.decode( tokens, (int)length, dp, probs, threads );
+		context.decodeBeams( tokens, slots, beams, dp, probs, params.cpuThreads );
 		return S_OK;
 	}
 	catch( HRESULT hr )
@@ -156,14 +184,64 @@ sTokenData ContextImpl::sampleBest( const float* probs, bool force_timestamp, bo
 	return result;
 }
 
+// Same as above, using the summary of the probabilities computed by the fused operator of the hybrid decoder
+sTokenData ContextImpl::sampleBest( const CpuCompute::sLogitsSummary& summary, bool force_timestamp, bool is_initial )
+{
+	const Vocabulary& vocab = model.shared->vocab;
+	sTokenData result = { 0 };
+
+	// The text tokens are the same for initial and subsequent timestamps, the initial timestamp cannot be larger than 100
+	const auto& timestamps = is_initial ? summary.initial : summary.timestamps;
+	const double sum_ts = is_initial ? summary.sumInitial : summary.sumTimestamps;
+	const double max_ts = timestamps[ 0 ].p;
+	const double max_tx = summary.text[ 0 ].p;
+	result.tid = timestamps[ 0 ].id;
+	result.pt = (float)( max_ts / ( sum_ts + 1e-10 ) );
+	result.ptsum = (float)sum_ts;
+
+	// Merge top K text tokens with top K timestamps, unless sampling a timestamp token
+	constexpr size_t top_k = CpuCompute::logitsTopK;
+	std::array<CpuCompute::sTokenProb, top_k * 2> candidates;
+	size_t count = 0;
+	for( const auto& e : timestamps )
+		candidates[ count++ ] = e;
+	if( !( sum_ts > max_tx || force_timestamp ) )
+	{
+		for( const auto& e : summary.text )
+			candidates[ count++ ] = e;
+	}
+
+	std::stable_sort( candidates.begin(), candidates.begin() + count,
+		[]( const CpuCompute::sTokenProb& a, const CpuCompute::sTokenProb& b ) {
+			return a.p > b.p;
+		} );
+
+	int res = 0;
+	while( ( candidates[ res ].id == vocab.token_sot ||
+		candidates[ res ].id == vocab.token_solm ||
+		candidates[ res ].id == vocab.token_not ) &&
+		res < (int)top_k - 1 )
+	{
+		res++;
+	}
+
+	result.id = candidates[ res ].id;
+	result.p = candidates[ res ].p;
+	return result;
+}
+
 sTokenData ContextImpl::sampleBest()
 {
+	if( logitsSummary.valid )
+		return sampleBest( logitsSummary, false, false );
 	const int n_vocab = model.shared->vocab.n_vocab;
 	return sampleBest( probs.data() + ( probs.size() - n_vocab ), false, false );
 }
 
 sTokenData ContextImpl::sampleTimestamp( bool initial )
 {
+	if( logitsSummary.valid )
+		return sampleBest( logitsSummary, true, initial );
 	const int n_vocab = model.shared->vocab.n_vocab;
 	return sampleBest( probs.data() + ( probs.size() - n_vocab ), true, initial );
 }
@@ -528,6 +606,22 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 		CHECK( context.clearState() );
 	}
 
+	// Every beam, and every candidate of the temperature fallback, needs a slot in the self-attention cache.
+	// The slots of the fallback are only reserved when a window needs it, on GPU every slot is a complete KV buffer in VRAM.
+	const bool useBeamSearch = params.strategy == eSamplingStrategy::BeamSearch && params.beam_search.beam_width > 1;
+	const bool useFallback = params.temperature_inc > 0 && params.best_of > 0;
+	uint32_t kvSlots = useBeamSearch ? (uint32_t)params.beam_search.beam_width : 1;
+	std::vector<whisper_token> windowPrompt;
+	std::vector<sTokenData> greedyTokens;
+	try
+	{
+		context.reserveKvSlots( kvSlots );
+	}
+	catch( HRESULT hr )
+	{
+		return hr;
+	}
+
 	while( true )
 	{
 		if( nullptr != progress.pfn )
@@ -591,12 +685,22 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 		bool failed = false;
 		bool has_ts = false; // have we already sampled a non-beg timestamp token for the current segment?
 
+		// The greedy loop consumes the prompt, the fallback needs another copy
+		if( useFallback )
+			windowPrompt = prompt;
+
+		if( useBeamSearch )
+		{
+			auto prof = context.decodeProfiler();
+			CHECK( beamSearch( params, prompt, seek, seek_end, tokens_cur, result_len, seek_delta, failed ) );
+		}
+		else
 		{
 			// Measure "Decode" profiler value, both CPU and GPU times
 			auto prof = context.decodeProfiler();
 			for( int i = 0, n_max = model.parameters.n_text_ctx / 2 - 4; i < n_max; i++ )
 			{
-				CHECK( decode( prompt.data(), prompt.size(), n_past, params.cpuThreads ) );
+				CHECK( decode( prompt.data(), prompt.size(), n_past, params ) );
 
 				n_past += (int)prompt.size();
 				prompt.clear();
@@ -672,6 +776,53 @@ HRESULT COMLIGHTCALL ContextImpl::runFullImpl( const sFullParams& params, const
 				}
 			}
 		}
+
+		// When the window failed, or the text looks like a repetition loop or a hallucination, decode it again with temperature sampling.
+		// Every attempt samples best_of candidates in a single batch, the temperature grows until one of them passes the checks.
+		if( useFallback && ( failed || needsFallback( params, tokens_cur, result_len ) ) )
+		{
+			auto prof = context.decodeProfiler();
+			if( kvSlots < (uint32_t)params.best_of )
+			{
+				// Discards the cache, sampleCandidates decodes the prompt again anyway
+				kvSlots = (uint32_t)params.best_of;
+				try
+				{
+					context.reserveKvSlots( kvSlots );
+				}
+				catch( HRESULT hr )
+				{
+					return hr;
+				}
+			}
+
+			// When the greedy decode produced a complete window, keep it in case none of the sampled attempts does
+			const bool greedyFailed = failed;
+			const int greedyLength = result_len;
+			const int greedySeekDelta = seek_delta;
+			if( !greedyFailed )
+				greedyTokens = tokens_cur;
+
+			for( float temperature = params.temperature_inc; temperature <= 1.0f + 1e-3f; temperature += params.temperature_inc )
+			{
+				seek_delta = 100 * WHISPER_CHUNK_SIZE;
+				result_len = 0;
+				CHECK( sampleCandidates( params, windowPrompt, temperature, seek, seek_end, tokens_cur, result_len, seek_delta, failed ) );
+				if( !failed && !needsFallback( params, tokens_cur, result_len ) )
+					break;
+				logDebug( u8"%s: temperature %g rejected", __func__, temperature );
+			}
+
+			if( failed && !greedyFailed )
+			{
+				logDebug( u8"%s: no sampled attempt completed the window, keeping the greedy result", __func__ );
+				tokens_cur.swap( greedyTokens );
+				result_len = greedyLength;
+				seek_delta = greedySeekDelta;
+				failed = false;
+			}
+		}
+
 		if( failed )
 		{
 			logError( u8"%s: failed to generate timestamp token - skipping one second", __func__ );
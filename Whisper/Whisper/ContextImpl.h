@@ -6,6 +6,7 @@
 #include "TranscribeResult.h"
 #include "sTokenData.h"
 #include "../ML/Device.h"
+#include <random>
 
 namespace Whisper
 {
@@ -52,14 +53,32 @@ namespace Whisper
 		int32_t exp_n_audio_ctx = 0; // 0 - use default
 
 		HRESULT encode( iSpectrogram& mel, int seek );
-		HRESULT decode( const int* tokens, size_t length, int n_past, int threads );
+		DirectCompute::sDecodeParams decodeParams( int n_past, const sFullParams& params ) const;
+		// When fullProbs is false and the hybrid decoder is in use, the decoder computes logitsSummary instead of the probs vector
+		HRESULT decode( const int* tokens, size_t length, int n_past, const sFullParams& params, bool fullProbs = false );
+		// Decode one token for each beam, every beam with its own slot of the KV cache; the probs vector receives beams * n_vocab numbers
+		HRESULT decodeBeams( const int* tokens, const uint32_t* slots, uint32_t beams, int n_past, const sFullParams& params );
+		// Beam search decoding of the current window, produces the same outputs as the greedy sampling loop in runFullImpl
+		HRESULT beamSearch( const sFullParams& params, const std::vector<whisper_token>& prompt, int seek, int seek_end,
+			std::vector<sTokenData>& tokens_cur, int& result_len, int& seek_delta, bool& failed );
+		// Temperature fallback of the current window: sample best_of candidates at the temperature, decoding all of them in a single batch,
+		// and keep the one with the best average log-probability
+		HRESULT sampleCandidates( const sFullParams& params, const std::vector<whisper_token>& prompt, float temperature, int seek, int seek_end,
+			std::vector<sTokenData>& tokens_cur, int& result_len, int& seek_delta, bool& failed );
+		// True when the decoded text of the window is unreliable: compression ratio too high, or the average log-probability too low
+		bool needsFallback( const sFullParams& params, const std::vector<sTokenData>& tokens, int result_len ) const;
+		// Random numbers for the temperature sampling, default seed so the results are reproducible
+		std::mt19937 rng;
 		sTokenData sampleBest( const float* probs, bool force_timestamp, bool is_initial );
+		sTokenData sampleBest( const CpuCompute::sLogitsSummary& summary, bool force_timestamp, bool is_initial );
 		sTokenData sampleBest();
 		sTokenData sampleTimestamp( bool initial );
 		int wrapSegment( int max_len );
 		void expComputeTokenLevelTimestamps( int i_segment, float thold_pt, float thold_ptsum );
 
 		std::vector<float> probs;
+		// The hybrid decoder computes this summary instead of the complete probs vector
+		CpuCompute::sLogitsSummary logitsSummary;
 		std::vector<std::pair<double, Vocabulary::id>> probs_id;
 
 		mutable TranscribeResultStatic results;
@@ -4,37 +4,9 @@
 #include "MelStreamer.h"
 #include "../API/iMediaFoundation.cl.h"
 #include "../Utils/Trace/tracing.h"
+#include "../CPU/CpuTopology.h"
 using namespace Whisper;
 
-static int getCpuCoresCount()
-{
-	DWORD bufferSize = 0;
-	GetLogicalProcessorInformation( NULL, &bufferSize );
-
-	// The SYSTEM_LOGICAL_PROCESSOR_INFORMATION structure has a uint64_t field
-	// Ideally need to align by 8 bytes, and that's why uint64_t type for the storage
-	std::unique_ptr<uint64_t[]> buffer = std::make_unique<uint64_t[]>( ( bufferSize + 7 ) / 8 );
-
-	SYSTEM_LOGICAL_PROCESSOR_INFORMATION* ptr = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)buffer.get();
-	if( !GetLogicalProcessorInformation( ptr, &bufferSize ) )
-	{
-		HRESULT hr = getLastHr();
-		logWarningHr( hr, u8"GetLogicalProcessorInformation" );
-		return 0;
-	}
-
-	DWORD byteOffset = 0;
-	int physicalCores = 0;
-	while( byteOffset < bufferSize )
-	{
-		if( ptr->Relationship == RelationProcessorCore )
-			physicalCores++;
-		byteOffset += sizeof( SYSTEM_LOGICAL_PROCESSOR_INFORMATION );
-		ptr++;
-	}
-	return physicalCores;
-}
-
 int ContextImpl::defaultThreadsCount() const
 {
 #if BUILD_HYBRID_VERSION
@@ -51,7 +23,8 @@ int ContextImpl::defaultThreadsCount() const
 		return std::min( hardwareThreads, 4 );
 
 	// It seems the CPU decoder in the hybrid context doesn’t scale well with count of hardware threads, but it does scale with count of physical cores.
-	int cores = getCpuCoresCount();
+	// On computers with multiple NUMA nodes, only using the cores of a single node, the threads are slowed down by the remote memory.
+	int cores = (int)CpuCompute::CpuTopology::instance().coresPerNode();
 	if( cores > 1 )
 		return cores;
 
@@ -72,6 +45,11 @@ HRESULT COMLIGHTCALL ContextImpl::fullDefaultParams( eSamplingStrategy strategy,
 	rdi->thold_pt = 0.01f;
 	rdi->thold_ptsum = 0.01f;
 	rdi->language = makeLanguageKey( "en" );
+	rdi->cpuSpinMicroseconds = 100;
+	rdi->temperature_inc = 0.2f;
+	rdi->best_of = 5;
+	rdi->compression_ratio_thold = 2.4f;
+	rdi->logprob_thold = -1.0f;
 
 	switch( strategy )
 	{
@@ -178,6 +156,14 @@ HRESULT COMLIGHTCALL ContextImpl::timingsPrint()
 	logMemoryUse( "Model", memModel );
 	logMemoryUse( "Context", memContext );
 	logMemoryUse( "Total", _mm_add_epi64( memModel, memContext ) );
+#if BUILD_HYBRID_VERSION
+	HybridContext::sMemoryPages pages;
+	if( context.getMemoryPages( pages ) )
+	{
+		logInfo( u8"Hybrid decoder\tweights in %zu KB pages, KV cache in %zu KB pages, compute in %zu KB pages",
+			pages.weights / 1024, pages.kvCache / 1024, pages.compute / 1024 );
+	}
+#endif
 	return S_OK;
 }
 
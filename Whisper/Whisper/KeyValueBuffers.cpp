@@ -36,6 +36,24 @@ Tensor AttentionBuffer::view( uint32_t length, uint32_t offset ) const
 	return Tensor( shape, srv, uav );
 }
 
+void AttentionBuffer::copyFrom( const AttentionBuffer& source, uint32_t offset, uint32_t length )
+{
+	if( offset + length > m_size || offset + length > source.m_size )
+		throw E_BOUNDS;
+	if( 0 == length )
+		return;
+
+	// Coordinates of a box are in bytes for buffers
+	D3D11_BOX box;
+	box.left = offset * 2;
+	box.right = ( offset + length ) * 2;
+	box.top = 0;
+	box.bottom = 1;
+	box.front = 0;
+	box.back = 1;
+	context()->CopySubresourceRegion( buffer, 0, offset * 2, 0, 0, source.buffer, 0, &box );
+}
+
 void KeyValueBuffers::resize( uint32_t size )
 {
 	keys.resize( size );
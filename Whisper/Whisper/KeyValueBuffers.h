@@ -16,6 +16,9 @@ namespace DirectCompute
 		// Create an 1D tensor which references a slice of that buffer
 		Tensor view( uint32_t length, uint32_t offset ) const;
 
+		// Copy a slice of another buffer into the same location of this buffer
+		void copyFrom( const AttentionBuffer& source, uint32_t offset, uint32_t length );
+
 		void clear()
 		{
 			buffer = nullptr;
@@ -35,6 +38,13 @@ namespace DirectCompute
 
 		void resize( uint32_t size );
 
+		// Copy a slice of both keys and values from another pair of buffers
+		void copyFrom( const KeyValueBuffers& source, uint32_t offset, uint32_t length )
+		{
+			keys.copyFrom( source.keys, offset, length );
+			values.copyFrom( source.values, offset, length );
+		}
+
 		void clear()
 		{
 			keys.clear();
@@ -59,11 +59,11 @@ HRESULT ModelImpl::createClone( const ModelImpl& source )
 	return model.createClone( source.model );
 }
 
-HRESULT ModelImpl::load( iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks )
+HRESULT ModelImpl::load( iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks, CpuCompute::MappedFile* mapping )
 {
 	auto ts = device.setForCurrentThread();
 	CHECK( device.create( gpuFlags, adapter ) );
-	return model.load( stm, hybrid, callbacks );
+	return model.load( stm, hybrid, gpuFlags, callbacks, mapping );
 }
 
 inline bool hasSse41AndF16C()
@@ -145,9 +145,16 @@ HRESULT __stdcall Whisper::loadGpuModel( const wchar_t* path, const sModelSetup&
 		return hr;
 	}
 
+	// Tensors are copied from the mapped pages of the file, avoiding an intermediate copy through the stream.
+	// The hybrid model keeps the mapping when some of the decoder's tensors are used directly from there.
+	CpuCompute::MappedFile mapping;
+	hr = mapping.map( path );
+	if( FAILED( hr ) )
+		logWarningHr( hr, u8"Unable to map the model file into memory, reading it with a stream" );
+
 	ComLight::CComPtr<ComLight::Object<ModelImpl>> obj;
 	CHECK( ComLight::Object<ModelImpl>::create( obj, setup ) );
-	hr = obj->load( &stream, hybrid, callbacks );
+	hr = obj->load( &stream, hybrid, callbacks, mapping.empty() ? nullptr : &mapping );
 	if( FAILED( hr ) )
 	{
 		logError16( L"Error loading the model from \"%s\"", path );
@@ -60,6 +60,6 @@ namespace Whisper
 
 		void FinalRelease();
 
-		HRESULT load( iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks );
+		HRESULT load( iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks, CpuCompute::MappedFile* mapping );
 	};
 }
\ No newline at end of file
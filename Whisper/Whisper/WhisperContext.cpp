@@ -16,6 +16,7 @@ namespace
 
 	LPCTSTR traceFileNative = LR"(C:\Temp\2remove\Whisper\gpu.bin)";
 	LPCTSTR traceFileHybrid = LR"(C:\Temp\2remove\Whisper\hybrid.bin)";
+	LPCTSTR traceFileHybridInt8 = LR"(C:\Temp\2remove\Whisper\hybrid-int8.bin)";
 
 	TensorsArena::sArenaConfigs defaultArenaConfigs()
 	{
@@ -65,7 +66,10 @@ WhisperContext::WhisperContext( const Whisper::WhisperModel& wm, Whisper::Profil
 		hybridContext = std::make_unique<HybridContext>( wm );
 		check( hybridContext->create() );
 #if SAVE_DEBUG_TRACE
-		Tracing::traceCreate( traceFileHybrid );
+		// With INT8 weights, save the trace into another file.
+		// Comparing these two traces with Tools / compareTraces measures the accuracy loss caused by the quantization.
+		const bool int8 = wm.shared->hybridTensors.layers[ 0 ].mlp0.w.type() == eDataType::I8;
+		Tracing::traceCreate( int8 ? traceFileHybridInt8 : traceFileHybrid );
 #endif
 	}
 	else
@@ -304,9 +308,20 @@ void WhisperContext::createKeyValueBuffers( const sEncodeParams& encParams )
 		const uint32_t n_mem = encParams.n_text_layer * encParams.n_text_ctx;
 		const uint32_t n_elements = encParams.n_text_state * n_mem;
 		kv.resize( n_elements );
+		for( auto& b : kvSlots )
+			b.resize( n_elements );
 	}
 }
 
+KeyValueBuffers& WhisperContext::kvSlot( uint32_t slot )
+{
+	if( 0 == slot )
+		return kv;
+	if( slot <= kvSlots.size() )
+		return kvSlots[ slot - 1 ];
+	throw E_BOUNDS;
+}
+
 Tensor WhisperContext::encode( Whisper::iSpectrogram& spectrogram, const sEncodeParams& encParams )
 {
 	auto prof = profiler.block( eProfilerBlock::Encode );
@@ -402,12 +417,14 @@ struct WhisperContext::sLayerDecParams
 {
 	uint32_t n_state, n_head, N;
 	uint32_t n_ctx, n_past, M;
+	const KeyValueBuffers* kv;
 };
 
 Tensor WhisperContext::decodeLayer( const Tensor& inpL, size_t il, const sLayerDecParams& ldp )
 {
 	auto prof = profiler.block( eProfilerBlock::DecodeLayer );
 	const auto& layer = gpuModel.dec.layers[ il ];
+	const KeyValueBuffers& kv = *ldp.kv;
 	std::optional<ArenaRaii> arenaRaii{ std::in_place, *this, arenas.layer };
 	if( 0 == il ) Tracing::tensor( "dec-inpL", inpL );
 
@@ -575,7 +592,7 @@ Tensor WhisperContext::decodeLayer( const Tensor& inpL, size_t il, const sLayerD
 	return cur;
 }
 
-void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecodeParams& decParams, std::vector<float>& probs, int threads )
+void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecodeParams& decParams, std::vector<float>& probs, int threads, CpuCompute::sLogitsSummary* summary )
 {
 	auto cppp = profiler.cpuBlock( Whisper::eCpuBlock::DecodeStep );
 
@@ -585,7 +602,13 @@ void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecod
 		HybridContext::sDecParams sdp;
 		sdp.n_threads = threads;
 		sdp.M = decParams.M;
+		sdp.n_logits = (int)decParams.n_logits;
+		sdp.summary = summary;
+		sdp.slots = &decParams.kvSlot;
+		sdp.spinMicroseconds = decParams.cpuSpinMicroseconds;
+		sdp.pinThreads = decParams.cpuPinThreads;
 		check( hybridContext->decode( tokens, n_tokens, decParams.n_past, sdp, probs ) );
+		hybridContext->flushOpStats( profiler );
 		return;
 	}
 #endif
@@ -611,6 +634,7 @@ void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecod
 		ldp.n_ctx = decParams.n_ctx;
 		ldp.n_past = decParams.n_past;
 		ldp.M = decParams.M;
+		ldp.kv = &kvSlot( decParams.kvSlot );
 #if 1
 		for( size_t i = 0; i < decParams.n_text_layer; i++ )
 			cur = decodeLayer( cur, i, ldp );
@@ -638,6 +662,77 @@ void WhisperContext::decode( const int* tokens, const int n_tokens, const sDecod
 	Tracing::vector( "probs", probs );
 }
 
+void WhisperContext::reserveKvSlots( uint32_t count )
+{
+	if( 0 == count )
+		throw E_INVALIDARG;
+#if BUILD_HYBRID_VERSION
+	if( hybridContext )
+	{
+		check( hybridContext->reserveSlots( count ) );
+		return;
+	}
+#endif
+	// The VRAM buffers are created by createKeyValueBuffers, on the next encode.
+	// When the cache already exists, the new slots are created right away, the temperature fallback reserves them after the encode.
+	const size_t prev = kvSlots.size();
+	kvSlots.resize( count - 1 );
+	const uint32_t elements = kv.keys.getSize();
+	if( 0 != elements )
+		for( size_t i = prev; i < kvSlots.size(); i++ )
+			kvSlots[ i ].resize( elements );
+}
+
+void WhisperContext::copyKvSlot( uint32_t source, uint32_t dest, uint32_t length, const sDecodeParams& decParams )
+{
+#if BUILD_HYBRID_VERSION
+	if( hybridContext )
+	{
+		check( hybridContext->copySlot( source, dest, length ) );
+		return;
+	}
+#endif
+	if( source == dest || 0 == length )
+		return;
+	const KeyValueBuffers& src = kvSlot( source );
+	KeyValueBuffers& dst = kvSlot( dest );
+	for( uint32_t il = 0; il < decParams.n_text_layer; il++ )
+		dst.copyFrom( src, decParams.n_state * il * decParams.n_ctx, decParams.n_state * length );
+}
+
+void WhisperContext::decodeBeams( const int* tokens, const uint32_t* slots, uint32_t beams, const sDecodeParams& decParams, std::vector<float>& probs, int threads )
+{
+#if BUILD_HYBRID_VERSION
+	if( hybridContext )
+	{
+		auto cppp = profiler.cpuBlock( Whisper::eCpuBlock::DecodeStep );
+		HybridContext::sDecParams sdp;
+		sdp.n_threads = threads;
+		sdp.M = decParams.M;
+		sdp.n_logits = 1;
+		sdp.beams = beams;
+		sdp.slots = slots;
+		sdp.spinMicroseconds = decParams.cpuSpinMicroseconds;
+		sdp.pinThreads = decParams.cpuPinThreads;
+		check( hybridContext->decode( tokens, 1, decParams.n_past, sdp, probs ) );
+		hybridContext->flushOpStats( profiler );
+		return;
+	}
+#endif
+	// D3D tensors can only view slices of the KV buffers, the GPU decoder runs these beams one after another
+	const size_t n_vocab = decParams.n_vocab;
+	probs.resize( n_vocab * beams );
+	std::vector<float> tmp;
+	sDecodeParams dp = decParams;
+	for( uint32_t b = 0; b < beams; b++ )
+	{
+		dp.kvSlot = slots[ b ];
+		decode( tokens + b, 1, dp, tmp, threads, nullptr );
+		assert( tmp.size() == n_vocab );
+		memcpy( probs.data() + b * n_vocab, tmp.data(), n_vocab * 4 );
+	}
+}
+
 __m128i WhisperContext::Arenas::getMemoryUse() const
 {
 	__m128i res = outer.getMemoryUse();
@@ -659,9 +754,15 @@ __m128i WhisperContext::getMemoryUse() const
 	res = _mm_add_epi64( res, decPool.getMemoryUse() );
 	res = _mm_add_epi64( res, melInput.getMemoryUse() );
 	res = _mm_add_epi64( res, kv.getMemoryUse() );
+	for( const auto& b : kvSlots )
+		res = _mm_add_epi64( res, b.getMemoryUse() );
 	res = _mm_add_epi64( res, kvCross.getMemoryUse() );
 	res = _mm_add_epi64( res, decoderInput.getMemoryUse() );
 	res = _mm_add_epi64( res, decoderOutput.getMemoryUse() );
+#if BUILD_HYBRID_VERSION
+	if( hybridContext )
+		res = _mm_add_epi64( res, _mm_cvtsi64_si128( (int64_t)hybridContext->memoryUsage() ) );
+#endif
 	return res;
 }
 
@@ -672,6 +773,8 @@ HRESULT WhisperContext::clearState()
 	// The above code doesn't work for some reason.
 	// Ideally need to debug, but destroying and re-creating these two buffers is not a huge deal. Unlike the buffers in the pools, only a few megabytes of VRAM.
 	kv.clear();
+	for( auto& b : kvSlots )
+		b.clear();
 	kvCross.clear();
 
 	CHECK( arenas.outer.zeroMemory() );
@@ -55,6 +55,9 @@ namespace DirectCompute
 
 		MelInputTensor melInput;
 		KeyValueBuffers kv, kvCross;
+		// Additional slots of the self-attention cache for the beam search, the slot 0 is the kv field
+		std::vector<KeyValueBuffers> kvSlots;
+		KeyValueBuffers& kvSlot( uint32_t slot );
 		DecoderInputBuffers decoderInput;
 		DecoderResultBuffer decoderOutput;
 		const ModelBuffers& gpuModel;
@@ -95,7 +98,17 @@ namespace DirectCompute
 
 		Tensor encode( Whisper::iSpectrogram& spectrogram, const sEncodeParams& encParams );
 
-		void decode( const int* tokens, const int n_tokens, const sDecodeParams& decParams, std::vector<float>& probs, int threads );
+		// When the summary is not nullptr and the hybrid decoder computed it, the decoder sets the valid field of the summary, and leaves the probs vector empty
+		void decode( const int* tokens, const int n_tokens, const sDecodeParams& decParams, std::vector<float>& probs, int threads, CpuCompute::sLogitsSummary* summary = nullptr );
+
+		// Resize the self-attention cache to hold the specified count of independent sequences; discards the content of the cache
+		void reserveKvSlots( uint32_t count );
+		// Copy the first `length` positions of the self-attention cache from one slot into another one.
+		// The hybrid decoder shares the pages of the paged cache instead, and copies them when written.
+		void copyKvSlot( uint32_t source, uint32_t dest, uint32_t length, const sDecodeParams& decParams );
+		// Decode a single token for each of the beams at the same position decParams.n_past, every beam with its own slot of the cache.
+		// The output vector receives beams * n_vocab probabilities. The hybrid decoder runs all beams in a single pass, GPU runs them one by one.
+		void decodeBeams( const int* tokens, const uint32_t* slots, uint32_t beams, const sDecodeParams& decParams, std::vector<float>& probs, int threads );
 
 		static WhisperContext& current();
 
@@ -127,6 +140,16 @@ namespace DirectCompute
 		}
 
 		__m128i getMemoryUse() const;
+#if BUILD_HYBRID_VERSION
+		// When the context uses the hybrid model, sizes of the memory pages of the CPU decoder, reported together with the memory usage
+		bool getMemoryPages( HybridContext::sMemoryPages& rdi ) const
+		{
+			if( !hybridContext )
+				return false;
+			rdi = hybridContext->memoryPages();
+			return true;
+		}
+#endif
 
 		HRESULT clearState();
 	};
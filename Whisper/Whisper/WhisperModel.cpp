@@ -7,6 +7,9 @@
 #include "../Utils/GpuProfilerSimple.h"
 #include "../Utils/CpuProfiler.h"
 #include "../CPU/HybridLoader.h"
+#include "../CPU/mulMat.h"
+#include "../Hybrid/DecodeEngine.h"
+#include "../API/sModelSetup.h"
 #include "../ML/Reshaper.h"
 using namespace Whisper;
 using namespace DirectCompute;
@@ -19,6 +22,34 @@ namespace
 		uint32_t n_mel = 0, n_fft = 0;
 	};
 
+	// Payload of a GPU tensor: a pointer into the memory mapped file when available, otherwise the bytes are read from the stream into the vector
+	HRESULT readPayload( ComLight::iReadStream* stm, const CpuCompute::MappedFile* mapping, size_t cb, std::vector<uint8_t>& bytesVector, const void*& rsi )
+	{
+		if( nullptr != mapping )
+		{
+			int64_t pos;
+			CHECK( stm->getPosition( pos ) );
+			const uint8_t* p = mapping->payload( pos, cb );
+			if( nullptr == p )
+				return E_EOF;
+			CHECK( stm->seek( (int64_t)cb, ComLight::eSeekOrigin::Current ) );
+			rsi = p;
+			return S_OK;
+		}
+
+		try
+		{
+			bytesVector.resize( cb );
+		}
+		catch( const std::bad_alloc& )
+		{
+			return E_OUTOFMEMORY;
+		}
+		CHECK( readBytes( stm, bytesVector.data(), cb ) );
+		rsi = bytesVector.data();
+		return S_OK;
+	}
+
 	enum struct ePostProcessing : uint8_t
 	{
 		None = 0,
@@ -254,7 +285,7 @@ public:
 	}
 };
 
-HRESULT WhisperModel::loadGpu( ComLight::iReadStream* stm, CallbacksImpl& callbacks )
+HRESULT WhisperModel::loadGpu( ComLight::iReadStream* stm, CallbacksImpl& callbacks, const CpuCompute::MappedFile* mapping )
 {
 	CAtlMap<CStringA, PendingTensor> map;
 	populateTensorsMap( map, parameters.n_audio_layer, parameters.n_text_layer, tensors, false );
@@ -303,27 +334,26 @@ HRESULT WhisperModel::loadGpu( ComLight::iReadStream* stm, CallbacksImpl& callba
 			dt = DirectCompute::eDataType::FP32;
 			cbElement = 4;
 		}
-		else
+		else if( header.ftype == 1 )
 		{
 			dt = DirectCompute::eDataType::FP16;
 			cbElement = 2;
 		}
+		else
+		{
+			// Tools/quantizeModel only quantizes the decoder's weights, these are loaded by the hybrid model into system RAM
+			logError( u8"%s: tensor '%s' has unsupported data type %i, quantized tensors are only supported by the decoder of the hybrid model", __func__, cstr( name ), header.ftype );
+			return E_INVALIDARG;
+		}
 
 		const size_t totalElts = (size_t)(uint32_t)ne[ 0 ] * (uint32_t)ne[ 1 ] * (uint32_t)ne[ 2 ];
 		if( totalElts * cbElement > UINT_MAX )
 			return DISP_E_OVERFLOW;
 
-		try
-		{
-			bytesVector.resize( cbElement * totalElts );
-		}
-		catch( const std::bad_alloc& )
-		{
-			return E_OUTOFMEMORY;
-		}
-		CHECK( readBytes( stm, bytesVector.data(), bytesVector.size() ) );
-		cb += bytesVector.size();
-		CHECK( p->m_value.dest->createImmutable( dt, ne, bytesVector.data() ) );
+		const void* rsi;
+		CHECK( readPayload( stm, mapping, cbElement * totalElts, bytesVector, rsi ) );
+		cb += cbElement * totalElts;
+		CHECK( p->m_value.dest->createImmutable( dt, ne, rsi ) );
 		CHECK( p->m_value.postProcess( reshape, dt ) );
 		countLoaded++;
 	}
@@ -340,12 +370,41 @@ HRESULT WhisperModel::loadGpu( ComLight::iReadStream* stm, CallbacksImpl& callba
 }
 
 #if BUILD_HYBRID_VERSION
-HRESULT WhisperModel::loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& callbacks )
+HRESULT WhisperModel::loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& callbacks, uint32_t flags, CpuCompute::MappedFile* mapping )
 {
 	CAtlMap<CStringA, PendingTensor> map;
 	populateTensorsMap( map, parameters.n_audio_layer, parameters.n_text_layer, tensors, true );
 	DirectCompute::Reshaper reshape;
-	CpuCompute::HybridLoader loader( shared->hybridTensors, parameters.n_text_layer );
+
+	bool int8Weights = 0 != ( flags & (uint32_t)eGpuModelFlags::HybridInt8 );
+	if( int8Weights && !CpuCompute::canQuantizeWeights() )
+	{
+		logWarning( u8"eGpuModelFlags.HybridInt8 requires a CPU with AVX2 support, using FP16 weights" );
+		int8Weights = false;
+	}
+	uint8_t largePages = 0;
+	if( 0 != ( flags & (uint32_t)eGpuModelFlags::HybridLargePagesWeights ) )
+		largePages |= (uint8_t)CpuCompute::eLargePages::Weights;
+	if( 0 != ( flags & (uint32_t)eGpuModelFlags::HybridLargePagesKvCache ) )
+		largePages |= (uint8_t)CpuCompute::eLargePages::KvCache;
+	if( 0 != ( flags & (uint32_t)eGpuModelFlags::HybridLargePagesCompute ) )
+		largePages |= (uint8_t)CpuCompute::eLargePages::Compute;
+	CpuCompute::HybridLoader loader( shared->hybridTensors, parameters.n_text_layer, int8Weights, (CpuCompute::eLargePages)largePages, mapping );
+
+	bool int8KvCache = 0 != ( flags & (uint32_t)eGpuModelFlags::HybridInt8KvCache );
+	if( int8KvCache && !CpuCompute::canQuantizeWeights() )
+	{
+		logWarning( u8"eGpuModelFlags.HybridInt8KvCache requires a CPU with AVX2 support, using FP16 KV cache" );
+		int8KvCache = false;
+	}
+	shared->hybridTensors.int8KvCache = int8KvCache;
+
+	if( 0 != ( flags & (uint32_t)eGpuModelFlags::HybridAutotune ) )
+	{
+		HRESULT hr = CpuCompute::enableMulMatAutotune();
+		if( FAILED( hr ) )
+			logWarningHr( hr, u8"Unable to enable mulMat autotuner" );
+	}
 
 	std::vector<uint8_t> bytesVector;
 	size_t countLoaded = 0;
@@ -381,6 +440,7 @@ HRESULT WhisperModel::loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& cal
 			HRESULT hr = loader.setupTensor( name, header.n_dims, header.ftype, ne, stm, callbacks.postponedBytes );
 			if( hr == S_OK )
 				continue;
+			CHECK( hr );
 			logError( u8"%s: unknown tensor '%s' in model file", __func__, cstr( name ) );
 			return E_INVALIDARG;
 		}
@@ -392,29 +452,28 @@ HRESULT WhisperModel::loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& cal
 			dt = DirectCompute::eDataType::FP32;
 			cbElement = 4;
 		}
-		else
+		else if( header.ftype == 1 )
 		{
 			dt = DirectCompute::eDataType::FP16;
 			cbElement = 2;
 		}
+		else
+		{
+			// Tools/quantizeModel only quantizes the decoder's weights, these are loaded by the hybrid model into system RAM
+			logError( u8"%s: tensor '%s' has unsupported data type %i, quantized tensors are only supported by the decoder of the hybrid model", __func__, cstr( name ), header.ftype );
+			return E_INVALIDARG;
+		}
 
 		const size_t totalElts = (size_t)(uint32_t)ne[ 0 ] * (uint32_t)ne[ 1 ] * (uint32_t)ne[ 2 ];
 		if( totalElts * cbElement > UINT_MAX )
 			return DISP_E_OVERFLOW;
 
-		try
-		{
-			bytesVector.resize( cbElement * totalElts );
-		}
-		catch( const std::bad_alloc& )
-		{
-			return E_OUTOFMEMORY;
-		}
-		CHECK( readBytes( stm, bytesVector.data(), bytesVector.size() ) );
-		CHECK( p->m_value.dest->createImmutable( dt, ne, bytesVector.data() ) );
+		const void* rsi;
+		CHECK( readPayload( stm, mapping, cbElement * totalElts, bytesVector, rsi ) );
+		CHECK( p->m_value.dest->createImmutable( dt, ne, rsi ) );
 		CHECK( p->m_value.postProcess( reshape, dt ) );
 		countLoaded++;
-		cb += bytesVector.size();
+		cb += cbElement * totalElts;
 	}
 
 	if( countLoaded != map.GetCount() )
@@ -427,11 +486,18 @@ HRESULT WhisperModel::loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& cal
 	logDebug( u8"Loaded %zu GPU tensors, %g MB VRAM", countLoaded, mulMb * cb );
 
 	CHECK( loader.completeLoad( stm, callbacks ) );
+
+	if( 0 != ( flags & (uint32_t)eGpuModelFlags::HybridSharedDecoder ) )
+	{
+		std::shared_ptr<DecodeEngine> engine = std::make_shared<DecodeEngine>( shared->hybridTensors, parameters );
+		CHECK( engine->create() );
+		shared->decodeEngine = std::move( engine );
+	}
 	return S_OK;
 }
 #endif
 
-HRESULT WhisperModel::load( ComLight::iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks )
+HRESULT WhisperModel::load( ComLight::iReadStream* stm, bool hybrid, uint32_t flags, const sLoadModelCallbacks* callbacks, CpuCompute::MappedFile* mapping )
 {
 	CpuProfiler cpuPerf;
 	CallbacksImpl cb;
@@ -478,13 +544,13 @@ HRESULT WhisperModel::load( ComLight::iReadStream* stm, bool hybrid, const sLoad
 	if( hybrid )
 	{
 #if BUILD_HYBRID_VERSION
-		CHECK( loadHybrid( stm, cb ) )
+		CHECK( loadHybrid( stm, cb, flags, mapping ) )
 #else
 		return E_NOTIMPL;
 #endif
 	}
 	else
-		CHECK( loadGpu( stm, cb ) );
+		CHECK( loadGpu( stm, cb, mapping ) );
 
 	CHECK( gpuProfiler.time( loadTimeGpu ) );
 	loadTimeCpu = cpuPerf.elapsed();
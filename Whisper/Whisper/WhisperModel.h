@@ -7,6 +7,10 @@
 #include "../API/sLoadModelCallbacks.h"
 #include "sModelParams.h"
 
+#if BUILD_HYBRID_VERSION
+class DecodeEngine;
+#endif
+
 namespace Whisper
 {
 	struct Filters
@@ -22,6 +26,8 @@ namespace Whisper
 		Filters filters;
 #if BUILD_HYBRID_VERSION
 		CpuCompute::DecoderTensors hybridTensors;
+		// When the model was loaded with HybridSharedDecoder flag, the decoder which merges single-token steps of all contexts of this model
+		std::shared_ptr<DecodeEngine> decodeEngine;
 #endif
 	};
 
@@ -34,7 +40,9 @@ namespace Whisper
 		std::shared_ptr<ModelShared> shared;
 		DirectCompute::ModelBuffers tensors;
 
-		HRESULT load( ComLight::iReadStream* stm, bool hybrid, const sLoadModelCallbacks* callbacks );
+		// When the mapping is not nullptr, it's the same file as the stream; the tensors are then read from the mapped pages instead of copied through the stream.
+		// The hybrid model may move the mapping into the decoder's tensors, to keep using these pages after the load.
+		HRESULT load( ComLight::iReadStream* stm, bool hybrid, uint32_t flags, const sLoadModelCallbacks* callbacks, CpuCompute::MappedFile* mapping = nullptr );
 		HRESULT createClone( const WhisperModel& rsi );
 
 		// A vector of 2 uint64_t values, both numbers are 100 nanosecond ticks:
@@ -54,7 +62,7 @@ namespace Whisper
 
 		class CallbacksImpl;
 
-		HRESULT loadGpu( ComLight::iReadStream* stm, CallbacksImpl& callbacks );
-		HRESULT loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& callbacks );
+		HRESULT loadGpu( ComLight::iReadStream* stm, CallbacksImpl& callbacks, const CpuCompute::MappedFile* mapping );
+		HRESULT loadHybrid( ComLight::iReadStream* stm, CallbacksImpl& callbacks, uint32_t flags, CpuCompute::MappedFile* mapping );
 	};
 }
\ No newline at end of file
@@ -16,5 +16,14 @@ namespace DirectCompute
 		uint32_t n_ctx, n_past, M;
 		uint32_t n_text_layer;
 		uint32_t n_vocab;
+		// Count of tokens at the end of the input which need the output probabilities, usually 1 because the sampling only uses the last token.
+		// The hybrid decoder only computes the vocabulary projection for these rows; the GPU decoder computes all rows.
+		// Either way, the last n_vocab numbers of the output vector are the probabilities for the last token.
+		uint32_t n_logits;
+		// Slot of the self-attention cache, see WhisperContext.reserveKvSlots; 0 unless decoding multiple beams
+		uint32_t kvSlot;
+		// Parameters of the CPU thread pool, only used by the hybrid decoder
+		uint32_t cpuSpinMicroseconds;
+		bool cpuPinThreads;
 	};
 }
\ No newline at end of file
@@ -11,7 +11,7 @@ namespace Whisper
 	{
 		/// <summary>Always select the most probable token</summary>
 		Greedy,
-		/// <summary>TODO: not implemented yet!</summary>
+		/// <summary>Keep beam_width most probable hypotheses, decoding all of them in a single batch</summary>
 		BeamSearch,
 	};
 
@@ -30,6 +30,9 @@ namespace Whisper
 		// Experimental
 		TokenTimestamps = 0x100,
 		SpeedupAudio = 0x200,
+
+		/// <summary>Pin the CPU worker threads of the hybrid decoder to logical processors</summary>
+		PinCpuThreads = 0x400,
 	};
 
 	/// <summary>Transcribe parameters</summary>
@@ -31,5 +31,31 @@ namespace Whisper
 
 		/// <summary>Create GPU tensors in a way which allows sharing across D3D devices</summary>
 		Cloneable = 0x10,
+
+		/// <summary>Hybrid model only: quantize weights of the decoder into INT8, requires AVX2 CPU</summary>
+		/// <remarks>This halves the memory bandwidth consumed by the decoder, at the cost of slightly lower accuracy</remarks>
+		HybridInt8 = 0x20,
+
+		/// <summary>Hybrid model only: benchmark matrix multiplication kernels for every shape on first use, and use the fastest one</summary>
+		/// <remarks>The results are cached in %LOCALAPPDATA%\Whisper directory, so only the first run on a computer pays for these benchmarks</remarks>
+		HybridAutotune = 0x40,
+
+		/// <summary>Hybrid model only: allocate weights of the decoder in large memory pages</summary>
+		/// <remarks>On Windows, requires SeLockMemoryPrivilege. When large pages are unavailable, the model uses normal pages.</remarks>
+		HybridLargePagesWeights = 0x80,
+
+		/// <summary>Hybrid model only: allocate KV caches of the decoder in large memory pages</summary>
+		HybridLargePagesKvCache = 0x100,
+
+		/// <summary>Hybrid model only: allocate temporary tensors of the decoder in large memory pages</summary>
+		HybridLargePagesCompute = 0x200,
+
+		/// <summary>Hybrid model only: keep the attention caches of the decoder in INT8, requires AVX2 CPU</summary>
+		/// <remarks>This halves the memory traffic of the cross-attention, and the RAM used by every context, at the cost of slightly lower accuracy</remarks>
+		HybridInt8KvCache = 0x400,
+
+		/// <summary>Hybrid model only: merge decoder steps of all contexts of the model into batched passes over the weights</summary>
+		/// <remarks>This improves the throughput when transcribing multiple streams at once, at the cost of latency for a single stream</remarks>
+		HybridSharedDecoder = 0x800,
 	}
 }
\ No newline at end of file
@@ -37,5 +37,17 @@ namespace Whisper.Internals
 		internal pfnEncoderBegin encoderBeginCallback;
 		/// <summary>Parameter for the above, not needed in C#</summary>
 		internal IntPtr encoderBeginCallbackData;
+
+		/// <summary>How long the idle CPU worker threads spin before parking in the OS kernel, in microseconds</summary>
+		internal uint cpuSpinMicroseconds;
+
+		/// <summary>Temperature fallback: the step of the temperature, 0 disables the fallback</summary>
+		internal float temperature_inc;
+		/// <summary>Count of candidates sampled at every temperature of the fallback</summary>
+		internal int best_of;
+		/// <summary>Retry the window when the compression ratio of the text is above this value, 0 disables the check</summary>
+		internal float compression_ratio_thold;
+		/// <summary>Retry the window when the average log-probability of the tokens is below this value; log-probabilities are never positive, 0 or any positive value disables the check</summary>
+		internal float logprob_thold;
 	}
 }
\ No newline at end of file